@@ -0,0 +1,623 @@
+#include "config.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include <pkgxx/graph.hxx>
+#include <pkgxx/harness.hxx>
+#include <pkgxx/nursery.hxx>
+#include <pkgxx/pkgname.hxx>
+#include <pkgxx/pkgpattern.hxx>
+#include <pkgxx/summary.hxx>
+
+#include "files.hxx"
+
+namespace fs = std::filesystem;
+using namespace na::literals;
+
+/* Microbenchmarks of pkgxx primitives that dominate the run time of
+ * pkgchkxx and pkgrrxx. Each benchmark prepares its input once and then
+ * times an operation repeatedly, so that regressions show up without
+ * running whole commands against a pkgsrc tree. Results can be saved and
+ * compared against later, which is what "make microbench" does when
+ * MICROBENCH_BASELINE is given.
+ */
+namespace {
+    struct options {
+        double      min_time = 0.5; // -t
+        unsigned    samples  = 5;   // -s
+        double      threshold = 10; // -T
+        std::string filter;         // -f
+        fs::path    output;         // -o
+        fs::path    baseline;       // -b
+        bool        list = false;   // -l
+    };
+
+    [[noreturn]] void
+    usage(char const* progname) {
+        std::cerr
+            << "Usage: " << progname << " [opts]" << std::endl
+            << "    -f STR    Only run benchmarks whose name contains STR" << std::endl
+            << "    -t SECS   Minimum time to spend on each benchmark (default: 0.5)" << std::endl
+            << "    -s N      Samples to take the median of (default: 5)" << std::endl
+            << "    -o FILE   Save results to FILE" << std::endl
+            << "    -b FILE   Compare results with a baseline saved by -o" << std::endl
+            << "    -T PCT    Fail if anything is PCT% slower than the baseline (default: 10)" << std::endl
+            << "    -l        List benchmarks and exit" << std::endl;
+        std::exit(1);
+    }
+
+    /// Prevent the compiler from optimizing away the computation of a
+    /// value.
+    template <typename T>
+    void
+    keep(T const& value) {
+        asm volatile("" : : "g"(&value) : "memory");
+    }
+
+    /** What a benchmark times. */
+    struct operation {
+        std::function<void ()> run;
+        /// Units of work done by a single run, e.g. tasks dispatched. Time
+        /// is reported per unit.
+        std::size_t items = 1;
+        /// Bytes processed by a single run, or zero if throughput makes
+        /// no sense.
+        std::size_t bytes = 0;
+    };
+
+    struct benchmark {
+        std::string name;
+        /// Prepare the input and return the operation to be timed.
+        std::function<operation ()> setup;
+    };
+
+    struct result {
+        std::string name;
+        double      ns_per_item;
+        double      mb_per_sec; // Zero if not a throughput benchmark.
+        std::size_t iterations;
+    };
+
+    using clock = std::chrono::steady_clock;
+
+    double
+    time_runs(operation const& op, std::size_t n) {
+        auto const begin = clock::now();
+        for (std::size_t i = 0; i < n; i++) {
+            op.run();
+        }
+        return std::chrono::duration<double>(clock::now() - begin).count();
+    }
+
+    /* Find the number of runs that take at least min_time / samples,
+     * and take the median of samples batches of that size. */
+    result
+    measure(options const& opts, std::string const& name, operation const& op) {
+        double const batch_time = opts.min_time / opts.samples;
+        std::size_t n = 1;
+        for (double t = time_runs(op, n); t < batch_time; t = time_runs(op, n)) {
+            n = t * 10 < batch_time
+                ? n * 10
+                : std::max(n + 1, static_cast<std::size_t>(static_cast<double>(n) * batch_time / t * 1.1));
+        }
+
+        std::vector<double> secs;
+        for (unsigned i = 0; i < opts.samples; i++) {
+            secs.push_back(time_runs(op, n));
+        }
+        std::sort(secs.begin(), secs.end());
+        double const median = secs[secs.size() / 2];
+        double const per_run = median / static_cast<double>(n);
+
+        return result {
+            name,
+            per_run * 1e9 / static_cast<double>(op.items),
+            op.bytes ? static_cast<double>(op.bytes) / per_run / 1e6 : 0,
+            n * opts.samples
+        };
+    }
+
+    /** A temporary directory, removed on destruction. */
+    struct tempdir {
+        tempdir() {
+            auto tmpl = (fs::temp_directory_path() / "pkgxx-microbench.XXXXXX").string();
+            if (!mkdtemp(tmpl.data())) {
+                throw std::system_error(errno, std::generic_category(), "mkdtemp");
+            }
+            path = tmpl;
+        }
+
+        ~tempdir() {
+            std::error_code ec;
+            fs::remove_all(path, ec);
+        }
+
+        fs::path path;
+    };
+
+    // -------------------------------------------------------------------
+    // Inputs shared by benchmarks. They are created on first use, and
+    // deterministically so that results are comparable across runs.
+    // -------------------------------------------------------------------
+
+    std::size_t const SUMMARY_ENTRIES = 25000;
+
+    /* A pkg_summary(5) of SUMMARY_ENTRIES packages. Every PKGBASE has two
+     * versions, and each package depends on a few others in various
+     * styles of patterns. Variables we don't parse are included so that
+     * the size of an entry is close to a real one. */
+    std::string const&
+    summary_text() {
+        static std::string const text = []() {
+            std::mt19937 rng(1);
+            std::ostringstream out;
+            auto const bases = SUMMARY_ENTRIES / 2;
+            auto const base_of = [](std::size_t i) {
+                std::ostringstream b;
+                b << (i % 10 == 3 ? "py311-" : i % 10 == 7 ? "p5-" : "")
+                  << "pkg" << std::setw(5) << std::setfill('0') << i;
+                return b.str();
+            };
+            for (std::size_t i = 0; i < SUMMARY_ENTRIES; i++) {
+                auto const b       = i % bases;
+                auto const base    = base_of(b);
+                auto const version = std::to_string(1 + i / bases) + '.' + std::to_string(b % 13) +
+                                     (b % 5 == 0 ? "nb" + std::to_string(b % 3 + 1) : "");
+                out << "PKGNAME=" << base << '-' << version << '\n'
+                    << "PKGPATH=category" << b % 20 << '/' << base << '\n'
+                    << "COMMENT=Synthetic package number " << i << '\n'
+                    << "CATEGORIES=category" << b % 20 << '\n'
+                    << "HOMEPAGE=https://example.org/" << base << '/' << '\n'
+                    << "LICENSE=modified-bsd\n"
+                    << "MACHINE_ARCH=x86_64\n"
+                    << "OPSYS=NetBSD\n"
+                    << "OS_VERSION=10.0\n"
+                    << "PKGTOOLS_VERSION=20211115\n"
+                    << "BUILD_DATE=2023-08-01 00:00:00 +0000\n"
+                    << "SIZE_PKG=" << rng() % 10000000 << '\n'
+                    << "FILE_SIZE=" << rng() % 1000000 << '\n';
+                if (b > 0) {
+                    for (unsigned d = 0, n = static_cast<unsigned>(rng() % 6); d < n; d++) {
+                        auto const dep = base_of(rng() % b);
+                        switch (rng() % 4) {
+                        case 0: out << "DEPENDS=" << dep << ">=1.0\n";                 break;
+                        case 1: out << "DEPENDS=" << dep << "-[0-9]*\n";               break;
+                        case 2: out << "DEPENDS=" << dep << ">=1.2<3\n";               break;
+                        case 3: out << "DEPENDS={" << dep << ',' << dep << "-alt}>=1\n"; break;
+                        }
+                    }
+                }
+                for (int line = 0; line < 4; line++) {
+                    out << "DESCRIPTION=This is line " << line
+                        << " of the description of a package that does nothing at all.\n";
+                }
+                out << '\n';
+            }
+            return out.str();
+        }();
+        return text;
+    }
+
+    /* A directory containing nothing but pkg_summary.SUFFIX. */
+    fs::path const&
+    summary_dir(std::string const& suffix) {
+        static tempdir const tmp;
+        static std::map<std::string, fs::path> dirs;
+        if (auto it = dirs.find(suffix); it != dirs.end()) {
+            return it->second;
+        }
+        auto const dir = tmp.path / suffix;
+        fs::create_directories(dir);
+        auto const file = dir / ("pkg_summary." + suffix);
+        if (suffix == "gz") {
+            bench::write_gzip(file, summary_text());
+        }
+        else if (suffix == "bz2") {
+            bench::write_bzip2(file, summary_text());
+        }
+        else {
+            bench::write_file(file, summary_text());
+        }
+        return dirs.emplace(suffix, dir).first->second;
+    }
+
+    pkgxx::summary
+    read_summary(fs::path const& dir) {
+        std::ostream null(nullptr);
+        return pkgxx::summary(null, null, pkgxx::concurrency(), dir, "pkg_info", ".tgz");
+    }
+
+    pkgxx::summary const&
+    summary() {
+        static pkgxx::summary const sum = read_summary(summary_dir("txt"));
+        return sum;
+    }
+
+    /* Patterns as they appear in the summary, shuffled. */
+    std::vector<pkgxx::pkgpattern> const&
+    patterns() {
+        static std::vector<pkgxx::pkgpattern> const pats = []() {
+            std::vector<pkgxx::pkgpattern> ps;
+            for (auto const& [name, vars]: summary()) {
+                ps.insert(ps.end(), vars.DEPENDS.begin(), vars.DEPENDS.end());
+            }
+            std::shuffle(ps.begin(), ps.end(), std::mt19937(1));
+            if (ps.size() > 4096) {
+                ps.erase(ps.begin() + 4096, ps.end());
+            }
+            return ps;
+        }();
+        return pats;
+    }
+
+    std::vector<std::string> const&
+    version_strings() {
+        static std::vector<std::string> const strs = []() {
+            std::vector<std::string> const forms = {
+                "1.2.3", "1.2.3nb4", "2.0beta3", "20230401", "1.0pl2",
+                "0.9rc1", "3.11.4", "5.36.0nb1", "1.0alpha", "2.4.57_1"
+            };
+            std::mt19937 rng(1);
+            std::vector<std::string> ss;
+            for (std::size_t i = 0; i < 4096; i++) {
+                ss.push_back(forms[rng() % forms.size()] + '.' + std::to_string(rng() % 100));
+            }
+            return ss;
+        }();
+        return strs;
+    }
+
+    std::vector<std::string> const&
+    pkgname_strings() {
+        static std::vector<std::string> const strs = []() {
+            std::vector<std::string> ss;
+            for (auto const& [name, vars]: summary()) {
+                ss.push_back(name.string());
+            }
+            std::shuffle(ss.begin(), ss.end(), std::mt19937(1));
+            ss.resize(4096);
+            return ss;
+        }();
+        return strs;
+    }
+
+    // Cycle through a vector of inputs, one per run.
+    template <typename T>
+    struct cycle {
+        cycle(std::vector<T> const& vec)
+            : _vec(vec), _i(0) {}
+
+        T const&
+        next() {
+            auto const& x = _vec[_i];
+            _i = _i + 1 == _vec.size() ? 0 : _i + 1;
+            return x;
+        }
+
+    private:
+        std::vector<T> const& _vec;
+        std::size_t _i;
+    };
+
+    template <typename T, typename Function>
+    operation
+    for_each_input(std::vector<T> const& inputs, Function&& f) {
+        auto c = std::make_shared<cycle<T>>(inputs);
+        return operation {
+            [c, f = std::forward<Function>(f)]() {
+                f(c->next());
+            }
+        };
+    }
+
+    using dep_graph = pkgxx::graph<pkgxx::pkgname>;
+
+    std::shared_ptr<dep_graph>
+    make_graph() {
+        auto g = std::make_shared<dep_graph>();
+        pkgxx::resolved_depends const deps(summary());
+        for (auto const& [name, vars]: summary()) {
+            g->add_vertex(name);
+            for (auto const* dep: deps.at(name)) {
+                g->add_edge(name, dep->first);
+            }
+        }
+        return g;
+    }
+
+    operation
+    read_summary_operation(std::string const& suffix) {
+        auto const dir = summary_dir(suffix);
+        return operation {
+            [dir]() {
+                keep(read_summary(dir).size());
+            },
+            1,
+            summary_text().size()
+        };
+    }
+
+    std::vector<benchmark> const BENCHMARKS = {
+        {"pkgversion/parse", []() {
+            return for_each_input(
+                version_strings(),
+                [](auto const& str) {
+                    keep(pkgxx::pkgversion(str));
+                });
+        }},
+        {"pkgversion/compare", []() {
+            auto vers = std::make_shared<std::vector<pkgxx::pkgversion>>();
+            for (auto const& str: version_strings()) {
+                vers->emplace_back(str);
+            }
+            auto i = std::make_shared<std::size_t>(0);
+            return operation {
+                [vers, i]() {
+                    auto const& a = (*vers)[*i];
+                    *i = (*i + 1) % vers->size();
+                    keep(a < (*vers)[*i]);
+                }
+            };
+        }},
+        {"pkgname/parse", []() {
+            return for_each_input(
+                pkgname_strings(),
+                [](auto const& str) {
+                    keep(pkgxx::pkgname(str));
+                });
+        }},
+        {"pkgname/string", []() {
+            auto names = std::make_shared<std::vector<pkgxx::pkgname>>();
+            for (auto const& str: pkgname_strings()) {
+                names->emplace_back(str);
+            }
+            return for_each_input(
+                *names,
+                [names](auto const& name) {
+                    keep(name.string());
+                });
+        }},
+        {"pkgpattern/parse", []() {
+            auto strs = std::make_shared<std::vector<std::string>>();
+            for (auto const& pat: patterns()) {
+                std::ostringstream ss;
+                ss << pat;
+                strs->push_back(ss.str());
+            }
+            return for_each_input(
+                *strs,
+                [strs](auto const& str) {
+                    keep(pkgxx::pkgpattern(std::string_view(str)));
+                });
+        }},
+        {"pkgpattern/for_each", []() {
+            auto const& sum = summary();
+            return for_each_input(
+                patterns(),
+                [&sum](auto const& pat) {
+                    std::size_t n = 0;
+                    pat.for_each(sum, [&](auto) { n++; });
+                    keep(n);
+                });
+        }},
+        {"pkgpattern/best", []() {
+            auto const& sum = summary();
+            return for_each_input(
+                patterns(),
+                [&sum](auto const& pat) {
+                    keep(pat.best(sum));
+                });
+        }},
+        {"summary/read-txt", []() { return read_summary_operation("txt"); }},
+        {"summary/read-gz",  []() { return read_summary_operation("gz");  }},
+        {"summary/read-bz2", []() { return read_summary_operation("bz2"); }},
+        {"summary/resolve-depends", []() {
+            auto const& sum = summary();
+            return operation {
+                [&sum]() {
+                    keep(pkgxx::resolved_depends(sum).distinct_patterns());
+                }
+            };
+        }},
+        {"graph/tsort", []() {
+            auto const g = make_graph();
+            return operation {
+                [g]() {
+                    keep(g->tsort(false).size());
+                },
+                g->tsort(false).size()
+            };
+        }},
+        {"graph/tsort_levels", []() {
+            auto const g = make_graph();
+            return operation {
+                [g]() {
+                    keep(g->tsort_levels().size());
+                },
+                g->tsort(false).size()
+            };
+        }},
+        {"nursery/start_soon", []() {
+            std::size_t const tasks = 1000;
+            return operation {
+                []() {
+                    std::atomic<std::size_t> done = 0;
+                    {
+                        pkgxx::nursery n;
+                        for (std::size_t i = 0; i < tasks; i++) {
+                            n.start_soon(
+                                [&]() {
+                                    done.fetch_add(1, std::memory_order_relaxed);
+                                });
+                        }
+                    }
+                    keep(done.load());
+                },
+                tasks
+            };
+        }},
+        {"harness/spawn", []() {
+            return operation {
+                []() {
+                    pkgxx::harness(
+                        pkgxx::shell, {pkgxx::shell, "-c", ":"},
+                        "stdout_action"_na = pkgxx::harness::fd_action::inherit).wait_success();
+                }
+            };
+        }}
+    };
+
+    std::string
+    json_string(std::string const& str) {
+        std::string out = "\"";
+        for (char const c: str) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+            }
+            out += c;
+        }
+        return out + '"';
+    }
+
+    void
+    save(fs::path const& file, std::vector<result> const& results) {
+        std::ofstream out(file, std::ios_base::out | std::ios_base::trunc);
+        if (!out) {
+            throw std::runtime_error("Failed to open " + file.string());
+        }
+        out << std::setprecision(6);
+        for (auto const& r: results) {
+            out << "{\"name\":" << json_string(r.name)
+                << ",\"ns_per_item\":" << r.ns_per_item
+                << ",\"mb_per_sec\":" << r.mb_per_sec
+                << ",\"iterations\":" << r.iterations << '}' << std::endl;
+        }
+    }
+
+    /* Read what save() wrote. This isn't a JSON parser, and it doesn't
+     * need to be. */
+    std::map<std::string, double>
+    load(fs::path const& file) {
+        std::ifstream in(file);
+        if (!in) {
+            throw std::runtime_error("Failed to open " + file.string());
+        }
+        static std::regex const re(R"(\"name\":\"([^\"]*)\",\"ns_per_item\":([-+.0-9eE]+))");
+        std::map<std::string, double> baseline;
+        for (std::string line; std::getline(in, line); ) {
+            if (std::smatch m; std::regex_search(line, m, re)) {
+                baseline[m[1]] = std::stod(m[2]);
+            }
+        }
+        return baseline;
+    }
+
+    void
+    print_header(bool compare) {
+        std::cout << std::left << std::setw(26) << "benchmark" << std::right
+                  << std::setw(14) << "ns/item" << std::setw(12) << "MB/s";
+        if (compare) {
+            std::cout << std::setw(14) << "baseline" << std::setw(10) << "change";
+        }
+        std::cout << std::endl;
+    }
+
+    /* Print a result and return true if it regressed. */
+    bool
+    print(options const& opts, result const& r, std::map<std::string, double> const& baseline) {
+        std::cout << std::fixed << std::setprecision(1)
+                  << std::left << std::setw(26) << r.name << std::right
+                  << std::setw(14) << r.ns_per_item;
+        if (r.mb_per_sec > 0) {
+            std::cout << std::setw(12) << r.mb_per_sec;
+        }
+        else {
+            std::cout << std::setw(12) << "-";
+        }
+
+        bool regressed = false;
+        if (!opts.baseline.empty()) {
+            if (auto it = baseline.find(r.name); it != baseline.end() && it->second > 0) {
+                double const change = (r.ns_per_item / it->second - 1) * 100;
+                regressed = change > opts.threshold;
+                std::cout << std::setw(14) << it->second
+                          << std::setw(9) << std::showpos << change << std::noshowpos << '%'
+                          << (regressed ? "  REGRESSED" : "");
+            }
+            else {
+                std::cout << std::setw(14) << "-" << std::setw(10) << "new";
+            }
+        }
+        std::cout << std::endl;
+        return regressed;
+    }
+}
+
+int
+main(int argc, char* argv[]) {
+    options opts;
+    int ch;
+    while ((ch = getopt(argc, argv, "T:b:f:lo:s:t:")) != -1) {
+        switch (ch) {
+        case 'T': opts.threshold = std::stod(optarg); break;
+        case 'b': opts.baseline  = optarg;            break;
+        case 'f': opts.filter    = optarg;            break;
+        case 'l': opts.list      = true;              break;
+        case 'o': opts.output    = optarg;            break;
+        case 's': opts.samples   = std::max(1u, static_cast<unsigned>(std::stoul(optarg))); break;
+        case 't': opts.min_time  = std::stod(optarg); break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+
+    try {
+        if (opts.list) {
+            for (auto const& b: BENCHMARKS) {
+                std::cout << b.name << std::endl;
+            }
+            return 0;
+        }
+
+        std::map<std::string, double> const baseline =
+            opts.baseline.empty() ? std::map<std::string, double>() : load(opts.baseline);
+
+        print_header(!opts.baseline.empty());
+        std::vector<result> results;
+        bool regressed = false;
+        for (auto const& b: BENCHMARKS) {
+            if (b.name.find(opts.filter) == std::string::npos) {
+                continue;
+            }
+            results.push_back(measure(opts, b.name, b.setup()));
+            regressed |= print(opts, results.back(), baseline);
+        }
+
+        if (!opts.output.empty()) {
+            save(opts.output, results);
+        }
+        return regressed ? 2 : 0;
+    }
+    catch (std::exception const& e) {
+        std::cerr << argv[0] << ": " << e.what() << std::endl;
+        return 1;
+    }
+}
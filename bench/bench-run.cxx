@@ -0,0 +1,303 @@
+#include "config.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+#include <pkgxx/harness.hxx>
+
+#include "world.hxx"
+
+namespace fs = std::filesystem;
+using namespace na::literals;
+
+namespace {
+    struct options {
+        std::vector<unsigned> sizes  = {100, 1000}; // -n
+        unsigned              repeat = 3;           // -r
+        fs::path              workdir = "bench-worlds"; // -w
+        fs::path              output;               // -o
+        fs::path              world_cmd;            // -W
+        fs::path              stub_cmd;             // -S
+        fs::path              pkgchkxx;             // -c
+        fs::path              pkgrrxx;              // -R
+        std::string           filter;               // -m
+    };
+
+    [[noreturn]] void
+    usage(char const* progname) {
+        std::cerr
+            << "Usage: " << progname << " -W bench-world -S bench-stub -c pkgchkxx -R pkgrrxx [opts]" << std::endl
+            << "    -n N,...  World sizes in packages (default: 100,1000)" << std::endl
+            << "    -r N      Runs of each mode (default: 3)" << std::endl
+            << "    -w DIR    Where to generate worlds (default: bench-worlds)" << std::endl
+            << "    -o FILE   Write results to FILE instead of stdout" << std::endl
+            << "    -m STR    Only run modes whose name contains STR" << std::endl
+            << std::endl
+            << "Time every mode of pkgchkxx and pkgrrxx against synthetic pkgsrc" << std::endl
+            << "worlds, and write one JSON object per mode and size." << std::endl;
+        std::exit(1);
+    }
+
+    struct mode {
+        std::string tool; // "pkgchkxx" or "pkgrrxx"
+        std::string name;
+        std::vector<std::string> args; // "@" is replaced with the world.
+        bool mutates;                  // Does it modify installed packages?
+    };
+
+    std::vector<mode> const MODES = {
+        {"pkgchkxx", "check",               {"-u", "-q"},                          false},
+        {"pkgchkxx", "check-source",        {"-u", "-q", "-s"},                    false},
+        {"pkgchkxx", "check-binary",        {"-u", "-q", "-b"},                    false},
+        {"pkgchkxx", "check-build-version", {"-u", "-q", "-s", "-B"},              false},
+        {"pkgchkxx", "list-txt",            {"-l", "-P", "@/packages.txt"},        false},
+        {"pkgchkxx", "list-gz",             {"-l", "-P", "@/packages.gz"},         false},
+        {"pkgchkxx", "list-bz2",            {"-l", "-P", "@/packages.bz2"},        false},
+        {"pkgchkxx", "pkgpaths",            {"-a", "-p"},                          false},
+        {"pkgchkxx", "generate",            {"-g", "-C", "@/generated.conf"},      false},
+        {"pkgchkxx", "todo",                {"-N"},                                false},
+        {"pkgchkxx", "dry-run",             {"-a", "-u", "-r", "-n"},              false},
+        {"pkgchkxx", "update-binary",       {"-a", "-u", "-b"},                    true },
+        {"pkgchkxx", "update-source",       {"-a", "-u", "-s"},                    true },
+        {"pkgchkxx", "remove",              {"-r", "-b"},                          true },
+        {"pkgrrxx",  "dry-run",             {"-n"},                                false},
+        {"pkgrrxx",  "dry-run-check",       {"-n", "-u"},                          false},
+        {"pkgrrxx",  "dry-run-strict",      {"-n", "-s", "-u"},                    false},
+        {"pkgrrxx",  "replace",             {"-u"},                                true }
+    };
+
+    struct sample {
+        double wall;
+        double user;
+        double sys;
+        int    status;
+        bool   cold;
+    };
+
+    double
+    seconds(timeval const& tv) {
+        return static_cast<double>(tv.tv_sec) + static_cast<double>(tv.tv_usec) / 1e6;
+    }
+
+    void
+    generate(options const& opts, fs::path const& world, unsigned size, bool reset) {
+        std::vector<std::string> argv = {
+            opts.world_cmd.string(), "-n", std::to_string(size), "-b", opts.stub_cmd.string()
+        };
+        if (reset) {
+            argv.push_back("-r");
+        }
+        argv.push_back(world.string());
+        pkgxx::harness h(opts.world_cmd, argv);
+        h.cin().close();
+        h.wait_success();
+    }
+
+    sample
+    run(options const& opts, fs::path const& world, mode const& m, bool cold) {
+        auto const& cmd = m.tool == "pkgchkxx" ? opts.pkgchkxx : opts.pkgrrxx;
+        std::vector<std::string> argv = {cmd.string()};
+        for (auto const& arg: m.args) {
+            argv.push_back(arg[0] == '@' ? world.string() + arg.substr(1) : arg);
+        }
+
+        if (cold) {
+            fs::remove_all(world / "cache");
+        }
+        auto const log_file = world / "log" / (m.tool + '-' + m.name + ".log");
+        fs::create_directories(log_file.parent_path());
+        std::ofstream log(log_file, std::ios_base::out | std::ios_base::trunc);
+
+        rusage before;
+        getrusage(RUSAGE_CHILDREN, &before);
+        auto const begin = std::chrono::steady_clock::now();
+
+        pkgxx::harness h(
+            cmd, argv,
+            "env_mod"_na = std::function<void (pkgxx::harness::env_t&)>(
+                [&](auto& env) {
+                    // The pkg_install tools are found through PATH, but
+                    // bmake is usually configured with an absolute path.
+                    env["BMAKE"]          = (world / "bin/bmake").string();
+                    env["PATH"]           = (world / "bin").string() + ':' + env["PATH"];
+                    env[bench::world_env] = world.string();
+                    env["MAKECONF"]       = (world / "mk.conf").string();
+                    env["PKGSRCDIR"]      = (world / "pkgsrc").string();
+                    env["XDG_CACHE_HOME"] = (world / "cache").string();
+                }),
+            "dtor_action"_na   = pkgxx::harness::dtor_action::wait,
+            "stderr_action"_na = pkgxx::harness::fd_action::merge_with_stdout);
+        // Not fd_action::close, as the tools would then reuse fd 0 for
+        // their own pipes.
+        h.cin().close();
+        log << h.cout().rdbuf();
+        auto const st = h.wait();
+
+        auto const end = std::chrono::steady_clock::now();
+        rusage after;
+        getrusage(RUSAGE_CHILDREN, &after);
+
+        int status;
+        if (auto const* e = std::get_if<pkgxx::harness::exited>(&st)) {
+            status = e->status;
+        }
+        else {
+            status = 128 + std::get<pkgxx::harness::signaled>(st).signal;
+        }
+        return sample {
+            std::chrono::duration<double>(end - begin).count(),
+            seconds(after.ru_utime) - seconds(before.ru_utime),
+            seconds(after.ru_stime) - seconds(before.ru_stime),
+            status,
+            cold
+        };
+    }
+
+    std::string
+    json_string(std::string const& str) {
+        std::string out = "\"";
+        for (char const c: str) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+            }
+            out += c;
+        }
+        return out + '"';
+    }
+
+    void
+    report(std::ostream& out, unsigned size, mode const& m, std::vector<sample> const& samples) {
+        std::vector<double> walls;
+        for (auto const& s: samples) {
+            walls.push_back(s.wall);
+        }
+        std::sort(walls.begin(), walls.end());
+        double const median = walls.size() % 2
+            ? walls[walls.size() / 2]
+            : (walls[walls.size() / 2 - 1] + walls[walls.size() / 2]) / 2;
+
+        std::string args;
+        for (auto const& arg: m.args) {
+            args += (args.empty() ? "" : " ") + arg;
+        }
+
+        out << std::fixed << std::setprecision(6)
+            << "{\"size\":" << size
+            << ",\"tool\":" << json_string(m.tool)
+            << ",\"mode\":" << json_string(m.name)
+            << ",\"args\":" << json_string(args)
+            << ",\"min_wall\":" << walls.front()
+            << ",\"median_wall\":" << median
+            << ",\"runs\":[";
+        for (std::size_t i = 0; i < samples.size(); i++) {
+            auto const& s = samples[i];
+            out << (i ? "," : "")
+                << "{\"wall\":" << s.wall
+                << ",\"user\":" << s.user
+                << ",\"sys\":"  << s.sys
+                << ",\"status\":" << s.status
+                << ",\"cold\":" << (s.cold ? "true" : "false") << '}';
+        }
+        out << "]}" << std::endl;
+
+        std::cerr << std::fixed << std::setprecision(3)
+                  << std::setw(6) << size << ' '
+                  << std::left << std::setw(9) << m.tool << std::setw(20) << m.name << std::right
+                  << " median " << median << "s, min " << walls.front() << 's';
+        for (auto const& s: samples) {
+            if (s.status != 0) {
+                std::cerr << " (exit " << s.status << ')';
+                break;
+            }
+        }
+        std::cerr << std::endl;
+    }
+}
+
+int
+main(int argc, char* argv[]) {
+    options opts;
+    int ch;
+    while ((ch = getopt(argc, argv, "R:S:W:c:m:n:o:r:w:")) != -1) {
+        switch (ch) {
+        case 'R': opts.pkgrrxx   = optarg; break;
+        case 'S': opts.stub_cmd  = optarg; break;
+        case 'W': opts.world_cmd = optarg; break;
+        case 'c': opts.pkgchkxx  = optarg; break;
+        case 'm': opts.filter    = optarg; break;
+        case 'n': {
+            opts.sizes.clear();
+            std::istringstream in(optarg);
+            for (std::string size; std::getline(in, size, ','); ) {
+                if (!size.empty()) {
+                    opts.sizes.push_back(static_cast<unsigned>(std::stoul(size)));
+                }
+            }
+            break;
+        }
+        case 'o': opts.output  = optarg; break;
+        case 'r': opts.repeat  = std::max(1u, static_cast<unsigned>(std::stoul(optarg))); break;
+        case 'w': opts.workdir = optarg; break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (opts.world_cmd.empty() || opts.stub_cmd.empty() ||
+        opts.pkgchkxx.empty() || opts.pkgrrxx.empty() || optind != argc) {
+        usage(argv[0]);
+    }
+
+    try {
+        opts.world_cmd = fs::absolute(opts.world_cmd);
+        opts.stub_cmd  = fs::absolute(opts.stub_cmd);
+        opts.pkgchkxx  = fs::absolute(opts.pkgchkxx);
+        opts.pkgrrxx   = fs::absolute(opts.pkgrrxx);
+
+        std::ofstream file;
+        if (!opts.output.empty()) {
+            file.open(opts.output, std::ios_base::out | std::ios_base::trunc);
+            if (!file) {
+                throw std::runtime_error("Failed to open " + opts.output.string());
+            }
+        }
+        std::ostream& out = opts.output.empty() ? std::cout : file;
+
+        for (auto const size: opts.sizes) {
+            auto const world = fs::absolute(opts.workdir / ("world-" + std::to_string(size)));
+            std::cerr << "Generating a world of " << size << " packages in " << world << std::endl;
+            generate(opts, world, size, false);
+
+            for (auto const& m: MODES) {
+                if (!opts.filter.empty() &&
+                    (m.tool + '-' + m.name).find(opts.filter) == std::string::npos) {
+                    continue;
+                }
+                std::vector<sample> samples;
+                for (unsigned i = 0; i < opts.repeat; i++) {
+                    if (m.mutates) {
+                        generate(opts, world, size, true);
+                    }
+                    samples.push_back(run(opts, world, m, i == 0));
+                }
+                report(out, size, m, samples);
+            }
+            // Leave the world as generated, for whoever wants to look
+            // into it.
+            generate(opts, world, size, true);
+        }
+        return 0;
+    }
+    catch (std::exception const& e) {
+        std::cerr << argv[0] << ": " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,662 @@
+#include "config.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <regex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+#include <pkgxx/pkgname.hxx>
+#include <pkgxx/pkgpattern.hxx>
+#include <pkgxx/string_algo.hxx>
+
+#include "world.hxx"
+
+namespace fs = std::filesystem;
+
+/* A stand-in for bmake(1), pkg_add(1), pkg_admin(1), pkg_delete(1), and
+ * pkg_info(1), chosen by the name it is invoked as. It implements just
+ * enough of them for pkgchkxx and pkgrrxx to run against a world
+ * generated by bench-world, and is meant to be cheap so that benchmarks
+ * measure the callers instead of the stubs.
+ */
+namespace {
+    struct failure: std::runtime_error {
+        using std::runtime_error::runtime_error;
+    };
+
+    pkgxx::pkgpattern
+    pattern_of(std::string const& str) {
+        return pkgxx::pkgpattern(std::string_view(str));
+    }
+
+    struct pkgdb {
+        pkgdb(fs::path const& root)
+            : _dir(root / "pkgdb") {
+
+            for (auto const& ent: fs::directory_iterator(_dir)) {
+                _names.emplace(ent.path().filename().string());
+            }
+        }
+
+        std::set<pkgxx::pkgname> const&
+        names() const noexcept {
+            return _names;
+        }
+
+        std::vector<pkgxx::pkgname>
+        find(std::string const& pattern) const {
+            std::vector<pkgxx::pkgname> found;
+            if (pattern == "*") {
+                found.assign(_names.begin(), _names.end());
+            }
+            else {
+                pattern_of(pattern).for_each(
+                    _names,
+                    [&](auto it) {
+                        found.push_back(*it);
+                    });
+            }
+            return found;
+        }
+
+        std::optional<pkgxx::pkgname>
+        best(std::string const& pattern) const {
+            if (auto it = pattern_of(pattern).best(_names); it != _names.end()) {
+                return *it;
+            }
+            return std::nullopt;
+        }
+
+        bench::record
+        load(pkgxx::pkgname const& name) const {
+            return bench::record::load(_dir / name.string() / "+INFO");
+        }
+
+        void
+        save(pkgxx::pkgname const& name, bench::record const& rec) {
+            auto const dir = _dir / name.string();
+            fs::create_directories(dir);
+            // pkg_info may be reading it at the same time.
+            rec.save(dir / "+INFO.tmp");
+            fs::rename(dir / "+INFO.tmp", dir / "+INFO");
+            _names.insert(name);
+        }
+
+        void
+        remove(pkgxx::pkgname const& name) {
+            auto const rec = load(name);
+            for (auto const& dep: rec.all("BLDDEP")) {
+                if (pkgxx::pkgname const dep_name(dep); _names.count(dep_name)) {
+                    auto dep_rec = load(dep_name);
+                    auto const it = std::find(
+                        dep_rec.begin(), dep_rec.end(),
+                        std::make_pair(std::string("REQUIRED_BY"), name.string()));
+                    if (it != dep_rec.end()) {
+                        dep_rec.erase(it);
+                        save(dep_name, dep_rec);
+                    }
+                }
+            }
+            fs::remove_all(_dir / name.string());
+            _names.erase(name);
+        }
+
+        /* Register a package described by \c rec, which has PKGNAME,
+         * PKGPATH, DEPENDS, BUILD_VERSION, and BLDDEP. Any package of the
+         * same PKGBASE is replaced, and packages requiring it are told
+         * about the new one. If \c mark_unsafe is true they are also
+         * marked as unsafe, like "make replace" does.
+         */
+        void
+        install(bench::record rec, bool automatic, bool mark_unsafe) {
+            pkgxx::pkgname const name(rec.get("PKGNAME"));
+
+            std::vector<std::string> required_by;
+            for (auto const& old: find(name.base)) {
+                if (old.base != name.base) {
+                    continue;
+                }
+                auto const old_rec = load(old);
+                automatic = old_rec.get("automatic") == "YES";
+                for (auto const& dependent: old_rec.all("REQUIRED_BY")) {
+                    pkgxx::pkgname const dep_name(dependent);
+                    auto dep_rec = load(dep_name);
+                    for (auto& [k, v]: dep_rec) {
+                        if (k == "BLDDEP" && v == old.string()) {
+                            v = name.string();
+                        }
+                    }
+                    if (mark_unsafe) {
+                        dep_rec.set("unsafe_depends_strict", "YES");
+                        if (old.version != name.version) {
+                            dep_rec.set("unsafe_depends", "YES");
+                        }
+                    }
+                    save(dep_name, dep_rec);
+                    required_by.push_back(dependent);
+                }
+                remove(old);
+            }
+
+            for (auto const& dependent: required_by) {
+                rec.emplace_back("REQUIRED_BY", dependent);
+            }
+            if (automatic) {
+                rec.set("automatic", "YES");
+            }
+            save(name, rec);
+
+            for (auto const& dep: rec.all("BLDDEP")) {
+                pkgxx::pkgname const dep_name(dep);
+                auto dep_rec = load(dep_name);
+                dep_rec.emplace_back("REQUIRED_BY", name.string());
+                save(dep_name, dep_rec);
+            }
+        }
+
+    private:
+        fs::path _dir;
+        std::set<pkgxx::pkgname> _names;
+    };
+
+    // Split "-abc" style flags. Flags listed in with_arg take the next
+    // argument.
+    struct flags {
+        flags(int argc, char* argv[], std::string_view const& with_arg) {
+            int i = 1;
+            for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+                for (char const* c = argv[i] + 1; *c; c++) {
+                    if (with_arg.find(*c) != std::string_view::npos) {
+                        if (c[1] != '\0') {
+                            values[*c] = c + 1;
+                        }
+                        else if (i + 1 < argc) {
+                            values[*c] = argv[++i];
+                        }
+                        break;
+                    }
+                    set.insert(*c);
+                }
+            }
+            for (; i < argc; i++) {
+                args.emplace_back(argv[i]);
+            }
+        }
+
+        [[gnu::pure]] bool
+        has(char c) const {
+            return set.count(c) || values.count(c);
+        }
+
+        std::set<char> set;
+        std::map<char, std::string> values;
+        std::vector<std::string> args;
+    };
+
+    bench::record
+    record_of_file(std::string const& file) {
+        if (!fs::exists(file)) {
+            throw failure("can't find package file `" + file + "'");
+        }
+        return bench::record::load(file);
+    }
+
+    void
+    print_section(std::string const& name, char const* title, std::vector<std::string> const& lines) {
+        std::cout << "Information for " << name << ":\n\n" << title << '\n';
+        for (auto const& line: lines) {
+            std::cout << line << '\n';
+        }
+        std::cout << '\n';
+    }
+
+    int
+    pkg_info(int argc, char* argv[]) {
+        flags const f(argc, argv, "eQ");
+        pkgdb const db(bench::world_root());
+
+        if (auto const e = f.values.find('e'); e != f.values.end()) {
+            auto const found = db.find(e->second);
+            if (!f.has('q')) {
+                for (auto const& name: found) {
+                    std::cout << name << '\n';
+                }
+            }
+            return found.empty() ? 1 : 0;
+        }
+        if (f.has('a') && f.has('Q')) {
+            auto const& var = f.values.at('Q');
+            for (auto const& name: db.names()) {
+                std::cout << db.load(name).get(var) << '\n';
+            }
+            return 0;
+        }
+
+        int status = 0;
+        for (auto const& arg: f.args) {
+            // A file instead of an installed package.
+            std::vector<std::pair<std::string, bench::record>> recs;
+            if (arg.find('/') != std::string::npos) {
+                auto rec = record_of_file(arg);
+                recs.emplace_back(rec.get("PKGNAME"), std::move(rec));
+            }
+            else {
+                for (auto const& name: db.find(arg)) {
+                    recs.emplace_back(name.string(), db.load(name));
+                }
+            }
+            if (recs.empty()) {
+                if (!f.has('I') || !f.has('q')) {
+                    std::cerr << "pkg_info: can't find package `" << arg << "' installed or in a file!" << std::endl;
+                }
+                status = 1;
+                continue;
+            }
+
+            for (auto const& [name, rec]: recs) {
+                if (f.has('b')) {
+                    for (auto const& line: rec.all("BUILD_VERSION")) {
+                        std::cout << line << '\n';
+                    }
+                }
+                else if (f.has('X')) {
+                    for (auto const& [k, v]: rec) {
+                        if (k == "PKGNAME" || k == "PKGPATH" || k == "DEPENDS") {
+                            std::cout << k << '=' << v << '\n';
+                        }
+                    }
+                    std::cout << '\n';
+                }
+                else if (f.has('I')) {
+                    std::cout << std::left << std::setw(19) << name << " Synthetic package\n";
+                }
+                else if (f.has('B')) {
+                    std::vector<std::string> lines;
+                    for (auto const& [k, v]: rec) {
+                        if (!bench::is_contents_var(k)) {
+                            lines.push_back(k + '=' + v);
+                        }
+                    }
+                    print_section(name, "Build information:", lines);
+                }
+                else if (f.has('N')) {
+                    print_section(name, "Built using the following packages:", rec.all("BLDDEP"));
+                }
+                else if (f.has('R')) {
+                    print_section(name, "Required by:", rec.all("REQUIRED_BY"));
+                }
+                else {
+                    throw failure("unsupported flags");
+                }
+            }
+        }
+        return status;
+    }
+
+    int
+    pkg_admin(int argc, char* argv[]) {
+        flags const f(argc, argv, "CKd");
+        if (f.args.empty()) {
+            throw failure("no command given");
+        }
+        auto const& cmd = f.args[0];
+        if (cmd == "config-var") {
+            if (f.args.size() == 2 && f.args[1] == "PKG_DBDIR") {
+                std::cout << (bench::world_root() / "pkgdb").string() << std::endl;
+            }
+            return 0;
+        }
+        else if (cmd != "set" && cmd != "unset") {
+            return 0;
+        }
+
+        pkgdb db(bench::world_root());
+        std::vector<std::pair<std::string, std::string>> changes;
+        auto arg = f.args.begin() + 1;
+        if (cmd == "set") {
+            for (; arg != f.args.end() && arg->find('=') != std::string::npos; arg++) {
+                auto const eq = arg->find('=');
+                changes.emplace_back(arg->substr(0, eq), arg->substr(eq + 1));
+            }
+        }
+        else if (arg != f.args.end()) {
+            changes.emplace_back(*arg++, std::string());
+        }
+
+        int status = 0;
+        for (; arg != f.args.end(); arg++) {
+            auto const found = db.find(*arg);
+            if (found.empty()) {
+                std::cerr << "pkg_admin: no matching pkg for `" << *arg << "'" << std::endl;
+                status = 1;
+            }
+            for (auto const& name: found) {
+                auto rec = db.load(name);
+                for (auto const& [k, v]: changes) {
+                    if (cmd == "set") {
+                        rec.set(k, v);
+                    }
+                    else {
+                        rec.erase_all(k);
+                    }
+                }
+                db.save(name, rec);
+            }
+        }
+        return status;
+    }
+
+    int
+    pkg_delete(int argc, char* argv[]) {
+        flags const f(argc, argv, "KP");
+        pkgdb db(bench::world_root());
+
+        std::set<pkgxx::pkgname> victims;
+        for (auto const& arg: f.args) {
+            auto const found = db.find(arg);
+            if (found.empty()) {
+                std::cerr << "pkg_delete: no matching pkg for `" << arg << "'" << std::endl;
+                return 1;
+            }
+            victims.insert(found.begin(), found.end());
+        }
+        if (f.has('r')) {
+            std::vector<pkgxx::pkgname> queue(victims.begin(), victims.end());
+            while (!queue.empty()) {
+                auto const name = queue.back();
+                queue.pop_back();
+                for (auto const& dependent: db.load(name).all("REQUIRED_BY")) {
+                    if (victims.emplace(dependent).second) {
+                        queue.emplace_back(dependent);
+                    }
+                }
+            }
+        }
+        else {
+            for (auto const& name: victims) {
+                for (auto const& dependent: db.load(name).all("REQUIRED_BY")) {
+                    if (!victims.count(pkgxx::pkgname(dependent))) {
+                        std::cerr << "pkg_delete: " << name << " is required by other packages: "
+                                  << dependent << std::endl;
+                        return 1;
+                    }
+                }
+            }
+        }
+        for (auto const& name: victims) {
+            db.remove(name);
+        }
+        return 0;
+    }
+
+    void
+    add_binary(pkgdb& db, fs::path const& file, bool automatic) {
+        auto rec = record_of_file(file.string());
+        rec.erase_all("BLDDEP");
+
+        // Dependencies come from the same directory.
+        std::optional<std::set<pkgxx::pkgname>> available;
+        for (auto const& pat: rec.all("DEPENDS")) {
+            auto dep = db.best(pat);
+            if (!dep) {
+                if (!available) {
+                    available.emplace();
+                    for (auto const& ent: fs::directory_iterator(file.parent_path())) {
+                        if (ent.path().extension() == ".tgz") {
+                            available->emplace(ent.path().stem().string());
+                        }
+                    }
+                }
+                auto const it = pattern_of(pat).best(*available);
+                if (it == available->end()) {
+                    throw failure("no pkg found for `" + pat + "'");
+                }
+                add_binary(db, file.parent_path() / (it->string() + ".tgz"), true);
+                dep = *it;
+            }
+            rec.emplace_back("BLDDEP", dep->string());
+        }
+        db.install(std::move(rec), automatic, false);
+    }
+
+    int
+    pkg_add(int argc, char* argv[]) {
+        flags const f(argc, argv, "IKmPpW");
+        pkgdb db(bench::world_root());
+        for (auto const& arg: f.args) {
+            add_binary(db, arg, f.has('A'));
+        }
+        return 0;
+    }
+
+    struct makefile {
+        makefile(fs::path const& pkgdir, std::map<std::string, std::string> const& assignments)
+            : dir(pkgdir)
+            , vars(bench::record::load(pkgdir / "Makefile")) {
+
+            auto const pkgname = vars.get("PKGNAME");
+            auto const version = pkgname.substr(pkgname.rfind('-') + 1);
+            std::string base   = pkgname.substr(0, pkgname.rfind('-'));
+            if (auto const reqd = assignments.find("PKGNAME_REQD"); reqd != assignments.end()) {
+                // Python-like packages accept any of their prefixes.
+                std::string_view requested(reqd->second);
+                if (pkgxx::ends_with(requested, "-[0-9]*")) {
+                    requested.remove_suffix(7);
+                }
+                std::istringstream prefixes(vars.get("_BENCH_PREFIXES"));
+                for (std::string prefix; prefixes >> prefix; ) {
+                    if (requested == prefix + '-' + vars.get("_BENCH_STEM")) {
+                        base = requested;
+                    }
+                }
+            }
+            auto const path = fs::relative(pkgdir, bench::world_root() / "pkgsrc").string();
+            derived = {
+                {"PKGNAME",    base + '-' + version},
+                {"PKGBASE",    base},
+                {"PKGVERSION", version},
+                {"PKGPATH",    path}
+            };
+
+            // Makefiles of dependencies stand in for their buildlink3.mk.
+            std::string makefiles = "- Makefile";
+            for (auto const& [_pat, depdir]: depends()) {
+                makefiles += ' ' + (depdir / "Makefile").string();
+            }
+            derived.emplace(".MAKE.MAKEFILES", std::move(makefiles));
+        }
+
+        std::optional<std::string>
+        get(std::string const& var) const {
+            if (auto const it = derived.find(var); it != derived.end()) {
+                return it->second;
+            }
+            for (auto const& [k, v]: vars) {
+                if (k == var) {
+                    return v;
+                }
+            }
+            return std::nullopt;
+        }
+
+        std::vector<std::string>
+        build_version() const {
+            auto const path = derived.at("PKGPATH");
+            return {
+                path + "/Makefile: $NetBSD: Makefile,v 1." + vars.get("_BENCH_REVISION") +
+                    " 2023/04/22 00:00:00 bench Exp $",
+                path + "/distinfo: $NetBSD: distinfo,v 1.1 2023/04/22 00:00:00 bench Exp $"
+            };
+        }
+
+        // DEPENDS as pairs of a pattern and a directory.
+        std::vector<std::pair<std::string, fs::path>>
+        depends() const {
+            std::vector<std::pair<std::string, fs::path>> deps;
+            std::istringstream in(vars.get("DEPENDS"));
+            for (std::string dep; in >> dep; ) {
+                auto const colon = dep.find(':');
+                deps.emplace_back(dep.substr(0, colon), (dir / dep.substr(colon + 1)).lexically_normal());
+            }
+            return deps;
+        }
+
+        fs::path dir;
+        bench::record vars;
+        std::map<std::string, std::string> derived;
+    };
+
+    pkgxx::pkgname
+    build_and_install(pkgdb& db, makefile const& mk, bool automatic, bool replace) {
+        pkgxx::pkgname const name(*mk.get("PKGNAME"));
+        if (!replace && db.names().count(name)) {
+            return name;
+        }
+
+        bench::record rec;
+        rec.emplace_back("PKGNAME", name.string());
+        rec.emplace_back("PKGPATH", *mk.get("PKGPATH"));
+        std::vector<std::string> blddeps;
+        for (auto const& [pat, dir]: mk.depends()) {
+            rec.emplace_back("DEPENDS", pat);
+            if (auto const dep = db.best(pat)) {
+                blddeps.push_back(dep->string());
+            }
+            else {
+                blddeps.push_back(build_and_install(db, makefile(dir, {}), true, false).string());
+            }
+        }
+        for (auto const& line: mk.build_version()) {
+            rec.emplace_back("BUILD_VERSION", line);
+        }
+        for (auto const& dep: blddeps) {
+            rec.emplace_back("BLDDEP", dep);
+        }
+        db.install(std::move(rec), automatic, replace);
+        return name;
+    }
+
+    int
+    bmake(int argc, char* argv[]) {
+        std::vector<std::string> files;
+        std::map<std::string, std::string> assignments;
+        std::vector<std::string> targets;
+        for (int i = 1; i < argc; i++) {
+            std::string_view const arg(argv[i]);
+            if (arg == "-f" && i + 1 < argc) {
+                files.emplace_back(argv[++i]);
+            }
+            else if (arg == "-C" && i + 1 < argc) {
+                if (chdir(argv[++i]) != 0) {
+                    throw failure(std::string("chdir: ") + argv[i]);
+                }
+            }
+            else if (arg == "-j" && i + 1 < argc) {
+                i++;
+            }
+            else if (auto const eq = arg.find('='); eq != std::string_view::npos) {
+                assignments.insert_or_assign(std::string(arg.substr(0, eq)), std::string(arg.substr(eq + 1)));
+            }
+            else if (!arg.empty() && arg[0] != '-') {
+                targets.emplace_back(arg);
+            }
+        }
+
+        auto const root = bench::world_root();
+        auto const cwd  = fs::current_path();
+        std::optional<makefile> mk;
+        if (fs::exists(cwd / "Makefile") &&
+            (files.empty() || std::find(files.begin(), files.end(), "Makefile") != files.end())) {
+            mk.emplace(cwd, assignments);
+        }
+
+        // The variable extraction protocol of pkgxx::extract_*_vars():
+        // print "${VAR}" for each VAR in the makefile given on stdin.
+        if (std::find(files.begin(), files.end(), "-") != files.end()) {
+            auto const defaults = bench::record::load(root / "defaults");
+            std::string const script(std::istreambuf_iterator<char>(std::cin), {});
+            static std::regex const re_var("\"\\$\\{([^}]+)\\}\"");
+            for (std::sregex_iterator it(script.begin(), script.end(), re_var), end; it != end; it++) {
+                auto const var = (*it)[1].str();
+                std::optional<std::string> value;
+                if (auto const a = assignments.find(var); a != assignments.end()) {
+                    value = a->second;
+                }
+                else if (mk) {
+                    value = mk->get(var);
+                }
+                if (!value) {
+                    value = defaults.get(var);
+                }
+                std::cout << *value << '\0';
+            }
+            return 0;
+        }
+
+        if (!mk) {
+            throw failure("no Makefile in " + cwd.string());
+        }
+        pkgdb db(root);
+        for (auto const& target: targets) {
+            if (auto const bv = assignments.find("_BUILD_VERSION_FILE");
+                bv != assignments.end() && bv->second == target) {
+                std::ofstream out(target);
+                for (auto const& line: mk->build_version()) {
+                    out << line << '\n';
+                }
+            }
+            else if (target == "install" || target == "update" || target == "package-install" ||
+                     target == "reinstall" || target == "bin-install") {
+                build_and_install(db, *mk, false, target != "install");
+            }
+            else if (target == "replace") {
+                build_and_install(db, *mk, false, true);
+            }
+            // Anything else, like "clean", succeeds doing nothing.
+        }
+        return 0;
+    }
+}
+
+int
+main(int argc, char* argv[]) {
+    auto const self = fs::path(argv[0]).filename().string();
+    try {
+        if (self == "bmake") {
+            return bmake(argc, argv);
+        }
+        else if (self == "pkg_add") {
+            return pkg_add(argc, argv);
+        }
+        else if (self == "pkg_admin") {
+            return pkg_admin(argc, argv);
+        }
+        else if (self == "pkg_delete") {
+            return pkg_delete(argc, argv);
+        }
+        else if (self == "pkg_info") {
+            return pkg_info(argc, argv);
+        }
+        else {
+            std::cerr << self << ": invoke this as one of";
+            for (auto const& tool: bench::stub_tools) {
+                std::cerr << ' ' << tool;
+            }
+            std::cerr << std::endl;
+            return 1;
+        }
+    }
+    catch (std::exception const& e) {
+        std::cerr << self << ": " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,453 @@
+#include "config.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include <pkgxx/pkgname.hxx>
+#include <pkgxx/pkgpattern.hxx>
+
+#include "files.hxx"
+#include "world.hxx"
+
+namespace fs = std::filesystem;
+
+namespace {
+    struct options {
+        unsigned    packages = 1000; // -n
+        unsigned    deps     = 4;    // -d
+        double      wanted   = 0.3;  // -w
+        double      mismatch = 0.1;  // -m
+        unsigned    seed     = 1;    // -s
+        std::string stub;            // -b
+        bool        reset    = false; // -r
+        fs::path    root;
+    };
+
+    [[noreturn]] void
+    usage(char const* progname) {
+        std::cerr
+            << "Usage: " << progname << " [opts] DIR" << std::endl
+            << "    -n N     Generate N packages (default: 1000)" << std::endl
+            << "    -d N     Average number of dependencies of a package (default: 4)" << std::endl
+            << "    -w R     Ratio of packages listed in pkgchk.conf (default: 0.3)" << std::endl
+            << "    -m R     Ratio of installed packages that are out of date (default: 0.1)" << std::endl
+            << "    -s N     Random seed (default: 1)" << std::endl
+            << "    -b STUB  Populate DIR/bin with symlinks to STUB" << std::endl
+            << "    -r       Only reset installed packages and pkgchk.conf" << std::endl
+            << std::endl
+            << "Generate a synthetic pkgsrc world in DIR. The same options always" << std::endl
+            << "generate the same world." << std::endl;
+        std::exit(1);
+    }
+
+    struct package {
+        std::string base;
+        std::string path;
+        unsigned    minor;    // PKGVERSION is 1.minor
+        unsigned    revision; // of Makefile in BUILD_VERSION
+        // Python-like packages have several PKGBASEs per PKGPATH. The
+        // default one is base, and the others have these prefixes.
+        std::vector<std::string> alt_prefixes;
+        std::string stem;
+        std::vector<std::size_t> deps;
+        std::vector<std::string> patterns;
+
+        std::string
+        version(unsigned m) const {
+            return "1." + std::to_string(m);
+        }
+
+        std::string
+        name() const {
+            return base + '-' + version(minor);
+        }
+    };
+
+    struct installed_package {
+        // The default PKGBASE, and possibly another one for Python-like
+        // packages.
+        std::vector<std::string> bases;
+        unsigned    minor;
+        unsigned    revision;
+        bool        automatic;
+    };
+
+    struct world {
+        std::vector<package> pkgs;
+        std::set<std::size_t> wanted;
+        std::map<std::size_t, installed_package> installed;
+    };
+
+    std::vector<std::string> const CATEGORIES = {
+        "archivers", "audio", "databases", "devel", "graphics", "lang",
+        "math", "net", "security", "textproc", "www", "x11"
+    };
+
+    // std::uniform_int_distribution isn't the same everywhere, but
+    // std::mt19937 is.
+    struct rng {
+        rng(unsigned seed)
+            : _gen(seed) {}
+
+        unsigned
+        below(unsigned n) {
+            return static_cast<unsigned>(_gen() % n);
+        }
+
+        bool
+        chance(double ratio) {
+            return below(1000000) < static_cast<unsigned>(ratio * 1000000);
+        }
+
+    private:
+        std::mt19937 _gen;
+    };
+
+    world
+    generate(options const& opts) {
+        rng r(opts.seed);
+        world w;
+
+        for (unsigned i = 0; i < opts.packages; i++) {
+            package p;
+            char num[16];
+            std::snprintf(num, sizeof(num), "%05u", i);
+            auto const& category = CATEGORIES[i % CATEGORIES.size()];
+            if (i % 20 == 7) {
+                p.stem         = std::string("bench") + num;
+                p.base         = "py311-" + p.stem;
+                p.path         = category + "/py-" + p.stem;
+                p.alt_prefixes = {"py39", "py310"};
+            }
+            else if (i % 9 == 4) {
+                p.base = std::string("p5-bench") + num;
+                p.path = category + '/' + p.base;
+            }
+            else {
+                p.base = std::string("bench") + num;
+                p.path = category + '/' + p.base;
+            }
+            p.minor    = r.below(20) + 1;
+            p.revision = r.below(50) + 1;
+
+            // Dependencies point to packages generated earlier, so the
+            // graph is always a DAG. Lower ones are preferred, like
+            // everything depends on a few libraries.
+            unsigned const n_deps = i == 0 ? 0 : std::min(i, r.below(2 * opts.deps + 1));
+            std::set<std::size_t> deps;
+            for (unsigned k = 0; k < n_deps; k++) {
+                double const u = r.below(1000) / 1000.0;
+                deps.insert(static_cast<std::size_t>(i * u * u));
+            }
+            for (auto const j: deps) {
+                auto const& d = w.pkgs[j];
+                std::string pat;
+                switch (r.below(20)) {
+                case 14: case 15: case 16:
+                    pat = d.base + "-[0-9]*";
+                    break;
+                case 17:
+                    pat = d.base + ">=1.0<2";
+                    break;
+                case 18:
+                    pat = "{" + d.base + ",obsolete-" + d.base + "}>=1.0";
+                    break;
+                case 19:
+                    pat = d.base + ">=" + d.version(r.below(d.minor) + 1);
+                    break;
+                default:
+                    pat = d.base + ">=1.0";
+                }
+                p.deps.push_back(j);
+                p.patterns.push_back(pat);
+            }
+            w.pkgs.push_back(std::move(p));
+        }
+
+        // Wanted packages are listed in pkgchk.conf, and all of them but
+        // a few are installed along with their dependencies.
+        for (std::size_t i = 0; i < w.pkgs.size(); i++) {
+            if (r.chance(opts.wanted)) {
+                w.wanted.insert(i);
+            }
+        }
+        std::vector<std::size_t> queue;
+        for (auto const i: w.wanted) {
+            if (!r.chance(0.05)) {
+                queue.push_back(i);
+            }
+        }
+        while (!queue.empty()) {
+            auto const i = queue.back();
+            queue.pop_back();
+            if (w.installed.count(i)) {
+                continue;
+            }
+            auto const& p = w.pkgs[i];
+            installed_package inst {{p.base}, p.minor, p.revision, w.wanted.count(i) == 0};
+            if (!p.alt_prefixes.empty() && r.below(2)) {
+                inst.bases.push_back(p.alt_prefixes[0] + '-' + p.stem);
+            }
+            if (r.chance(opts.mismatch)) {
+                // Either an older version, or the same version built from
+                // an older Makefile.
+                if (inst.minor > 1) {
+                    inst.minor--;
+                }
+                else if (inst.revision > 1) {
+                    inst.revision--;
+                }
+            }
+            w.installed.emplace(i, inst);
+            queue.insert(queue.end(), p.deps.begin(), p.deps.end());
+        }
+        return w;
+    }
+
+    std::vector<std::string>
+    build_version(std::string const& path, unsigned revision) {
+        return {
+            path + "/Makefile: $NetBSD: Makefile,v 1." + std::to_string(revision) +
+                " 2023/04/22 00:00:00 bench Exp $",
+            path + "/distinfo: $NetBSD: distinfo,v 1.1 2023/04/22 00:00:00 bench Exp $"
+        };
+    }
+
+    bench::record
+    binary_record(package const& p, std::string const& base, unsigned minor, unsigned revision) {
+        bench::record rec;
+        rec.emplace_back("PKGNAME", base + '-' + p.version(minor));
+        rec.emplace_back("PKGPATH", p.path);
+        for (auto const& pat: p.patterns) {
+            rec.emplace_back("DEPENDS", pat);
+        }
+        for (auto const& bv: build_version(p.path, revision)) {
+            rec.emplace_back("BUILD_VERSION", bv);
+        }
+        return rec;
+    }
+
+    void
+    write_pkgsrc(options const& opts, world const& w) {
+        auto const pkgsrc = opts.root / "pkgsrc";
+        for (auto const& p: w.pkgs) {
+            fs::create_directories(pkgsrc / p.path);
+
+            bench::record mk;
+            mk.emplace_back("PKGNAME", p.name());
+            if (!p.alt_prefixes.empty()) {
+                std::string prefixes;
+                for (auto const& prefix: p.alt_prefixes) {
+                    prefixes += prefix + ' ';
+                }
+                mk.emplace_back("_BENCH_PREFIXES", prefixes + "py311");
+                mk.emplace_back("_BENCH_STEM", p.stem);
+            }
+            std::string depends;
+            for (std::size_t k = 0; k < p.deps.size(); k++) {
+                depends += (k ? " " : "") + p.patterns[k] + ":../../" + w.pkgs[p.deps[k]].path;
+            }
+            mk.emplace_back("DEPENDS", depends);
+            mk.emplace_back("_BENCH_REVISION", std::to_string(p.revision));
+            mk.save(pkgsrc / p.path / "Makefile");
+        }
+
+        // pkgchkxx looks for PKGSRCDIR using these.
+        for (auto const& tool: {"pkgtools/pkg_chk", "pkgtools/pkg_install"}) {
+            fs::create_directories(pkgsrc / tool);
+            bench::write_file(pkgsrc / tool / "Makefile", "");
+        }
+
+        fs::create_directories(pkgsrc / "doc");
+        std::string todo = "Suggested package updates\n=========================\n\n";
+        for (std::size_t i = 0; i < w.pkgs.size(); i += 17) {
+            auto const& p = w.pkgs[i];
+            todo += "\to " + p.base + '-' + p.version(p.minor + 1) + " [bench]\n";
+        }
+        bench::write_file(pkgsrc / "doc/TODO", todo);
+    }
+
+    void
+    write_packages(options const& opts, world const& w) {
+        auto const all = opts.root / "packages.txt/All";
+        fs::create_directories(all);
+
+        std::string summary;
+        auto const add =
+            [&](package const& p, std::string const& base, unsigned minor, unsigned revision) {
+                auto const rec = binary_record(p, base, minor, revision);
+                rec.save(all / (rec.get("PKGNAME") + ".tgz"));
+
+                std::ostringstream entry;
+                for (auto const& [k, v]: rec) {
+                    if (k != "BUILD_VERSION") {
+                        entry << k << '=' << v << '\n';
+                    }
+                }
+                summary += entry.str() + '\n';
+            };
+        for (std::size_t i = 0; i < w.pkgs.size(); i++) {
+            auto const& p = w.pkgs[i];
+            add(p, p.base, p.minor, p.revision);
+            for (auto const& prefix: p.alt_prefixes) {
+                add(p, prefix + '-' + p.stem, p.minor, p.revision);
+            }
+            // Keep the old version of some out-of-date packages around, as
+            // repositories often do.
+            if (auto const inst = w.installed.find(i);
+                inst != w.installed.end() && inst->second.minor != p.minor && i % 2 == 0) {
+                add(p, p.base, inst->second.minor, inst->second.revision);
+            }
+        }
+        bench::write_file(all / "pkg_summary.txt", summary);
+
+        fs::create_directories(opts.root / "packages.gz/All");
+        bench::write_gzip(opts.root / "packages.gz/All/pkg_summary.gz", summary);
+
+        fs::create_directories(opts.root / "packages.bz2/All");
+        bench::write_bzip2(opts.root / "packages.bz2/All/pkg_summary.bz2", summary);
+    }
+
+    void
+    write_pkgdb(options const& opts, world const& w) {
+        auto const pkgdb = opts.root / "pkgdb";
+        fs::remove_all(pkgdb);
+        fs::create_directories(pkgdb);
+
+        std::set<pkgxx::pkgname> names;
+        std::map<pkgxx::pkgname, std::pair<std::size_t, std::string>> index_of;
+        for (auto const& [i, inst]: w.installed) {
+            for (auto const& base: inst.bases) {
+                pkgxx::pkgname const name(base + '-' + w.pkgs[i].version(inst.minor));
+                names.insert(name);
+                index_of.emplace(name, std::make_pair(i, base));
+            }
+        }
+
+        std::map<pkgxx::pkgname, bench::record> recs;
+        for (auto const& [name, pair]: index_of) {
+            auto const& [i, base] = pair;
+            auto const& inst = w.installed.at(i);
+            auto rec = binary_record(w.pkgs[i], base, inst.minor, inst.revision);
+            for (auto const& pat: w.pkgs[i].patterns) {
+                if (auto const dep = pkgxx::pkgpattern(std::string_view(pat)).best(names);
+                    dep != names.end()) {
+                    rec.emplace_back("BLDDEP", dep->string());
+                }
+            }
+            if (inst.automatic) {
+                rec.emplace_back("automatic", "YES");
+            }
+            recs.emplace(name, std::move(rec));
+        }
+        for (auto const& [name, rec]: recs) {
+            for (auto const& dep: rec.all("BLDDEP")) {
+                recs.at(pkgxx::pkgname(dep)).emplace_back("REQUIRED_BY", name.string());
+            }
+        }
+        for (auto const& [name, rec]: recs) {
+            fs::create_directories(pkgdb / name.string());
+            rec.save(pkgdb / name.string() / "+INFO");
+        }
+    }
+
+    void
+    write_config(options const& opts, world const& w) {
+        std::string conf = "# Generated by bench-world\n";
+        for (auto const i: w.wanted) {
+            conf += w.pkgs[i].path + '\n';
+        }
+        bench::write_file(opts.root / "pkgchk.conf", conf);
+
+        fs::remove(opts.root / "pkgchk_update.conf");
+        fs::remove(opts.root / "pkgchk.conf.old");
+        fs::remove(opts.root / "generated.conf");
+        fs::remove(opts.root / "generated.conf.old");
+    }
+
+    void
+    write_defaults(options const& opts) {
+        auto const& root = opts.root;
+        bench::record vars;
+        vars.emplace_back("LOCALBASE", "/usr/pkg");
+        vars.emplace_back("MACHINE_ARCH", "x86_64");
+        vars.emplace_back("OPSYS", "NetBSD");
+        vars.emplace_back("OS_VERSION", "10.0");
+        vars.emplace_back("PACKAGES", (root / "packages.txt").string());
+        vars.emplace_back("PKG_ADD", "pkg_add");
+        vars.emplace_back("PKG_ADMIN", "pkg_admin");
+        vars.emplace_back("PKG_DELETE", "pkg_delete");
+        vars.emplace_back("PKG_INFO", "pkg_info");
+        vars.emplace_back("PKG_SUFX", ".tgz");
+        vars.emplace_back("PKG_SYSCONFDIR", (root / "etc").string());
+        vars.emplace_back("PKGCHK_CONF", (root / "pkgchk.conf").string());
+        vars.emplace_back("PKGCHK_UPDATE_CONF", (root / "pkgchk_update.conf").string());
+        vars.emplace_back("PKGSRCDIR", (root / "pkgsrc").string());
+        vars.emplace_back("DISTDIR", (root / "distfiles").string());
+        vars.save(root / "defaults");
+        bench::write_file(root / "mk.conf", "");
+    }
+
+    void
+    write_bin(options const& opts) {
+        auto const bin = opts.root / "bin";
+        fs::create_directories(bin);
+        auto const stub = fs::absolute(opts.stub);
+        for (auto const& tool: bench::stub_tools) {
+            fs::remove(bin / tool);
+            fs::create_symlink(stub, bin / tool);
+        }
+    }
+}
+
+int
+main(int argc, char* argv[]) {
+    options opts;
+    int ch;
+    while ((ch = getopt(argc, argv, "b:d:m:n:rs:w:")) != -1) {
+        switch (ch) {
+        case 'b': opts.stub     = optarg; break;
+        case 'd': opts.deps     = static_cast<unsigned>(std::stoul(optarg)); break;
+        case 'm': opts.mismatch = std::stod(optarg); break;
+        case 'n': opts.packages = static_cast<unsigned>(std::stoul(optarg)); break;
+        case 'r': opts.reset    = true; break;
+        case 's': opts.seed     = static_cast<unsigned>(std::stoul(optarg)); break;
+        case 'w': opts.wanted   = std::stod(optarg); break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+    }
+    opts.root = fs::absolute(argv[optind]);
+
+    try {
+        auto const w = generate(opts);
+        if (!opts.reset) {
+            fs::create_directories(opts.root);
+            write_defaults(opts);
+            write_pkgsrc(opts, w);
+            write_packages(opts, w);
+        }
+        write_pkgdb(opts, w);
+        write_config(opts, w);
+        if (!opts.stub.empty()) {
+            write_bin(opts);
+        }
+        return 0;
+    }
+    catch (std::exception const& e) {
+        std::cerr << argv[0] << ": " << e.what() << std::endl;
+        return 1;
+    }
+}
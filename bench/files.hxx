@@ -0,0 +1,59 @@
+#pragma once
+
+#include <bzlib.h>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <zlib.h>
+
+/** Writing files in every compression \c pkg_summary(5) may come in. Only
+ * programs linking zlib and libbz2 may include this.
+ */
+namespace bench {
+    namespace fs = std::filesystem;
+
+    /// Write a file as is, replacing it.
+    inline void
+    write_file(fs::path const& file, std::string const& contents) {
+        std::ofstream out(file, std::ios_base::out | std::ios_base::trunc);
+        if (!out || !out.write(contents.data(), static_cast<std::streamsize>(contents.size()))) {
+            throw std::runtime_error("Failed to write " + file.string());
+        }
+    }
+
+    /// Write a gzip-compressed file, replacing it.
+    inline void
+    write_gzip(fs::path const& file, std::string const& contents) {
+        gzFile gz = gzopen(file.c_str(), "wb");
+        if (!gz) {
+            throw std::runtime_error("Failed to open " + file.string());
+        }
+        bool const ok =
+            gzwrite(gz, contents.data(), static_cast<unsigned>(contents.size())) ==
+            static_cast<int>(contents.size());
+        if (gzclose(gz) != Z_OK || !ok) {
+            throw std::runtime_error("Failed to write " + file.string());
+        }
+    }
+
+    /// Write a bzip2-compressed file, replacing it.
+    inline void
+    write_bzip2(fs::path const& file, std::string const& contents) {
+        FILE* fp = std::fopen(file.c_str(), "wb");
+        if (!fp) {
+            throw std::runtime_error("Failed to open " + file.string());
+        }
+        int err;
+        BZFILE* bz = BZ2_bzWriteOpen(&err, fp, 9, 0, 0);
+        if (err == BZ_OK) {
+            BZ2_bzWrite(&err, bz, const_cast<char*>(contents.data()), static_cast<int>(contents.size()));
+        }
+        int close_err;
+        BZ2_bzWriteClose(&close_err, bz, 0, nullptr, nullptr);
+        if (std::fclose(fp) != 0 || err != BZ_OK || close_err != BZ_OK) {
+            throw std::runtime_error("Failed to write " + file.string());
+        }
+    }
+}
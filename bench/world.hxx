@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/** A synthetic pkgsrc world, generated by \c bench-world and operated on
+ * by \c bench-stub, which pretends to be \c bmake and the \c
+ * pkg_install tools. Its layout is:
+ *
+ * - \c defaults: make variables every \c bmake invocation sees, one \c
+ *   VAR=value per line.
+ * - \c mk.conf: an empty file.
+ * - \c pkgchk.conf: a \c pkgchk.conf(5) listing some PKGPATHs.
+ * - \c pkgsrc/CATEGORY/NAME/Makefile: a \ref record of make variables of
+ *   a package.
+ * - \c pkgsrc/doc/TODO: newer versions of some packages.
+ * - \c pkgdb/PKGNAME/+INFO: a \ref record of an installed package.
+ * - \c packages.SUFFIX/All/pkg_summary.SUFFIX: the same \c pkg_summary(5)
+ *   in each compression, \c txt, \c gz, and \c bz2.
+ * - \c packages.txt/All/PKGNAME.tgz: a binary package, which is just a
+ *   \ref record in disguise.
+ * - \c bin: symlinks to \c bench-stub named after the tools.
+ */
+namespace bench {
+    namespace fs = std::filesystem;
+
+    /// The environment variable telling \c bench-stub where the world is.
+    inline constexpr char const* world_env = "PKGCHKXX_BENCH_WORLD";
+
+    /** Tools \c bench-stub pretends to be. */
+    inline std::vector<std::string> const stub_tools = {
+        "bmake", "pkg_add", "pkg_admin", "pkg_delete", "pkg_info"
+    };
+
+    /** An ordered list of \c VAR=value pairs. A variable may appear more
+     * than once, e.g. \c DEPENDS in a \c pkg_summary(5) entry. */
+    struct record: public std::vector<std::pair<std::string, std::string>> {
+        /// Read a record up to an empty line or EOF.
+        static record
+        read(std::istream& in) {
+            record r;
+            for (std::string line; std::getline(in, line) && !line.empty(); ) {
+                if (auto const eq = line.find('='); eq != std::string::npos) {
+                    r.emplace_back(line.substr(0, eq), line.substr(eq + 1));
+                }
+            }
+            return r;
+        }
+
+        /// Read a record from a file.
+        static record
+        load(fs::path const& file) {
+            std::ifstream in(file);
+            if (!in) {
+                throw std::runtime_error("Failed to open " + file.string());
+            }
+            return read(in);
+        }
+
+        /// Write a record to a file, replacing it.
+        void
+        save(fs::path const& file) const {
+            std::ofstream out(file, std::ios_base::out | std::ios_base::trunc);
+            if (!out) {
+                throw std::runtime_error("Failed to open " + file.string());
+            }
+            out << *this;
+        }
+
+        /// Return the last value of a variable, or an empty string.
+        std::string
+        get(std::string_view const& var) const {
+            for (auto it = rbegin(); it != rend(); it++) {
+                if (it->first == var) {
+                    return it->second;
+                }
+            }
+            return std::string();
+        }
+
+        /// Return all the values of a variable.
+        std::vector<std::string>
+        all(std::string_view const& var) const {
+            std::vector<std::string> values;
+            for (auto const& [k, v]: *this) {
+                if (k == var) {
+                    values.push_back(v);
+                }
+            }
+            return values;
+        }
+
+        /// Replace all the values of a variable with a single one.
+        void
+        set(std::string const& var, std::string const& value) {
+            erase_all(var);
+            emplace_back(var, value);
+        }
+
+        /// Remove all the values of a variable.
+        void
+        erase_all(std::string_view const& var) {
+            for (auto it = begin(); it != end(); ) {
+                it = it->first == var ? erase(it) : it + 1;
+            }
+        }
+
+        /// Write a record without a trailing empty line.
+        friend std::ostream&
+        operator<< (std::ostream& out, record const& r) {
+            for (auto const& [k, v]: r) {
+                out << k << '=' << v << '\n';
+            }
+            return out;
+        }
+    };
+
+    /** Variables of an installed package that \c pkg_info -B doesn't
+     * show. Everything else is build information, including variables
+     * set with \c pkg_admin. */
+    inline bool
+    is_contents_var(std::string_view const& var) {
+        return var == "PKGNAME"
+            || var == "DEPENDS"
+            || var == "BLDDEP"
+            || var == "REQUIRED_BY"
+            || var == "BUILD_VERSION";
+    }
+
+    /** Return the root of the world from the environment, or throw. */
+    inline fs::path
+    world_root() {
+        if (char const* root = std::getenv(world_env); root && *root) {
+            return root;
+        }
+        throw std::runtime_error(std::string(world_env) + " is not set");
+    }
+}
@@ -6,6 +6,7 @@
 #include <utility>
 
 #include "build_version.hxx"
+#include "environment.hxx"
 #include "harness.hxx"
 #include "tempfile.hxx"
 
@@ -44,9 +45,8 @@ namespace pkgxx {
             return {};
         }
 
-        harness pkg_info(shell, {shell, "-s", "--", "-q", "-b", bin_pkg_file});
-        pkg_info.cin() << "exec " << PKG_INFO << " \"$@\"" << std::endl;
-        pkg_info.cin().close();
+        auto const argv = shell_command_argv(PKG_INFO, {"-q", "-b", bin_pkg_file});
+        harness pkg_info(argv[0], argv, "stdin_action"_na = harness::fd_action::close);
 
         build_version const bv = read_build_version(pkg_info.cout());
         if (pkg_info.wait_exit().status == 0) {
@@ -64,14 +64,12 @@ namespace pkgxx {
 
         // Discard stderr because the package might not be installed. It's
         // the only way to suppress errors in that case.
+        auto const argv = shell_command_argv(PKG_INFO, {"-q", "-b", name.string()});
         harness pkg_info(
-            shell,
-            {shell, "-s", "--", "-q", "-b", name.string()},
-            "stdin_action"_na  = harness::fd_action::pipe,
-            "stdout_action"_na = harness::fd_action::close,
+            argv[0], argv,
+            "stdin_action"_na  = harness::fd_action::close,
+            "stdout_action"_na = harness::fd_action::pipe,
             "stderr_action"_na = harness::fd_action::close);
-        pkg_info.cin() << "exec " << PKG_INFO << " \"$@\"" << std::endl;
-        pkg_info.cin().close();
 
         build_version const bv = read_build_version(pkg_info.cout());
         if (pkg_info.wait_exit().status == 0) {
@@ -95,7 +93,7 @@ namespace pkgxx {
         // helpfully allows us to specify the name
         tempfile tmp;
         std::vector<std::string> const argv = {
-            CFG_BMAKE,
+            bmake(),
             "_BUILD_VERSION_FILE=" + tmp.path.string(),
             tmp.path.string()
         };
@@ -104,7 +102,7 @@ namespace pkgxx {
         // "'/tmp/temp.XXXXXX' is up to date". This means we have to unlink
         // the temporary file and then reopen it after make(1) exits.
         fs::remove(tmp.path);
-        harness(CFG_BMAKE, argv, "cwd"_na = std::optional(PKGSRCDIR / path)).wait_success();
+        harness(bmake(), argv, "cwd"_na = std::optional(PKGSRCDIR / path)).wait_success();
 
         std::ifstream in(tmp.path, std::ios_base::in);
         if (!in) {
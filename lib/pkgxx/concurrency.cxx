@@ -0,0 +1,215 @@
+#include "config.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#if defined(HAVE_SCHED_GETAFFINITY)
+#  include <sched.h>
+#endif
+#include <stdlib.h>
+
+#include "concurrency.hxx"
+
+namespace {
+    unsigned
+    available_cpus() {
+#if defined(HAVE_SCHED_GETAFFINITY)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            if (int const n = CPU_COUNT(&set); n > 0) {
+                return static_cast<unsigned>(n);
+            }
+        }
+#endif
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    std::optional<double>
+    load_average() {
+#if defined(HAVE_GETLOADAVG)
+        double load[1];
+        if (getloadavg(load, 1) == 1) {
+            return load[0];
+        }
+#endif
+        return std::nullopt;
+    }
+
+    // Nursery tasks and child processes of ours running right now.
+    std::atomic<int> running_work = 0;
+
+    /* Pressure stall information of a resource, i.e. the percentage of
+     * time in the last 10 seconds some or all of non-idle tasks were
+     * stalled on it. Only Linux has this.
+     */
+    struct pressure {
+        double some = 0;
+        double full = 0;
+    };
+
+    std::optional<pressure>
+    pressure_of(char const* resource) {
+        std::ifstream in(std::string("/proc/pressure/") + resource);
+        if (!in) {
+            return std::nullopt;
+        }
+
+        // some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+        // full avg10=0.00 avg60=0.00 avg300=0.00 total=0
+        pressure p;
+        for (std::string line; std::getline(in, line); ) {
+            std::istringstream ls(line);
+            std::string kind, avg10;
+            ls >> kind >> avg10;
+            if (avg10.compare(0, 6, "avg10=") != 0) {
+                continue;
+            }
+            double const value = std::strtod(avg10.c_str() + 6, nullptr);
+            if (kind == "some") {
+                p.some = value;
+            }
+            else if (kind == "full") {
+                p.full = value;
+            }
+        }
+        return p;
+    }
+}
+
+namespace pkgxx {
+    namespace detail {
+        void
+        work_started() noexcept {
+            running_work.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void
+        work_finished() noexcept {
+            running_work.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        struct adaptive_controller {
+            unsigned
+            limit(workload w) {
+                std::unique_lock<std::mutex> lk(_mtx);
+
+                auto const now = std::chrono::steady_clock::now();
+                if (!_last_sample || now - *_last_sample >= std::chrono::seconds(1)) {
+                    _last_sample = now;
+                    if (auto const msg = sample(); msg && _log) {
+                        // Don't call the logger with the lock held. It
+                        // may take locks of its own.
+                        auto const log = _log;
+                        unsigned const ret = w == workload::cpu ? _cpu : _spawn;
+                        lk.unlock();
+                        log(*msg);
+                        return ret;
+                    }
+                }
+                return w == workload::cpu ? _cpu : _spawn;
+            }
+
+            void
+            on_decision(std::function<void (std::string const&)> const& log) {
+                std::lock_guard<std::mutex> lk(_mtx);
+                _log = log;
+            }
+
+        private:
+            // Recompute the limits, and describe them if they have
+            // changed.
+            std::optional<std::string>
+            sample() {
+                unsigned const cpus = available_cpus();
+                double cpu = cpus;
+
+                // The load average includes our own tasks and children.
+                // Subtract the ones running now so that we don't back off
+                // from our own work.
+                auto const load = load_average();
+                if (load) {
+                    double const ours   = running_work.load(std::memory_order_relaxed);
+                    double const others = std::max(0.0, *load - ours);
+                    cpu -= others;
+                }
+
+                // Tasks already waiting for a CPU for a significant amount
+                // of time means the machine is oversubscribed, whatever
+                // the load average says.
+                auto const cpu_pressure = pressure_of("cpu");
+                if (cpu_pressure && cpu_pressure->some > 20.0) {
+                    cpu *= 1.0 - cpu_pressure->some / 100.0;
+                }
+
+                unsigned const new_cpu =
+                    std::clamp(static_cast<unsigned>(std::lround(std::max(cpu, 1.0))), 1u, cpus);
+
+                // Child processes mostly wait for disks, so we can afford
+                // more of them than CPUs, but each of them costs memory.
+                unsigned new_spawn = new_cpu * 2;
+                auto const mem_pressure = pressure_of("memory");
+                if (mem_pressure) {
+                    if (mem_pressure->full > 5.0) {
+                        new_spawn = std::max(1u, new_cpu / 2);
+                    }
+                    else if (mem_pressure->some > 10.0) {
+                        new_spawn = new_cpu;
+                    }
+                }
+
+                if (new_cpu == _cpu && new_spawn == _spawn) {
+                    return std::nullopt;
+                }
+                _cpu   = new_cpu;
+                _spawn = new_spawn;
+
+                std::ostringstream msg;
+                msg << "Concurrency: cpu " << _cpu << ", spawn " << _spawn
+                    << " (CPUs " << cpus;
+                if (load) {
+                    msg << ", load " << *load;
+                }
+                if (cpu_pressure) {
+                    msg << ", CPU pressure " << cpu_pressure->some << '%';
+                }
+                if (mem_pressure) {
+                    msg << ", memory pressure " << mem_pressure->some
+                        << "% / " << mem_pressure->full << '%';
+                }
+                msg << ')';
+                return msg.str();
+            }
+
+            std::mutex _mtx;
+            std::optional<std::chrono::steady_clock::time_point> _last_sample;
+            unsigned _cpu   = 0;
+            unsigned _spawn = 0;
+            std::function<void (std::string const&)> _log;
+        };
+    }
+
+    concurrency
+    concurrency::adaptive() {
+        concurrency c;
+        c._ctl = std::make_shared<detail::adaptive_controller>();
+        return c;
+    }
+
+    unsigned
+    concurrency::operator() (workload w) const {
+        return _ctl ? _ctl->limit(w) : _fixed;
+    }
+
+    void
+    concurrency::on_decision(std::function<void (std::string const&)> const& log) {
+        if (_ctl) {
+            _ctl->on_decision(log);
+        }
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace pkgxx {
+    /** Kinds of work done by concurrent tasks. They are limited
+     * separately, because they compete for different resources.
+     */
+    enum class workload {
+        cpu,  ///< Computation in our own process, such as parsing.
+        spawn ///< Waiting for child processes such as bmake and pkg_info.
+    };
+
+    namespace detail {
+        struct adaptive_controller;
+
+        /** Tell adaptive limits that a unit of our own work, a nursery
+         * task or a child process, has started running. They subtract
+         * such work from the load average, which counts it as well. */
+        void
+        work_started() noexcept;
+
+        /** Tell adaptive limits that a unit of work counted by \ref
+         * work_started() has finished. */
+        void
+        work_finished() noexcept;
+    }
+
+    /** A limit on the number of tasks running at once. It is either a
+     * fixed number, or adapts to the load of the system.
+     *
+     * Copies of an adaptive \ref concurrency share the same state, and
+     * are safe to use from multiple threads.
+     */
+    struct concurrency {
+        /** Construct a fixed limit applying to any kind of work. */
+        concurrency(unsigned n = std::max(1u, std::thread::hardware_concurrency()))
+            : _fixed(std::max(1u, n)) {}
+
+        /** Construct a limit that adapts to the load of the system. It
+         * starts from the number of CPUs the process may run on, and
+         * reduces it by the load average not caused by our own tasks
+         * and children and, on Linux, by CPU and memory pressure
+         * reported in \c /proc/pressure. Work waiting
+         * for child processes is allowed twice as many tasks as CPU-bound
+         * work, unless memory is under pressure. */
+        static concurrency
+        adaptive();
+
+        /** Return the current limit for a kind of work. Adaptive limits
+         * are recomputed at most once a second, so tasks of a long phase
+         * of work pick up changes in the load. */
+        unsigned
+        operator() (workload w = workload::cpu) const;
+
+        /** Return true if the limit is adaptive. */
+        bool
+        is_adaptive() const noexcept {
+            return static_cast<bool>(_ctl);
+        }
+
+        /** Set a function to be called with a description of each
+         * decision made by an adaptive limit. It may be called from any
+         * thread. It does nothing for fixed limits. */
+        void
+        on_decision(std::function<void (std::string const&)> const& log);
+
+    private:
+        unsigned _fixed = 1;
+        std::shared_ptr<detail::adaptive_controller> _ctl;
+    };
+}
@@ -0,0 +1,432 @@
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <system_error>
+#include <unistd.h>
+
+#include "distfile.hxx"
+#include "harness.hxx"
+#include "makevars.hxx"
+#include "mutex_guard.hxx"
+#include "nursery.hxx"
+#include "string_algo.hxx"
+#include "wwwstream.hxx"
+
+namespace fs = std::filesystem;
+
+namespace {
+    // An expression that bmake expands into lines of "file site..." for
+    // every distfile and patchfile. SITES.* are defined by
+    // mk/fetch/fetch.mk.
+    std::string const SITES_OF_ALLFILES =
+        "_ALLFILES:@f@${f} ${SITES.${f:T:S/=/--/}}${.newline}@";
+
+    std::string
+    host_of(std::string_view const& url) {
+        // scheme://[user@]host[:port]/...
+        auto const scheme_end = url.find("://");
+        if (scheme_end == std::string_view::npos) {
+            return std::string(url);
+        }
+        auto authority = url.substr(scheme_end + 3);
+        authority = authority.substr(0, authority.find('/'));
+        if (auto const at = authority.rfind('@'); at != std::string_view::npos) {
+            authority = authority.substr(at + 1);
+        }
+        return std::string(authority);
+    }
+
+    /** A set of counting semaphores, one per host. */
+    struct site_limiter {
+        site_limiter(unsigned limit)
+            : _limit(limit) {}
+
+        struct slot {
+            slot(site_limiter& sl, std::string&& host)
+                : _sl(sl)
+                , _host(std::move(host)) {
+
+                std::unique_lock<std::mutex> lk(_sl._mtx);
+                _sl._cv.wait(lk, [&]() { return _sl._busy[_host] < _sl._limit; });
+                _sl._busy[_host]++;
+            }
+
+            ~slot() {
+                {
+                    std::lock_guard<std::mutex> lk(_sl._mtx);
+                    _sl._busy[_host]--;
+                }
+                _sl._cv.notify_all();
+            }
+
+        private:
+            site_limiter& _sl;
+            std::string _host;
+        };
+
+    private:
+        unsigned _limit;
+        std::mutex _mtx;
+        std::condition_variable _cv;
+        std::map<std::string, unsigned> _busy;
+    };
+
+    std::map<std::string, std::string>
+    compute_digests(std::string const& DIGEST,
+                    std::map<std::string, std::string> const& expected,
+                    fs::path const& file) {
+        // digest(1) takes only one algorithm at a time, so a single shell
+        // runs it for each of them. It prints "ALGORITHM (FILE) =
+        // DIGEST".
+        using namespace na::literals;
+        std::vector<std::string> argv = {
+            pkgxx::shell, "-c",
+            "d=$1; f=$2; shift 2; for a; do $d \"$a\" \"$f\" || exit; done",
+            pkgxx::shell, DIGEST, file.string()
+        };
+        for (auto const& [algorithm, _digest]: expected) {
+            argv.push_back(algorithm);
+        }
+        pkgxx::harness digest(
+            pkgxx::shell, argv, "stdin_action"_na = pkgxx::harness::fd_action::close);
+
+        std::map<std::string, std::string> ret;
+        for (std::string line; std::getline(digest.cout(), line); ) {
+            auto const open = line.find(" (");
+            auto const eq   = line.rfind(" = ");
+            if (open == std::string::npos || eq == std::string::npos || eq < open) {
+                throw pkgxx::distfile_error(
+                    "Unexpected output from " + DIGEST + ": " + line);
+            }
+            ret.emplace(line.substr(0, open), line.substr(eq + 3));
+        }
+        digest.wait_success();
+        return ret;
+    }
+
+    void
+    verify(pkgxx::distfile const& file, fs::path const& tmp, std::string const& DIGEST) {
+        if (file.size && fs::file_size(tmp) != *file.size) {
+            throw pkgxx::distfile_error(
+                "Size mismatch for " + file.name + ": expected " + std::to_string(*file.size) +
+                " bytes but got " + std::to_string(fs::file_size(tmp)));
+        }
+        if (file.checksums.empty()) {
+            return;
+        }
+        auto const actual = compute_digests(DIGEST, file.checksums, tmp);
+        for (auto const& [algorithm, expected]: file.checksums) {
+            if (auto it = actual.find(algorithm); it == actual.end() || it->second != expected) {
+                throw pkgxx::distfile_error(
+                    algorithm + " checksum mismatch for " + file.name);
+            }
+        }
+    }
+
+    void
+    download_with_libfetch(std::string const& url, fs::path const& tmp) {
+        // libfetch reports errors through process-wide variables, so
+        // transfers can't overlap.
+        static std::mutex mtx;
+        std::lock_guard<std::mutex> lk(mtx);
+
+        pkgxx::wwwistream in(url);
+        std::ofstream out(tmp, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+        if (!out) {
+            throw std::system_error(errno, std::generic_category(), "Failed to open " + tmp.string());
+        }
+        out.exceptions(std::ios_base::badbit);
+
+        std::array<char, 65536> buf;
+        while (in.read(buf.data(), buf.size()), in.gcount() > 0) {
+            out.write(buf.data(), in.gcount());
+        }
+        if (in.bad()) {
+            throw pkgxx::distfile_error("Failed to read " + url);
+        }
+    }
+
+    void
+    download(pkgxx::fetch_tools const& tools, std::string const& url, fs::path const& tmp) {
+        if (tools.FETCH_CMD.empty()) {
+            download_with_libfetch(url, tmp);
+            return;
+        }
+
+        // mk/fetch/fetch runs "${FETCH_CMD} ${FETCH_BEFORE_ARGS}
+        // ${FETCH_OUTPUT_ARGS} file url ${FETCH_AFTER_ARGS}".
+        auto const head = tools.FETCH_CMD + ' ' + tools.FETCH_BEFORE_ARGS + ' ' + tools.FETCH_OUTPUT_ARGS;
+        std::vector<std::string> argv;
+        if (auto after = pkgxx::split_shell_words(tools.FETCH_AFTER_ARGS); after) {
+            argv = pkgxx::shell_command_argv(head, {tmp.string(), url});
+            argv.insert(argv.end(), after->begin(), after->end());
+        }
+        else {
+            argv = {
+                pkgxx::shell, "-c",
+                "exec " + head + " \"$1\" \"$2\" " + tools.FETCH_AFTER_ARGS,
+                pkgxx::shell, tmp.string(), url
+            };
+        }
+
+        using namespace na::literals;
+        // Transfers run in parallel, so their progress meters would only
+        // garble the terminal. Keep the output to explain failures.
+        pkgxx::harness fetch(
+            argv[0], argv,
+            "stdin_action"_na  = pkgxx::harness::fd_action::close,
+            "stderr_action"_na = pkgxx::harness::fd_action::merge_with_stdout,
+            "dtor_action"_na   = pkgxx::harness::dtor_action::wait);
+        std::string last;
+        for (std::string line; std::getline(fetch.cout(), line); ) {
+            if (!line.empty()) {
+                last = std::move(line);
+            }
+        }
+        auto const& st = fetch.wait();
+        if (auto const* ex = std::get_if<pkgxx::harness::exited>(&st); !ex || ex->status != 0) {
+            throw pkgxx::distfile_error(
+                last.empty() ? tools.FETCH_CMD + " failed" : last);
+        }
+    }
+
+    void
+    fetch_one(
+        pkgxx::distfile const& file,
+        pkgxx::fetch_tools const& tools,
+        std::function<void (std::string const&)> const& on_attempt,
+        site_limiter* limiter) {
+
+        static std::atomic<unsigned> serial = 0;
+
+        fs::create_directories(file.path.parent_path());
+        auto tmp = file.path;
+        tmp += ".fetch." + std::to_string(getpid()) + '.' + std::to_string(serial++);
+
+        std::string errors;
+        for (auto const& url: file.urls()) {
+            try {
+                on_attempt(url);
+                {
+                    std::optional<site_limiter::slot> slot;
+                    if (limiter) {
+                        slot.emplace(*limiter, host_of(url));
+                    }
+                    download(tools, url, tmp);
+                }
+                verify(file, tmp, tools.DIGEST);
+                fs::rename(tmp, file.path);
+                return;
+            }
+            catch (std::exception const& e) {
+                // Try the next site, but remember why this one failed. A
+                // failure to remove the partial file must not hide it.
+                std::error_code ec;
+                fs::remove(tmp, ec);
+                errors += "\n    ";
+                errors += url;
+                errors += ": ";
+                errors += e.what();
+            }
+        }
+        throw pkgxx::distfile_error(
+            "Unable to fetch " + file.name + (errors.empty() ? ": no sites" : errors));
+    }
+}
+
+namespace pkgxx {
+    std::vector<std::string>
+    distfile::urls() const {
+        std::string const basename = fs::path(name).filename().string();
+        std::vector<std::string> ret;
+        for (auto const& site: sites) {
+            if (starts_with(site, "-")) {
+                ret.push_back(site.substr(1));
+            }
+            else {
+                ret.push_back(site + basename);
+            }
+        }
+        return ret;
+    }
+
+    std::optional<fetch_info>
+    fetch_info::from_source(
+        std::filesystem::path const& PKGSRCDIR,
+        pkgxx::pkgpath const& path) {
+
+        auto const pkgdir = PKGSRCDIR / path;
+        auto const vars =
+            extract_pkgmk_vars(
+                pkgdir,
+                {
+                    "DISTDIR", "DIST_SUBDIR", "DISTINFO_FILE", "TOOLS_DIGEST",
+                    "FETCH_CMD", "FETCH_BEFORE_ARGS", "FETCH_OUTPUT_ARGS", "FETCH_AFTER_ARGS",
+                    "_MASTER_SITE_OVERRIDE", "_MASTER_SITE_BACKUP",
+                    SITES_OF_ALLFILES,
+                    "BOOTSTRAP_DEPENDS", "BUILD_DEPENDS", "TOOL_DEPENDS", "DEPENDS"
+                });
+        if (!vars) {
+            return std::nullopt;
+        }
+
+        fetch_info info;
+        info.tools.DIGEST = vars->at("TOOLS_DIGEST").empty() ? "digest" : vars->at("TOOLS_DIGEST");
+        info.tools.FETCH_CMD         = vars->at("FETCH_CMD");
+        info.tools.FETCH_BEFORE_ARGS = vars->at("FETCH_BEFORE_ARGS");
+        info.tools.FETCH_OUTPUT_ARGS = vars->at("FETCH_OUTPUT_ARGS");
+        info.tools.FETCH_AFTER_ARGS  = vars->at("FETCH_AFTER_ARGS");
+
+        for (auto const& var: {"BOOTSTRAP_DEPENDS", "BUILD_DEPENDS", "TOOL_DEPENDS", "DEPENDS"}) {
+            for (auto const& dep: words(vars->at(var))) {
+                // pattern:../../category/name
+                if (auto colon = dep.find(':'); colon != std::string_view::npos) {
+                    auto const dep_path = dep.substr(colon + 1);
+                    if (starts_with(dep_path, "../../")) {
+                        info.depends.emplace(dep_path.substr(6));
+                    }
+                }
+            }
+        }
+
+        fs::path const DISTDIR = vars->at("DISTDIR");
+        std::string const& DIST_SUBDIR = vars->at("DIST_SUBDIR");
+        std::string const& DISTINFO_FILE = vars->at("DISTINFO_FILE");
+        std::map<std::string, std::map<std::string, std::string>> distinfo;
+        if (!DISTINFO_FILE.empty() && fs::exists(DISTINFO_FILE)) {
+            distinfo = read_distinfo(DISTINFO_FILE);
+        }
+
+        std::istringstream lines(vars->at(SITES_OF_ALLFILES));
+        for (std::string line; std::getline(lines, line); ) {
+            words ws(line);
+            auto it = ws.begin();
+            if (it == ws.end()) {
+                continue;
+            }
+
+            distfile file;
+            file.name = std::string(*it++);
+            file.path = DIST_SUBDIR.empty()
+                ? DISTDIR / file.name
+                : DISTDIR / DIST_SUBDIR / file.name;
+
+            for (auto const& site: words(vars->at("_MASTER_SITE_OVERRIDE"))) {
+                file.sites.emplace_back(site);
+            }
+            for (; it != ws.end(); it++) {
+                file.sites.emplace_back(*it);
+            }
+            for (auto const& site: words(vars->at("_MASTER_SITE_BACKUP"))) {
+                file.sites.emplace_back(site);
+            }
+
+            // distinfo lists files relative to DISTDIR, not
+            // ${DISTDIR}/${DIST_SUBDIR}.
+            auto const key = DIST_SUBDIR.empty() ? file.name : DIST_SUBDIR + '/' + file.name;
+            if (auto sums = distinfo.find(key); sums != distinfo.end()) {
+                for (auto const& [algorithm, digest]: sums->second) {
+                    if (algorithm == "Size") {
+                        file.size = std::stoull(digest);
+                    }
+                    else {
+                        file.checksums.emplace(algorithm, digest);
+                    }
+                }
+            }
+            info.distfiles.push_back(std::move(file));
+        }
+        return info;
+    }
+
+    std::map<std::string, std::map<std::string, std::string>>
+    read_distinfo(std::filesystem::path const& file) {
+        std::ifstream in(file);
+        if (!in) {
+            throw std::system_error(errno, std::generic_category(), "Failed to open " + file.string());
+        }
+
+        // ALGORITHM (FILE) = DIGEST
+        // Size (FILE) = BYTES bytes
+        std::map<std::string, std::map<std::string, std::string>> ret;
+        for (std::string line; std::getline(in, line); ) {
+            auto const open  = line.find(" (");
+            auto const close = line.rfind(") = ");
+            if (open == std::string::npos || close == std::string::npos || close < open) {
+                continue;
+            }
+            auto const algorithm = line.substr(0, open);
+            auto const name      = line.substr(open + 2, close - open - 2);
+            auto value           = line.substr(close + 4);
+            if (algorithm == "Size") {
+                value = value.substr(0, value.find(' '));
+            }
+            ret[name][algorithm] = std::move(value);
+        }
+        return ret;
+    }
+
+    bool
+    is_fetched(distfile const& file, std::string const& DIGEST) {
+        std::error_code ec;
+        if (!fs::is_regular_file(file.path, ec)) {
+            return false;
+        }
+        try {
+            verify(file, file.path, DIGEST);
+            return true;
+        }
+        catch (std::exception const&) {
+            // Most likely a leftover from an interrupted fetch.
+            return false;
+        }
+    }
+
+    void
+    fetch_distfile(
+        distfile const& file,
+        fetch_tools const& tools,
+        std::function<void (std::string const& url)> const& on_attempt) {
+
+        fetch_one(file, tools, on_attempt, nullptr);
+    }
+
+    std::map<std::filesystem::path, std::exception_ptr>
+    fetch_distfiles(
+        std::vector<distfile> const& files,
+        fetch_tools const& tools,
+        pkgxx::concurrency const& concurrency,
+        unsigned per_site_limit,
+        std::function<void (distfile const&, std::string const& url)> const& on_attempt) {
+
+        site_limiter limiter(per_site_limit);
+        guarded<std::map<fs::path, std::exception_ptr>> failed;
+        {
+            nursery n(concurrency, workload::spawn);
+            for (auto const& file: files) {
+                n.start_soon(
+                    [&]() {
+                        // Don't let a failure cancel other transfers.
+                        try {
+                            if (is_fetched(file, tools.DIGEST)) {
+                                return;
+                            }
+                            fetch_one(
+                                file, tools,
+                                [&](auto const& url) {
+                                    on_attempt(file, url);
+                                },
+                                &limiter);
+                        }
+                        catch (...) {
+                            failed.lock()->emplace(file.path, std::current_exception());
+                        }
+                    });
+            }
+        }
+        return std::move(*failed.lock());
+    }
+}
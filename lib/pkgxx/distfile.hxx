@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <pkgxx/concurrency.hxx>
+#include <pkgxx/pkgpath.hxx>
+
+namespace pkgxx {
+    struct distfile_error: std::runtime_error {
+        using std::runtime_error::runtime_error;
+    };
+
+    /** A distfile to be fetched in order to build a package. */
+    struct distfile {
+        /// The name of the file as it appears in \c DISTFILES or \c
+        /// PATCHFILES.
+        std::string name;
+
+        /// The path to the file on the local file system, i.e. \c
+        /// ${DISTDIR}/${DIST_SUBDIR}/${name}.
+        std::filesystem::path path;
+
+        /// Master sites to fetch the file from, in the order of
+        /// preference. Sites starting with a hyphen are complete URLs.
+        std::vector<std::string> sites;
+
+        /// Checksums of the file taken from \c distinfo, in the form of
+        /// {algorithm, digest}.
+        std::map<std::string, std::string> checksums;
+
+        /// The size of the file in bytes if \c distinfo has it.
+        std::optional<std::uintmax_t> size;
+
+        /// Return the list of URLs to try in order.
+        std::vector<std::string>
+        urls() const;
+    };
+
+    /** Commands to fetch and verify distfiles, taken from \c
+     * mk/fetch/fetch.mk so that \c FETCH_USING is honored.
+     */
+    struct fetch_tools {
+        /// The command to compute checksums, i.e. \c ${TOOLS_DIGEST}.
+        std::string DIGEST;
+
+        /// The command to fetch a URL. If it's empty, files are fetched
+        /// with libfetch one at a time.
+        std::string FETCH_CMD;
+
+        std::string FETCH_BEFORE_ARGS;
+        std::string FETCH_OUTPUT_ARGS;
+        std::string FETCH_AFTER_ARGS;
+    };
+
+    /** Information needed to fetch distfiles of a package, extracted from
+     * its Makefile. This does not recurse into dependencies, but \ref
+     * depends lists the package paths to visit for them.
+     */
+    struct fetch_info {
+        /// Extract the information from a package directory. Returns \c
+        /// std::nullopt if it doesn't have a Makefile.
+        static std::optional<fetch_info>
+        from_source(
+            std::filesystem::path const& PKGSRCDIR,
+            pkgxx::pkgpath const& path);
+
+        /// Distfiles and patchfiles of the package.
+        std::vector<distfile> distfiles;
+
+        /// Package paths that the package depends on in any way.
+        std::set<pkgxx::pkgpath> depends;
+
+        /// Commands to fetch and verify them.
+        fetch_tools tools;
+    };
+
+    /** Parse a \c distinfo file. Returns a map from file names relative
+     * to DISTDIR to {algorithm, digest} pairs. Sizes are recorded with the
+     * algorithm name "Size" and the digest being a number of bytes.
+     */
+    std::map<std::string, std::map<std::string, std::string>>
+    read_distinfo(std::filesystem::path const& file);
+
+    /** See if a distfile exists and matches its size and checksums. */
+    bool
+    is_fetched(distfile const& file, std::string const& DIGEST);
+
+    /** Fetch a single distfile to its path, trying each site in order. The
+     * file is written to a temporary file next to the destination and is
+     * renamed only after verifying its size and checksums, so an
+     * interrupted fetch never leaves a partial file behind. Throws \ref
+     * distfile_error if no sites succeeded.
+     */
+    void
+    fetch_distfile(
+        distfile const& file,
+        fetch_tools const& tools,
+        std::function<void (std::string const& url)> const& on_attempt = [](auto const&) {});
+
+    /** Fetch a set of distfiles in parallel with at most \c concurrency
+     * transfers at a time, as limited for \ref workload::spawn, and at most
+     * \c per_site_limit of them talking to the same host. Files that
+     * already exist are verified and fetched again only if they don't
+     * match. Returns a map from paths of distfiles that couldn't be
+     * fetched to the reason why.
+     */
+    std::map<std::filesystem::path, std::exception_ptr>
+    fetch_distfiles(
+        std::vector<distfile> const& files,
+        fetch_tools const& tools,
+        pkgxx::concurrency const& concurrency,
+        unsigned per_site_limit = 2,
+        std::function<void (distfile const&, std::string const& url)> const& on_attempt =
+            [](auto const&, auto const&) {});
+}
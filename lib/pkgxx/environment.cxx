@@ -1,12 +1,101 @@
+#include <algorithm>
 #include <exception>
+#include <set>
 #include <stdlib.h>
+#include <sys/utsname.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "environment.hxx"
 #include "makevars.hxx"
+#include "spawn.hxx"
+#include "tape.hxx"
 
 namespace fs = std::filesystem;
 
+namespace {
+    // Make variables that either pkgchkxx or pkgrrxx needs at startup.
+    std::vector<std::string> const STARTUP_VARS = {
+        "FETCH_USING",
+        "MACHINE_ARCH",
+        "OPSYS",
+        "OS_VERSION",
+        "PACKAGES",
+        "PKG_ADD",
+        "PKG_ADMIN",
+        "PKG_DELETE",
+        "PKG_INFO",
+        "PKG_SUFX",
+        "PKG_SYSCONFDIR",
+        "PKGCHK_CONF",
+        "PKGCHK_NOTAGS",
+        "PKGCHK_TAGS",
+        "PKGCHK_UPDATE_CONF",
+        "SU_CMD"
+    };
+
+    // Environment variables that may affect values of STARTUP_VARS,
+    // besides the ones starting with "PKG". bmake imports the whole
+    // environment, but taking all of it into the cache key would make
+    // the cache rarely hit, as it contains things like session IDs.
+    std::set<std::string_view> const STARTUP_ENV = {
+        "FETCH_USING",
+        "HOME",
+        "LOCALBASE",
+        "MACHINE",
+        "MACHINE_ARCH",
+        "MAKECONF",
+        "MAKEFLAGS",
+        "MAKESYSPATH",
+        "OPSYS",
+        "OS_VERSION",
+        "PACKAGES",
+        "PATH",
+        "SU_CMD",
+        "UNPRIVILEGED",
+        "USER"
+    };
+
+    // Everything other than files that affects values of STARTUP_VARS.
+    std::string
+    startup_cache_key(fs::path const& makeconf) {
+        std::string key;
+        key += pkgxx::bmake();
+        key += '\n';
+        key += makeconf.string();
+        key += '\n';
+        key += std::to_string(geteuid());
+        key += '\n';
+
+        // OPSYS, OS_VERSION, and MACHINE_ARCH come from uname(3) unless
+        // they are set explicitly.
+        if (utsname u; uname(&u) == 0) {
+            key += u.sysname;
+            key += ' ';
+            key += u.release;
+            key += ' ';
+            key += u.machine;
+            key += '\n';
+        }
+
+        std::vector<std::string_view> env;
+        for (auto p = pkgxx::environ_snapshot()->data(); *p; p++) {
+            std::string_view const def(*p);
+            auto const name = def.substr(0, def.find('='));
+            if (name.substr(0, 3) == "PKG" || STARTUP_ENV.count(name)) {
+                env.push_back(def);
+            }
+        }
+        std::sort(env.begin(), env.end());
+        for (auto const& def: env) {
+            key += def;
+            key += '\n';
+        }
+        return key;
+    }
+
+}
+
 namespace pkgxx {
     std::string
     cgetenv(std::string const& name) {
@@ -14,6 +103,16 @@ namespace pkgxx {
         return value ? value : "";
     }
 
+    std::string const&
+    bmake() {
+        static std::string const cmd =
+            []() {
+                auto const value = cgetenv("BMAKE");
+                return value.empty() ? std::string(CFG_BMAKE) : value;
+            }();
+        return cmd;
+    }
+
     environment::environment(
         std::function<
                 void (std::string_view const&, std::string_view const&)
@@ -27,6 +126,7 @@ namespace pkgxx {
             p.set_value(path);
             PKG_PATH = p.get_future();
             unsetenv("PKG_PATH");
+            refresh_environ_snapshot();
             _var_logger("PKG_PATH", path);
         }
 
@@ -47,7 +147,7 @@ namespace pkgxx {
                         "/etc/mk.conf"
                     };
                     for (auto const &mkconf: candidates) {
-                        if (fs::exists(mkconf)) {
+                        if (tape::exists(mkconf)) {
                             vMAKECONF = mkconf;
                             break;
                         }
@@ -60,22 +160,36 @@ namespace pkgxx {
                 return vMAKECONF;
             }).share();
 
-        // PKGSRCDIR
-        PKGSRCDIR = std::async(
+        // PKGSRCDIR and pkgsrc_vars. Evaluating them takes two bmake
+        // runs, one for mk.conf and one for a package Makefile, so we
+        // cache them on disk.
+        std::shared_future<std::map<std::string, std::string>> const startup = std::async(
             std::launch::deferred,
             [&]() {
+                makevars_cache const cache(startup_cache_key(MAKECONF.get()));
+                if (auto vars = cache.load(); vars) {
+                    auto const curdir = vars->find(".CURDIR");
+                    if (curdir == vars->end() || curdir->second == fs::current_path().string()) {
+                        if (cgetenv("PKGSRCDIR").empty()) {
+                            _var_logger("PKGSRCDIR", (*vars)["PKGSRCDIR"]);
+                        }
+                        return std::move(*vars);
+                    }
+                }
+
+                std::map<std::string, std::string> vars;
                 fs::path vPKGSRCDIR = cgetenv("PKGSRCDIR");
                 fs::path vLOCALBASE = cgetenv("LOCALBASE");
 
                 if (vPKGSRCDIR.empty()) {
-                    std::vector<std::string> vars = {
+                    std::vector<std::string> mkconf_vars = {
                         "PKGSRCDIR"
                     };
                     if (vLOCALBASE.empty()) {
-                        vars.push_back("LOCALBASE");
+                        mkconf_vars.push_back("LOCALBASE");
                     }
 
-                    auto value_of = pkgxx::extract_mkconf_vars(MAKECONF.get(), vars).value();
+                    auto value_of = pkgxx::extract_mkconf_vars(MAKECONF.get(), mkconf_vars).value();
                     for (auto const& [var, value]: value_of) {
                         _var_logger(var, value);
                     }
@@ -95,15 +209,62 @@ namespace pkgxx {
                         "/usr/pkgsrc"
                     };
                     for (auto const &pkgsrcdir: candidates) {
-                        if (fs::exists(pkgsrcdir / "mk/bsd.pkg.mk")) {
+                        if (tape::exists(pkgsrcdir / "mk/bsd.pkg.mk")) {
                             vPKGSRCDIR = fs::absolute(pkgsrcdir);
+                            if (pkgsrcdir.is_relative()) {
+                                // The result depends on where we are.
+                                vars[".CURDIR"] = fs::current_path().string();
+                            }
                             break;
                         }
                     }
                     _var_logger("PKGSRCDIR", vPKGSRCDIR.string());
                 }
-                return vPKGSRCDIR;
+
+                // Now we have PKGSRCDIR, evaluate everything that can only
+                // be obtained from pkgsrc Makefiles in one go. We also ask
+                // for the makefiles bmake read, so that the cache notices
+                // changes to files mk.conf includes.
+                auto query = STARTUP_VARS;
+                query.push_back(".MAKE.MAKEFILES");
+                std::vector<fs::path> deps;
+                auto const pkgdir = vPKGSRCDIR / "pkgtools/pkg_install"; // Any package will do.
+                if (!vPKGSRCDIR.empty() && tape::is_directory(pkgdir)) {
+                    vars.merge(pkgxx::extract_pkgmk_vars(pkgdir, query).value());
+                    deps = pkgxx::makefiles_read(vars[".MAKE.MAKEFILES"], pkgdir);
+                }
+                else if (MAKECONF.get() != "/dev/null") {
+                    vars.merge(pkgxx::extract_mkconf_vars(MAKECONF.get(), query).value());
+                    deps = pkgxx::makefiles_read(vars[".MAKE.MAKEFILES"], fs::current_path());
+                }
+                vars.erase(".MAKE.MAKEFILES");
+                vars["PKGSRCDIR"] = vPKGSRCDIR.string();
+
+                if (!vPKGSRCDIR.empty()) {
+                    // Files in ${PKGSRCDIR}/mk are covered by the
+                    // directory itself.
+                    auto const mk = (vPKGSRCDIR / "mk").lexically_normal();
+                    deps.erase(
+                        std::remove_if(
+                            deps.begin(), deps.end(),
+                            [&](auto const& file) {
+                                auto const rel = file.lexically_relative(mk);
+                                return !rel.empty() && *rel.begin() != "..";
+                            }),
+                        deps.end());
+                    deps.push_back(MAKECONF.get());
+                    deps.push_back(mk);
+                    deps.push_back(pkgdir);
+                    cache.store(vars, deps);
+                }
+                return vars;
+            }).share();
+        PKGSRCDIR = std::async(
+            std::launch::deferred,
+            [startup]() {
+                return fs::path(startup.get().at("PKGSRCDIR"));
             }).share();
+        pkgsrc_vars = startup;
 
         // WRKDIR_BASENAME
         WRKDIR_BASENAME = std::async(
@@ -121,4 +282,16 @@ namespace pkgxx {
                 return vWRKDIR_BASENAME;
             }).share();
     }
+
+    std::map<std::string, std::string>
+    environment::pkgsrc_vars_of(std::vector<std::string> const& vars) const {
+        auto const& all = pkgsrc_vars.get();
+        std::map<std::string, std::string> value_of;
+        for (auto const& var: vars) {
+            auto const it = all.find(var);
+            auto const& value = value_of[var] = it != all.end() ? it->second : "";
+            _var_logger(var, value);
+        }
+        return value_of;
+    }
 }
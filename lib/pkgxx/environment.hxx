@@ -3,13 +3,21 @@
 #include <filesystem>
 #include <functional>
 #include <future>
+#include <map>
+#include <string>
 #include <string_view>
+#include <vector>
 
 namespace pkgxx {
     /** C++ wrapper for POSIX getenv(3) */
     std::string
     cgetenv(std::string const& name);
 
+    /** The bmake command to run: \c BMAKE in the environment if it's
+     * set, or the one found at configure time otherwise. */
+    std::string const&
+    bmake();
+
     /** Values from the environment such as various Makefiles. Most of such
      * values are very expensive to retrieve so they are lazily
      * evaluated.
@@ -29,6 +37,21 @@ namespace pkgxx {
         std::shared_future<std::filesystem::path> PKGSRCDIR;       ///< Base of pkgsrc tree
         std::shared_future<std::filesystem::path> WRKDIR_BASENAME; ///< Directories to clean
 
+        /** Values of make variables either tool needs at startup, taken
+         * from a package Makefile in PKGSRCDIR, or from MAKECONF if no
+         * such packages exist. They are evaluated all at once, and the
+         * result is reused by later invocations as long as MAKECONF,
+         * makefiles it includes, files in \c ${PKGSRCDIR}/mk, the
+         * output of <tt>uname -srm</tt>, and relevant environment
+         * variables are unchanged. */
+        std::shared_future<std::map<std::string, std::string>> pkgsrc_vars;
+
+        /** Obtain values of some of \ref pkgsrc_vars and log them. The
+         * result contains every variable in \c vars, empty if it isn't
+         * known. */
+        std::map<std::string, std::string>
+        pkgsrc_vars_of(std::vector<std::string> const& vars) const;
+
     private:
         std::function<
             void (std::string_view const&, std::string_view const&)
@@ -1,11 +1,54 @@
+#include <algorithm>
 #include <cerrno>
+#include <cstring>
+#include <utility>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "fdstream.hxx"
+#include "stats.hxx"
+
+namespace {
+    /* Write all of the given buffers, retrying on short writes. The
+     * array of iovec is modified.
+     */
+    bool
+    writev_all(int fd, iovec* iov, int iovcnt) {
+        while (iovcnt > 0) {
+            if (iov->iov_len == 0) {
+                iov++;
+                iovcnt--;
+                continue;
+            }
+
+            ssize_t const n_written = writev(fd, iov, iovcnt);
+            if (n_written > 0) {
+                auto n_remaining = static_cast<std::size_t>(n_written);
+                while (n_remaining > 0 && n_remaining >= iov->iov_len) {
+                    n_remaining -= iov->iov_len;
+                    iov++;
+                    iovcnt--;
+                }
+                if (n_remaining > 0) {
+                    iov->iov_base = static_cast<char*>(iov->iov_base) + n_remaining;
+                    iov->iov_len -= n_remaining;
+                }
+            }
+            else if (n_written == -1 && errno == EINTR) {
+                continue;
+            }
+            else {
+                return false;
+            }
+        }
+        return true;
+    }
+}
 
 namespace pkgxx {
-    fdstreambuf::fdstreambuf(int fd)
-        : _fd(fd) {}
+    fdstreambuf::fdstreambuf(int fd, std::size_t buf_size)
+        : _fd(fd)
+        , _buf_size(std::max<std::size_t>(buf_size, 1)) {}
 
     fdstreambuf::~fdstreambuf() {
         close();
@@ -21,28 +64,171 @@ namespace pkgxx {
         return this;
     }
 
+    int
+    fdstreambuf::release() {
+        sync();
+        setg(nullptr, nullptr, nullptr);
+        return std::exchange(_fd, -1);
+    }
+
+    std::optional<std::string_view>
+    fdstreambuf::getline_view(char_type delim) {
+        // The number of bytes at gptr() already known not to contain
+        // delim.
+        std::size_t scanned = 0;
+        while (true) {
+            char_type* const begin = gptr();
+            std::size_t const avail = static_cast<std::size_t>(egptr() - begin);
+            if (avail > scanned) {
+                if (auto* const end = static_cast<char_type*>(
+                        std::memchr(begin + scanned, delim, avail - scanned)); end) {
+                    setg(eback(), end + 1, egptr());
+                    return std::string_view(begin, static_cast<std::size_t>(end - begin));
+                }
+                scanned = avail;
+            }
+
+            if (!fill()) {
+                if (avail > 0) {
+                    // The last line isn't terminated.
+                    setg(eback(), egptr(), egptr());
+                    return std::string_view(gptr() - avail, avail);
+                }
+                return std::nullopt;
+            }
+        }
+    }
+
+    bool
+    fdstreambuf::fill() {
+        std::size_t const avail = gptr() != nullptr
+            ? static_cast<std::size_t>(egptr() - gptr())
+            : 0;
+
+        if (!_read_buf) {
+            _read_buf      = std::unique_ptr<char_type[]>(new char_type[_buf_size]);
+            _read_buf_size = _buf_size;
+        }
+        else if (avail == _read_buf_size) {
+            auto bigger = std::unique_ptr<char_type[]>(new char_type[_read_buf_size * 2]);
+            std::memcpy(bigger.get(), gptr(), avail);
+            _read_buf = std::move(bigger);
+            _read_buf_size *= 2;
+        }
+        else if (avail > 0) {
+            std::memmove(_read_buf.get(), gptr(), avail);
+        }
+        setg(_read_buf.get(), _read_buf.get(), _read_buf.get() + avail);
+
+        while (true) {
+            ssize_t const n_read = read(_fd, _read_buf.get() + avail, _read_buf_size - avail);
+            if (n_read > 0) {
+                stats::pipe_bytes_read.add(static_cast<std::uint64_t>(n_read));
+                setg(_read_buf.get(), _read_buf.get(), _read_buf.get() + avail + n_read);
+                return true;
+            }
+            else if (n_read == -1 && errno == EINTR) {
+                continue;
+            }
+            else {
+                return false;
+            }
+        }
+    }
+
+    bool
+    fdstreambuf::flush(char_type const* s, std::size_t count) {
+        std::size_t const pending = pbase() != nullptr
+            ? static_cast<std::size_t>(pptr() - pbase())
+            : 0;
+
+        iovec iov[2] = {
+            {pbase(), pending},
+            {const_cast<char_type*>(s), count}
+        };
+        bool const ok = writev_all(_fd, iov, 2);
+        if (_write_buf) {
+            setp(_write_buf.get(), _write_buf.get() + _buf_size);
+        }
+        return ok;
+    }
+
 #if !defined(DOXYGEN)
     int
     fdstreambuf::sync() {
         if (pbase() != nullptr && pptr() > pbase()) {
-            std::size_t const n_write = static_cast<std::size_t>(pptr() - pbase());
-            for (std::size_t n_remaining = n_write; n_remaining > 0; ) {
-                ssize_t const n_written = write(_fd, _write_buf->data(), n_write);
-                if (n_written > 0) {
-                    n_remaining -= static_cast<std::size_t>(n_written);
-                    continue;
-                }
-                else if (n_written == -1 && errno == EINTR) {
-                    continue;
+            if (!flush()) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+#endif
+
+#if !defined(DOXYGEN)
+    std::streamsize
+    fdstreambuf::xsgetn(char_type* s, std::streamsize count) {
+        // Take what's buffered first.
+        std::streamsize n_got = std::min<std::streamsize>(count, egptr() - gptr());
+        if (n_got > 0) {
+            std::memcpy(s, gptr(), static_cast<std::size_t>(n_got));
+            gbump(static_cast<int>(n_got));
+        }
+
+        if (!_read_buf) {
+            _read_buf      = std::unique_ptr<char_type[]>(new char_type[_buf_size]);
+            _read_buf_size = _buf_size;
+        }
+
+        // Then read the rest directly into the caller's memory, and
+        // refill our buffer with the same system call.
+        while (n_got < count) {
+            std::size_t const n_wanted = static_cast<std::size_t>(count - n_got);
+            iovec iov[2] = {
+                {s + n_got, n_wanted},
+                {_read_buf.get(), _read_buf_size}
+            };
+            ssize_t const n_read = readv(_fd, iov, 2);
+            if (n_read > 0) {
+                auto const n = static_cast<std::size_t>(n_read);
+                if (n > n_wanted) {
+                    n_got = count;
+                    setg(_read_buf.get(), _read_buf.get(), _read_buf.get() + (n - n_wanted));
                 }
                 else {
-                    return -1;
+                    n_got += n_read;
+                    setg(_read_buf.get(), _read_buf.get(), _read_buf.get());
                 }
             }
-            setp(_write_buf->data(),
-                 _write_buf->data() + _write_buf->size());
+            else if (n_read == -1 && errno == EINTR) {
+                continue;
+            }
+            else {
+                break;
+            }
+        }
+        return n_got;
+    }
+#endif
+
+#if !defined(DOXYGEN)
+    std::streamsize
+    fdstreambuf::xsputn(char_type const* s, std::streamsize count) {
+        if (pbase() == nullptr) {
+            _write_buf = std::unique_ptr<char_type[]>(new char_type[_buf_size]);
+            setp(_write_buf.get(), _write_buf.get() + _buf_size);
+        }
+
+        if (count <= epptr() - pptr()) {
+            std::memcpy(pptr(), s, static_cast<std::size_t>(count));
+            pbump(static_cast<int>(count));
+            return count;
+        }
+        else {
+            // It doesn't fit. Write out what's buffered and the new data
+            // together.
+            return flush(s, static_cast<std::size_t>(count)) ? count : 0;
         }
-        return 0;
     }
 #endif
 
@@ -52,28 +238,16 @@ namespace pkgxx {
         if (pbase() == nullptr) {
             // An overflow has happened because we haven't allocated a
             // buffer yet.
-            _write_buf = buffer_t();
+            _write_buf = std::unique_ptr<char_type[]>(new char_type[_buf_size]);
+            setp(_write_buf.get(), _write_buf.get() + _buf_size);
         }
         else if (pptr() > pbase()) {
             // An overflow has happened either because the buffer became
             // full, or because it's being closed. Flush it now.
-            std::size_t const n_write = static_cast<std::size_t>(pptr() - pbase());
-            for (std::size_t n_remaining = n_write; n_remaining > 0; ) {
-                ssize_t const n_written = write(_fd, _write_buf->data(), n_write);
-                if (n_written > 0) {
-                    n_remaining -= static_cast<std::size_t>(n_written);
-                    continue;
-                }
-                else if (n_written == -1 && errno == EINTR) {
-                    continue;
-                }
-                else {
-                    return traits_type::eof();
-                }
+            if (!flush()) {
+                return traits_type::eof();
             }
         }
-        setp(_write_buf->data(),
-             _write_buf->data() + _write_buf->size());
 
         if (!traits_type::eq_int_type(ch, traits_type::eof())) {
             char_type const c = traits_type::to_char_type(ch);
@@ -88,28 +262,12 @@ namespace pkgxx {
 #if !defined(DOXYGEN)
     fdstreambuf::int_type
     fdstreambuf::underflow() {
-        if (eback() == nullptr) {
-            // An underflow has happened because we haven't allocated a
-            // buffer yet.
-            _read_buf = buffer_t();
-        }
-
-        while (true) {
-            ssize_t const n_read = read(_fd, _read_buf->data(), _read_buf->size());
-            if (n_read > 0) {
-                setg(_read_buf->data(),
-                     _read_buf->data(),
-                     _read_buf->data() + n_read);
-                break;
-            }
-            else if (n_read == -1 && errno == EINTR) {
-                continue;
-            }
-            else {
-                return traits_type::eof();
-            }
+        // An underflow has happened either because we haven't allocated a
+        // buffer yet, or because everything in it has been consumed.
+        setg(eback(), egptr(), egptr());
+        if (!fill()) {
+            return traits_type::eof();
         }
-
         return traits_type::to_int_type(*gptr());
     }
 #endif
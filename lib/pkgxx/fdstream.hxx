@@ -3,22 +3,29 @@
 /* Streaming I/O based on POSIX file descriptors.
  */
 
-#include <array>
+#include <cstddef>
 #include <memory>
 #include <optional>
 #include <ostream>
 #include <istream>
 #include <streambuf>
+#include <string>
+#include <string_view>
 #include <utility>
 
 namespace pkgxx {
     /** A stream buffer that works with a POSIX file descriptor.
      */
     struct fdstreambuf: public std::streambuf {
+        /** The default size of read and write buffers. Most of our file
+         * descriptors are pipes, and this is what a pipe usually holds. */
+        static constexpr std::size_t const default_buf_size = 65536;
+
         /** Construct a stream buffer reading data from / writing data to a
          * file descriptor. The fd will be owned by the buffer, i.e. when
-         * it's destructed the fd will also be closed. */
-        fdstreambuf(int fd);
+         * it's destructed the fd will also be closed. Buffers of \c
+         * buf_size bytes are allocated on first read and first write. */
+        fdstreambuf(int fd, std::size_t buf_size = default_buf_size);
 
         virtual
         ~fdstreambuf();
@@ -28,11 +35,31 @@ namespace pkgxx {
         fdstreambuf*
         close();
 
+        /** Give up the ownership of the file descriptor and return it
+         * without closing it. Data already buffered for reading is
+         * discarded, and pending writes are flushed. */
+        int
+        release();
+
+        /** Read a line without copying it out of the buffer. The line
+         * excludes \c delim, and the final line doesn't need to be
+         * terminated by it. Return \c std::nullopt on EOF. The returned
+         * view is valid until the next operation on the buffer. Lines
+         * longer than the buffer make it grow. */
+        std::optional<std::string_view>
+        getline_view(char_type delim = '\n');
+
     protected:
 #if !defined(DOXYGEN)
         virtual int
         sync() override;
 
+        virtual std::streamsize
+        xsgetn(char_type* s, std::streamsize count) override;
+
+        virtual std::streamsize
+        xsputn(char_type const* s, std::streamsize count) override;
+
         virtual int_type
         overflow(int_type ch = traits_type::eof()) override;
 
@@ -44,23 +71,51 @@ namespace pkgxx {
 #endif
 
     private:
-        static constexpr int const buf_size = 1024;
-        using buffer_t = std::array<char_type, buf_size>;
+        // Move unread data to the beginning of the read buffer, growing
+        // it if it's full, and append whatever can be read. Return false
+        // on EOF or error.
+        bool
+        fill();
+
+        // Write out the put area followed by [s, s + count).
+        bool
+        flush(char_type const* s = nullptr, std::size_t count = 0);
 
         int _fd;
-        std::optional<buffer_t> _read_buf;
-        std::optional<buffer_t> _write_buf;
+        std::size_t _buf_size;
+        std::unique_ptr<char_type[]> _read_buf;
+        std::size_t _read_buf_size = 0;
+        std::unique_ptr<char_type[]> _write_buf;
     };
 
+    /** Call a function \c f with each line read from an input stream as
+     * a \c std::string_view, valid only during the call. Streams backed
+     * by \ref fdstreambuf are read without copying lines. */
+    template <typename Function>
+    void
+    for_each_line(std::istream& in, Function&& f) {
+        if (auto* buf = dynamic_cast<fdstreambuf*>(in.rdbuf()); buf) {
+            while (auto const line = buf->getline_view()) {
+                f(*line);
+            }
+            in.setstate(std::ios_base::eofbit);
+        }
+        else {
+            for (std::string line; std::getline(in, line); ) {
+                f(std::string_view(line));
+            }
+        }
+    }
+
     /** An output stream that writes data to a POSIX file descriptor.
      */
     struct fdostream: public std::ostream {
         /** Construct an output stream writing data to a file
          * descriptor. The fd will be owned by the stream, i.e. when it's
          * destructed the fd will also be closed. */
-        fdostream(int fd)
+        fdostream(int fd, std::size_t buf_size = fdstreambuf::default_buf_size)
             : std::ostream(nullptr)
-            , _buf(std::make_unique<fdstreambuf>(fd)) {
+            , _buf(std::make_unique<fdstreambuf>(fd, buf_size)) {
 
             rdbuf(_buf.get());
         }
@@ -99,9 +154,9 @@ namespace pkgxx {
         /** Construct an input stream reading data from a file
          * descriptor. The fd will be owned by the stream, i.e. when it's
          * destructed the fd will also be closed. */
-        fdistream(int fd)
+        fdistream(int fd, std::size_t buf_size = fdstreambuf::default_buf_size)
             : std::istream(nullptr)
-            , _buf(std::make_unique<fdstreambuf>(fd)) {
+            , _buf(std::make_unique<fdstreambuf>(fd, buf_size)) {
 
             rdbuf(_buf.get());
         }
@@ -130,6 +185,14 @@ namespace pkgxx {
             }
         }
 
+        /** Give up the ownership of the file descriptor and return it,
+         * so that it can be read by other means. Nothing must have been
+         * read from the stream. */
+        int
+        release() {
+            return _buf ? _buf->release() : -1;
+        }
+
     private:
         std::unique_ptr<fdstreambuf> _buf;
     };
@@ -141,9 +204,9 @@ namespace pkgxx {
         /** Construct a stream reading data from / writing data to a file
          * descriptor. The fd will be owned by the stream, i.e. when it's
          * destructed the fd will also be closed. */
-        fdstream(int fd)
+        fdstream(int fd, std::size_t buf_size = fdstreambuf::default_buf_size)
             : std::iostream(nullptr)
-            , _buf(std::make_unique<fdstreambuf>(fd)) {
+            , _buf(std::make_unique<fdstreambuf>(fd, buf_size)) {
 
             rdbuf(_buf.get());
         }
@@ -0,0 +1,204 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+
+#include "config.h"
+#if defined(HAVE_SYS_INOTIFY_H)
+#  include <sys/inotify.h>
+#endif
+
+#include "fswatch.hxx"
+#include "hash.hxx"
+
+namespace fs = std::filesystem;
+
+namespace {
+#if defined(HAVE_SYS_INOTIFY_H)
+    constexpr std::uint32_t DIR_MASK =
+        IN_ATTRIB | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MODIFY |
+        IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+
+    constexpr std::uint32_t FILE_MASK =
+        IN_ATTRIB | IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF;
+#endif
+
+    void
+    hash_entry(std::size_t& seed, fs::directory_entry const& entry) {
+        std::error_code ec;
+        pkgxx::hash_append(seed, entry.path().string());
+        pkgxx::hash_append(seed, entry.last_write_time(ec).time_since_epoch().count());
+        if (entry.is_regular_file(ec)) {
+            pkgxx::hash_append(seed, entry.file_size(ec));
+        }
+    }
+}
+
+namespace pkgxx {
+    fswatch::fswatch(std::chrono::milliseconds interval)
+        : _interval(interval)
+        , _next_poll(std::chrono::steady_clock::now() + interval)
+        , _fd(-1) {
+
+#if defined(HAVE_SYS_INOTIFY_H)
+        _fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+    }
+
+    fswatch::~fswatch() {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+
+    void
+    fswatch::add(fs::path const& path, bool recursive) {
+        std::error_code ec;
+        auto target = path;
+        if (!fs::exists(target, ec)) {
+            target = target.parent_path();
+            recursive = false;
+            if (target.empty() || !fs::exists(target, ec)) {
+                return;
+            }
+        }
+
+        auto const is_dir = fs::is_directory(target, ec);
+        _specs.push_back(spec {target, recursive && is_dir, 0});
+        if (_fd < 0) {
+            _specs.back().fingerprint = fingerprint(target, recursive && is_dir);
+            return;
+        }
+
+        add_watch(target, is_dir);
+        if (recursive && is_dir) {
+            for (auto it = fs::recursive_directory_iterator(
+                     target, fs::directory_options::skip_permission_denied, ec);
+                 _fd >= 0 && !ec && it != fs::recursive_directory_iterator();
+                 it.increment(ec)) {
+
+                if (it->is_directory(ec) && !it->is_symlink(ec)) {
+                    add_watch(it->path(), true);
+                }
+            }
+        }
+    }
+
+    void
+    fswatch::add_watch(fs::path const& path [[maybe_unused]], bool is_dir [[maybe_unused]]) {
+#if defined(HAVE_SYS_INOTIFY_H)
+        int const wd = inotify_add_watch(_fd, path.c_str(), is_dir ? DIR_MASK : FILE_MASK);
+        if (wd >= 0) {
+            _watches.insert_or_assign(wd, path);
+        }
+        else if (errno == ENOSPC || errno == ENOMEM) {
+            // The kernel has run out of watches. We can still do the job
+            // by polling.
+            switch_to_polling();
+        }
+        // Anything else, such as the path having disappeared meanwhile,
+        // is not worth failing for.
+#endif
+    }
+
+    void
+    fswatch::switch_to_polling() {
+        close(_fd);
+        _fd = -1;
+        _watches.clear();
+        for (auto& s: _specs) {
+            s.fingerprint = fingerprint(s.path, s.recursive);
+        }
+        _next_poll = std::chrono::steady_clock::now() + _interval;
+    }
+
+    std::size_t
+    fswatch::fingerprint(fs::path const& path, bool recursive) {
+        std::error_code ec;
+        std::size_t seed = 0;
+        hash_entry(seed, fs::directory_entry(path, ec));
+        if (fs::is_directory(path, ec)) {
+            auto const opts = fs::directory_options::skip_permission_denied;
+            if (recursive) {
+                for (auto it = fs::recursive_directory_iterator(path, opts, ec);
+                     !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+                    hash_entry(seed, *it);
+                }
+            }
+            else {
+                for (auto it = fs::directory_iterator(path, opts, ec);
+                     !ec && it != fs::directory_iterator(); it.increment(ec)) {
+                    hash_entry(seed, *it);
+                }
+            }
+        }
+        return seed;
+    }
+
+    int
+    fswatch::poll_timeout() const {
+        if (_fd >= 0) {
+            return -1;
+        }
+        auto const left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            _next_poll - std::chrono::steady_clock::now()).count();
+        return static_cast<int>(std::max<decltype(left)>(left, 0));
+    }
+
+    std::optional<fs::path>
+    fswatch::changed(bool now) {
+        std::optional<fs::path> found;
+#if defined(HAVE_SYS_INOTIFY_H)
+        if (_fd >= 0) {
+            // Drain every event queued, as a single change often
+            // generates a burst of them.
+            alignas(inotify_event) char buf[8192];
+            while (true) {
+                ssize_t const n = read(_fd, buf, sizeof(buf));
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                else if (n <= 0) {
+                    break;
+                }
+                for (char const* p = buf; p < buf + n; ) {
+                    auto const* ev = reinterpret_cast<inotify_event const*>(p);
+                    p += sizeof(inotify_event) + ev->len;
+
+                    if (ev->mask & IN_Q_OVERFLOW) {
+                        if (!found && !_specs.empty()) {
+                            found = _specs.front().path;
+                        }
+                    }
+                    else if (auto it = _watches.find(ev->wd); it != _watches.end()) {
+                        if (!found) {
+                            found = ev->len > 0 ? it->second / ev->name : it->second;
+                        }
+                        if (ev->mask & IN_IGNORED) {
+                            _watches.erase(it);
+                        }
+                    }
+                }
+            }
+            return found;
+        }
+#endif
+        auto const t = std::chrono::steady_clock::now();
+        if (!now && t < _next_poll) {
+            return std::nullopt;
+        }
+        for (auto& s: _specs) {
+            auto const fp = fingerprint(s.path, s.recursive);
+            if (fp != s.fingerprint) {
+                s.fingerprint = fp;
+                if (!found) {
+                    found = s.path;
+                }
+            }
+        }
+        _next_poll = t + _interval;
+        return found;
+    }
+}
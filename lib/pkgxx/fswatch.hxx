@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <vector>
+
+namespace pkgxx {
+    /** A watcher of changes to files and directories. It is notified by
+     * \c inotify(7) where available. Elsewhere, or if the kernel runs out
+     * of watches, it periodically compares modification times of
+     * everything being watched.
+     *
+     * Watching a directory catches its entries being created, deleted,
+     * renamed, or modified, but not those of its subdirectories unless it
+     * is watched recursively. A subdirectory created after the watch has
+     * begun is not watched, but its creation is a change in itself.
+     */
+    struct fswatch {
+        /** Create a watcher that looks for changes every \c interval if
+         * it has to poll. */
+        explicit
+        fswatch(std::chrono::milliseconds interval = std::chrono::seconds(5));
+
+        fswatch(fswatch const&) = delete;
+
+        ~fswatch();
+
+        /** Start watching a file or a directory. If \c path doesn't
+         * exist, its parent directory is watched instead so that its
+         * creation is noticed. */
+        void
+        add(std::filesystem::path const& path, bool recursive = false);
+
+        /** Return a file descriptor which becomes readable when something
+         * may have changed, or \c -1 if the watcher polls. */
+        int
+        fd() const noexcept {
+            return _fd;
+        }
+
+        /** Return the number of milliseconds \c poll(2) may wait before
+         * \ref changed is called again, or \c -1 if it may wait
+         * forever. */
+        int
+        poll_timeout() const;
+
+        /** Return a path that has changed since the last call, or \c
+         * std::nullopt if nothing has. This never blocks. If the watcher
+         * polls, modification times are compared only once every
+         * interval, unless \c now is \c true. */
+        std::optional<std::filesystem::path>
+        changed(bool now = false);
+
+    private:
+        struct spec {
+            std::filesystem::path path;
+            bool recursive;
+            std::size_t fingerprint;
+        };
+
+        void
+        add_watch(std::filesystem::path const& path, bool is_dir);
+
+        void
+        switch_to_polling();
+
+        static std::size_t
+        fingerprint(std::filesystem::path const& path, bool recursive);
+
+        std::chrono::milliseconds const _interval;
+        std::chrono::steady_clock::time_point _next_poll;
+        std::vector<spec> _specs;
+
+        int _fd; // -1 if polling.
+        std::map<int, std::filesystem::path> _watches;
+    };
+}
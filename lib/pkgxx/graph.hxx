@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <deque>
 #include <exception>
 #include <functional>
@@ -194,6 +195,16 @@ namespace pkgxx {
         std::vector<vertex_reference_type>
         tsort(bool cache = true) const;
 
+        /** Perform a topological sort on the graph and group vertices
+         * into levels. Vertices in the first level have no out-edges, and
+         * vertices in the level \c n only have out-edges to vertices in
+         * levels before \c n. That is, vertices in the same level are
+         * independent of each other. If it has a cycle \ref not_a_dag
+         * will be thrown.
+         */
+        std::vector<std::vector<vertex_reference_type>>
+        tsort_levels() const;
+
     private:
         using vertex_id = unsigned long;
 
@@ -668,6 +679,47 @@ namespace pkgxx {
         return tsorted;
     }
 
+    template <typename VertexT, typename EdgeT, bool IsBidirectional>
+    std::vector<
+        std::vector<
+            typename graph<VertexT, EdgeT, IsBidirectional>::vertex_reference_type
+            >
+        >
+    graph<VertexT, EdgeT, IsBidirectional>::tsort_levels() const {
+        // Since tsort() puts vertices after all of their out-edges, the
+        // level of every out-edge is known by the time we reach a vertex.
+        std::map<vertex_id, std::size_t> level_of;
+        std::vector<std::vector<vertex_reference_type>> levels;
+
+        for (auto const& value: tsort()) {
+            auto const id = _vertex_id_of.find(value);
+            assert(id != _vertex_id_of.end());
+            auto const v = _vertices.find(id->second);
+            assert(v != _vertices.end());
+
+            std::size_t level = 0;
+            for (auto const& out: v->second.outs) {
+                vertex_id out_id;
+                if constexpr (std::is_same_v<EdgeT, void>) {
+                    out_id = out;
+                }
+                else {
+                    out_id = out.first;
+                }
+                auto const out_level = level_of.find(out_id);
+                assert(out_level != level_of.end());
+                level = std::max(level, out_level->second + 1);
+            }
+
+            level_of.emplace(id->second, level);
+            if (levels.size() <= level) {
+                levels.resize(level + 1);
+            }
+            levels[level].push_back(value);
+        }
+        return levels;
+    }
+
     template <typename VertexT, typename EdgeT, bool IsBidirectional>
     std::optional<
             std::conditional_t<
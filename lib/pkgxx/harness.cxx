@@ -1,14 +1,138 @@
+#include "config.h"
+
 #include <cassert>
 #include <cerrno>
 #include <iostream>
+#include <mutex>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <system_error>
 #include <unistd.h>
 
+#include "concurrency.hxx"
 #include "harness.hxx"
 #include "spawn.hxx"
+#include "stats.hxx"
+#include "tape.hxx"
 
 namespace pkgxx {
+    std::optional<std::vector<std::string>>
+    split_shell_words(std::string_view const& cmd) {
+        using namespace std::literals;
+        // Characters that mean something more than literals to sh(1)
+        // when unquoted. '#' and '~' only do at the beginning of a word,
+        // and '=' only in the first word, but we don't bother.
+        static auto const specials = "|&;<>()$`*?[]#~="sv;
+
+        std::vector<std::string> words;
+        std::optional<std::string> word;
+        for (auto it = cmd.begin(); it != cmd.end(); it++) {
+            switch (*it) {
+            case ' ':
+            case '\t':
+            case '\n':
+                if (word) {
+                    words.push_back(std::move(*word));
+                    word.reset();
+                }
+                break;
+
+            case '\\':
+                if (++it == cmd.end()) {
+                    return std::nullopt;
+                }
+                else if (*it != '\n') { // Not a line continuation
+                    if (!word) {
+                        word.emplace();
+                    }
+                    *word += *it;
+                }
+                break;
+
+            case '\'':
+                if (!word) {
+                    word.emplace();
+                }
+                for (it++; it != cmd.end() && *it != '\''; it++) {
+                    *word += *it;
+                }
+                if (it == cmd.end()) {
+                    return std::nullopt;
+                }
+                break;
+
+            case '"':
+                if (!word) {
+                    word.emplace();
+                }
+                for (it++; it != cmd.end() && *it != '"'; it++) {
+                    if (*it == '$' || *it == '`') {
+                        return std::nullopt;
+                    }
+                    else if (*it == '\\' && it + 1 != cmd.end() &&
+                             "$`\"\\\n"sv.find(*(it + 1)) != std::string_view::npos) {
+                        if (*++it != '\n') {
+                            *word += *it;
+                        }
+                    }
+                    else {
+                        *word += *it;
+                    }
+                }
+                if (it == cmd.end()) {
+                    return std::nullopt;
+                }
+                break;
+
+            default:
+                if (specials.find(*it) != std::string_view::npos) {
+                    return std::nullopt;
+                }
+                if (!word) {
+                    word.emplace();
+                }
+                *word += *it;
+            }
+        }
+        if (word) {
+            words.push_back(std::move(*word));
+        }
+
+        if (words.empty()) {
+            return std::nullopt;
+        }
+        return words;
+    }
+
+    std::vector<std::string>
+    shell_command_argv(std::string const& cmd, std::vector<std::string> const& args) {
+        static std::mutex mtx;
+        static std::map<std::string, std::vector<std::string>> memo;
+
+        std::vector<std::string> argv;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            auto it = memo.find(cmd);
+            if (it == memo.end()) {
+                if (auto words = split_shell_words(cmd); words) {
+                    it = memo.emplace(cmd, std::move(*words)).first;
+                }
+                else {
+                    // $0 of the shell is the shell itself, and the rest
+                    // become "$@".
+                    it = memo.emplace(
+                        cmd,
+                        std::vector<std::string> {
+                            shell, "-c", "exec " + cmd + " \"$@\"", shell
+                        }).first;
+                }
+            }
+            argv = it->second;
+        }
+        argv.insert(argv.end(), args.begin(), args.end());
+        return argv;
+    }
+
     harness::harness(
         int,
         std::filesystem::path const& cmd,
@@ -22,10 +146,46 @@ namespace pkgxx {
         : _da(da)
         , _cmd(cmd)
         , _argv(argv)
-        , _cwd(cwd)
-        , _env(cenviron()) {
+        , _cwd(cwd) {
 
-        env_mod(_env);
+        // Most children inherit our environment as is. Don't copy it in
+        // that case, but share the snapshot taken once.
+        if (env_mod) {
+            _env.emplace(cenviron());
+            env_mod(*_env);
+        }
+
+        try {
+            _tape = tape::session::begin(argv, cwd, _env);
+        }
+        catch (std::exception& e) {
+            throw failed_to_spawn_process(
+                command_error(
+                    std::move(_cmd),
+                    std::move(_argv),
+                    std::move(_cwd),
+                    take_env()),
+                e.what());
+        }
+        if (_tape && _tape->replaying()) {
+            if (stdin_action == fd_action::pipe) {
+                _stdin.emplace(_tape->input(-1));
+                _stdin->exceptions(std::ios_base::badbit);
+            }
+            if (stdout_action == fd_action::pipe) {
+                _stdout.emplace(_tape->output(-1, STDOUT_FILENO));
+                _stdout->exceptions(std::ios_base::badbit);
+            }
+            if (stderr_action == fd_action::pipe) {
+                _stderr.emplace(_tape->output(-1, STDERR_FILENO));
+                _stderr->exceptions(std::ios_base::badbit);
+            }
+            _tape->start();
+            if (trace::enabled()) {
+                _spawned = trace::clock::now();
+            }
+            return;
+        }
 
         auto const stdin_fds  = stdin_action  == fd_action::pipe
             ? std::make_optional(cpipe(true))
@@ -38,7 +198,9 @@ namespace pkgxx {
             : std::nullopt;
 
         spawnp s(cmd, argv);
-        s.environ(_env);
+        if (_env) {
+            s.environ(*_env);
+        }
 
         if (cwd) {
             s.chdir(*cwd);
@@ -89,8 +251,17 @@ namespace pkgxx {
             std::abort();
         }
 
+        // Our own descriptors are all close-on-exec, but libraries may
+        // have opened some that aren't.
+        s.close_fds_from(3);
+
         try {
             _pid = s();
+            stats::spawned(_cmd);
+            detail::work_started();
+            if (trace::enabled()) {
+                _spawned = trace::clock::now();
+            }
         }
         catch (std::exception& e) {
             throw failed_to_spawn_process(
@@ -98,44 +269,61 @@ namespace pkgxx {
                     std::move(_cmd),
                     std::move(_argv),
                     std::move(_cwd),
-                    std::move(_env)),
+                    take_env()),
                 e.what());
         }
 
+        // While recording, the caller talks to the tape which talks to
+        // the child.
         if (stdin_fds) {
             close((*stdin_fds)[0]);
-            _stdin.emplace((*stdin_fds)[1]);
+            _stdin.emplace(_tape ? _tape->input((*stdin_fds)[1]) : (*stdin_fds)[1]);
             _stdin->exceptions(std::ios_base::badbit);
         }
         if (stdout_fds) {
             close((*stdout_fds)[1]);
-            _stdout.emplace((*stdout_fds)[0]);
+            _stdout.emplace(_tape ? _tape->output((*stdout_fds)[0], STDOUT_FILENO) : (*stdout_fds)[0]);
             _stdout->exceptions(std::ios_base::badbit);
         }
         if (stderr_fds) {
             close((*stderr_fds)[1]);
-            _stderr.emplace((*stderr_fds)[0]);
+            _stderr.emplace(_tape ? _tape->output((*stderr_fds)[0], STDERR_FILENO) : (*stderr_fds)[0]);
             _stderr->exceptions(std::ios_base::badbit);
         }
+        if (_tape) {
+            _tape->start();
+        }
+    }
+
+    harness::env_t
+    harness::take_env() {
+        return _env ? std::move(*_env) : cenviron();
     }
 
     harness::harness(harness&& other)
         : _da(other._da)
+        , _cmd(std::move(other._cmd))
+        , _argv(std::move(other._argv))
+        , _cwd(std::move(other._cwd))
+        , _env(std::move(other._env))
         , _pid(std::move(other._pid))
         , _stdin(std::move(other._stdin))
         , _stdout(std::move(other._stdout))
         , _stderr(std::move(other._stderr))
-        , _status(std::move(other._status)) {
+        , _status(std::move(other._status))
+        , _spawned(std::move(other._spawned))
+        , _tape(std::move(other._tape)) {
 
         other._pid.reset();
         other._stdin.reset();
         other._stdout.reset();
         other._stderr.reset();
         other._status.reset();
+        other._spawned.reset();
     }
 
     harness::~harness() noexcept(false) {
-        if (_pid && !_status) {
+        if ((_pid || _tape) && !_status) {
             switch (_da) {
             case dtor_action::wait:
                 wait();
@@ -159,10 +347,13 @@ namespace pkgxx {
 
     void
     harness::kill(int sig) {
-        assert(_pid);
+        assert(_pid || _tape);
 
         if (!_status) {
-            if (::kill(*_pid, sig) == -1) {
+            if (!_pid) {
+                _tape->kill(sig);
+            }
+            else if (::kill(*_pid, sig) == -1) {
                 if (errno == ESRCH) {
                     // The process has already gone. This is not an error.
                 }
@@ -176,26 +367,88 @@ namespace pkgxx {
 
     harness::status const&
     harness::wait() {
-        assert(_pid);
+        assert(_pid || _tape);
 
         if (!_status) {
-            int cstatus;
-            if (waitpid(*_pid, &cstatus, 0) == -1) {
-                throw std::system_error(
-                    errno, std::generic_category(), "waitpid");
-            }
-            else if (WIFEXITED(cstatus)) {
-                _status.emplace(exited {WEXITSTATUS(cstatus)});
-            }
-            else if (WIFSIGNALED(cstatus)) {
-                _status.emplace(signaled {
-                    WTERMSIG(cstatus),
-                    static_cast<bool>(WCOREDUMP(cstatus))});
+#if defined(HAVE_WAIT4)
+            struct rusage ru = {};
+#endif
+            if (!_pid) {
+                _status.emplace(_tape->finish(std::nullopt));
             }
             else {
-                std::cerr << "The process " << *_pid << " terminated but it didn't exit nor receive a signal. "
-                          << "Then what the hell has happened to it???" << std::endl;
-                std::abort(); // Impossible
+                int cstatus;
+#if defined(HAVE_WAIT4)
+                int const waited = wait4(*_pid, &cstatus, 0, &ru);
+#else
+                int const waited = waitpid(*_pid, &cstatus, 0);
+#endif
+                detail::work_finished();
+                if (waited == -1) {
+                    throw std::system_error(
+                        errno, std::generic_category(),
+#if defined(HAVE_WAIT4)
+                        "wait4"
+#else
+                        "waitpid"
+#endif
+                        );
+                }
+                else if (WIFEXITED(cstatus)) {
+                    _status.emplace(exited {WEXITSTATUS(cstatus)});
+                }
+                else if (WIFSIGNALED(cstatus)) {
+                    _status.emplace(signaled {
+                        WTERMSIG(cstatus),
+                        static_cast<bool>(WCOREDUMP(cstatus))});
+                }
+                else {
+                    std::cerr << "The process " << *_pid << " terminated but it didn't exit nor receive a signal. "
+                              << "Then what the hell has happened to it???" << std::endl;
+                    std::abort(); // Impossible
+                }
+
+                if (_tape) {
+                    _tape->finish(*_status);
+                }
+            }
+
+            if (_spawned) {
+                trace::args a;
+                a.add("argv", stringify_argv(_argv));
+                if (_cwd) {
+                    a.add("cwd", _cwd->string());
+                }
+                std::visit(
+                    [&](auto const& st) {
+                        if constexpr (std::is_same_v<exited const&, decltype(st)>) {
+                            a.add("status", st.status);
+                        }
+                        else {
+                            a.add("signal", st.signal);
+                        }
+                    },
+                    *_status);
+                if (!_pid) {
+                    a.add("replayed", 1);
+                }
+#if defined(HAVE_WAIT4)
+                else {
+                    auto const usec =
+                        [](timeval const& tv) {
+                            return static_cast<long long>(tv.tv_sec) * 1000000 + tv.tv_usec;
+                        };
+                    a.add("utime_us" , usec(ru.ru_utime));
+                    a.add("stime_us" , usec(ru.ru_stime));
+                    // Kilobytes on most platforms, but bytes on Darwin.
+                    a.add("maxrss"   , ru.ru_maxrss);
+                }
+#endif
+                trace::record(
+                    "spawn",
+                    _argv.empty() ? _cmd.filename().string()
+                                  : std::filesystem::path(_argv[0]).filename().string(),
+                    *_spawned, trace::clock::now(), a);
             }
         }
 
@@ -216,8 +469,8 @@ namespace pkgxx {
                                 std::move(_cmd),
                                 std::move(_argv),
                                 std::move(_cwd),
-                                std::move(_env)),
-                            _pid.value()),
+                                take_env()),
+                            _pid.value_or(0)),
                         st);
                 }
             },
@@ -233,8 +486,8 @@ namespace pkgxx {
                         std::move(_cmd),
                         std::move(_argv),
                         std::move(_cwd),
-                        std::move(_env)),
-                    _pid.value()),
+                        take_env()),
+                    _pid.value_or(0)),
                 st);
         }
     }
@@ -4,11 +4,13 @@
 #include <functional>
 #include <istream>
 #include <map>
+#include <memory>
 #include <optional>
 #include <ostream>
 #include <signal.h>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <sys/types.h>
 #include <type_traits>
 #include <utility>
@@ -23,10 +25,15 @@
 #pragma GCC diagnostic pop
 
 #include <pkgxx/fdstream.hxx>
+#include <pkgxx/trace.hxx>
 
 namespace pkgxx {
     static inline std::string const shell = "/bin/sh";
 
+    namespace tape {
+        struct session;
+    }
+
     template <typename Argv>
     inline std::string
     stringify_argv(Argv const& argv) {
@@ -63,6 +70,23 @@ namespace pkgxx {
         return ss.str();
     }
 
+    /** Split a command string such as \c PKG_INFO into words the way
+     * sh(1) would, honoring quotes and backslashes. Returns \c
+     * std::nullopt if the string uses any other shell features, such as
+     * expansions, redirections, globs, or variable assignments, which
+     * means it has to be run through the shell. */
+    std::optional<std::vector<std::string>>
+    split_shell_words(std::string_view const& cmd);
+
+    /** Construct an argv for running a command string \c cmd, which may
+     * contain its own arguments, followed by \c args. The command string
+     * is split in-process when possible so that no shell has to be
+     * spawned, or otherwise is run by <tt>sh -c</tt>. The first element
+     * of the result is the command to spawn. Splitting is memoized for
+     * each distinct \c cmd. */
+    std::vector<std::string>
+    shell_command_argv(std::string const& cmd, std::vector<std::string> const& args = {});
+
     // I'm not comfortable with bringing it in this scope, but what else
     // can we do?
     using namespace na::literals;
@@ -110,7 +134,8 @@ namespace pkgxx {
 
         /** Spawn a child process. The command \c cmd should either be a
          * path to an executable file or a name of command found in the
-         * environment variable \c PATH.
+         * environment variable \c PATH. If \ref tape is replaying, no
+         * process is spawned and a recorded one is played back instead.
          */
         template <typename... Args>
         harness(
@@ -120,7 +145,7 @@ namespace pkgxx {
             : harness(
                 0, cmd, argv,
                 na::get("cwd"_na           = std::nullopt             , std::forward<Args>(args)...),
-                na::get("env_mod"_na       = [](env_t&) {}            , std::forward<Args>(args)...),
+                na::get("env_mod"_na       = std::function<void (env_t&)>(), std::forward<Args>(args)...),
                 na::get("dtor_action"_na   = dtor_action::wait_success, std::forward<Args>(args)...),
                 na::get("stdin_action"_na  = fd_action::pipe          , std::forward<Args>(args)...),
                 na::get("stdout_action"_na = fd_action::pipe          , std::forward<Args>(args)...),
@@ -206,13 +231,18 @@ namespace pkgxx {
         wait_success();
 
     private:
+        // Obtain the environment of the child for error reporting.
+        env_t
+        take_env();
+
         dtor_action _da;
 
         // In
         std::filesystem::path _cmd;
         std::vector<std::string> _argv;
         std::optional<std::filesystem::path> _cwd;
-        std::map<std::string, std::string> _env;
+        // Only has a value when env_mod has modified it.
+        std::optional<env_t> _env;
 
         // Out
         std::optional<pid_t> _pid;
@@ -220,6 +250,11 @@ namespace pkgxx {
         std::optional<fdistream> _stdout;
         std::optional<fdistream> _stderr;
         std::optional<status> _status;
+        // Only has a value when tracing was on at the time of spawning.
+        std::optional<trace::clock::time_point> _spawned;
+        // Only non-null when the process is recorded or replayed. A
+        // replayed process has no _pid.
+        std::unique_ptr<tape::session> _tape;
     };
 
     /** An error happened while running an external command. */
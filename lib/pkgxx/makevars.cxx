@@ -1,22 +1,180 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
 #include <map>
+#include <mutex>
+#include <pthread.h>
+#include <sstream>
 #include <string>
+#include <system_error>
+#include <unistd.h>
 #include <vector>
 
 #include "config.h"
+#include "environment.hxx"
 #include "harness.hxx"
 #include "makevars.hxx"
+#include "stats.hxx"
+#include "tape.hxx"
 
 namespace fs = std::filesystem;
 
-namespace pkgxx {
+namespace {
+    // Bump this whenever the format of cache files changes.
+    char const CACHE_MAGIC[] = "pkgchkxx-makevars-2";
+
+    // A digest of a cache key. Keys may contain values of environment
+    // variables, which we don't want to write to disk as they are. Two
+    // FNV-1a hashes with different offset bases make collisions between
+    // keys unlikely enough for a cache.
+    std::string
+    key_digest(std::string const& key) {
+        std::uint64_t h1 = 0xcbf29ce484222325ULL;
+        std::uint64_t h2 = 0x84222325cbf29ce4ULL;
+        for (unsigned char const c: key) {
+            h1 = (h1 ^ c) * 0x100000001b3ULL;
+            h2 = (h2 ^ c) * 0x100000001b3ULL;
+        }
+        std::ostringstream ss;
+        ss << std::hex << std::setfill('0')
+           << std::setw(16) << h1
+           << std::setw(16) << h2;
+        return ss.str();
+    }
+
+    std::optional<fs::path>
+    cache_dir() {
+        if (auto const xdg = pkgxx::cgetenv("XDG_CACHE_HOME"); !xdg.empty()) {
+            return fs::path(xdg) / "pkgchkxx";
+        }
+        else if (auto const home = pkgxx::cgetenv("HOME"); !home.empty()) {
+            return fs::path(home) / ".cache/pkgchkxx";
+        }
+        else {
+            return std::nullopt;
+        }
+    }
+
+    // The modification time of a file as a string, or "-" if it doesn't
+    // exist.
+    std::string
+    mtime_of(fs::path const& file) {
+        std::error_code ec;
+        auto const t = fs::last_write_time(file, ec);
+        return ec ? "-" : std::to_string(t.time_since_epoch().count());
+    }
+
     std::optional<
         std::map<std::string, std::string>>
-    extract_mkconf_vars(
-        std::filesystem::path const& makeconf,
+    load_entry(fs::path const& file, std::string const& key) {
+        std::ifstream in(file, std::ios_base::in | std::ios_base::binary);
+        if (!in) {
+            return std::nullopt;
+        }
+
+        // MAGIC \0 KEY \0 NDEPS \0 (PATH \0 MTIME \0)* (VAR \0 VALUE \0)*
+        std::string field;
+        auto const next =
+            [&]() -> bool {
+                return static_cast<bool>(std::getline(in, field, '\0'));
+            };
+        if (!next() || field != CACHE_MAGIC ||
+            !next() || field != key ||
+            !next()) {
+            return std::nullopt;
+        }
+
+        std::size_t n_deps;
+        try {
+            n_deps = std::stoul(field);
+        }
+        catch (std::exception const&) {
+            return std::nullopt;
+        }
+        for (std::size_t i = 0; i < n_deps; i++) {
+            if (!next()) {
+                return std::nullopt;
+            }
+            fs::path const dep = field;
+            if (!next() || mtime_of(dep) != field) {
+                return std::nullopt;
+            }
+        }
+
+        std::map<std::string, std::string> vars;
+        while (next()) {
+            auto var = std::move(field);
+            if (!next()) {
+                return std::nullopt;
+            }
+            vars.emplace(std::move(var), std::move(field));
+        }
+        return vars;
+    }
+
+    // Results of extract_pkgmk_vars() memoized in memory. See
+    // pkgxx::memoize_pkgmk_vars().
+    struct pkgmk_memo {
+        static pkgmk_memo&
+        instance() {
+            // Never destroyed, because pool threads may still be
+            // extracting variables while the process exits. The mutex is
+            // held across fork(2), so that the child never inherits it
+            // locked.
+            static auto* const m =
+                []() {
+                    pthread_atfork(
+                        []() { instance().mtx.lock();   },
+                        []() { instance().mtx.unlock(); },
+                        []() { instance().mtx.unlock(); });
+                    return new pkgmk_memo();
+                }();
+            return *m;
+        }
+
+        static std::string
+        key(fs::path const& pkgdir,
+            std::vector<std::string> const& vars,
+            std::map<std::string, std::string> const& assignments) {
+
+            std::string k = pkgdir.string();
+            k += '\0';
+            for (auto const& var: vars) {
+                k += var;
+                k += '\0';
+            }
+            k += '\0';
+            for (auto const& [var, value]: assignments) {
+                k += var;
+                k += '=';
+                k += value;
+                k += '\0';
+            }
+            return k;
+        }
+
+        std::atomic<bool> enabled = false;
+        std::mutex mtx;
+        std::map<
+            std::string,
+            std::optional<std::map<std::string, std::string>>
+            > entries;
+        // Makefiles read for any of the entries.
+        std::set<fs::path> makefiles;
+    };
+
+    std::optional<
+        std::map<std::string, std::string>>
+    run_pkgmk(
+        fs::path const& pkgdir,
         std::vector<std::string> const& vars,
         std::map<std::string, std::string> const& assignments) {
 
-        if (!fs::exists(makeconf)) {
+        using namespace na::literals;
+
+        if (!pkgxx::tape::exists(pkgdir / "Makefile")) {
             return std::nullopt;
         }
 
@@ -27,17 +185,16 @@ namespace pkgxx {
         }
         else {
             std::vector<std::string> argv = {
-                CFG_BMAKE, "-f", "-", "-f", makeconf, "x"
+                pkgxx::bmake(), "-f", "-", "-f", "Makefile", "x"
             };
             for (auto const& [var, value]: assignments) {
                 argv.push_back(var + '=' + value);
             }
-            harness make(CFG_BMAKE, argv);
+            pkgxx::harness make(pkgxx::bmake(), argv, "cwd"_na = std::optional(pkgdir));
 
             make.cin()
-                << "BSD_PKG_MK=1" << std::endl
-                << ".PHONY: x"    << std::endl
-                << "x:"           << std::endl;
+                << ".PHONY: x" << std::endl
+                << "x:"        << std::endl;
             for (auto const& var: vars) {
                 make.cin()
                     << "\t@printf '%s\\0' \"${" << var << "}\"" << std::endl;
@@ -55,15 +212,17 @@ namespace pkgxx {
             return value_of;
         }
     }
+}
 
+namespace pkgxx {
     std::optional<
         std::map<std::string, std::string>>
-    extract_pkgmk_vars(
-        std::filesystem::path const& pkgdir,
+    extract_mkconf_vars(
+        std::filesystem::path const& makeconf,
         std::vector<std::string> const& vars,
         std::map<std::string, std::string> const& assignments) {
 
-        if (!fs::exists(pkgdir / "Makefile")) {
+        if (!tape::exists(makeconf)) {
             return std::nullopt;
         }
 
@@ -74,16 +233,17 @@ namespace pkgxx {
         }
         else {
             std::vector<std::string> argv = {
-                CFG_BMAKE, "-f", "-", "-f", "Makefile", "x"
+                pkgxx::bmake(), "-f", "-", "-f", makeconf, "x"
             };
             for (auto const& [var, value]: assignments) {
                 argv.push_back(var + '=' + value);
             }
-            harness make(CFG_BMAKE, argv, "cwd"_na = std::optional(pkgdir));
+            harness make(pkgxx::bmake(), argv);
 
             make.cin()
-                << ".PHONY: x" << std::endl
-                << "x:"        << std::endl;
+                << "BSD_PKG_MK=1" << std::endl
+                << ".PHONY: x"    << std::endl
+                << "x:"           << std::endl;
             for (auto const& var: vars) {
                 make.cin()
                     << "\t@printf '%s\\0' \"${" << var << "}\"" << std::endl;
@@ -101,4 +261,141 @@ namespace pkgxx {
             return value_of;
         }
     }
+
+    std::optional<
+        std::map<std::string, std::string>>
+    extract_pkgmk_vars(
+        std::filesystem::path const& pkgdir,
+        std::vector<std::string> const& vars,
+        std::map<std::string, std::string> const& assignments) {
+
+        auto& memo = pkgmk_memo::instance();
+        if (!memo.enabled.load(std::memory_order_relaxed)) {
+            return run_pkgmk(pkgdir, vars, assignments);
+        }
+
+        auto const key = pkgmk_memo::key(pkgdir, vars, assignments);
+        {
+            std::lock_guard<std::mutex> lk(memo.mtx);
+            if (auto it = memo.entries.find(key); it != memo.entries.end()) {
+                return it->second;
+            }
+        }
+        // Two threads may run bmake for the same query at once, but
+        // they get the same result anyway. The results stay valid only
+        // as long as the makefiles don't change, so ask bmake which ones
+        // it has read.
+        auto query = vars;
+        bool const asked = std::find(vars.begin(), vars.end(), ".MAKE.MAKEFILES") != vars.end();
+        if (!vars.empty() && !asked) {
+            query.push_back(".MAKE.MAKEFILES");
+        }
+        auto value_of = run_pkgmk(pkgdir, query, assignments);
+        std::lock_guard<std::mutex> lk(memo.mtx);
+        if (value_of && !vars.empty()) {
+            for (auto& file: makefiles_read((*value_of)[".MAKE.MAKEFILES"], pkgdir)) {
+                memo.makefiles.insert(std::move(file));
+            }
+            if (!asked) {
+                value_of->erase(".MAKE.MAKEFILES");
+            }
+        }
+        memo.entries.emplace(key, value_of);
+        return value_of;
+    }
+
+    void
+    memoize_pkgmk_vars() {
+        pkgmk_memo::instance().enabled.store(true, std::memory_order_relaxed);
+    }
+
+    std::set<std::filesystem::path>
+    memoized_pkgmk_makefiles() {
+        auto& memo = pkgmk_memo::instance();
+        std::lock_guard<std::mutex> lk(memo.mtx);
+        return memo.makefiles;
+    }
+
+    std::vector<std::filesystem::path>
+    makefiles_read(std::string const& MAKEFILES, std::filesystem::path const& dir) {
+        std::vector<fs::path> files;
+        std::istringstream ss(MAKEFILES);
+        for (std::string word; ss >> word; ) {
+            if (word != "-") {
+                files.push_back((dir / word).lexically_normal());
+            }
+        }
+        return files;
+    }
+
+    makevars_cache::makevars_cache(std::string const& key)
+        : _key(key_digest(key)) {
+
+        // A cache hit would keep bmake off the tape, and a tape may be
+        // replayed where the files the entry depends on don't exist.
+        if (tape::recording() || tape::replaying()) {
+            return;
+        }
+        if (auto const dir = cache_dir(); dir) {
+            _file = *dir / ("makevars." + _key.substr(0, 16));
+        }
+    }
+
+    std::optional<
+        std::map<std::string, std::string>>
+    makevars_cache::load() const {
+        if (!_file) {
+            return std::nullopt;
+        }
+        auto vars = load_entry(*_file, _key);
+        (vars ? stats::cache_hits : stats::cache_misses).add();
+        return vars;
+    }
+
+    void
+    makevars_cache::store(
+        std::map<std::string, std::string> const& vars,
+        std::vector<std::filesystem::path> const& deps) const noexcept {
+
+        if (!_file) {
+            return;
+        }
+        try {
+            std::vector<std::pair<fs::path, std::string>> mtimes;
+            for (auto const& dep: deps) {
+                mtimes.emplace_back(dep, mtime_of(dep));
+                std::error_code ec;
+                if (fs::is_directory(dep, ec)) {
+                    for (auto const& ent: fs::recursive_directory_iterator(dep)) {
+                        mtimes.emplace_back(ent.path(), mtime_of(ent.path()));
+                    }
+                }
+            }
+
+            fs::create_directories(_file->parent_path());
+            auto tmp = *_file;
+            tmp += ".tmp." + std::to_string(getpid());
+            {
+                std::ofstream out(tmp, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+                out << CACHE_MAGIC << '\0'
+                    << _key << '\0'
+                    << mtimes.size() << '\0';
+                for (auto const& [dep, mtime]: mtimes) {
+                    out << dep.string() << '\0' << mtime << '\0';
+                }
+                for (auto const& [var, value]: vars) {
+                    out << var << '\0' << value << '\0';
+                }
+                if (!out.flush()) {
+                    fs::remove(tmp);
+                    return;
+                }
+            }
+            // Readers never see a partially written file.
+            fs::rename(tmp, *_file);
+        }
+        catch (...) {
+            // The cache is only an optimization.
+        }
+    }
 }
@@ -3,6 +3,8 @@
 #include <filesystem>
 #include <map>
 #include <optional>
+#include <set>
+#include <string>
 #include <vector>
 
 namespace pkgxx {
@@ -50,4 +52,62 @@ namespace pkgxx {
             return std::nullopt;
         }
     }
+
+    /** Make extract_pkgmk_vars() remember its results in memory for the
+     * rest of the lifetime of the process, so that the same query never
+     * spawns bmake twice. This is for long-running processes which watch
+     * package Makefiles by other means, as the results get stale as soon
+     * as they change.
+     */
+    void
+    memoize_pkgmk_vars();
+
+    /** Return every makefile bmake has read for the results memoized by
+     * extract_pkgmk_vars() so far, such as \c mk.conf, files it
+     * includes, and \c buildlink3.mk of dependencies. This is empty
+     * unless memoize_pkgmk_vars() has been called.
+     */
+    std::set<std::filesystem::path>
+    memoized_pkgmk_makefiles();
+
+    /** Parse the value of \c .MAKE.MAKEFILES into absolute paths,
+     * skipping the makefile read from stdin. Relative paths are relative
+     * to \c dir, the directory bmake ran in.
+     */
+    std::vector<std::filesystem::path>
+    makefiles_read(std::string const& MAKEFILES, std::filesystem::path const& dir);
+
+    /** A set of make variables stored on disk, so that values which
+     * take a bmake run to evaluate can be reused by later
+     * invocations. An entry is identified by a key string, which should
+     * contain everything affecting the values other than files, and is
+     * valid as long as the files it was stored with have the same
+     * modification times. Only a digest of the key is written to disk.
+     *
+     * Entries are stored under \c $XDG_CACHE_HOME/pkgchkxx, or \c
+     * $HOME/.cache/pkgchkxx. The cache is disabled if neither of them is
+     * set, or while \ref tape is recording or replaying. Failing to read or write the cache is never an error.
+     */
+    struct makevars_cache {
+        /// Construct an object representing the cache entry for \c key.
+        makevars_cache(std::string const& key);
+
+        /** Load the entry. Return \c std::nullopt if it doesn't exist or
+         * is outdated. */
+        std::optional<
+            std::map<std::string, std::string>>
+        load() const;
+
+        /** Store the entry, replacing the old one if any. \c deps is a
+         * sequence of files the values depend on. Directories in \c deps
+         * are recursively scanned, and files that don't exist are
+         * recorded as such. */
+        void
+        store(std::map<std::string, std::string> const& vars,
+              std::vector<std::filesystem::path> const& deps) const noexcept;
+
+    private:
+        std::string _key;
+        std::optional<std::filesystem::path> _file;
+    };
 }
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <pkgxx/concurrency.hxx>
+#include <pkgxx/nursery.hxx>
+
+namespace pkgxx {
+    /** Apply a function \c f to each element of \c items in parallel, and
+     * reduce the results into a single value. The function is called as
+     * \c f(item,acc) where \c acc is a mutable reference to an
+     * accumulator of type \c Result owned by the worker running it. No
+     * locks are taken for each element: every worker starts with a
+     * default-constructed accumulator, and accumulators are merged with
+     * \c operator+= only once each worker runs out of elements.
+     *
+     * Just like \ref xargs_fold, \c Result must form a commutative monoid
+     * under its default constructor and \c operator+=. The order of
+     * elements each worker sees, and the order in which accumulators are
+     * merged, are both unspecified.
+     *
+     * Workers run on a \ref nursery for the kind of work \c w. Their
+     * number is decided when this function is called, and elements are
+     * handed out one at a time to whichever worker asks first, so a few
+     * expensive elements don't keep the others waiting. If \c f throws,
+     * the remaining elements are skipped and the exception is rethrown.
+     */
+    template <typename Result, typename Range, typename Function>
+    Result
+    map_reduce(Range&& items,
+               Function&& f,
+               pkgxx::concurrency const& concurrency = pkgxx::concurrency(),
+               workload w = workload::cpu) {
+
+        static_assert(std::is_default_constructible_v<Result>);
+
+        // Elements are claimed by index, so we need random access to
+        // them even if the range is a std::set.
+        using iterator = decltype(std::begin(items));
+        std::vector<iterator> its;
+        for (auto it = std::begin(items); it != std::end(items); it++) {
+            its.push_back(it);
+        }
+
+        Result result;
+        if (its.empty()) {
+            return result;
+        }
+
+        std::mutex mtx;
+        std::atomic<std::size_t> next   = 0;
+        std::atomic<bool>        failed = false;
+        {
+            nursery n(concurrency, w);
+            auto const workers = std::min<std::size_t>(its.size(), std::max(1u, concurrency(w)));
+            for (std::size_t i = 0; i < workers; i++) {
+                n.start_soon(
+                    [&]() {
+                        Result acc;
+                        try {
+                            for (auto j = next.fetch_add(1, std::memory_order_relaxed);
+                                 j < its.size() && !failed.load(std::memory_order_relaxed);
+                                 j = next.fetch_add(1, std::memory_order_relaxed)) {
+
+                                f(*its[j], acc);
+                            }
+                        }
+                        catch (...) {
+                            failed.store(true, std::memory_order_relaxed);
+                            throw;
+                        }
+                        std::lock_guard<std::mutex> lk(mtx);
+                        result += std::move(acc);
+                    });
+            }
+        }
+        // The nursery has to be destroyed before this happens, otherwise
+        // we would miss some accumulators.
+        return result;
+    }
+
+    namespace detail {
+        // The trivial monoid, for parallel_for_each() which accumulates
+        // nothing.
+        struct unit {
+            unit&
+            operator+= (unit&&) {
+                return *this;
+            }
+        };
+    }
+
+    /** Apply a function \c f to each element of \c items in parallel. This
+     * is \ref map_reduce without an accumulator, for functions that have
+     * side effects of their own.
+     */
+    template <typename Range, typename Function>
+    void
+    parallel_for_each(Range&& items,
+                      Function&& f,
+                      pkgxx::concurrency const& concurrency = pkgxx::concurrency(),
+                      workload w = workload::cpu) {
+
+        map_reduce<detail::unit>(
+            std::forward<Range>(items),
+            [&](auto&& item, detail::unit&) {
+                f(std::forward<decltype(item)>(item));
+            },
+            concurrency, w);
+    }
+}
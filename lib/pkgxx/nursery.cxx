@@ -1,135 +1,296 @@
+#include <algorithm>
+#include <optional>
+#include <pthread.h>
+
 #include "nursery.hxx"
+#include "stats.hxx"
+#include "trace.hxx"
 
-using namespace std::placeholders;
+namespace {
+    /* A process-wide pool of worker threads shared by all nurseries. Each
+     * worker has its own deque of jobs: jobs submitted from a worker go
+     * to the back of its own deque and are taken from there by the same
+     * worker, while idle workers steal from the front of others'
+     * deques. Jobs submitted from outside the pool go to a global
+     * injection queue.
+     */
+    struct thread_pool {
+        using job_t = std::function<void ()>;
 
-namespace pkgxx {
-    nursery::nursery(unsigned int concurrency)
-        : _concurrency(concurrency) {}
+        static thread_pool&
+        instance() {
+            // Never destroyed, because the workers never terminate. A
+            // process forked from this one has none of the workers
+            // though, so it starts over with a pool of its own.
+            static std::once_flag once;
+            std::call_once(
+                once,
+                []() {
+                    pthread_atfork(
+                        nullptr, nullptr,
+                        []() {
+                            current_instance.store(nullptr, std::memory_order_relaxed);
+                            current_pool = nullptr;
+                        });
+                });
 
-    nursery::~nursery() noexcept(false) {
-        std::unique_lock<mutex_t> lk(_mtx);
+            auto* pool = current_instance.load(std::memory_order_acquire);
+            if (!pool) {
+                // The constructor starts no threads, so losing the race
+                // costs nothing but an allocation.
+                auto* fresh = new thread_pool();
+                if (current_instance.compare_exchange_strong(pool, fresh, std::memory_order_acq_rel)) {
+                    pool = fresh;
+                }
+                else {
+                    delete fresh;
+                }
+            }
+            return *pool;
+        }
 
-        while (true) {
-            if (!_ex) {
-                start_some();
+        // Make sure the pool has at least n workers, up to a fixed
+        // limit.
+        void
+        reserve(unsigned n) {
+            n = std::min(n, max_workers);
+            if (_num_workers.load(std::memory_order_acquire) >= n) {
+                return;
             }
 
-            if (!_pending_tasks.empty() && !_ex) {
-                // We still have pending tasks, which means we have reached
-                // the maximum concurrency. In this case we should wait
-                // until some tasks finish so that we can start more.
-                _finished.wait(lk);
+            std::lock_guard<std::mutex> lk(_grow_mtx);
+            for (auto i = _num_workers.load(std::memory_order_relaxed); i < n; i++) {
+                _workers.push_back(std::make_unique<worker>());
+                // Publish the worker before starting the thread, so that
+                // it can find its own deque.
+                _num_workers.store(i + 1, std::memory_order_release);
+                std::thread(&thread_pool::worker_main, this, i).detach();
             }
-            else if (!_busy_workers.empty()) {
-                // We have no pending children anymore but some tasks are
-                // still running. Wait until they all finish.
-                _finished.wait(lk);
+        }
+
+        void
+        submit(job_t&& j) {
+            if (current_pool == this) {
+                auto& w = *_workers[current_index];
+                std::lock_guard<std::mutex> lk(w.mtx);
+                w.jobs.push_back(std::move(j));
             }
             else {
-                // No pending nor running tasks. Terminate all the
-                // workers. But since workers will call our
-                // task_finished(), which locks our mutex, we must unlock
-                // it to avoid deadlock.
-                lk.unlock();
-                for (auto& [_id, w]: _workers) {
-                    w->async_terminate();
+                std::lock_guard<std::mutex> lk(_injection_mtx);
+                _injection.push_back(std::move(j));
+            }
+            {
+                std::lock_guard<std::mutex> lk(_sleep_mtx);
+                _queued++;
+            }
+            _wake.notify_one();
+        }
+
+    private:
+        static constexpr unsigned max_workers = 1024;
+
+        struct worker {
+            std::mutex mtx;
+            std::deque<job_t> jobs;
+        };
+
+        thread_pool() {
+            // _workers must never reallocate, because other workers read
+            // it without locking.
+            _workers.reserve(max_workers);
+        }
+
+        std::optional<job_t>
+        take(std::size_t self) {
+            {
+                auto& w = *_workers[self];
+                std::lock_guard<std::mutex> lk(w.mtx);
+                if (!w.jobs.empty()) {
+                    auto j = std::move(w.jobs.back());
+                    w.jobs.pop_back();
+                    return j;
                 }
-                for (auto& [_id, w]: _workers) {
-                    w->join();
+            }
+            {
+                std::lock_guard<std::mutex> lk(_injection_mtx);
+                if (!_injection.empty()) {
+                    auto j = std::move(_injection.front());
+                    _injection.pop_front();
+                    return j;
                 }
-                // No need to worry about this lock() being skipped when
-                // join() throws.
-                lk.lock();
-                break;
             }
+            auto const n = _num_workers.load(std::memory_order_acquire);
+            for (std::size_t i = 1; i < n; i++) {
+                auto& victim = *_workers[(self + i) % n];
+                std::lock_guard<std::mutex> lk(victim.mtx);
+                if (!victim.jobs.empty()) {
+                    auto j = std::move(victim.jobs.front());
+                    victim.jobs.pop_front();
+                    return j;
+                }
+            }
+            return std::nullopt;
         }
 
-        if (_ex) {
-            std::rethrow_exception(_ex);
+        void
+        worker_main(std::size_t self) {
+            current_pool  = this;
+            current_index = self;
+
+            while (true) {
+                if (auto j = take(self); j) {
+                    _queued--;
+                    (*j)();
+                }
+                else {
+                    std::unique_lock<std::mutex> lk(_sleep_mtx);
+                    _wake.wait(lk, [&]() { return _queued > 0; });
+                }
+            }
         }
-    }
 
-    void
-    nursery::start_some() {
-        lock_t lk(_mtx);
-
-        auto const pop_task =
-            [this]() {
-                task t = std::move(_pending_tasks.front());
-                _pending_tasks.pop_front();
-                return t;
-            };
-
-        while (!_pending_tasks.empty()) {
-            if (auto it = _idle_workers.begin(); it != _idle_workers.end()) {
-                // We have an idle worker. Assign a task to it.
-                _workers.at(*it)->assign(pop_task());
-                _busy_workers.insert(*it);
-                _idle_workers.erase(it);
-            }
-            else if (_workers.size() < _concurrency) {
-                // We have no idle workers but we have a room for spawning
-                // more.
-                auto w = std::make_unique<worker>(*this);
-                auto const worker_id = w->get_id();
-
-                w->assign(pop_task());
-                _workers.insert_or_assign(worker_id, std::move(w));
-                _busy_workers.insert(worker_id);
+        static inline std::atomic<thread_pool*> current_instance = nullptr;
+
+        static thread_local thread_pool* current_pool;
+        static thread_local std::size_t current_index;
+
+        std::mutex _grow_mtx;
+        std::vector<std::unique_ptr<worker>> _workers;
+        std::atomic<unsigned> _num_workers = 0;
+
+        std::mutex _injection_mtx;
+        std::deque<job_t> _injection;
+
+        // The number of jobs in any of the queues. Only incremented while
+        // holding _sleep_mtx so that no wakeups are lost.
+        std::mutex _sleep_mtx;
+        std::atomic<std::size_t> _queued = 0;
+        std::condition_variable _wake;
+    };
+
+    thread_local thread_pool* thread_pool::current_pool  = nullptr;
+    thread_local std::size_t  thread_pool::current_index = 0;
+}
+
+namespace pkgxx {
+    nursery::nursery(pkgxx::concurrency const& concurrency, workload w)
+        : _concurrency(concurrency)
+        , _workload(w)
+        , _limit(_concurrency(w))
+        , _uncaught(std::uncaught_exceptions()) {}
+
+    nursery::~nursery() noexcept(false) {
+        refresh_limit();
+        std::unique_lock<mutex_t> lk(_mtx);
+
+        while (!_jobs.empty() || (!_ex && !_pending_tasks.empty())) {
+            if (_jobs.empty()) {
+                // Jobs have quit because the limit has decreased, but
+                // there are still tasks to run.
+                start_some();
+                continue;
+            }
+
+            // Help the pool by running one of our own jobs that no worker
+            // has picked up yet. This is what keeps nested nurseries from
+            // deadlocking when every worker is waiting for one.
+            auto it = std::find_if(
+                _jobs.begin(), _jobs.end(),
+                [](auto const& j) {
+                    return !j->claimed.exchange(true);
+                });
+            if (it != _jobs.end()) {
+                auto j = *it;
+                lk.unlock();
+                run_job(j);
+                lk.lock();
             }
             else {
-                // We have reached the maximum concurrency.
-                break;
+                // Every job is running on some worker. Wait until they
+                // all finish.
+                _finished.wait(lk);
+            }
+        }
+
+        if (_ex) {
+            // Tasks that haven't started are never started.
+            _pending_tasks.clear();
+            if (std::uncaught_exceptions() <= _uncaught) {
+                std::rethrow_exception(_ex);
             }
         }
     }
 
     void
-    nursery::task_finished(std::thread::id worker_id, std::exception_ptr ex) {
-        {
-            lock_t lk(_mtx);
+    nursery::refresh_limit() {
+        _limit.store(_concurrency(_workload), std::memory_order_relaxed);
+    }
 
-            if (ex && !_ex) {
-                _ex = ex;
-            }
-            _busy_workers.erase(worker_id);
-            _idle_workers.insert(worker_id);
+    void
+    nursery::start_some() {
+        auto& pool = thread_pool::instance();
+        auto const limit = _limit.load(std::memory_order_relaxed);
+        pool.reserve(limit);
+
+        // Jobs that aren't running a task will take a pending one soon,
+        // so we only need more jobs for the rest.
+        while (_jobs.size() < limit &&
+               _jobs.size() - _busy < _pending_tasks.size()) {
+            auto j = std::make_shared<job>(*this);
+            _jobs.push_back(j);
+            pool.submit(
+                [j]() {
+                    if (!j->claimed.exchange(true)) {
+                        j->owner.run_job(j);
+                    }
+                });
         }
-        _finished.notify_one();
     }
 
     void
-    nursery::worker::thread_main() {
+    nursery::run_job(std::shared_ptr<job> const& j) {
+        refresh_limit();
         std::unique_lock<mutex_t> lk(_mtx);
 
-        while (true) {
-            // Sleep until we get a task or a termination request. We
-            // should not terminate as long as we have a task.
-            std::optional<task> t = std::move(_task);
-            _task.reset();
-            if (t) {
-                // fall through
-            }
-            else if (_terminate) {
-                break;
-            }
-            else {
-                _got_request.wait(lk);
-                continue;
-            }
+        // Quit early if the limit has decreased below the number of
+        // jobs. The remaining jobs take over our tasks.
+        while (!_ex && !_pending_tasks.empty() &&
+               _jobs.size() <= _limit.load(std::memory_order_relaxed)) {
+            task t = std::move(_pending_tasks.front());
+            _pending_tasks.pop_front();
 
-            // We got a task. Run it now, but don't lock the mutex while
-            // doing that. Otherwise the nursery can't even post a
-            // terminate request to us.
+            stats::nursery_tasks_run.add();
+            stats::nursery_queue_wait_us.add(
+                static_cast<std::uint64_t>(
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - t.queued).count()));
+
+            // Don't lock the mutex while running the task. Otherwise
+            // nobody can even add more tasks to us.
+            _busy++;
             lk.unlock();
+            std::exception_ptr ex;
+            detail::work_started();
             try {
-                t->run();
-                _nursery.task_finished(get_id());
+                trace::span s("nursery", _workload == workload::cpu ? "cpu task" : "spawn task");
+                t.run();
             }
             catch (...) {
-                _nursery.task_finished(get_id(), std::current_exception());
+                ex = std::current_exception();
             }
+            detail::work_finished();
+            refresh_limit();
             lk.lock();
+            _busy--;
+
+            if (ex && !_ex) {
+                _ex = ex;
+            }
         }
+
+        _jobs.erase(std::find(_jobs.begin(), _jobs.end(), j));
+        // The destructor may return as soon as we unlock the mutex, so
+        // this must be the last thing to touch the nursery.
+        _finished.notify_all();
     }
 }
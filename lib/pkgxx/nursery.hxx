@@ -1,18 +1,19 @@
 #pragma once
 
-#include <cassert>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <deque>
 #include <exception>
 #include <functional>
-#include <map>
-#include <set>
 #include <memory>
 #include <mutex>
-#include <optional>
 #include <thread>
 #include <type_traits>
 #include <utility>
+#include <vector>
+
+#include <pkgxx/concurrency.hxx>
 
 namespace pkgxx {
     /** An implementation of structured concurrency:
@@ -20,16 +21,26 @@ namespace pkgxx {
      */
     struct nursery {
         /** Create a nursery with a given maximum concurrency. It is
-         * typically the number of available CPUs.
+         * typically the number of available CPUs. If it's adaptive, the
+         * limit for the kind of work \c w is consulted each time a task
+         * starts, so that a long-lived nursery follows changes in the
+         * load.
          */
-        nursery(unsigned concurrency
-                    = std::max(1u, std::thread::hardware_concurrency()));
+        nursery(pkgxx::concurrency const& concurrency = pkgxx::concurrency(),
+                workload w = workload::cpu);
 
-        /** Block until all the registered child tasks finish.
+        /** Block until all the registered child tasks finish. While
+         * waiting, the calling thread runs child tasks that no worker
+         * thread has picked up yet, so a nursery created inside a task of
+         * another nursery never waits for a free worker.
          *
          * This is a memory barrier. Whatever memory values children tasks
          * could see before terminating can also be seen by the thread
          * destroying the nursery.
+         *
+         * An exception thrown by a child task is not rethrown if the
+         * nursery is being destroyed by stack unwinding, because that
+         * would terminate the process. It is discarded instead.
          */
         ~nursery() noexcept(false);
 
@@ -38,7 +49,11 @@ namespace pkgxx {
          * before the destructor of nursery returns.
          *
          * \ref nursery does not spawn a separate thread for each child
-         * task. Instead it creates a pool of threads and reuses them.
+         * task. Instead every nursery in the process shares a single pool
+         * of threads, which is started lazily and grows up to the largest
+         * concurrency requested so far. A process forked from another
+         * starts over with a pool of its own. At most \c concurrency tasks of
+         * the same nursery run at once.
          *
          * If a child task throws an exception, it will be caught by the
          * \ref nursery and rethrown from either its destructor or the next
@@ -49,8 +64,9 @@ namespace pkgxx {
          * throws an exception, only the first one will be rethrown and
          * others will be discarded.
          *
-         * You may create a nested \ref nursery in the task, but the
-         * concurrency isn't coordinated with the parent \ref nursery.
+         * You may create a nested \ref nursery in the task. Its tasks run
+         * on the same pool, so nesting does not multiply the number of
+         * threads.
          *
          * This is a memory barrier. Whatever memory values the thread
          * calling this function can also be seen by the child task.
@@ -59,6 +75,7 @@ namespace pkgxx {
         void
         start_soon(Function&& f, Args&&... args) {
             static_assert(std::is_invocable_v<Function&&, Args&&...>);
+            refresh_limit();
             lock_t lk(_mtx);
 
             if (_ex) {
@@ -86,7 +103,8 @@ namespace pkgxx {
             task(Function&& f, Args&&... args)
                 : run(
                     std::bind(
-                        std::forward<Function>(f), std::forward<Args>(args)...)) {
+                        std::forward<Function>(f), std::forward<Args>(args)...))
+                , queued(std::chrono::steady_clock::now()) {
 
                 static_assert(std::is_invocable_v<Function&&, Args&&...>);
             }
@@ -96,107 +114,74 @@ namespace pkgxx {
             task(task&&) = default;
 
             std::function<void ()> run;
-        };
-
-        struct worker {
-            worker(nursery& n)
-                : _nursery(n)
-                , _terminate(false)
-                , _thr(std::bind(&worker::thread_main, this)) {}
-            worker() = delete;
-            worker(worker const&) = delete;
-            worker(worker&&) = delete;
-
-            std::thread::id
-            get_id() const {
-                return _thr.get_id();
-            }
-
-            void
-            assign(task&& t) {
-                {
-                    lock_t lk(_mtx);
-
-                    assert(!_task.has_value());
-                    _task.emplace(std::move(t));
-                }
-                _got_request.notify_one();
-            }
-
-            void
-            async_terminate() {
-                {
-                    lock_t lk(_mtx);
-                    _terminate = true;
-                }
-                _got_request.notify_one();
-            }
-
-            void
-            join() {
-                _thr.join();
-            }
-
-        private:
-            void thread_main();
-
-            using mutex_t   = std::mutex;
-            using lock_t    = std::lock_guard<mutex_t>;
-            using condvar_t = std::condition_variable;
 
-            // These members aren't guarded by a mutex.
-            nursery& _nursery;
-            mutable mutex_t _mtx;
-
-            // When this has a value it means the worker is busy. Guarded
-            // by mtx.
-            std::optional<task> _task;
+            // When the task was registered, for the statistics of how
+            // long tasks wait for a worker.
+            std::chrono::steady_clock::time_point queued;
+        };
 
-            // Set to true when the nursery wants the worker to
-            // die. Guarded by mtx.
-            bool _terminate;
+        /* A request to the thread pool to run tasks of a nursery. A job
+         * keeps taking tasks from _pending_tasks until there are none
+         * left, so the number of outstanding jobs is the number of tasks
+         * that may run at once.
+         */
+        struct job {
+            job(nursery& n)
+                : owner(n) {}
 
-            // Signaled when the nursery assigns a task to an idle worker
-            // or it asks the worker to die.
-            condvar_t _got_request;
+            nursery& owner;
 
-            // The thread object isn't guarded by the mutex.
-            std::thread _thr;
+            // Set by whoever runs the job first: either a pool worker or
+            // the thread destroying the nursery. The other one must not
+            // touch the owner, because it may already be gone.
+            std::atomic<bool> claimed = false;
         };
 
-        // Start some pending tasks as long as we haven't reached the
-        // maximum concurrency.
+        // Consult _concurrency and update _limit. The caller must not
+        // hold _mtx, because an adaptive limit may call its logger.
+        void
+        refresh_limit();
+
+        // Submit jobs to the pool as long as we have pending tasks and
+        // haven't reached the maximum concurrency. The caller must hold
+        // _mtx.
         void
         start_some();
 
-        // Notify the nursery that a task either finished successfully or
-        // threw an exception.
+        // Run tasks until there are no pending ones, or one of them
+        // throws.
         void
-        task_finished(std::thread::id worker_id, std::exception_ptr ex = {});
+        run_job(std::shared_ptr<job> const& j);
 
-        using mutex_t   = std::recursive_mutex;
+        using mutex_t   = std::mutex;
         using lock_t    = std::lock_guard<mutex_t>;
-        using condvar_t = std::condition_variable_any;
+        using condvar_t = std::condition_variable;
 
         mutable mutex_t _mtx;
-        unsigned _concurrency;
+        pkgxx::concurrency _concurrency;
+        workload _workload;
+
+        // The last value of _concurrency for _workload.
+        std::atomic<unsigned> _limit;
 
         // The list of tasks that haven't started yet.
         std::deque<task> _pending_tasks;
 
-        // The pool of worker threads.
-        std::map<std::thread::id, std::unique_ptr<worker>> _workers;
+        // Jobs submitted to the pool which haven't finished yet, whether
+        // or not somebody has claimed them.
+        std::vector<std::shared_ptr<job>> _jobs;
 
-        // The set of busy worker threads.
-        std::set<std::thread::id> _busy_workers;
-
-        // The set of idle worker threads.
-        std::set<std::thread::id> _idle_workers;
+        // The number of jobs currently running a task.
+        std::size_t _busy = 0;
 
         // An exception thrown by a task.
         std::exception_ptr _ex;
 
-        // Signaled when a task finishes.
+        // std::uncaught_exceptions() at construction. The destructor is
+        // called by unwinding if it's higher then.
+        int _uncaught;
+
+        // Signaled when a job finishes.
         condvar_t _finished;
     };
 }
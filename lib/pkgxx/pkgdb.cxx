@@ -1,15 +1,286 @@
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <mutex>
+
+#include <unistd.h>
+
 #include "pkgdb.hxx"
+#include "string_algo.hxx"
 
-namespace pkgxx {
-    installed_pkgname_iterator::installed_pkgname_iterator(std::string const& PKG_INFO)
-        : _pkg_info(std::make_shared<harness>(
-                        pkgxx::shell,
-                        std::initializer_list<std::string>(
-                            {pkgxx::shell, "-s", "--", "-e", "*"}),
-                        "dtor_action"_na = harness::dtor_action::kill)) {
+namespace pkgxx::detail {
+    struct pkg_info_query {
+        pkg_info_query(pkgxx::pkgpattern const& pattern_)
+            : pattern(pattern_) {}
+
+        pkgxx::pkgpattern pattern;
+        bool done = false;
+        std::vector<std::string> lines;
+        std::exception_ptr error;
+    };
+
+    // Queries are never sent to a single pkg_info in larger groups than
+    // this, so that the command line stays well below ARG_MAX.
+    static constexpr std::size_t max_batch_size = 256;
+
+    // While a batch is running, newly queued queries are held back until
+    // this many have accumulated, rather than starting tiny batches
+    // alongside it.
+    static constexpr std::size_t min_concurrent_batch_size = 16;
+
+    /* Return true if PKG_INFO is a plain pkg_info(1) whose PKG_DBDIR we
+     * can read. Spawning it for a single package is cheap then, and
+     * batching would only delay callers. Anything else, such as a wrapper
+     * running pkg_info on another host or as another user, is assumed to
+     * be expensive to spawn.
+     */
+    static bool
+    is_pkg_dbdir_readable(std::string const& PKG_INFO) noexcept {
+        try {
+            auto const words = pkgxx::split_shell_words(PKG_INFO);
+            if (!words || words->size() != 1) {
+                return false;
+            }
+            std::filesystem::path const pkg_info(words->front());
+            if (pkg_info.filename() != "pkg_info") {
+                return false;
+            }
+            // pkg_admin(1) is always installed alongside pkg_info(1).
+            auto const pkg_admin = pkg_info.has_parent_path()
+                ? (pkg_info.parent_path() / "pkg_admin").string()
+                : std::string("pkg_admin");
+            pkgxx::harness cmd(
+                pkg_admin, {pkg_admin, "config-var", "PKG_DBDIR"},
+                "stdin_action"_na  = pkgxx::harness::fd_action::close,
+                "stderr_action"_na = pkgxx::harness::fd_action::close);
+            std::string PKG_DBDIR;
+            std::getline(cmd.cout(), PKG_DBDIR);
+            return cmd.wait_exit().status == 0
+                && !PKG_DBDIR.empty()
+                && access(PKG_DBDIR.c_str(), R_OK | X_OK) == 0;
+        }
+        catch (...) {
+            return false;
+        }
+    }
+
+    /* Queries of one kind sent to one PKG_INFO, waiting to be run
+     * together.
+     */
+    struct pkg_info_batcher {
+        pkg_info_batcher(std::string const& PKG_INFO_, char flag_, bool batching_)
+            : PKG_INFO(PKG_INFO_)
+            , flag(flag_)
+            , batching(batching_) {}
+
+        void
+        query(std::shared_ptr<pkg_info_query> const& query) {
+            if (!batching) {
+                run({query});
+                return;
+            }
+
+            std::unique_lock<std::mutex> lk(_mtx);
+            _pending.push_back(query);
+            while (!query->done) {
+                if (_running > 0 && _pending.size() < min_concurrent_batch_size) {
+                    // Our query is either in a running batch or will be
+                    // taken by the next one.
+                    _cv.wait(lk);
+                    continue;
+                }
+
+                std::vector<std::shared_ptr<pkg_info_query>> batch;
+                while (!_pending.empty() && batch.size() < max_batch_size) {
+                    batch.push_back(std::move(_pending.front()));
+                    _pending.pop_front();
+                }
+                _running++;
+                lk.unlock();
+
+                run(batch);
+
+                lk.lock();
+                for (auto& q: batch) {
+                    q->done = true;
+                }
+                _running--;
+                _cv.notify_all();
+            }
+        }
+
+    private:
+        void
+        run(std::vector<std::shared_ptr<pkg_info_query>> const& batch) noexcept {
+            try {
+                std::vector<std::string> pats;
+                std::set<std::string> seen;
+                for (auto const& q: batch) {
+                    if (auto pat = q->pattern.string(); seen.insert(pat).second) {
+                        pats.push_back(std::move(pat));
+                    }
+                }
+                if (flag == 'e') {
+                    run_exists(batch, pats);
+                }
+                else {
+                    run_info(batch, pats);
+                }
+            }
+            catch (...) {
+                for (auto const& q: batch) {
+                    q->error = std::current_exception();
+                }
+            }
+        }
+
+        /* pkg_info -e takes only one pattern, so a batch is a loop in a
+         * single shell that prints each pattern pkg_info found. Without
+         * batching there is only one pattern, and pkg_info is spawned
+         * directly.
+         */
+        void
+        run_exists(std::vector<std::shared_ptr<pkg_info_query>> const& batch,
+                   std::vector<std::string> const& pats) {
+
+            if (!batching) {
+                auto const argv = pkgxx::shell_command_argv(PKG_INFO, {"-q", "-e", pats.at(0)});
+                pkgxx::harness pkg_info(
+                    argv[0], argv,
+                    "stdin_action"_na = pkgxx::harness::fd_action::close);
+                if (pkg_info.wait_exit().status == 0) {
+                    for (auto const& q: batch) {
+                        q->lines.push_back(q->pattern.string());
+                    }
+                }
+                return;
+            }
+
+            std::vector<std::string> argv = {
+                pkgxx::shell, "-c",
+                "for p; do " + PKG_INFO + " -q -e \"$p\" && printf '%s\\n' \"$p\"; done",
+                pkgxx::shell
+            };
+            argv.insert(argv.end(), pats.begin(), pats.end());
+            pkgxx::harness pkg_info(
+                argv[0], argv,
+                "dtor_action"_na  = pkgxx::harness::dtor_action::wait,
+                "stdin_action"_na = pkgxx::harness::fd_action::close);
+
+            std::set<std::string> found;
+            pkgxx::for_each_line(
+                pkg_info.cout(),
+                [&](std::string_view const& line) {
+                    found.emplace(line);
+                });
+            pkg_info.wait();
 
-        _pkg_info->cin() << "exec " << PKG_INFO << " \"$@\"" << std::endl;
-        _pkg_info->cin().close();
+            for (auto const& q: batch) {
+                if (auto pat = q->pattern.string(); found.count(pat)) {
+                    q->lines.push_back(std::move(pat));
+                }
+            }
+        }
+
+        void
+        run_info(std::vector<std::shared_ptr<pkg_info_query>> const& batch,
+                 std::vector<std::string> const& pats) {
+
+            // Without -q, pkg_info prints a header "Information for
+            // NAME:" before each package, which is what lets us tell
+            // them apart.
+            auto argv = pkgxx::shell_command_argv(PKG_INFO, {std::string("-") + flag});
+            argv.insert(argv.end(), pats.begin(), pats.end());
+
+            // pkg_info exits with non-zero when any of the patterns
+            // doesn't match, which is not an error for us.
+            pkgxx::harness pkg_info(
+                argv[0], argv,
+                "dtor_action"_na  = pkgxx::harness::dtor_action::wait,
+                "stdin_action"_na = pkgxx::harness::fd_action::close);
+
+            std::map<pkgxx::pkgname, std::vector<std::string>> sections;
+            std::vector<std::string>* section = nullptr;
+            pkgxx::for_each_line(
+                pkg_info.cout(),
+                [&](std::string_view const& line) {
+                    if (pkgxx::starts_with(line, "Information for ") && pkgxx::ends_with(line, ":")) {
+                        auto const name = line.substr(16, line.size() - 17);
+                        section = &sections[pkgxx::pkgname(name)];
+                    }
+                    else if (section) {
+                        // -N and -R lists packages, one per line, after a
+                        // title line ending with a colon. -B lists
+                        // variables and the caller skips anything else.
+                        if (flag != 'B' && (line.empty() || pkgxx::ends_with(line, ":"))) {
+                            return;
+                        }
+                        section->emplace_back(line);
+                    }
+                });
+            pkg_info.wait();
+
+            for (auto const& q: batch) {
+                q->pattern.for_each(
+                    std::as_const(sections),
+                    [&](auto it) {
+                        q->lines.insert(q->lines.end(), it->second.begin(), it->second.end());
+                    });
+            }
+        }
+
+    public:
+        std::string const PKG_INFO;
+        char const flag;
+        bool const batching;
+
+    private:
+        std::mutex _mtx;
+        std::condition_variable _cv;
+        std::deque<std::shared_ptr<pkg_info_query>> _pending;
+        unsigned _running = 0;
+    };
+
+    static pkg_info_batcher&
+    batcher_for(std::string const& PKG_INFO, char flag) {
+        // Batchers are never destroyed, because detached threads may
+        // still be using them when the program exits.
+        static auto* const mtx = new std::mutex();
+        static auto* const readable = new std::map<std::string, bool>();
+        static auto* const batchers =
+            new std::map<std::pair<std::string, char>, std::unique_ptr<pkg_info_batcher>>();
+
+        std::lock_guard<std::mutex> lk(*mtx);
+        auto& b = (*batchers)[{PKG_INFO, flag}];
+        if (!b) {
+            auto it = readable->find(PKG_INFO);
+            if (it == readable->end()) {
+                it = readable->emplace(PKG_INFO, is_pkg_dbdir_readable(PKG_INFO)).first;
+            }
+            b = std::make_unique<pkg_info_batcher>(PKG_INFO, flag, !it->second);
+        }
+        return *b;
+    }
+
+    std::shared_ptr<std::vector<std::string> const>
+    query_pkg_info(std::string const& PKG_INFO, char flag, pkgxx::pkgpattern const& pat) {
+        auto const query = std::make_shared<pkg_info_query>(pat);
+        batcher_for(PKG_INFO, flag).query(query);
+        if (query->error) {
+            std::rethrow_exception(query->error);
+        }
+        return std::shared_ptr<std::vector<std::string> const>(query, &query->lines);
+    }
+}
+
+namespace pkgxx {
+    installed_pkgname_iterator::installed_pkgname_iterator(std::string const& PKG_INFO) {
+        auto const argv = shell_command_argv(PKG_INFO, {"-e", "*"});
+        _pkg_info = std::make_shared<harness>(
+            argv[0], argv,
+            "dtor_action"_na  = harness::dtor_action::kill,
+            "stdin_action"_na = harness::fd_action::close);
 
         ++(*this);
     }
@@ -29,39 +300,26 @@ namespace pkgxx {
     build_info_iterator::build_info_iterator(
         std::string const& PKG_INFO,
         pkgxx::pkgpattern const& pattern)
-        : _pkg_info(std::make_shared<harness>(
-                        pkgxx::shell,
-                        std::initializer_list<std::string>(
-                            {pkgxx::shell, "-s", "--", "-Bq", pattern.string()}),
-                        "dtor_action"_na = harness::dtor_action::kill)) {
-
-        _pkg_info->cin() << "exec " << PKG_INFO << " \"$@\"" << std::endl;
-        _pkg_info->cin().close();
+        : _lines(detail::query_pkg_info(PKG_INFO, 'B', pattern)) {
 
         ++(*this);
     }
 
     build_info_iterator&
     build_info_iterator::operator++ () {
-        while (true) {
-            if (std::getline(_pkg_info->cout(), _current_line)) {
-                if (auto equal = _current_line.find('='); equal != std::string::npos) {
-                    auto const line_v = std::string_view(_current_line);
-                    _current.emplace(
-                        line_v.substr(0, equal),
-                        line_v.substr(equal + 1));
-                    break;
-                }
-                else {
-                    // Not a variable definition. Skip this line.
-                    continue;
-                }
-            }
-            else {
-                _current.reset();
-                break;
+        // _line points one past the line _current was taken from.
+        for (; _line < _lines->size(); _line++) {
+            auto const line_v = std::string_view((*_lines)[_line]);
+            if (auto equal = line_v.find('='); equal != std::string_view::npos) {
+                _current.emplace(
+                    line_v.substr(0, equal),
+                    line_v.substr(equal + 1));
+                _line++;
+                return *this;
             }
+            // Not a variable definition. Skip this line.
         }
+        _current.reset();
         return *this;
     }
 
@@ -78,28 +336,16 @@ namespace pkgxx {
     namespace detail {
         bool
         is_pkg_installed(std::string const& PKG_INFO, pkgxx::pkgpattern const& pat) {
-            pkgxx::harness pkg_info(
-                pkgxx::shell, {pkgxx::shell, "-s", "--", "-q", "-e", pat.string()});
-
-            pkg_info.cin() << "exec " << PKG_INFO << " \"$@\"" << std::endl;
-            pkg_info.cin().close();
-
-            return pkg_info.wait_exit().status == 0;
+            return !query_pkg_info(PKG_INFO, 'e', pat)->empty();
         }
 
         std::set<pkgxx::pkgname>
         build_depends(std::string const& PKG_INFO, pkgxx::pkgpattern const& pat) {
-            pkgxx::harness pkg_info(
-                pkgxx::shell, {pkgxx::shell, "-s", "--", "-Nq", pat.string()});
-
-            pkg_info.cin() << "exec " << PKG_INFO << " \"$@\"" << std::endl;
-            pkg_info.cin().close();
-
+            // The lines are owned by the returned pointer, which must
+            // outlive the loop.
+            auto const lines = query_pkg_info(PKG_INFO, 'N', pat);
             std::set<pkgxx::pkgname> ret;
-            for (std::string line; std::getline(pkg_info.cout(), line); ) {
-                if (line.empty()) {
-                    break;
-                }
+            for (auto const& line: *lines) {
                 ret.emplace(line);
             }
             return ret;
@@ -107,17 +353,9 @@ namespace pkgxx {
 
         std::set<pkgxx::pkgname>
         who_requires(std::string const& PKG_INFO, pkgxx::pkgpattern const& pat) {
-            pkgxx::harness pkg_info(
-                pkgxx::shell, {pkgxx::shell, "-s", "--", "-Rq", pat.string()});
-
-            pkg_info.cin() << "exec " << PKG_INFO << " \"$@\"" << std::endl;
-            pkg_info.cin().close();
-
+            auto const lines = query_pkg_info(PKG_INFO, 'R', pat);
             std::set<pkgxx::pkgname> ret;
-            for (std::string line; std::getline(pkg_info.cout(), line); ) {
-                if (line.empty()) {
-                    break;
-                }
+            for (auto const& line: *lines) {
                 ret.emplace(line);
             }
             return ret;
@@ -3,6 +3,7 @@
 #include <memory>
 #include <set>
 #include <type_traits>
+#include <vector>
 
 #include <pkgxx/harness.hxx>
 #include <pkgxx/ordered.hxx>
@@ -10,6 +11,18 @@
 #include <pkgxx/pkgpattern.hxx>
 
 namespace pkgxx {
+    namespace detail {
+        /** Run <tt>pkg_info -FLAG pattern</tt> and return the lines it
+         * printed for packages matching the pattern. When \c PKG_DBDIR
+         * can't be read directly, queries issued concurrently by
+         * different threads are gathered and sent to a single invocation
+         * of \c pkg_info, and its output is split back into per-query
+         * results.
+         */
+        std::shared_ptr<std::vector<std::string> const>
+        query_pkg_info(std::string const& PKG_INFO, char flag, pkgxx::pkgpattern const& pat);
+    }
+
     /** An iterator that iterates through installed packages. */
     struct installed_pkgname_iterator: equality_comparable<installed_pkgname_iterator> {
         using iterator_category = std::forward_iterator_tag; ///< The category of the iterator.
@@ -111,7 +124,7 @@ namespace pkgxx {
         bool
         operator== (build_info_iterator const& other) const noexcept {
             if (_current.has_value()) {
-                return _pkg_info == other._pkg_info && other._current.has_value();
+                return _lines == other._lines && _line == other._line && other._current.has_value();
             }
             else {
                 return !other._current.has_value();
@@ -144,8 +157,8 @@ namespace pkgxx {
         }
 
     private:
-        std::shared_ptr<pkgxx::harness> _pkg_info;
-        std::string _current_line;
+        std::shared_ptr<std::vector<std::string> const> _lines;
+        std::size_t _line = 0;
         std::optional<value_type> _current;
     };
 
@@ -171,7 +184,7 @@ namespace pkgxx {
 
         /// Return an iterator to the first variable.
         const_iterator
-        begin() const noexcept {
+        begin() const {
             return const_iterator(_pkg_info, _pattern);
         }
 
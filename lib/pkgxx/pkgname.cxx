@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <charconv>
 
 #include "pkgname.hxx"
 #include "string_algo.hxx"
@@ -99,6 +100,61 @@ namespace pkgxx {
         }
     }
 
+    char*
+    pkgversion::write(char* first, char* last) const noexcept {
+        auto const put_number =
+            [&](unsigned long num, int width) -> bool {
+                char digits[24];
+                auto const res = std::to_chars(digits, digits + sizeof(digits), num);
+                auto const len = static_cast<std::size_t>(res.ptr - digits);
+                auto const pad = width > 0 && static_cast<std::size_t>(width) > len
+                    ? static_cast<std::size_t>(width) - len
+                    : 0;
+                if (static_cast<std::size_t>(last - first) < pad + len) {
+                    return false;
+                }
+                first = std::fill_n(first, pad, '0');
+                first = std::copy(digits, res.ptr, first);
+                return true;
+            };
+        auto const put_string =
+            [&](std::string_view const& str) -> bool {
+                if (static_cast<std::size_t>(last - first) < str.size()) {
+                    return false;
+                }
+                first = std::copy(str.begin(), str.end(), first);
+                return true;
+            };
+
+        for (auto const& comp: _comps) {
+            bool const ok = std::visit(
+                [&](auto const& c) {
+                    using T = std::decay_t<decltype(c)>;
+                    if constexpr (std::is_same_v<T, digits>) {
+                        return put_number(static_cast<unsigned long>(static_cast<int>(c)), c.width());
+                    }
+                    else if constexpr (std::is_same_v<T, modifier>) {
+                        return put_string(c.string());
+                    }
+                    else {
+                        static_assert(std::is_same_v<T, alpha>);
+                        char const ch = c;
+                        return put_string(std::string_view(&ch, 1));
+                    }
+                },
+                comp);
+            if (!ok) {
+                return nullptr;
+            }
+        }
+        if (_rev > 0) {
+            if (!put_string("nb") || !put_number(_rev, -1)) {
+                return nullptr;
+            }
+        }
+        return first;
+    }
+
     pkgname::pkgname(std::string_view const& name) {
         auto const hyphen = name.rfind('-');
         if (hyphen == std::string_view::npos) {
@@ -41,6 +41,12 @@ namespace pkgxx {
                 return _num;
             }
 
+            /// Obtain the intended width, or \c -1 if it has none.
+            int
+            width() const noexcept {
+                return _width;
+            }
+
             /// Print an instance of \ref digits to an output stream.
             friend std::ostream&
             operator<< (std::ostream& out, digits const& ds) {
@@ -197,6 +203,14 @@ namespace pkgxx {
             return out;
         }
 
+        /** Write the string representation of \ref pkgversion to a
+         * buffer <tt>[first, last)</tt> without allocating memory. Return
+         * a pointer past the last character written, or \c nullptr if it
+         * doesn't fit.
+         */
+        char*
+        write(char* first, char* last) const noexcept;
+
     private:
         friend struct std::hash<pkgversion>;
 
@@ -1,6 +1,14 @@
+#include <algorithm>
+#include <array>
+#include <bitset>
 #include <cassert>
+#include <cstdint>
 #include <exception>
+#include <fnmatch.h>
+#include <map>
 #include <optional>
+#include <set>
+#include <stdexcept>
 #include <variant>
 
 #include "pkgpattern.hxx"
@@ -8,28 +16,42 @@
 
 using namespace std::literals;
 
-namespace pkgxx {
-    pkgpattern::alternatives::alternatives(std::string_view const& patstr)
-        : _original(patstr) {
-
+namespace {
+    /* Expand csh-style alternatives in a pattern into patterns without
+     * braces. Throws if there are more than max of them, which happens
+     * long before pathological patterns like {a,b}{a,b}{a,b}... exhaust
+     * memory.
+     */
+    std::vector<std::string>
+    expand_alternatives(std::string_view const& patstr, std::size_t max) {
         // Extract the part preceding the opening brace.
         auto const o_brace = patstr.find('{');
-        assert(o_brace != std::string_view::npos);
+        if (o_brace == std::string_view::npos) {
+            return {std::string(patstr)};
+        }
         auto const head = patstr.substr(0, o_brace);
 
-        // Extract the part following the closing brace. Note that it may
-        // contain other sets of braces, which will be handled by recursive
-        // calls of parse_alternatives().
+        // Extract the part following the closing brace, and split the
+        // part enclosed by outermost braces into comma-separated
+        // segments. Both of them may contain other sets of braces, which
+        // will be handled by recursive calls.
+        std::vector<std::string_view> segments;
         auto c_brace = std::string_view::npos;
         {
             int level = 0;
+            auto seg_begin = o_brace + 1;
             for (auto i = o_brace; i < patstr.size(); i++) {
                 if (patstr[i] == '{') {
                     level++;
                 }
+                else if (patstr[i] == ',' && level == 1) {
+                    segments.push_back(patstr.substr(seg_begin, i - seg_begin));
+                    seg_begin = i + 1;
+                }
                 else if (patstr[i] == '}') {
                     level--;
                     if (level == 0) {
+                        segments.push_back(patstr.substr(seg_begin, i - seg_begin));
                         c_brace = i;
                         break;
                     }
@@ -39,49 +61,144 @@ namespace pkgxx {
                 throw std::runtime_error("Malformed alternate `" + std::string(patstr) + "'");
             }
         }
-        auto const tail = c_brace + 1 < patstr.size()
-            ? patstr.substr(c_brace + 1)
-            : ""sv;
-
-        // Now iterate comma-separated alternatives enclosed by outermost
-        // braces.
-        for (auto seg_begin = o_brace + 1;; ) {
-            auto seg_end = std::string_view::npos;
-            int level = 1;
-            for (auto i = seg_begin;; i++) {
-                if (patstr[i] == '{') {
-                    level++;
-                }
-                else if (patstr[i] == ',') {
-                    if (level == 1) {
-                        seg_end = i;
-                        break;
+        auto const tails = expand_alternatives(patstr.substr(c_brace + 1), max);
+
+        std::vector<std::string> ret;
+        for (auto const& segment: segments) {
+            for (auto const& middle: expand_alternatives(segment, max)) {
+                for (auto const& tail: tails) {
+                    if (ret.size() >= max) {
+                        throw std::runtime_error(
+                            "Too many alternatives in `" + std::string(patstr) + "'");
                     }
+                    ret.push_back(std::string(head) + middle + tail);
                 }
-                else if (patstr[i] == '}') {
-                    level--;
-                    if (level == 0) {
-                        seg_end = i;
-                        break;
-                    }
+            }
+        }
+        return ret;
+    }
+}
+
+namespace pkgxx {
+    /* A trie of literal prefixes of expanded alternatives. Each node
+     * holds the indices of patterns whose prefix ends there.
+     */
+    struct pkgpattern::alternatives::trie {
+        struct node {
+            std::map<char, std::size_t> children;
+            std::vector<std::size_t> patterns;
+        };
+
+        trie()
+            : nodes(1) {}
+
+        void
+        insert(std::string_view const& prefix, std::size_t pattern) {
+            std::size_t cur = 0;
+            for (char const c: prefix) {
+                if (auto it = nodes[cur].children.find(c); it != nodes[cur].children.end()) {
+                    cur = it->second;
                 }
+                else {
+                    nodes.emplace_back();
+                    nodes[cur].children.emplace(c, nodes.size() - 1);
+                    cur = nodes.size() - 1;
+                }
+            }
+            nodes[cur].patterns.push_back(pattern);
+        }
+
+        // Collect the shallowest prefixes having any patterns. Deeper ones
+        // are covered by searching for them.
+        void
+        roots(std::size_t cur, std::string& path, std::vector<std::string>& out) const {
+            if (!nodes[cur].patterns.empty()) {
+                out.push_back(path);
+                return;
+            }
+            for (auto const& [c, child]: nodes[cur].children) {
+                path.push_back(c);
+                roots(child, path, out);
+                path.pop_back();
             }
-            assert(seg_end != std::string_view::npos);
-            auto const segment = patstr.substr(seg_begin, seg_end - seg_begin);
+        }
 
-            _expanded.emplace_back(
-                std::string(head) + std::string(segment) + std::string(tail));
+        // nodes[0] is the root.
+        std::vector<node> nodes;
+    };
 
-            if (patstr[seg_end] == '}') {
-                break;
+    pkgpattern::alternatives::alternatives(std::string_view const& patstr)
+        : _original(patstr) {
+
+        assert(patstr.find('{') != std::string_view::npos);
+
+        // Different combinations may expand to the same pattern, as in
+        // {foo,f{o,x}o}. Keep only the first one.
+        std::set<std::string> seen;
+        for (auto& expanded: expand_alternatives(patstr, max_expansions)) {
+            if (seen.insert(expanded).second) {
+                _expanded.emplace_back(std::string_view(expanded));
             }
-            else {
-                // Given that we haven't reached the closing brace yet,
-                // seg_end+1 is guaranteed to be within the valid range of
-                // indices.
-                seg_begin = seg_end + 1;
+        }
+
+        auto t = std::make_shared<trie>();
+        for (std::size_t i = 0; i < _expanded.size(); i++) {
+            std::visit(
+                [&](auto const& pat) {
+                    using T = std::decay_t<decltype(pat)>;
+                    if constexpr (std::is_same_v<T, version_range>) {
+                        t->insert(pat.base, i);
+                    }
+                    else if constexpr (std::is_same_v<T, glob>) {
+                        t->insert(pat.literal_prefix(), i);
+                    }
+                    else {
+                        assert(0 && "alternatives must have been fully expanded");
+                        std::abort();
+                    }
+                },
+                _expanded[i]._pat);
+        }
+        std::string path;
+        t->roots(0, path, _roots);
+        std::sort(_roots.begin(), _roots.end());
+        _trie = std::move(t);
+    }
+
+    bool
+    pkgpattern::alternatives::match(pkgname const& name) const {
+        if (!_trie) {
+            return false;
+        }
+
+        // Only patterns whose prefix is a prefix of the PKGBASE can
+        // possibly match it.
+        auto const& nodes = _trie->nodes;
+        auto const any_matches =
+            [&](trie::node const& n) {
+                for (auto const i: n.patterns) {
+                    if (_expanded[i].match(name)) {
+                        return true;
+                    }
+                }
+                return false;
+            };
+
+        std::size_t cur = 0;
+        if (any_matches(nodes[cur])) {
+            return true;
+        }
+        for (char const c: name.base) {
+            auto it = nodes[cur].children.find(c);
+            if (it == nodes[cur].children.end()) {
+                return false;
+            }
+            cur = it->second;
+            if (any_matches(nodes[cur])) {
+                return true;
             }
         }
+        return false;
     }
 
     std::ostream&
@@ -240,6 +357,289 @@ namespace pkgxx {
         return out;
     }
 
+    /* A glob compiled into a nondeterministic finite automaton, simulated
+     * with bit-parallelism. State \c i means the subject has matched the
+     * first \c i tokens of the pattern, and a token is either a single
+     * character, a bracket expression, \c ?, or \c *. Consecutive stars
+     * are merged into one, so the automaton has at most as many states as
+     * the pattern has characters, and we only compile patterns short
+     * enough for the states to fit in a word.
+     */
+    struct pkgpattern::glob::program {
+        using state_set = std::uint64_t;
+        static constexpr std::size_t max_tokens = 63;
+
+        static std::shared_ptr<program const>
+        compile(std::string_view const& pat) {
+            auto prog = std::make_shared<program>();
+            std::size_t n = 0;
+
+            auto const add_token =
+                [&](std::bitset<256> const& chars) -> bool {
+                    if (n >= max_tokens) {
+                        return false;
+                    }
+                    for (std::size_t c = 0; c < 256; c++) {
+                        if (chars[c]) {
+                            prog->trans[c] |= state_set(1) << n;
+                        }
+                    }
+                    n++;
+                    return true;
+                };
+            auto const add_literal =
+                [&](char c) -> bool {
+                    if (c == '.') {
+                        prog->dot |= state_set(1) << n;
+                    }
+                    std::bitset<256> chars;
+                    chars.set(static_cast<unsigned char>(c));
+                    return add_token(chars);
+                };
+
+            for (std::size_t i = 0; i < pat.size(); i++) {
+                switch (pat[i]) {
+                case '*':
+                    if (n > 0 && (prog->star & (state_set(1) << (n - 1)))) {
+                        continue;
+                    }
+                    prog->star |= state_set(1) << n;
+                    if (!add_token(std::bitset<256>().set())) {
+                        return nullptr;
+                    }
+                    continue;
+
+                case '?':
+                    if (!add_token(std::bitset<256>().set())) {
+                        return nullptr;
+                    }
+                    continue;
+
+                case '\\':
+                    // A trailing backslash matches itself.
+                    if (i + 1 < pat.size()) {
+                        i++;
+                    }
+                    if (!add_literal(pat[i])) {
+                        return nullptr;
+                    }
+                    continue;
+
+                case '[': {
+                    std::bitset<256> chars;
+                    auto close = i;
+                    switch (parse_bracket(pat, close, chars)) {
+                    case bracket::ok:
+                        if (!add_token(chars)) {
+                            return nullptr;
+                        }
+                        i = close;
+                        continue;
+                    case bracket::unsupported:
+                        return nullptr;
+                    case bracket::unterminated:
+                        // An unterminated bracket matches itself.
+                        break;
+                    }
+                    [[fallthrough]];
+                }
+
+                default:
+                    if (!add_literal(pat[i])) {
+                        return nullptr;
+                    }
+                }
+            }
+            prog->accept = state_set(1) << n;
+            return prog;
+        }
+
+        [[gnu::pure]] bool
+        match(std::string_view const& subject) const noexcept {
+            state_set cur = closure(1);
+            for (std::size_t i = 0; i < subject.size(); i++) {
+                auto const c = static_cast<unsigned char>(subject[i]);
+
+                // The pattern matches everything before "-[0-9]", so it
+                // would match the whole with "-[0-9]*" appended.
+                if ((cur & accept) && c == '-' &&
+                    i + 1 < subject.size() && is_ascii_digit(subject[i + 1])) {
+                    return true;
+                }
+
+                // Only a literal period can match a leading one.
+                auto const movable = cur & (i == 0 && c == '.' ? dot : trans[c]);
+                cur = closure(((movable & ~star) << 1) | (movable & star));
+                if (cur == 0) {
+                    return false;
+                }
+            }
+            return (cur & accept) != 0;
+        }
+
+        // States that consume each byte.
+        std::array<state_set, 256> trans = {};
+        // States that are stars.
+        state_set star = 0;
+        // States that are literal periods.
+        state_set dot = 0;
+        state_set accept = 0;
+
+    private:
+        // A star may match nothing, so being before a star means being
+        // after it as well. Stars are never adjacent, so doing this once
+        // is enough.
+        state_set
+        closure(state_set s) const noexcept {
+            return s | ((s & star) << 1);
+        }
+
+        enum class bracket {
+            ok,
+            unterminated,
+            unsupported // Character classes and such
+        };
+
+        // Parse a bracket expression starting at pat[pos] into a set of
+        // characters. On success pos is moved to the closing bracket.
+        static bracket
+        parse_bracket(std::string_view const& pat, std::size_t& pos, std::bitset<256>& chars) {
+            auto i = pos + 1;
+            bool const negated = i < pat.size() && (pat[i] == '!' || pat[i] == '^');
+            if (negated) {
+                i++;
+            }
+            for (bool first = true; i < pat.size(); first = false) {
+                if (pat[i] == ']' && !first) {
+                    if (negated) {
+                        chars.flip();
+                    }
+                    pos = i;
+                    return bracket::ok;
+                }
+                if (pat[i] == '[' && i + 1 < pat.size() &&
+                    (pat[i + 1] == ':' || pat[i + 1] == '.' || pat[i + 1] == '=')) {
+                    return bracket::unsupported;
+                }
+                if (pat[i] == '\\' && i + 1 < pat.size()) {
+                    i++;
+                }
+                auto const lo = static_cast<unsigned char>(pat[i++]);
+                auto hi = lo;
+                if (i + 1 < pat.size() && pat[i] == '-' && pat[i + 1] != ']') {
+                    i++;
+                    if (pat[i] == '\\' && i + 1 < pat.size()) {
+                        i++;
+                    }
+                    hi = static_cast<unsigned char>(pat[i++]);
+                }
+                for (unsigned c = lo; c <= hi; c++) {
+                    chars.set(c);
+                }
+            }
+            return bracket::unterminated;
+        }
+    };
+
+    pkgpattern::glob::glob(std::string const& patstr)
+        : std::string(patstr)
+        , _prog(program::compile(patstr)) {}
+
+    bool
+    pkgpattern::glob::match(pkgname const& name) const {
+        // PKGNAMEs are short. Assemble one on the stack.
+        std::array<char, 256> buf;
+        if (name.base.size() + 1 < buf.size()) {
+            auto* const base_end = std::copy(name.base.begin(), name.base.end(), buf.begin());
+            *base_end = '-';
+            if (auto* const end = name.version.write(base_end + 1, buf.data() + buf.size());
+                end && _prog) {
+
+                return _prog->match(
+                    std::string_view(buf.data(), static_cast<std::size_t>(end - buf.data())));
+            }
+        }
+
+        auto const name_str = name.string();
+        if (fnmatch(c_str(), name_str.c_str(), FNM_PERIOD) == 0) {
+            return true;
+        }
+        else {
+            // The match may have failed only because the pattern lacks
+            // version.
+            auto const with_version = static_cast<std::string const&>(*this) + "-[0-9]*";
+            return fnmatch(with_version.c_str(), name_str.c_str(), FNM_PERIOD) == 0;
+        }
+    }
+
+    std::string_view
+    pkgpattern::glob::literal_prefix() const {
+        // Since globs may be specified with or without a version number,
+        // the literal may contain a hyphen that isn't a part of
+        // PKGBASE. So we must treat the last occuring hyphen in the
+        // literal as a meta character as well.
+        auto literal =
+            static_cast<std::string_view>(*this).substr(0, find_first_of("*?[]"));
+        return literal.substr(0, literal.rfind('-'));
+    }
+
+    bool
+    pkgpattern::version_range::match(pkgname const& name) const {
+        if (name.base != base) {
+            return false;
+        }
+
+        auto const& v = name.version;
+        auto const below_sup =
+            [&](auto const& sup) {
+                return std::visit(
+                    [&](auto const& ver) {
+                        if constexpr (std::is_same_v<le const&, decltype(ver)>) {
+                            return v <= ver;
+                        }
+                        else {
+                            static_assert(std::is_same_v<lt const&, decltype(ver)>);
+                            return v < ver;
+                        }
+                    },
+                    sup);
+            };
+        return std::visit(
+            [&](auto const& c) {
+                using T = std::decay_t<decltype(c)>;
+                if constexpr (std::is_same_v<T, le>) {
+                    return v <= c;
+                }
+                else if constexpr (std::is_same_v<T, lt>) {
+                    return v < c;
+                }
+                else if constexpr (std::is_same_v<T, ge>) {
+                    return v >= c.min && (!c.sup || below_sup(*c.sup));
+                }
+                else if constexpr (std::is_same_v<T, gt>) {
+                    return v > c.inf && (!c.sup || below_sup(*c.sup));
+                }
+                else if constexpr (std::is_same_v<T, eq>) {
+                    return v == c;
+                }
+                else {
+                    static_assert(std::is_same_v<T, ne>);
+                    return v != c;
+                }
+            },
+            cst);
+    }
+
+    bool
+    pkgpattern::match(pkgname const& name) const {
+        stats::pattern_matches.add();
+        return std::visit(
+            [&](auto const& pat) {
+                return pat.match(name);
+            },
+            _pat);
+    }
+
     pkgpattern::pkgpattern(std::string_view const& patstr) {
         if (patstr.find('{') != std::string_view::npos) {
             _pat = alternatives(patstr);
@@ -1,19 +1,22 @@
 #pragma once
 
-#include <fnmatch.h>
 #include <functional>
+#include <iterator>
+#include <memory>
 #include <optional>
 #include <ostream>
 #include <sstream>
 #include <string>
 #include <string_view>
 #include <type_traits>
+#include <utility>
 #include <variant>
 #include <vector>
 
 #include <pkgxx/hash.hxx>
 #include <pkgxx/ordered.hxx>
 #include <pkgxx/pkgname.hxx>
+#include <pkgxx/stats.hxx>
 #include <pkgxx/string_algo.hxx>
 
 namespace pkgxx {
@@ -28,21 +31,61 @@ namespace pkgxx {
                 return it->first;
             }
         }
+
+        // The first package of PKGBASE \c base in an ordered set \c s.
+        template <typename Set>
+        auto
+        base_begin(Set&& s, pkgbase const& base) {
+            return s.lower_bound(pkgname(base, pkgversion()));
+        }
+
+        // The first package past PKGBASE \c base in an ordered set \c
+        // s. base + '\0' is the smallest string greater than base.
+        template <typename Set>
+        auto
+        base_end(Set&& s, pkgbase const& base) {
+            return s.lower_bound(pkgname(base + '\0', pkgversion()));
+        }
+
+        // Turn a pair of iterators into an empty range if first is not
+        // before last, which happens when constraints can't be satisfied
+        // at all, e.g. >=3<2.
+        template <typename Set, typename Iterator>
+        std::pair<Iterator, Iterator>
+        ordered_range(Set&& s, Iterator first, Iterator last) {
+            if (first == s.end() ||
+                (last != s.end() && !(pkgname_at(first) < pkgname_at(last)))) {
+                return {s.end(), s.end()};
+            }
+            return {first, last};
+        }
     }
 
     /** A class that represents a package name pattern.
      */
     struct pkgpattern: equality_comparable<pkgpattern> {
-        /// csh-style alternatives, e.g. \c foo{bar,{baz,qux}}
+        /** csh-style alternatives, e.g. \c foo{bar,{baz,qux}}
+         *
+         * Alternatives are expanded into a set of distinct patterns
+         * without braces, whose literal prefixes are then organized in a
+         * trie. Searching a set of packages visits each package at most
+         * once no matter how many of the patterns match it.
+         */
         class alternatives {
         public:
             alternatives() {}
 
-            /// Parse a string representation of alternatives.
+            /** Parse a string representation of alternatives. Throws if
+             * braces are unbalanced, or if the pattern expands to more
+             * than \ref max_expansions patterns. */
             alternatives(std::string_view const& patstr);
 
-            /// The const iterator that iterates through alternative
-            /// patterns.
+            /// The maximum number of patterns a single set of
+            /// alternatives may expand to.
+            static constexpr std::size_t max_expansions = 4096;
+
+            /// The const iterator that iterates through distinct
+            /// alternative patterns, none of which contain braces.
             using const_iterator = std::vector<pkgpattern>::const_iterator;
 
             /// Return an iterator to the beginning of alternatives.
@@ -62,6 +105,10 @@ namespace pkgxx {
                 return _original;
             }
 
+            /// \sa pkgpattern::match
+            bool
+            match(pkgname const& name) const;
+
             /// \sa pkgpattern::for_each
             template <typename Set, typename Function>
             void
@@ -79,18 +126,24 @@ namespace pkgxx {
             }
 
         private:
+            struct trie;
+
             std::string _original;
             std::vector<pkgpattern> _expanded;
+            // Literal prefixes to search for, in ascending order. None of
+            // them is a prefix of another.
+            std::vector<std::string> _roots;
+            std::shared_ptr<trie const> _trie;
         };
 
         /// Version constraints, e.g. \c foo>=1.1<2
         struct version_range {
             /// \c <=
             struct le: public pkgversion {
-                /// \sa pkgpattern::for_each
-                template <typename Set, typename Function>
-                void
-                for_each(Set&& s, Function&& f, pkgbase const& base) const;
+                /// \sa version_range::bounds
+                template <typename Set>
+                auto
+                bounds(Set&& s, pkgbase const& base) const;
 
                 /// Print a version constraint to an output stream.
                 friend std::ostream&
@@ -100,10 +153,10 @@ namespace pkgxx {
             };
             /// \c <
             struct lt: public pkgversion {
-                /// \sa pkgpattern::for_each
-                template <typename Set, typename Function>
-                void
-                for_each(Set&& s, Function&& f, pkgbase const& base) const;
+                /// \sa version_range::bounds
+                template <typename Set>
+                auto
+                bounds(Set&& s, pkgbase const& base) const;
 
                 /// Print a version constraint to an output stream.
                 friend std::ostream&
@@ -113,10 +166,10 @@ namespace pkgxx {
             };
             /// \c >=
             struct ge {
-                /// \sa pkgpattern::for_each
-                template <typename Set, typename Function>
-                void
-                for_each(Set&& s, Function&& f, pkgbase const& base) const;
+                /// \sa version_range::bounds
+                template <typename Set>
+                auto
+                bounds(Set&& s, pkgbase const& base) const;
 
                 /// Print a version constraint to an output stream.
                 friend std::ostream&
@@ -137,10 +190,10 @@ namespace pkgxx {
             };
             /// \c >
             struct gt {
-                /// \sa pkgpattern::for_each
-                template <typename Set, typename Function>
-                void
-                for_each(Set&& s, Function&& f, pkgbase const& base) const;
+                /// \sa version_range::bounds
+                template <typename Set>
+                auto
+                bounds(Set&& s, pkgbase const& base) const;
 
                 /// Print a version constraint to an output stream.
                 friend std::ostream&
@@ -161,10 +214,10 @@ namespace pkgxx {
             };
             /// \c ==
             struct eq: public pkgversion {
-                /// \sa pkgpattern::for_each
-                template <typename Set, typename Function>
-                void
-                for_each(Set&& s, Function&& f, pkgbase const& base) const;
+                /// \sa version_range::bounds
+                template <typename Set>
+                auto
+                bounds(Set&& s, pkgbase const& base) const;
 
                 /// Print a version constraint to an output stream.
                 friend std::ostream&
@@ -174,10 +227,10 @@ namespace pkgxx {
             };
             /// \c !=
             struct ne: public pkgversion {
-                /// \sa pkgpattern::for_each
-                template <typename Set, typename Function>
-                void
-                for_each(Set&& s, Function&& f, pkgbase const& base) const;
+                /// \sa version_range::bounds
+                template <typename Set>
+                auto
+                bounds(Set&& s, pkgbase const& base) const;
 
                 /// Print a version constraint to an output stream.
                 friend std::ostream&
@@ -191,11 +244,32 @@ namespace pkgxx {
             /// Parse a string representation of version constraints.
             version_range(std::string_view const& patstr);
 
+            /// \sa pkgpattern::match
+            bool
+            match(pkgname const& name) const;
+
+            /** Return a pair of iterators delimiting packages in an
+             * ordered set \c s that may satisfy the constraints. Versions
+             * of a PKGBASE are sorted in the set, so this takes at most
+             * two binary searches. Every package in the range satisfies
+             * the constraints, except for the one excluded by \ref ne.
+             */
+            template <typename Set>
+            auto
+            bounds(Set&& s) const;
+
             /// \sa pkgpattern::for_each
             template <typename Set, typename Function>
             void
             for_each(Set&& s, Function&& f) const;
 
+            /** \sa pkgpattern::best. Unlike other patterns this doesn't
+             * need to look at every matching package, because the best
+             * one is always at the upper end of \ref bounds. */
+            template <typename Set>
+            auto
+            best(Set&& s) const;
+
             /// Print the version constraints to an output stream.
             friend std::ostream&
             operator<< (std::ostream& out, version_range const& ver);
@@ -210,14 +284,44 @@ namespace pkgxx {
 
             pkgbase base;   ///< The base name of package, e.g. \c foo
             constraint cst; ///< The version constraints, e.g. \c >=1.1<2
+
+        private:
+            // The upper end of the range of ge and gt.
+            template <typename Set, typename Sup>
+            static auto
+            sup_end(Set&& s, pkgbase const& base, std::optional<Sup> const& sup);
         };
 
         /// Glob pattern: foo-[0-9]*
         struct glob: std::string {
+            /// Parse a glob pattern and compile it into a matcher.
+            glob(std::string const& patstr);
+
+            /** Test if a package name matches the pattern, in the manner
+             * of fnmatch(3) with \c FNM_PERIOD. A pattern that fails to
+             * match only because it lacks a version, such as \c foo, is
+             * treated as if it were <tt>foo-[0-9]*</tt>.
+             */
+            bool
+            match(pkgname const& name) const;
+
+            /** Return the literal part of the glob that precedes any meta
+             * characters. Every PKGBASE the glob matches starts with
+             * it. */
+            std::string_view
+            literal_prefix() const;
+
             /// \sa pkgpattern::for_each
             template <typename Set, typename Function>
             void
             for_each(Set&& s, Function&& f) const;
+
+        private:
+            struct program;
+
+            // Null if the pattern is too complex to compile, in which
+            // case fnmatch(3) is used instead.
+            std::shared_ptr<program const> _prog;
         };
 
         /// Possible variants of package name patterns.
@@ -246,6 +350,10 @@ namespace pkgxx {
         pkgpattern(pattern_type&& pat)
             : _pat(std::move(pat)) {}
 
+        /// Test if a package name matches the pattern.
+        bool
+        match(pkgname const& name) const;
+
         /** Apply a function \c f to each package matching to the pattern
          * in a set \c s. The set is expected to either be \c
          * std::set<pkgname> or <tt>std::map<pkgname, (anything)></tt>. The
@@ -302,158 +410,153 @@ namespace pkgxx {
     template <typename Set, typename Function>
     void
     pkgpattern::alternatives::for_each(Set&& s, Function&& f) const {
-        for (pkgpattern const& pat: _expanded) {
-            pat.for_each(s, f);
+        // Roots are disjoint and sorted, so this visits every candidate
+        // exactly once in ascending order.
+        for (auto const& root: _roots) {
+            for (auto it = s.lower_bound(pkgname(pkgbase(root), pkgversion()));
+                 it != s.end() &&
+                     starts_with(detail::pkgname_at(it).base, root);
+                 it++) {
+
+                if (match(detail::pkgname_at(it))) {
+                    f(it);
+                }
+            }
         }
     }
 
-    template <typename Set, typename Function>
-    void
-    pkgpattern::version_range::le::for_each(Set&& s, Function&& f, pkgbase const& base) const {
-        for (auto it = s.lower_bound(pkgname(base, pkgversion()));
-             it != s.end() &&
-                 detail::pkgname_at(it).base == base &&
-                 detail::pkgname_at(it).version <= *this;
-             it++) {
-
-            f(it);
-        }
+    template <typename Set>
+    auto
+    pkgpattern::version_range::le::bounds(Set&& s, pkgbase const& base) const {
+        return detail::ordered_range(
+            s,
+            detail::base_begin(s, base),
+            s.upper_bound(pkgname(base, *this)));
     }
 
-    template <typename Set, typename Function>
-    void
-    pkgpattern::version_range::lt::for_each(Set&& s, Function&& f, pkgbase const& base) const {
-        for (auto it = s.lower_bound(pkgname(base, pkgversion()));
-             it != s.end() &&
-                 detail::pkgname_at(it).base == base &&
-                 detail::pkgname_at(it).version < *this;
-             it++) {
-
-            f(it);
-        }
+    template <typename Set>
+    auto
+    pkgpattern::version_range::lt::bounds(Set&& s, pkgbase const& base) const {
+        return detail::ordered_range(
+            s,
+            detail::base_begin(s, base),
+            s.lower_bound(pkgname(base, *this)));
     }
 
-    template <typename Set, typename Function>
-    void
-    pkgpattern::version_range::ge::for_each(Set&& s, Function&& f, pkgbase const& base) const {
-        for (auto it = s.lower_bound(pkgname(base, min));
-             it != s.end() &&
-                 detail::pkgname_at(it).base == base &&
-                 (!sup.has_value() ||
-                  std::visit(
-                      [&](auto const& ver) {
-                          if constexpr (std::is_same_v<le const&, decltype(ver)>) {
-                              return detail::pkgname_at(it).version <= ver;
-                          }
-                          else {
-                              static_assert(std::is_same_v<lt const&, decltype(ver)>);
-                              return detail::pkgname_at(it).version < ver;
-                          }
-                      },
-                      *sup));
-             it++) {
-
-            f(it);
+    template <typename Set, typename Sup>
+    auto
+    pkgpattern::version_range::sup_end(Set&& s, pkgbase const& base, std::optional<Sup> const& sup) {
+        if (!sup.has_value()) {
+            return detail::base_end(s, base);
         }
+        return std::visit(
+            [&](auto const& ver) {
+                if constexpr (std::is_same_v<le const&, decltype(ver)>) {
+                    return s.upper_bound(pkgname(base, ver));
+                }
+                else {
+                    static_assert(std::is_same_v<lt const&, decltype(ver)>);
+                    return s.lower_bound(pkgname(base, ver));
+                }
+            },
+            *sup);
     }
 
-    template <typename Set, typename Function>
-    void
-    pkgpattern::version_range::gt::for_each(Set&& s, Function&& f, pkgbase const& base) const {
-        for (auto it = s.upper_bound(pkgname(base, inf));
-             it != s.end() &&
-                 detail::pkgname_at(it).base == base &&
-                 (!sup.has_value() ||
-                  std::visit(
-                      [&](auto const& ver) {
-                          if constexpr (std::is_same_v<le const&, decltype(ver)>) {
-                              return detail::pkgname_at(it).version <= ver;
-                          }
-                          else {
-                              static_assert(std::is_same_v<lt const&, decltype(ver)>);
-                              return detail::pkgname_at(it).version < ver;
-                          }
-                      },
-                      *sup));
-             it++) {
+    template <typename Set>
+    auto
+    pkgpattern::version_range::ge::bounds(Set&& s, pkgbase const& base) const {
+        return detail::ordered_range(
+            s,
+            s.lower_bound(pkgname(base, min)),
+            sup_end(s, base, sup));
+    }
 
-            f(it);
-        }
+    template <typename Set>
+    auto
+    pkgpattern::version_range::gt::bounds(Set&& s, pkgbase const& base) const {
+        return detail::ordered_range(
+            s,
+            s.upper_bound(pkgname(base, inf)),
+            sup_end(s, base, sup));
     }
 
-    template <typename Set, typename Function>
-    void
-    pkgpattern::version_range::eq::for_each(Set&& s, Function&& f, pkgbase const& base) const {
+    template <typename Set>
+    auto
+    pkgpattern::version_range::eq::bounds(Set&& s, pkgbase const& base) const {
         // This is the best comparison! We only need to perform a search
         // just once!
-        if (auto it = s.find(pkgname(base, *this)); it != s.end()) {
-            f(it);
-        }
+        auto const it = s.find(pkgname(base, *this));
+        return std::make_pair(it, it == s.end() ? it : std::next(it));
+    }
+
+    template <typename Set>
+    auto
+    pkgpattern::version_range::ne::bounds(Set&& s, pkgbase const& base) const {
+        // The entire PKGBASE. The caller has to skip the version we
+        // exclude.
+        return detail::ordered_range(
+            s,
+            detail::base_begin(s, base),
+            detail::base_end(s, base));
+    }
+
+    template <typename Set>
+    auto
+    pkgpattern::version_range::bounds(Set&& s) const {
+        return std::visit(
+            [&](auto const& ver) {
+                return ver.bounds(s, base);
+            },
+            cst);
     }
 
     template <typename Set, typename Function>
     void
-    pkgpattern::version_range::ne::for_each(Set&& s, Function&& f, pkgbase const& base) const {
-        for (auto it = s.lower_bound(pkgname(base, pkgversion()));
-             it != s.end() &&
-                 detail::pkgname_at(it).base == base;
-             it++) {
-
-            if (detail::pkgname_at(it).version != *this) {
+    pkgpattern::version_range::for_each(Set&& s, Function&& f) const {
+        auto const* const excluded = std::get_if<ne>(&cst);
+        auto const [first, last] = bounds(s);
+        for (auto it = first; it != last; it++) {
+            if (!excluded || detail::pkgname_at(it).version != *excluded) {
                 f(it);
             }
         }
     }
 
-    template <typename Set, typename Function>
-    void
-    pkgpattern::version_range::for_each(Set&& s, Function&& f) const {
-        std::visit(
-            [&](auto const& ver) {
-                ver.for_each(s, f, base);
-            },
-            cst);
+    template <typename Set>
+    auto
+    pkgpattern::version_range::best(Set&& s) const {
+        auto const* const excluded = std::get_if<ne>(&cst);
+        auto const [first, last] = bounds(s);
+        for (auto it = last; it != first; ) {
+            it--;
+            if (!excluded || detail::pkgname_at(it).version != *excluded) {
+                return it;
+            }
+        }
+        return s.end();
     }
 
     template <typename Set, typename Function>
     void
     pkgpattern::glob::for_each(Set&& s, Function&& f) const {
-        // Extract a literal part of the glob that precedes any meta
-        // characters, and narrow down the search range with it. Much
+        // Narrow down the search range with the literal prefix. Much
         // better than just iterating the entire set.
-        //
-        // But since globs may be specified with or without a version
-        // number, it may contain a hyphen that isn't a part of PKGBASE. So
-        // we must treat the last occuring hyphen in the literal as a meta
-        // character as well.
-        auto literal =
-            static_cast<std::string_view>(*this).substr(0, find_first_of("*?[]"));
-        literal = literal.substr(0, literal.rfind('-'));
-
+        auto const literal = literal_prefix();
         for (auto it = s.lower_bound(pkgname(pkgbase(literal), pkgversion()));
              it != s.end() &&
                  starts_with(detail::pkgname_at(it).base, literal);
              it++) {
 
-            auto const name_str = detail::pkgname_at(it).string();
-            if (fnmatch(c_str(), name_str.c_str(), FNM_PERIOD) == 0) {
+            if (match(detail::pkgname_at(it))) {
                 f(it);
             }
-            else {
-                // The match may have failed only because the pattern lacks
-                // version.
-                auto const with_version =
-                    static_cast<std::string>(*this) + "-[0-9]*";
-                if (fnmatch(with_version.c_str(), name_str.c_str(), FNM_PERIOD) == 0) {
-                    f(it);
-                }
-            }
         }
     }
 
     template <typename Set, typename Function>
     void
     pkgpattern::for_each(Set&& s, Function&& f) const {
+        stats::pattern_matches.add();
         std::visit(
             [&](auto const& pat) {
                 pat.for_each(s, f);
@@ -464,6 +567,11 @@ namespace pkgxx {
     template <typename Set>
     auto
     pkgpattern::best(Set&& s) const {
+        if (auto const* const vr = std::get_if<version_range>(&_pat)) {
+            stats::pattern_matches.add();
+            return vr->best(s);
+        }
+
         std::optional<
             std::reference_wrapper<pkgname const>> current;
         for_each(
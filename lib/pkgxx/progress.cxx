@@ -0,0 +1,334 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <thread>
+#include <unistd.h>
+
+#include "progress.hxx"
+
+namespace {
+    using clock = std::chrono::steady_clock;
+
+    // Serializes writes to the terminal between renderers and
+    // clear_line().
+    std::mutex&
+    terminal_mutex() {
+        // Never destroyed, because renderers may still be running while
+        // the process exits. It is held across fork(2), so that the child
+        // never inherits it locked.
+        static auto* const mtx =
+            []() {
+                pthread_atfork(
+                    []() { terminal_mutex().lock();   },
+                    []() { terminal_mutex().unlock(); },
+                    []() { terminal_mutex().unlock(); });
+                return new std::mutex();
+            }();
+        return *mtx;
+    }
+
+    bool
+    stderr_is_tty() {
+        static bool const tty = isatty(STDERR_FILENO);
+        return tty;
+    }
+
+    std::size_t
+    terminal_width() {
+        winsize ws;
+        if (ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+            return ws.ws_col;
+        }
+        return 80;
+    }
+
+    void
+    write_all(std::string_view const& str) {
+        for (auto rest = str; !rest.empty(); ) {
+            ssize_t const n = write(STDERR_FILENO, rest.data(), rest.size());
+            if (n > 0) {
+                rest.remove_prefix(static_cast<std::size_t>(n));
+            }
+            else if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            else {
+                break;
+            }
+        }
+    }
+
+    std::string
+    format_duration(double secs) {
+        auto const total = static_cast<long long>(secs + 0.5);
+        char buf[32];
+        if (total >= 3600) {
+            std::snprintf(buf, sizeof(buf), "%lld:%02lld:%02lld", total / 3600, total / 60 % 60, total % 60);
+        }
+        else {
+            std::snprintf(buf, sizeof(buf), "%lld:%02lld", total / 60, total % 60);
+        }
+        return buf;
+    }
+
+    double
+    seconds(clock::duration d) {
+        return std::chrono::duration<double>(d).count();
+    }
+}
+
+namespace pkgxx {
+    /* A slot for an item in flight. Only the worker which has claimed it
+     * writes to it, and the renderer reads it optimistically, retrying
+     * if the sequence number has changed in the meantime. Everything is
+     * atomic so that neither of them ever blocks the other.
+     */
+    struct progress::slot {
+        static constexpr std::size_t max_name = 64;
+
+        std::atomic<bool> busy = false;
+        std::atomic<unsigned> seq = 0; // Odd while being written.
+        std::atomic<clock::rep> began = 0;
+        std::atomic<std::size_t> len = 0;
+        std::array<std::atomic<char>, max_name> name = {};
+
+        void
+        write(std::string_view const& str, clock::rep t) noexcept {
+            auto const s = seq.load(std::memory_order_relaxed);
+            seq.store(s + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            auto const n = std::min(str.size(), max_name);
+            for (std::size_t i = 0; i < n; i++) {
+                name[i].store(str[i], std::memory_order_relaxed);
+            }
+            len.store(n, std::memory_order_relaxed);
+            began.store(t, std::memory_order_relaxed);
+
+            seq.store(s + 2, std::memory_order_release);
+        }
+
+        // Return (name, began) unless the slot is idle or being
+        // written.
+        std::optional<std::pair<std::string, clock::rep>>
+        read() const {
+            for (int attempt = 0; attempt < 4; attempt++) {
+                auto const s1 = seq.load(std::memory_order_acquire);
+                if (s1 % 2 != 0) {
+                    continue;
+                }
+                std::string str(len.load(std::memory_order_relaxed), '\0');
+                for (std::size_t i = 0; i < str.size(); i++) {
+                    str[i] = name[i].load(std::memory_order_relaxed);
+                }
+                auto const t = began.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (seq.load(std::memory_order_relaxed) == s1) {
+                    if (t == 0) {
+                        return std::nullopt;
+                    }
+                    return std::make_pair(std::move(str), t);
+                }
+            }
+            return std::nullopt;
+        }
+    };
+
+    struct progress::state {
+        static constexpr std::size_t num_slots = 256;
+
+        state(std::string const& title_, std::size_t total_)
+            : title(title_)
+            , started(clock::now())
+            , total(total_)
+            , done(0)
+            , tty(stderr_is_tty())
+            , stopping(false)
+            , printed(false) {
+
+            renderer = std::thread(&state::render_main, this);
+        }
+
+        ~state() {
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                stopping = true;
+            }
+            wake.notify_one();
+            renderer.join();
+
+            // Leave a final line if anything has been shown, so that the
+            // user can see where the time has gone.
+            if (printed) {
+                std::lock_guard<std::mutex> lk(terminal_mutex());
+                auto const elapsed = seconds(clock::now() - started);
+                auto const n = done.load(std::memory_order_relaxed);
+                char buf[64];
+                std::snprintf(buf, sizeof(buf), ": %zu done in %s (%.1f/s)\n",
+                              n, format_duration(elapsed).c_str(),
+                              elapsed > 0 ? static_cast<double>(n) / elapsed : 0.0);
+                write_all((tty ? "\r\x1b[K" : "") + title + buf);
+                _line_shown.store(false, std::memory_order_relaxed);
+            }
+        }
+
+        slot*
+        claim_slot() noexcept {
+            // Start looking from a place that differs between threads, so
+            // that they rarely race for the same slot.
+            auto const start = std::hash<std::thread::id>()(std::this_thread::get_id());
+            for (std::size_t i = 0; i < num_slots; i++) {
+                auto& s = slots[(start + i) % num_slots];
+                if (!s.busy.exchange(true, std::memory_order_acquire)) {
+                    return &s;
+                }
+            }
+            return nullptr;
+        }
+
+        std::string
+        render() const {
+            auto const now = clock::now();
+            auto const elapsed = seconds(now - started);
+            auto const n = done.load(std::memory_order_relaxed);
+            auto const t = total.load(std::memory_order_relaxed);
+            auto const rate = elapsed > 0 ? static_cast<double>(n) / elapsed : 0.0;
+
+            char buf[128];
+            std::string line = title + ": ";
+            if (t > 0) {
+                std::snprintf(buf, sizeof(buf), "%zu/%zu (%zu%%), %.1f/s",
+                              n, t, std::min<std::size_t>(100, n * 100 / t), rate);
+                line += buf;
+                if (n > 0 && n < t) {
+                    line += ", ETA " + format_duration(static_cast<double>(t - n) / rate);
+                }
+            }
+            else {
+                std::snprintf(buf, sizeof(buf), "%zu done, %.1f/s", n, rate);
+                line += buf;
+            }
+
+            std::optional<std::pair<std::string, clock::rep>> slowest;
+            for (auto const& s: slots) {
+                if (s.busy.load(std::memory_order_relaxed)) {
+                    if (auto cur = s.read(); cur && (!slowest || cur->second < slowest->second)) {
+                        slowest = std::move(cur);
+                    }
+                }
+            }
+            if (slowest) {
+                auto const d = now - clock::time_point(clock::duration(slowest->second));
+                std::snprintf(buf, sizeof(buf), " (%.1fs)", seconds(d));
+                line += ", slowest: " + slowest->first + buf;
+            }
+            return line;
+        }
+
+        void
+        render_main() {
+            // Redraw the status line often enough to look alive, but
+            // don't flood a log file.
+            auto const interval = tty
+                ? std::chrono::milliseconds(200)
+                : std::chrono::milliseconds(10000);
+            // Phases that finish quickly aren't worth reporting.
+            auto const quiet = tty
+                ? std::chrono::milliseconds(1000)
+                : interval;
+
+            std::unique_lock<std::mutex> lk(mtx);
+            while (!wake.wait_for(lk, interval, [this]() { return stopping; })) {
+                if (clock::now() - started < quiet) {
+                    continue;
+                }
+                auto line = render();
+
+                std::lock_guard<std::mutex> tlk(terminal_mutex());
+                if (tty) {
+                    auto const width = terminal_width();
+                    if (line.size() >= width) {
+                        line.resize(width - 1);
+                    }
+                    // Don't let output buffered in stdout land after
+                    // the status line.
+                    std::fflush(stdout);
+                    write_all("\r\x1b[K" + line);
+                    _line_shown.store(true, std::memory_order_relaxed);
+                }
+                else {
+                    write_all(line + '\n');
+                }
+                printed = true;
+            }
+        }
+
+        std::string const title;
+        clock::time_point const started;
+        std::atomic<std::size_t> total;
+        std::atomic<std::size_t> done;
+        std::array<slot, num_slots> slots;
+        bool const tty;
+
+        std::mutex mtx;
+        std::condition_variable wake;
+        bool stopping;
+        bool printed; // Only touched by the renderer until it's joined.
+        std::thread renderer;
+    };
+
+    void
+    progress::enable() {
+        _enabled.store(true, std::memory_order_relaxed);
+    }
+
+    void
+    progress::clear_line_slow() {
+        std::lock_guard<std::mutex> lk(terminal_mutex());
+        if (_line_shown.exchange(false, std::memory_order_relaxed)) {
+            write_all("\r\x1b[K");
+        }
+    }
+
+    progress::progress(std::string const& title, std::size_t total) {
+        if (enabled()) {
+            _state = std::make_unique<state>(title, total);
+        }
+    }
+
+    progress::~progress() = default;
+
+    void
+    progress::add_total(std::size_t n) noexcept {
+        if (_state) {
+            _state->total.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    void
+    progress::item::begin(std::string&& name) {
+        _slot = _state->claim_slot();
+        if (_slot) {
+            _slot->write(name, clock::now().time_since_epoch().count());
+        }
+    }
+
+    progress::item::~item() {
+        if (_state) {
+            if (_slot) {
+                _slot->write("", 0);
+                _slot->busy.store(false, std::memory_order_release);
+            }
+            _state->done.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
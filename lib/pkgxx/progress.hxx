@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <sstream>
+#include <string>
+
+namespace pkgxx {
+    /** A reporter of the progress of a long phase of work, such as
+     * scanning installed packages.
+     *
+     * Reporting is off until \ref progress::enable is called. While it's
+     * on, a background thread renders the number of items done and the
+     * total, the rate per second, the estimated time to completion, and
+     * the item that has been in flight for the longest time. It is
+     * rendered on a status line if stderr is a terminal, or as a line
+     * every 10 seconds otherwise.
+     *
+     * Workers only touch atomic counters and a slot of their own, so
+     * they never wait for each other or for the renderer. While
+     * reporting is off, a \ref progress and its items cost next to
+     * nothing.
+     */
+    struct progress {
+    private:
+        struct state;
+        struct slot;
+
+    public:
+        /** Turn on reporting of progress to stderr. */
+        static void
+        enable();
+
+        /// Return \c true if progress is reported.
+        static bool
+        enabled() noexcept {
+            return _enabled.load(std::memory_order_relaxed);
+        }
+
+        /** Erase the status line from the terminal if it's shown, so that
+         * it doesn't get mixed with other output. It is drawn again on the
+         * next update. Call this before writing anything to the
+         * terminal. */
+        static void
+        clear_line() {
+            if (_line_shown.load(std::memory_order_relaxed)) {
+                clear_line_slow();
+            }
+        }
+
+        /** Begin reporting the progress of a phase of work named \c
+         * title, having \c total items. The total may be increased
+         * later. */
+        progress(std::string const& title, std::size_t total = 0);
+
+        progress(progress const&) = delete;
+
+        /** End the phase and stop reporting it. */
+        ~progress();
+
+        /// Increase the total number of items by \c n.
+        void
+        add_total(std::size_t n) noexcept;
+
+        /** An RAII object representing an item being worked on. The item
+         * is done when the object is destroyed.
+         */
+        struct item {
+            /** Begin working on an item. \c name is anything that can be
+             * written to \c std::ostream, and is formatted only if
+             * reporting is on. */
+            template <typename Name>
+            item(progress& p, Name const& name)
+                : _state(p._state.get())
+                , _slot(nullptr) {
+
+                if (_state) {
+                    std::ostringstream ss;
+                    ss << name;
+                    begin(ss.str());
+                }
+            }
+
+            item(item const&) = delete;
+
+            ~item();
+
+        private:
+            void
+            begin(std::string&& name);
+
+            state* _state;
+            slot* _slot;
+        };
+
+    private:
+        static void
+        clear_line_slow();
+
+        static inline std::atomic<bool> _enabled    = false;
+        static inline std::atomic<bool> _line_shown = false;
+
+        // nullptr if reporting was off when the phase began.
+        std::unique_ptr<state> _state;
+    };
+}
@@ -0,0 +1,390 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+#include "reactor.hxx"
+#include "spawn.hxx"
+#include "stats.hxx"
+
+namespace {
+    void
+    set_nonblocking(int fd) {
+        int const flags = fcntl(fd, F_GETFL);
+        if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            throw std::system_error(errno, std::generic_category(), "fcntl");
+        }
+    }
+
+    // Consume the SIGPIPE a failed write has raised on this thread, if
+    // any. The reactor thread blocks it, so it is left pending.
+    void
+    discard_sigpipe() {
+        sigset_t pending;
+        sigpending(&pending);
+        if (sigismember(&pending, SIGPIPE)) {
+            sigset_t set;
+            sigemptyset(&set);
+            sigaddset(&set, SIGPIPE);
+            int sig;
+            sigwait(&set, &sig);
+        }
+    }
+
+    // Guards the creation of the reactor. It is held across fork(2), so
+    // that the child never inherits it locked.
+    std::mutex&
+    instance_mutex() {
+        static auto* const mtx = new std::mutex();
+        return *mtx;
+    }
+
+    std::atomic<pkgxx::reactor*> current_instance = nullptr;
+}
+
+namespace pkgxx {
+    reactor&
+    reactor::instance() {
+        // Never destroyed, because the thread never terminates. A process
+        // forked from this one has no such thread though, so it starts a
+        // reactor of its own. Descriptors watched by the old one are
+        // left as they are.
+        if (auto* r = current_instance.load(std::memory_order_acquire); r) {
+            return *r;
+        }
+
+        static std::once_flag once;
+        std::call_once(
+            once,
+            []() {
+                pthread_atfork(
+                    []() { instance_mutex().lock();   },
+                    []() { instance_mutex().unlock(); },
+                    []() {
+                        instance_mutex().unlock();
+                        current_instance.store(nullptr, std::memory_order_relaxed);
+                    });
+            });
+
+        std::lock_guard<std::mutex> lk(instance_mutex());
+        auto* r = current_instance.load(std::memory_order_relaxed);
+        if (!r) {
+            r = new reactor();
+            current_instance.store(r, std::memory_order_release);
+        }
+        return *r;
+    }
+
+    reactor::reactor() {
+        auto const fds = cpipe(true);
+        _wake_r = fds[0];
+        _wake_w = fds[1];
+        set_nonblocking(_wake_r);
+        set_nonblocking(_wake_w);
+
+        _thr = std::thread(&reactor::thread_main, this);
+        _thr.detach();
+    }
+
+    void
+    reactor::watch(int fd, data_callback&& on_data, done_callback&& on_done) {
+        set_nonblocking(fd);
+        {
+            std::lock_guard<std::mutex> lk(_mtx);
+            _watchers.insert_or_assign(fd, watcher {std::move(on_data), std::move(on_done)});
+        }
+        wake();
+    }
+
+    std::future<std::string>
+    reactor::slurp(int fd) {
+        auto buf     = std::make_shared<std::string>();
+        auto promise = std::make_shared<std::promise<std::string>>();
+        auto future  = promise->get_future();
+        watch(
+            fd,
+            [buf](auto const& chunk) {
+                buf->append(chunk);
+            },
+            [buf, promise](auto ex) {
+                if (ex) {
+                    promise->set_exception(ex);
+                }
+                else {
+                    promise->set_value(std::move(*buf));
+                }
+            });
+        return future;
+    }
+
+    void
+    reactor::send(int fd, std::string_view const& data) {
+        {
+            std::lock_guard<std::mutex> lk(_mtx);
+            auto [it, inserted] = _senders.try_emplace(fd);
+            if (inserted) {
+                try {
+                    set_nonblocking(fd);
+                }
+                catch (...) {
+                    _senders.erase(it);
+                    throw;
+                }
+            }
+            if (it->second.broken || data.empty()) {
+                return;
+            }
+            it->second.pending.append(data);
+        }
+        wake();
+    }
+
+    void
+    reactor::close_after_sent(int fd) {
+        {
+            std::lock_guard<std::mutex> lk(_mtx);
+            auto it = _senders.find(fd);
+            if (it == _senders.end()) {
+                close(fd);
+                return;
+            }
+            else if (it->second.pending.empty()) {
+                _senders.erase(it);
+                close(fd);
+                return;
+            }
+            it->second.closing = true;
+        }
+        wake();
+    }
+
+    void
+    reactor::after(std::chrono::steady_clock::duration delay, std::function<void ()>&& f) {
+        {
+            std::lock_guard<std::mutex> lk(_mtx);
+            _timers.emplace(std::chrono::steady_clock::now() + delay, std::move(f));
+        }
+        wake();
+    }
+
+    void
+    reactor::wake() {
+        // If the pipe is full the reactor is going to wake up anyway.
+        char const c = 0;
+        while (write(_wake_w, &c, 1) == -1 && errno == EINTR);
+    }
+
+    void
+    reactor::thread_main() {
+        // Writing to a pipe whose reader has gone should fail with EPIPE
+        // instead of killing the process.
+        {
+            sigset_t set;
+            sigemptyset(&set);
+            sigaddset(&set, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &set, nullptr);
+        }
+
+        std::array<char, 65536> buf;
+        std::vector<pollfd> pfds;
+        std::vector<std::function<void ()>> due;
+
+        while (true) {
+            pfds.clear();
+            pfds.push_back(pollfd {_wake_r, POLLIN, 0});
+            int timeout = -1;
+            {
+                std::lock_guard<std::mutex> lk(_mtx);
+                for (auto const& [fd, _w]: _watchers) {
+                    pfds.push_back(pollfd {fd, POLLIN, 0});
+                }
+                for (auto const& [fd, s]: _senders) {
+                    if (!s.pending.empty()) {
+                        pfds.push_back(pollfd {fd, POLLOUT, 0});
+                    }
+                }
+                if (!_timers.empty()) {
+                    // Round up so that we don't wake up just before the
+                    // deadline and spin.
+                    auto const left = _timers.begin()->first - std::chrono::steady_clock::now();
+                    auto const ms   = std::chrono::ceil<std::chrono::milliseconds>(left).count();
+                    timeout = static_cast<int>(std::clamp<decltype(ms)>(ms, 0, 60 * 1000));
+                }
+            }
+
+            if (poll(pfds.data(), static_cast<nfds_t>(pfds.size()), timeout) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // Throwing from here would terminate the process. Fail
+                // every watcher we polled and give up on every sender
+                // instead, and keep serving new ones.
+                auto const ex = std::make_exception_ptr(
+                    std::system_error(errno, std::generic_category(), "poll"));
+                for (auto it = pfds.begin() + 1; it != pfds.end(); it++) {
+                    if (it->events == POLLIN) {
+                        finish(it->fd, ex);
+                    }
+                    else {
+                        std::lock_guard<std::mutex> lk(_mtx);
+                        if (auto s = _senders.find(it->fd); s != _senders.end()) {
+                            s->second.broken = true;
+                            s->second.pending.clear();
+                            if (s->second.closing) {
+                                close(it->fd);
+                                _senders.erase(s);
+                            }
+                        }
+                    }
+                }
+                continue;
+            }
+
+            if (pfds[0].revents != 0) {
+                while (read(_wake_r, buf.data(), buf.size()) > 0);
+            }
+
+            {
+                std::lock_guard<std::mutex> lk(_mtx);
+                auto const now = std::chrono::steady_clock::now();
+                auto const end = _timers.upper_bound(now);
+                for (auto it = _timers.begin(); it != end; it++) {
+                    due.push_back(std::move(it->second));
+                }
+                _timers.erase(_timers.begin(), end);
+            }
+            for (auto& f: due) {
+                try {
+                    f();
+                }
+                catch (...) {
+                    // Nobody could catch it on this thread.
+                }
+            }
+            due.clear();
+
+            for (auto it = pfds.begin() + 1; it != pfds.end(); it++) {
+                if (it->revents == 0) {
+                    continue;
+                }
+                else if (it->events == POLLOUT) {
+                    flush(it->fd);
+                    continue;
+                }
+
+                // Nobody but us removes watchers, so the reference stays
+                // valid without holding the lock.
+                watcher* w;
+                {
+                    std::lock_guard<std::mutex> lk(_mtx);
+                    auto found = _watchers.find(it->fd);
+                    if (found == _watchers.end()) {
+                        continue;
+                    }
+                    w = &found->second;
+                }
+
+                // Drain whatever is available now, but don't let a single
+                // chatty child starve the others.
+                std::exception_ptr ex;
+                bool done = false;
+                try {
+                    for (int i = 0; i < 16; i++) {
+                        ssize_t const n_read = read(it->fd, buf.data(), buf.size());
+                        if (n_read > 0) {
+                            stats::pipe_bytes_read.add(static_cast<std::uint64_t>(n_read));
+                            w->on_data(std::string_view(buf.data(), static_cast<std::size_t>(n_read)));
+                        }
+                        else if (n_read == 0) {
+                            done = true;
+                            break;
+                        }
+                        else if (errno == EINTR) {
+                            continue;
+                        }
+                        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                            break;
+                        }
+                        else {
+                            throw std::system_error(errno, std::generic_category(), "read");
+                        }
+                    }
+                }
+                catch (...) {
+                    ex   = std::current_exception();
+                    done = true;
+                }
+
+                if (done) {
+                    finish(it->fd, ex);
+                }
+            }
+        }
+    }
+
+    void
+    reactor::flush(int fd) {
+        std::lock_guard<std::mutex> lk(_mtx);
+        auto it = _senders.find(fd);
+        if (it == _senders.end()) {
+            return;
+        }
+
+        auto& s = it->second;
+        while (!s.pending.empty()) {
+            ssize_t const n_written = write(fd, s.pending.data(), s.pending.size());
+            if (n_written >= 0) {
+                s.pending.erase(0, static_cast<std::size_t>(n_written));
+            }
+            else if (errno == EINTR) {
+                continue;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            else {
+                // Most likely EPIPE. There is nobody to report it to, and
+                // a real process would have got the same.
+                if (errno == EPIPE) {
+                    discard_sigpipe();
+                }
+                s.broken = true;
+                s.pending.clear();
+            }
+        }
+        if (s.pending.empty() && s.closing) {
+            _senders.erase(it);
+            close(fd);
+        }
+    }
+
+    void
+    reactor::finish(int fd, std::exception_ptr const& ex) noexcept {
+        done_callback on_done;
+        {
+            std::lock_guard<std::mutex> lk(_mtx);
+            auto w = _watchers.find(fd);
+            if (w == _watchers.end()) {
+                return;
+            }
+            on_done = std::move(w->second.on_done);
+            _watchers.erase(w);
+        }
+        close(fd);
+        try {
+            on_done(ex);
+        }
+        catch (...) {
+            // Nobody could catch it on this thread.
+        }
+    }
+}
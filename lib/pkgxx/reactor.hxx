@@ -0,0 +1,114 @@
+#pragma once
+
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace pkgxx {
+    /** A single thread multiplexing reads from and writes to many file
+     * descriptors, typically pipes connected to standard outputs of
+     * child processes. Reading output of hundreds of children then costs
+     * one thread instead of one per child.
+     *
+     * The reactor is started on first use and lives until the process
+     * exits. A child forked while it's running starts a new one on first
+     * use.
+     */
+    struct reactor {
+        /** Called with each chunk of data read from a file
+         * descriptor. Chunks are not aligned to lines. */
+        using data_callback = std::function<void (std::string_view const& chunk)>;
+
+        /** Called exactly once after the last chunk, either with a null
+         * \c exception_ptr on EOF or with the error that occured while
+         * reading or polling. An exception thrown by \c on_data is
+         * reported this way too. An exception thrown by this callback is
+         * discarded. */
+        using done_callback = std::function<void (std::exception_ptr ex)>;
+
+        /// Obtain the process-wide reactor.
+        static reactor&
+        instance();
+
+        /** Start reading from a file descriptor. The reactor takes the
+         * ownership of \c fd and closes it after calling \c on_done. Both
+         * callbacks run on the reactor thread, so they must not block.
+         */
+        void
+        watch(int fd, data_callback&& on_data, done_callback&& on_done);
+
+        /** Read everything from a file descriptor until EOF, and make it
+         * available through a future. The reactor takes the ownership of
+         * \c fd. */
+        std::future<std::string>
+        slurp(int fd);
+
+        /** Write data to a file descriptor as it becomes writable,
+         * without blocking the caller. The reactor takes the ownership
+         * of \c fd on the first call for it, and later calls append to
+         * what is still pending. If the reader goes away, pending and
+         * later data are discarded. */
+        void
+        send(int fd, std::string_view const& data);
+
+        /** Close a file descriptor given to \ref send once everything
+         * sent to it has been written. A descriptor that was never given
+         * to \ref send is closed immediately. */
+        void
+        close_after_sent(int fd);
+
+        /** Call \c f on the reactor thread once \c delay has
+         * elapsed. Like the other callbacks it must not block, and an
+         * exception thrown by it is discarded. */
+        void
+        after(std::chrono::steady_clock::duration delay, std::function<void ()>&& f);
+
+    private:
+        reactor();
+
+        void
+        wake();
+
+        // Stop watching fd, close it, and call its on_done with ex.
+        void
+        finish(int fd, std::exception_ptr const& ex) noexcept;
+
+        [[noreturn]] void
+        thread_main();
+
+        // Write out what is pending for fd, and close it if it's done.
+        void
+        flush(int fd);
+
+        struct watcher {
+            data_callback on_data;
+            done_callback on_done;
+        };
+
+        struct sender {
+            std::string pending;
+            bool closing = false;
+            bool broken  = false;
+        };
+
+        std::mutex _mtx;
+        // File descriptors being watched. Guarded by _mtx.
+        std::map<int, watcher> _watchers;
+        // File descriptors being written to. Guarded by _mtx.
+        std::map<int, sender> _senders;
+        // Callbacks to run at given times. Guarded by _mtx.
+        std::multimap<std::chrono::steady_clock::time_point, std::function<void ()>> _timers;
+
+        // A pipe to interrupt poll(2) when _watchers changes.
+        int _wake_r;
+        int _wake_w;
+
+        std::thread _thr;
+    };
+}
@@ -3,10 +3,12 @@
 #include <array>
 #include <cassert>
 #include <cerrno>
+#include <climits>
 #include <exception>
 #include <fcntl.h>
 #include <iterator>
 #include <memory>
+#include <mutex>
 #if defined(HAVE_SPAWN_H)
 #  include <spawn.h>
 #endif
@@ -25,7 +27,10 @@
       )                                                       \
     ) &&                                                      \
     defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSE) &&        \
+    defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP) && \
     defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDDUP2)
+// Without posix_spawn_file_actions_addclosefrom_np() children would
+// inherit every descriptor not marked FD_CLOEXEC, so we fork instead.
 #  define USE_POSIX_SPAWN 1
 #endif
 
@@ -41,6 +46,17 @@ namespace pkgxx {
     std::array<int, 2>
     cpipe(bool set_cloexec) {
         std::array<int, 2> fds;
+#if defined(HAVE_PIPE2)
+        // Setting FD_CLOEXEC atomically matters, because other threads may
+        // be spawning processes concurrently. They would otherwise leak
+        // our pipe into their children.
+        if (set_cloexec) {
+            if (pipe2(fds.data(), O_CLOEXEC) != 0) {
+                throw std::system_error(errno, std::generic_category(), "pipe2");
+            }
+            return fds;
+        }
+#endif
         if (pipe(fds.data()) != 0) {
             throw std::system_error(errno, std::generic_category(), "pipe");
         }
@@ -73,6 +89,37 @@ namespace pkgxx {
         return env_map;
     }
 
+    envp_block::envp_block(std::map<std::string, std::string> const& env) {
+        _strings.reserve(env.size());
+        _ptrs.reserve(env.size() + 1);
+        for (auto const& [name, value]: env) {
+            _strings.push_back(name + '=' + value);
+            _ptrs.push_back(_strings.back().c_str());
+            _bytes += _strings.back().size() + 1 + sizeof(char*);
+        }
+        _ptrs.push_back(nullptr);
+    }
+
+    namespace {
+        std::mutex environ_mtx;
+        std::shared_ptr<envp_block const> environ_snap;
+    }
+
+    std::shared_ptr<envp_block const>
+    environ_snapshot() {
+        std::lock_guard<std::mutex> lk(environ_mtx);
+        if (!environ_snap) {
+            environ_snap = std::make_shared<envp_block const>(cenviron());
+        }
+        return environ_snap;
+    }
+
+    void
+    refresh_environ_snapshot() {
+        std::lock_guard<std::mutex> lk(environ_mtx);
+        environ_snap.reset();
+    }
+
     namespace detail {
         /** A thin wrapper of posix_spawn_file_actions_t */
 #if defined(USE_POSIX_SPAWN)
@@ -139,10 +186,59 @@ namespace pkgxx {
                 return *this;
             }
 
+            file_actions&
+            close_from(int lowfd) {
+                if (posix_spawn_file_actions_addclosefrom_np(&_fas, lowfd) != 0) {
+                    throw std::system_error(
+                        errno, std::generic_category(), "posix_spawn_file_actions_addclosefrom_np");
+                }
+                return *this;
+            }
+
         private:
             posix_spawn_file_actions_t _fas;
         };
 
+        /** A thin wrapper of posix_spawnattr_t. It's only initialized
+         * when there's a flag worth setting. */
+        struct spawn_attr {
+            spawn_attr() {
+#  if defined(POSIX_SPAWN_USEVFORK)
+                if (posix_spawnattr_init(&_attr) != 0) {
+                    throw std::system_error(
+                        errno, std::generic_category(), "posix_spawnattr_init");
+                }
+                if (posix_spawnattr_setflags(&_attr, POSIX_SPAWN_USEVFORK) != 0) {
+                    posix_spawnattr_destroy(&_attr);
+                    throw std::system_error(
+                        errno, std::generic_category(), "posix_spawnattr_setflags");
+                }
+#  endif
+            }
+
+            spawn_attr(spawn_attr const&) = delete;
+
+            ~spawn_attr() {
+#  if defined(POSIX_SPAWN_USEVFORK)
+                posix_spawnattr_destroy(&_attr);
+#  endif
+            }
+
+            posix_spawnattr_t const*
+            c_ptr() const noexcept {
+#  if defined(POSIX_SPAWN_USEVFORK)
+                return &_attr;
+#  else
+                return nullptr;
+#  endif
+            }
+
+        private:
+#  if defined(POSIX_SPAWN_USEVFORK)
+            posix_spawnattr_t _attr;
+#  endif
+        };
+
 #else // defined(USE_POSIX_SPAWN)
         struct file_actions {
             template <typename Path>
@@ -166,10 +262,19 @@ namespace pkgxx {
                 return *this;
             }
 
+            file_actions&
+            close_from(int lowfd) {
+                _fas.push_back(std::make_unique<fa_closefrom>(lowfd));
+                return *this;
+            }
+
+            // Perform the actions in the child. close_from() leaves
+            // keep_fd open, which is where the child reports errors to
+            // the parent.
             void
-            operator() () const {
+            operator() (int keep_fd) const {
                 for (std::unique_ptr<file_action> const& fa: _fas) {
-                    (*fa)();
+                    (*fa)(keep_fd);
                 }
             }
 
@@ -178,7 +283,7 @@ namespace pkgxx {
                 virtual ~file_action() = default;
 
                 virtual void
-                operator() () const = 0;
+                operator() (int keep_fd) const = 0;
             };
 
             struct fa_chdir: file_action {
@@ -187,7 +292,7 @@ namespace pkgxx {
                     : _dir(std::forward<Path>(dir)) {}
 
                 virtual void
-                operator() () const override {
+                operator() (int) const override {
                     if (::chdir(_dir.c_str()) != 0) {
                         throw std::system_error(
                             errno, std::generic_category(), "chdir");
@@ -203,7 +308,7 @@ namespace pkgxx {
                     : _fd(fd) {}
 
                 virtual void
-                operator() () const override {
+                operator() (int) const override {
                     if (::close(_fd) != 0) {
                         throw std::system_error(
                             errno, std::generic_category(), "close");
@@ -214,13 +319,64 @@ namespace pkgxx {
                 int _fd;
             };
 
+            struct fa_closefrom: file_action {
+                fa_closefrom(int lowfd)
+                    : _lowfd(lowfd) {
+#  if !defined(HAVE_CLOSEFROM)
+                    // Looked up here, because sysconf(3) isn't safe to
+                    // call after vfork(2).
+                    long const open_max = sysconf(_SC_OPEN_MAX);
+                    _open_max = open_max > 0 && open_max < INT_MAX
+                        ? static_cast<int>(open_max)
+                        : _POSIX_OPEN_MAX;
+#  endif
+                }
+
+                virtual void
+                operator() (int keep_fd) const override {
+                    if (keep_fd >= _lowfd) {
+                        for (int fd = _lowfd; fd < keep_fd; fd++) {
+                            ::close(fd);
+                        }
+                        close_all_from(keep_fd + 1);
+                    }
+                    else {
+                        close_all_from(_lowfd);
+                    }
+                }
+
+            private:
+                void
+                close_all_from(int lowfd) const noexcept {
+#  if defined(HAVE_CLOSEFROM)
+                    closefrom(lowfd);
+#  else
+#    if defined(HAVE_CLOSE_RANGE)
+                    if (close_range(static_cast<unsigned>(lowfd), ~0U, 0) == 0) {
+                        return;
+                    }
+#    endif
+                    // The kernel may not have close_range(2), or the libc
+                    // may have neither. Close them one by one then.
+                    for (int fd = lowfd; fd < _open_max; fd++) {
+                        ::close(fd);
+                    }
+#  endif
+                }
+
+                int _lowfd;
+#  if !defined(HAVE_CLOSEFROM)
+                int _open_max;
+#  endif
+            };
+
             struct fa_dup2: file_action {
                 fa_dup2(int from, int to)
                     : _from(from)
                     , _to(to) {}
 
                 virtual void
-                operator() () const override {
+                operator() (int) const override {
                     if (::dup2(_from, _to) < 0) {
                         throw std::system_error(
                             errno, std::generic_category(), "dup2");
@@ -262,27 +418,15 @@ namespace pkgxx {
             return *this;
         }
 
+        spawn_base&
+        spawn_base::close_fds_from(int lowfd) {
+            fas().close_from(lowfd);
+            return *this;
+        }
+
         pid_t
         spawn_base::operator() () const {
-            std::vector<std::string> envp;
-#if __cplusplus >= 202002L && __cpp_lib_optional >= 202110L
-            for (auto const& [name, value]: *_env.or_else([] { return cenviron(); })) {
-                envp.emplace_back(name + "=" + value);
-            }
-#else
-            // NOTE: We can remove this cpp conditional when we switch to
-            // C++23.
-            if (_env) {
-                for (auto const& [name, value]: *_env) {
-                    envp.emplace_back(name + "=" + value);
-                }
-            }
-            else {
-                for (auto const& [name, value]: cenviron()) {
-                    envp.emplace_back(name + "=" + value);
-                }
-            }
-#endif // __cplusplus >= 202002L && __cpp_lib_optional >= 202110L
+            auto const envp = _envp ? _envp : environ_snapshot();
 
 #if defined(USE_POSIX_SPAWN)
             /*
@@ -295,34 +439,33 @@ namespace pkgxx {
             }
             cargv.push_back(nullptr);
 
-            std::vector<char const*> cenvp;
-            cenvp.reserve(envp.size() + 1);
-            for (auto const& env: envp) {
-                cenvp.push_back(env.c_str());
-            }
-            cenvp.push_back(nullptr);
+            // Ask for vfork semantics where it's not the default. The
+            // child only execs, so sharing our address space is safe and
+            // avoids copying page tables of a large multi-threaded
+            // process.
+            spawn_attr const attr;
 
             pid_t pid;
             if (_is_file) {
-                if (posix_spawnp(
+                if (int const err = posix_spawnp(
                         &pid,
                         _cmd.c_str(),
                         _fas ? _fas->c_ptr() : nullptr,
-                        nullptr, // attrp
+                        attr.c_ptr(),
                         const_cast<char* const*>(cargv.data()),
-                        const_cast<char* const*>(cenvp.data())) != 0) {
-                    throw std::system_error(errno, std::generic_category(), "posix_spawnp");
+                        envp->data()); err != 0) {
+                    throw std::system_error(err, std::generic_category(), "posix_spawnp");
                 }
             }
             else {
-                if (posix_spawn(
+                if (int const err = posix_spawn(
                         &pid,
                         _cmd.c_str(),
                         _fas ? _fas->c_ptr() : nullptr,
-                        nullptr, // attrp
+                        attr.c_ptr(),
                         const_cast<char* const*>(cargv.data()),
-                        const_cast<char* const*>(cenvp.data())) != 0) {
-                    throw std::system_error(errno, std::generic_category(), "posix_spawnp");
+                        envp->data()); err != 0) {
+                    throw std::system_error(err, std::generic_category(), "posix_spawn");
                 }
             }
             return pid;
@@ -344,7 +487,7 @@ namespace pkgxx {
 
                 if (_fas) {
                     try {
-                        (*_fas)();
+                        (*_fas)(msg_fds[1]);
                     }
                     catch (std::system_error &e) {
                         int const code = e.code().value();
@@ -366,27 +509,22 @@ namespace pkgxx {
                 }
                 cargv.push_back(nullptr);
 
-                std::vector<char const*> cenvp;
-                cenvp.reserve(envp.size() + 1);
-                for (auto const& env: envp) {
-                    cenvp.push_back(env.c_str());
-                }
-                cenvp.push_back(nullptr);
+                char* const* const cenvp = envp->data();
 
                 if (_is_file) {
 #  if defined(HAVE_EXECVPE)
                     if (execvpe(
                             _cmd.c_str(),
                             const_cast<char* const*>(cargv.data()),
-                            const_cast<char* const*>(cenvp.data())) != 0) {
+                            cenvp) != 0) {
                         msg_out.write(reinterpret_cast<char const*>(&errno), sizeof(int));
                         msg_out << "execvpe";
                     }
 #  else
 #    if defined(HAVE__NSGETENVIRON)
-                    *_NSGetEnviron() = const_cast<char **>(cenvp.data());
+                    *_NSGetEnviron() = const_cast<char**>(cenvp);
 #    else
-                    environ = const_cast<char **>(cenvp.data());
+                    environ = const_cast<char**>(cenvp);
 #    endif
                     if (execvp(
                             _cmd.c_str(),
@@ -401,15 +539,15 @@ namespace pkgxx {
                     if (execve(
                             _cmd.c_str(),
                             const_cast<char* const*>(cargv.data()),
-                            const_cast<char* const*>(cenvp.data())) != 0) {
+                            cenvp) != 0) {
                         msg_out.write(reinterpret_cast<char const*>(&errno), sizeof(int));
                         msg_out << "execve";
                     }
 #  else
 #    if defined(HAVE__NSGETENVIRON)
-                    *_NSGetEnviron() = const_cast<char **>(cenvp.data());
+                    *_NSGetEnviron() = const_cast<char**>(cenvp);
 #    else
-                    environ = const_cast<char **>(cenvp.data());
+                    environ = const_cast<char**>(cenvp);
 #    endif
                     if (execv(
                             _cmd.c_str(),
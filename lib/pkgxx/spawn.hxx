@@ -3,6 +3,7 @@
 #include <array>
 #include <filesystem>
 #include <map>
+#include <memory>
 #include <optional>
 #include <string>
 #include <sys/types.h>
@@ -10,6 +11,49 @@
 #include <vector>
 
 namespace pkgxx {
+    /** A set of environment variables in the form that exec(2)
+     * takes. It is immutable once constructed, so that a single instance
+     * can be shared by any number of spawns.
+     */
+    struct envp_block {
+        /// Construct an environment block from a map.
+        explicit envp_block(std::map<std::string, std::string> const& env);
+
+        envp_block(envp_block const&) = delete;
+
+        /// Obtain a null-terminated array of \c NAME=VALUE strings.
+        char* const*
+        data() const noexcept {
+            return const_cast<char* const*>(_ptrs.data());
+        }
+
+        /// Obtain the number of bytes the block occupies in the argument
+        /// area of a new process, which counts toward \c ARG_MAX.
+        std::size_t
+        bytes() const noexcept {
+            return _bytes;
+        }
+
+    private:
+        std::vector<std::string> _strings;
+        std::vector<char const*> _ptrs;
+        std::size_t _bytes = sizeof(char*);
+    };
+
+    /** Obtain a snapshot of \c environ(7) taken on the first call, or on
+     * the first call after \ref refresh_environ_snapshot(). Children
+     * spawned without modifying their environment all share it.
+     */
+    std::shared_ptr<envp_block const>
+    environ_snapshot();
+
+    /** Discard the snapshot of \c environ(7). This must be called after
+     * modifying the environment of the process, e.g. with \c
+     * unsetenv(3).
+     */
+    void
+    refresh_environ_snapshot();
+
     namespace detail {
         // This is an incomplete type whose definition is in spawn.cxx
         struct file_actions;
@@ -23,10 +67,15 @@ namespace pkgxx {
                 , _argv(std::forward<Argv>(argv)) {}
 
         public:
-            template <typename Env>
             spawn_base&
-            environ(Env&& env) {
-                _env.emplace(std::forward<Env>(env));
+            environ(std::map<std::string, std::string> const& env) {
+                _envp = std::make_shared<envp_block const>(env);
+                return *this;
+            }
+
+            spawn_base&
+            environ(std::shared_ptr<envp_block const> const& envp) {
+                _envp = envp;
                 return *this;
             }
 
@@ -45,6 +94,10 @@ namespace pkgxx {
             spawn_base&
             dup_fd(int from, int to);
 
+            // Close every file descriptor >= lowfd in the child.
+            spawn_base&
+            close_fds_from(int lowfd);
+
             pid_t
             operator() () const;
 
@@ -56,9 +109,8 @@ namespace pkgxx {
             bool _is_file;
             std::filesystem::path _cmd;
             std::vector<std::string> _argv;
-            std::optional<
-                std::map<std::string, std::string>
-                > _env;
+            // Null means environ_snapshot().
+            std::shared_ptr<envp_block const> _envp;
             // This can't be unique_ptr because then our constructor has to
             // be defined in spawn.cxx, which we don't want to do.
             mutable std::shared_ptr<file_actions> _fas;
@@ -0,0 +1,307 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <initializer_list>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <string>
+#include <sys/resource.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+
+#include "stats.hxx"
+
+namespace fs = std::filesystem;
+
+namespace {
+    struct registry {
+        static registry&
+        instance() {
+            // Never destroyed, because pool threads may still be spawning
+            // processes while the process exits. The mutex is held across
+            // fork(2), so that the child never inherits it locked.
+            static auto* const r =
+                []() {
+                    pthread_atfork(
+                        []() { instance().mtx.lock();   },
+                        []() { instance().mtx.unlock(); },
+                        []() { instance().mtx.unlock(); });
+                    return new registry();
+                }();
+            return *r;
+        }
+
+        std::mutex mtx;
+        std::map<std::string, std::uint64_t> spawned; // command => count
+
+        bool print = false;
+        std::optional<fs::path> textfile;
+        std::string tool;
+    };
+
+    auto started = std::chrono::steady_clock::now();
+
+    struct usage {
+        usage(int who) {
+            if (getrusage(who, &_ru) != 0) {
+                _ru = {};
+            }
+        }
+
+        double
+        utime() const noexcept {
+            return seconds(_ru.ru_utime);
+        }
+
+        double
+        stime() const noexcept {
+            return seconds(_ru.ru_stime);
+        }
+
+        std::uint64_t
+        maxrss_bytes() const noexcept {
+#if defined(__APPLE__)
+            return static_cast<std::uint64_t>(_ru.ru_maxrss);
+#else
+            return static_cast<std::uint64_t>(_ru.ru_maxrss) * 1024;
+#endif
+        }
+
+    private:
+        static double
+        seconds(timeval const& tv) noexcept {
+            return static_cast<double>(tv.tv_sec) + static_cast<double>(tv.tv_usec) / 1e6;
+        }
+
+        rusage _ru;
+    };
+
+    double
+    elapsed() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    }
+
+    std::map<std::string, std::uint64_t>
+    spawned_snapshot() {
+        auto& r = registry::instance();
+        std::lock_guard<std::mutex> lk(r.mtx);
+        return r.spawned;
+    }
+
+    std::string
+    label_value(std::string_view const& str) {
+        std::string out;
+        for (char const c: str) {
+            switch (c) {
+            case '\\': out += "\\\\"; break;
+            case '"':  out += "\\\""; break;
+            case '\n': out += "\\n";  break;
+            default:   out += c;
+            }
+        }
+        return out;
+    }
+
+    struct prometheus_writer {
+        prometheus_writer(std::ostream& out, std::string_view const& tool)
+            : _out(out)
+            , _tool(label_value(tool)) {}
+
+        void
+        header(char const* name, char const* type, char const* help) {
+            _out << "# HELP " << name << ' ' << help << '\n'
+                 << "# TYPE " << name << ' ' << type << '\n';
+        }
+
+        template <typename T>
+        void
+        sample(char const* name, T value,
+               std::initializer_list<std::pair<char const*, std::string_view>> labels = {}) {
+            _out << name << "{tool=\"" << _tool << '"';
+            for (auto const& [label, val]: labels) {
+                _out << ',' << label << "=\"" << label_value(val) << '"';
+            }
+            _out << "} " << value << '\n';
+        }
+
+        template <typename T>
+        void
+        single(char const* name, char const* type, char const* help, T value) {
+            header(name, type, help);
+            sample(name, value);
+        }
+
+    private:
+        std::ostream& _out;
+        std::string const _tool;
+    };
+
+    void
+    report() {
+        auto& r = registry::instance();
+        if (r.print) {
+            pkgxx::stats::print(std::cerr);
+        }
+        if (r.textfile) {
+            auto tmp = *r.textfile;
+            tmp += ".tmp." + std::to_string(getpid());
+            try {
+                {
+                    std::ofstream out(tmp, std::ios_base::out | std::ios_base::trunc);
+                    pkgxx::stats::write_prometheus(out, r.tool);
+                    if (!out.flush()) {
+                        throw std::system_error(errno, std::generic_category(), "Failed to write " + tmp.string());
+                    }
+                }
+                fs::rename(tmp, *r.textfile);
+            }
+            catch (std::exception const& e) {
+                std::error_code ec;
+                fs::remove(tmp, ec);
+                std::cerr << r.tool << ": " << e.what() << std::endl;
+            }
+        }
+    }
+}
+
+namespace pkgxx {
+    namespace stats {
+        void
+        spawned(std::filesystem::path const& cmd) {
+            auto& r = registry::instance();
+            std::lock_guard<std::mutex> lk(r.mtx);
+            r.spawned[cmd.filename().string()]++;
+        }
+
+        void
+        reset() {
+            {
+                auto& r = registry::instance();
+                std::lock_guard<std::mutex> lk(r.mtx);
+                r.spawned.clear();
+            }
+            for (auto* c: {&pipe_bytes_read, &summary_records_parsed, &cache_hits, &cache_misses,
+                           &pattern_matches, &nursery_tasks_run, &nursery_queue_wait_us}) {
+                c->reset();
+            }
+            started = std::chrono::steady_clock::now();
+        }
+
+        void
+        print(std::ostream& out) {
+            auto const spawned = spawned_snapshot();
+            std::uint64_t total_spawned = 0;
+            for (auto const& [_cmd, n]: spawned) {
+                total_spawned += n;
+            }
+            usage const self(RUSAGE_SELF);
+            usage const children(RUSAGE_CHILDREN);
+
+            auto const row =
+                [&](std::string_view const& name, auto const& value) {
+                    out << "  " << std::left << std::setw(28) << name << std::right
+                        << ' ' << value << std::endl;
+                };
+            auto const flags = out.flags();
+            out << std::fixed << std::setprecision(3)
+                << "Statistics:" << std::endl;
+            row("wall time (s)", elapsed());
+            row("user CPU time (s)", self.utime());
+            row("system CPU time (s)", self.stime());
+            row("peak RSS (KiB)", self.maxrss_bytes() / 1024);
+            row("children user CPU time (s)", children.utime());
+            row("children system CPU time (s)", children.stime());
+            row("children peak RSS (KiB)", children.maxrss_bytes() / 1024);
+            row("processes spawned", total_spawned);
+            for (auto const& [cmd, n]: spawned) {
+                row("  " + cmd, n);
+            }
+            row("bytes read from pipes", pipe_bytes_read.value());
+            row("summary records parsed", summary_records_parsed.value());
+            row("cache hits", cache_hits.value());
+            row("cache misses", cache_misses.value());
+            row("pattern matches", pattern_matches.value());
+            row("nursery tasks run", nursery_tasks_run.value());
+            row("nursery queue wait (s)", static_cast<double>(nursery_queue_wait_us.value()) / 1e6);
+            out.flags(flags);
+        }
+
+        void
+        write_prometheus(std::ostream& out, std::string_view const& tool) {
+            usage const self(RUSAGE_SELF);
+            usage const children(RUSAGE_CHILDREN);
+            prometheus_writer w(out, tool);
+            auto const flags = out.flags();
+            out << std::fixed << std::setprecision(6);
+
+            w.single("pkgxx_last_run_timestamp_seconds", "gauge",
+                     "Unix time when the last run finished.",
+                     static_cast<long long>(std::time(nullptr)));
+            w.single("pkgxx_run_duration_seconds", "gauge",
+                     "Wall time of the last run.", elapsed());
+
+            w.header("pkgxx_run_cpu_seconds", "gauge",
+                     "CPU time of the last run, by process and mode.");
+            w.sample("pkgxx_run_cpu_seconds", self.utime()    , {{"process", "self"    }, {"mode", "user"  }});
+            w.sample("pkgxx_run_cpu_seconds", self.stime()    , {{"process", "self"    }, {"mode", "system"}});
+            w.sample("pkgxx_run_cpu_seconds", children.utime(), {{"process", "children"}, {"mode", "user"  }});
+            w.sample("pkgxx_run_cpu_seconds", children.stime(), {{"process", "children"}, {"mode", "system"}});
+
+            w.header("pkgxx_run_peak_rss_bytes", "gauge",
+                     "Peak resident set size of the last run, by process. For children it is the largest one.");
+            w.sample("pkgxx_run_peak_rss_bytes", self.maxrss_bytes()    , {{"process", "self"    }});
+            w.sample("pkgxx_run_peak_rss_bytes", children.maxrss_bytes(), {{"process", "children"}});
+
+            w.header("pkgxx_run_processes_spawned", "gauge",
+                     "Child processes spawned in the last run, by command.");
+            for (auto const& [cmd, n]: spawned_snapshot()) {
+                w.sample("pkgxx_run_processes_spawned", n, {{"command", cmd}});
+            }
+
+            w.single("pkgxx_run_pipe_read_bytes", "gauge",
+                     "Bytes read from pipes connected to child processes in the last run.",
+                     pipe_bytes_read.value());
+            w.single("pkgxx_run_summary_records_parsed", "gauge",
+                     "Package records parsed from pkg_summary(5) in the last run.",
+                     summary_records_parsed.value());
+
+            w.header("pkgxx_run_cache_lookups", "gauge",
+                     "Lookups of the make variable cache in the last run, by result.");
+            w.sample("pkgxx_run_cache_lookups", cache_hits.value()  , {{"result", "hit" }});
+            w.sample("pkgxx_run_cache_lookups", cache_misses.value(), {{"result", "miss"}});
+
+            w.single("pkgxx_run_pattern_matches", "gauge",
+                     "Package patterns matched in the last run.",
+                     pattern_matches.value());
+            w.single("pkgxx_run_nursery_tasks", "gauge",
+                     "Parallel tasks run in the last run.",
+                     nursery_tasks_run.value());
+            w.single("pkgxx_run_nursery_queue_wait_seconds", "gauge",
+                     "Total time parallel tasks waited for a worker in the last run.",
+                     static_cast<double>(nursery_queue_wait_us.value()) / 1e6);
+            out.flags(flags);
+        }
+
+        void
+        report_at_exit(bool print,
+                       std::optional<std::filesystem::path> const& textfile,
+                       std::string_view const& tool) {
+            auto& r = registry::instance();
+            {
+                std::lock_guard<std::mutex> lk(r.mtx);
+                r.print    = print;
+                r.textfile = textfile;
+                r.tool     = tool;
+            }
+            if (print || textfile) {
+                std::atexit(report);
+            }
+        }
+    }
+}
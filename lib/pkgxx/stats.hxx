@@ -0,0 +1,132 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <ostream>
+#include <string_view>
+
+namespace pkgxx {
+    /** Process-wide statistics about what a run has cost.
+     *
+     * Unlike \ref trace, the counters are always on. Bumping one costs a
+     * relaxed atomic addition on a slot that is rarely shared with
+     * another thread, so they can be put in hot paths such as pattern
+     * matching. They can be printed in a human-readable form, or written
+     * in the text format of Prometheus so that the textfile collector of
+     * node_exporter can pick them up.
+     */
+    namespace stats {
+        namespace detail {
+            inline constexpr std::size_t num_slots = 16;
+
+            // Threads are spread over the slots of every counter in
+            // the order they first bump one.
+            inline std::size_t
+            this_thread_slot() noexcept {
+                static std::atomic<std::size_t> next = 0;
+                thread_local std::size_t const slot =
+                    next.fetch_add(1, std::memory_order_relaxed) % num_slots;
+                return slot;
+            }
+        }
+
+        /** A monotonically increasing counter which many threads can
+         * bump at once without fighting over a cache line.
+         */
+        struct counter {
+            constexpr counter() noexcept = default;
+            counter(counter const&) = delete;
+
+            /// Increase the counter by \c n.
+            void
+            add(std::uint64_t n = 1) noexcept {
+                _slots[detail::this_thread_slot()].value.fetch_add(n, std::memory_order_relaxed);
+            }
+
+            /// Reset the counter to zero.
+            void
+            reset() noexcept {
+                for (auto& s: _slots) {
+                    s.value.store(0, std::memory_order_relaxed);
+                }
+            }
+
+            /// Return the current value of the counter.
+            std::uint64_t
+            value() const noexcept {
+                std::uint64_t sum = 0;
+                for (auto const& s: _slots) {
+                    sum += s.value.load(std::memory_order_relaxed);
+                }
+                return sum;
+            }
+
+        private:
+            struct alignas(64) slot {
+                std::atomic<std::uint64_t> value = 0;
+            };
+            std::array<slot, detail::num_slots> _slots;
+        };
+
+        /// The number of bytes read from pipes connected to child
+        /// processes.
+        inline counter pipe_bytes_read;
+
+        /// The number of package records parsed from \c pkg_summary(5).
+        inline counter summary_records_parsed;
+
+        /// The number of lookups that hit the on-disk cache of make
+        /// variables.
+        inline counter cache_hits;
+
+        /// The number of lookups that missed the on-disk cache of make
+        /// variables.
+        inline counter cache_misses;
+
+        /// The number of times a \ref pkgpattern has been matched against
+        /// a package name or a set of them.
+        inline counter pattern_matches;
+
+        /// The number of tasks run by any \ref nursery.
+        inline counter nursery_tasks_run;
+
+        /// The total time in microseconds nursery tasks have spent
+        /// waiting for a worker.
+        inline counter nursery_queue_wait_us;
+
+        /** Count a child process spawned from \c cmd. Processes are
+         * counted by the file name of the command, e.g. \c bmake. */
+        void
+        spawned(std::filesystem::path const& cmd);
+
+        /** Reset every counter to zero and restart the clock of the
+         * run. A process forked to do a piece of work calls this, so that
+         * it reports only what the work has cost. */
+        void
+        reset();
+
+        /** Print the statistics in a human-readable form. */
+        void
+        print(std::ostream& out);
+
+        /** Write the statistics to \c out in the text format of
+         * Prometheus. Every sample has a label \c tool whose value is \c
+         * tool. They describe a single run, and are thus exported as
+         * gauges rather than counters. */
+        void
+        write_prometheus(std::ostream& out, std::string_view const& tool);
+
+        /** Arrange for the statistics to be reported when the process
+         * exits: printed to \c std::cerr if \c print is \c true, and
+         * written to \c textfile in the format of \ref write_prometheus
+         * if it has a value. The textfile is replaced atomically, so that
+         * a collector never sees it half written. */
+        void
+        report_at_exit(bool print,
+                       std::optional<std::filesystem::path> const& textfile,
+                       std::string_view const& tool);
+    }
+}
@@ -1,16 +1,23 @@
+#include <algorithm>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <future>
 #include <string>
+#include <stdexcept>
 #include <system_error>
+#include <unordered_map>
 #include <vector>
 
 #include "bzip2stream.hxx"
+#include "fdstream.hxx"
 #include "gzipstream.hxx"
 #include "harness.hxx"
+#include "map_reduce.hxx"
+#include "stats.hxx"
 #include "string_algo.hxx"
 #include "summary.hxx"
+#include "trace.hxx"
 #include "wwwstream.hxx"
 #include "xargs_fold.hxx"
 
@@ -25,14 +32,11 @@ namespace {
         "pkg_summary.txt"
     };
 
-    summary
-    read_summary(std::istream& in) {
-        summary sum;
-        std::vector<pkgpattern> DEPENDS;
-        std::optional<std::filesystem::path> FILENAME;
-        std::optional<pkgname> PKGNAME;
-        std::optional<pkgpath> PKGPATH;
-        for (std::string line; std::getline(in, line); ) {
+    /* Builds a summary out of pkg_summary(5) lines fed one at a time.
+     */
+    struct summary_parser {
+        void
+        operator() (std::string_view const& line) {
             if (line.empty()) {
                 if (PKGNAME && PKGPATH) {
                     DEPENDS.shrink_to_fit();
@@ -44,16 +48,16 @@ namespace {
                             PKGNAME.value(),
                             PKGPATH.value()
                         });
+                    n_records++;
                 }
                 DEPENDS.clear();
                 FILENAME.reset();
                 PKGNAME.reset();
                 PKGPATH.reset();
             }
-            else if (auto const equal = line.find('='); equal != std::string::npos) {
-                auto const view     = static_cast<std::string_view>(line);
-                auto const variable = view.substr(0, equal);
-                auto const value    = equal + 1 < view.size() ? view.substr(equal + 1) : ""sv;
+            else if (auto const equal = line.find('='); equal != std::string_view::npos) {
+                auto const variable = line.substr(0, equal);
+                auto const value    = line.substr(equal + 1);
 
                 if (variable == "DEPENDS") {
                     DEPENDS.emplace_back(value);
@@ -69,7 +73,31 @@ namespace {
                 }
             }
         }
-        return sum;
+
+        summary
+        result() && {
+            stats::summary_records_parsed.add(n_records);
+            return std::move(sum);
+        }
+
+    private:
+        summary sum;
+        std::vector<pkgpattern> DEPENDS;
+        std::optional<std::filesystem::path> FILENAME;
+        std::optional<pkgname> PKGNAME;
+        std::optional<pkgpath> PKGPATH;
+        std::uint64_t n_records = 0;
+    };
+
+    summary
+    read_summary(std::istream& in) {
+        summary_parser parser;
+        for_each_line(
+            in,
+            [&](std::string_view const& line) {
+                parser(line);
+            });
+        return std::move(parser).result();
     }
 
     template <typename Function>
@@ -99,7 +127,7 @@ namespace {
     read_local_summary(
         std::ostream& msg,
         std::ostream& verbose,
-        unsigned concurrency,
+        pkgxx::concurrency const& concurrency,
         std::filesystem::path const& PACKAGES,
         std::string const& PKG_INFO,
         std::string const& PKG_SUFX) {
@@ -109,7 +137,10 @@ namespace {
         auto const latest_bin_pkg = std::async(
             std::launch::deferred,
             [&PACKAGES]() {
-                fs::file_time_type t;
+                // Not a default-constructed file_time_type: its epoch can
+                // be in the future, e.g. on libstdc++, which would make
+                // every summary file look outdated.
+                auto t = fs::file_time_type::min();
                 for (auto const& ent:
                          fs::directory_iterator(
                              PACKAGES,
@@ -153,12 +184,8 @@ namespace {
 
         verbose << "No valid summaries exist. Scanning "
                 << PACKAGES << " ..." << std::endl;
-        return xargs_fold({
-                shell,
-                "-c", "exec " + PKG_INFO + " -X \"$@\"",
-                shell // This will be $0 of the shell, and the rest of argv
-                      // will be constructed by xargs.
-            },
+        return xargs_fold(
+            shell_command_argv(PKG_INFO, {"-X"}),
             [&](auto&& args) {
                 for (auto const& ent:
                          fs::directory_iterator(
@@ -169,7 +196,9 @@ namespace {
                     }
                 }
             },
-            read_summary,
+            []() {
+                return summary_parser();
+            },
             concurrency);
     }
 
@@ -201,10 +230,11 @@ namespace {
 
 namespace pkgxx {
     summary::summary(std::string const& PKG_INFO) {
-        harness pkg_info(shell, {shell, "-s", "--", "-X", "*"});
+        trace::span span("phase", "summary");
+        span.arg("source", "installed");
 
-        pkg_info.cin() << "exec " << PKG_INFO << " \"$@\"" << std::endl;
-        pkg_info.cin().close();
+        auto const argv = shell_command_argv(PKG_INFO, {"-X", "*"});
+        harness pkg_info(argv[0], argv, "stdin_action"_na = harness::fd_action::close);
 
         *this = read_summary(pkg_info.cout());
     }
@@ -212,11 +242,14 @@ namespace pkgxx {
     summary::summary(
         std::ostream& msg,
         std::ostream& verbose,
-        unsigned concurrency,
+        pkgxx::concurrency const& concurrency,
         std::filesystem::path const& PACKAGES,
         std::string const& PKG_INFO,
         std::string const& PKG_SUFX) {
 
+        trace::span span("phase", "summary");
+        span.arg("source", PACKAGES.string());
+
         if (PACKAGES.string().find("://") != std::string::npos) {
             *this = read_remote_summary(msg, PACKAGES);
         }
@@ -230,4 +263,97 @@ namespace pkgxx {
             (*this)[pair.second.PKGPATH][pair.first.base].insert(pair);
         }
     }
+
+    resolved_depends::resolved_depends(
+        summary const& sum,
+        pkgxx::concurrency const& concurrency) {
+
+        trace::span span("phase", "resolve depends");
+
+        // Give every distinct pattern a dense ID, and remember which
+        // pattern each DEPENDS refers to.
+        std::unordered_map<pkgpattern, std::size_t> ids;
+        std::vector<pkgpattern const*> patterns;
+        std::vector<std::size_t> dep_ids;
+
+        _pkgs.reserve(sum.size());
+        _offsets.reserve(sum.size() + 1);
+        _offsets.push_back(0);
+        for (auto const& pkg: sum) {
+            _pkgs.push_back(&pkg);
+            for (auto const& pat: pkg.second.DEPENDS) {
+                auto const [it, inserted] = ids.emplace(pat, patterns.size());
+                if (inserted) {
+                    patterns.push_back(&pat);
+                }
+                dep_ids.push_back(it->second);
+            }
+            _offsets.push_back(dep_ids.size());
+        }
+        _distinct = patterns.size();
+        span.arg("depends", dep_ids.size()).arg("patterns", _distinct);
+
+        // Sort patterns by their string representation, which begins
+        // with PKGBASE, and hand them out in contiguous runs. This way
+        // each worker looks up neighbouring parts of the summary one
+        // after another, like a merge join would, instead of jumping
+        // around the whole tree.
+        std::vector<std::string> keys;
+        keys.reserve(patterns.size());
+        for (auto const* pat: patterns) {
+            keys.push_back(pat->string());
+        }
+        std::vector<std::size_t> order(patterns.size());
+        for (std::size_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        std::sort(
+            order.begin(), order.end(),
+            [&](auto a, auto b) {
+                return keys[a] < keys[b];
+            });
+
+        constexpr std::size_t run_length = 64;
+        std::vector<std::pair<std::size_t, std::size_t>> runs;
+        for (std::size_t first = 0; first < order.size(); first += run_length) {
+            runs.emplace_back(first, std::min(first + run_length, order.size()));
+        }
+
+        // Each slot is written by exactly one worker, so no locks are
+        // needed.
+        std::vector<value_type const*> resolved(patterns.size(), nullptr);
+        parallel_for_each(
+            runs,
+            [&](auto const& run) {
+                for (auto i = run.first; i < run.second; i++) {
+                    auto const id = order[i];
+                    if (auto const best = patterns[id]->best(sum); best != sum.end()) {
+                        resolved[id] = &*best;
+                    }
+                }
+            },
+            concurrency);
+
+        _deps.reserve(dep_ids.size());
+        for (auto const id: dep_ids) {
+            _deps.push_back(resolved[id]);
+        }
+    }
+
+    resolved_depends::range
+    resolved_depends::at(pkgname const& name) const {
+        auto const it = std::lower_bound(
+            _pkgs.begin(), _pkgs.end(), name,
+            [](auto const* pkg, auto const& n) {
+                return pkg->first < n;
+            });
+        if (it == _pkgs.end() || (*it)->first != name) {
+            throw std::out_of_range("Package not in the summary: " + name.string());
+        }
+        auto const i = static_cast<std::size_t>(it - _pkgs.begin());
+        return range {
+            _deps.data() + _offsets[i],
+            _deps.data() + _offsets[i + 1]
+        };
+    }
 }
@@ -6,7 +6,9 @@
 #include <optional>
 #include <ostream>
 #include <set>
+#include <vector>
 
+#include <pkgxx/concurrency.hxx>
 #include <pkgxx/pkgpath.hxx>
 #include <pkgxx/pkgpattern.hxx>
 #include <pkgxx/pkgname.hxx>
@@ -47,7 +49,7 @@ namespace pkgxx {
         summary(
             std::ostream& msg,
             std::ostream& verbose,
-            unsigned concurrency,
+            pkgxx::concurrency const& concurrency,
             std::filesystem::path const& PACKAGES,
             std::string const& PKG_INFO,
             std::string const& PKG_SUFX);
@@ -75,4 +77,68 @@ namespace pkgxx {
          */
         pkgmap(summary const& all_packages);
     };
+
+    /** Dependencies of every package in a summary, resolved against the
+     * summary itself. This is what \ref pkgpattern::best would give for
+     * each pattern in \c DEPENDS, but every distinct pattern is resolved
+     * only once, in parallel, and results are stored in a single dense
+     * array. A bulk build has tens of thousands of \c DEPENDS but only a
+     * few thousand distinct patterns among them.
+     *
+     * Objects of this class refer to elements of the summary they are
+     * constructed from, which must therefore outlive them.
+     */
+    struct resolved_depends {
+        using value_type = summary::value_type;
+
+        /** A range of resolved dependencies of a package. */
+        struct range {
+            using iterator = value_type const* const*;
+
+            iterator
+            begin() const noexcept {
+                return _first;
+            }
+
+            iterator
+            end() const noexcept {
+                return _last;
+            }
+
+            std::size_t
+            size() const noexcept {
+                return static_cast<std::size_t>(_last - _first);
+            }
+
+            iterator _first;
+            iterator _last;
+        };
+
+        /** Resolve \c DEPENDS of every package in \c sum. */
+        resolved_depends(
+            summary const& sum,
+            pkgxx::concurrency const& concurrency = pkgxx::concurrency());
+
+        /** Return the packages that best satisfy \c DEPENDS of a package
+         * \c name, in the same order as \c DEPENDS. An element is \c
+         * nullptr if nothing in the summary matches the corresponding
+         * pattern. Throws \c std::out_of_range if the package isn't in
+         * the summary. */
+        range
+        at(pkgname const& name) const;
+
+        /// Return the number of distinct patterns that were resolved.
+        std::size_t
+        distinct_patterns() const noexcept {
+            return _distinct;
+        }
+
+    private:
+        // Packages in the same order as the summary. Dependencies of
+        // _pkgs[i] are _deps[_offsets[i]] to _deps[_offsets[i+1]].
+        std::vector<value_type const*> _pkgs;
+        std::vector<std::size_t> _offsets;
+        std::vector<value_type const*> _deps;
+        std::size_t _distinct;
+    };
 }
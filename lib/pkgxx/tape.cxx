@@ -0,0 +1,709 @@
+#include "config.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <signal.h>
+#include <stdexcept>
+#include <system_error>
+#include <unistd.h>
+
+#include "reactor.hxx"
+#include "spawn.hxx"
+#include "tape.hxx"
+
+using namespace std::literals;
+namespace fs = std::filesystem;
+
+namespace {
+    using pkgxx::harness;
+
+    std::string_view const MAGIC = "pkgxx-tape 2";
+
+    struct interaction {
+        std::vector<std::string> argv;
+        std::optional<std::string> cwd;
+        std::vector<std::string> env;
+        std::string in;
+        std::string out;
+        std::string err;
+        harness::status status;
+        std::chrono::microseconds duration;
+    };
+
+    std::string
+    key_of(std::vector<std::string> const& argv,
+           std::optional<std::string> const& cwd,
+           std::vector<std::string> const& env) {
+        std::string key;
+        for (auto const& arg: argv) {
+            key += arg;
+            key += '\0';
+        }
+        if (cwd) {
+            key += '\1';
+            key += *cwd;
+        }
+        for (auto const& var: env) {
+            key += '\2';
+            key += var;
+        }
+        return key;
+    }
+
+    /* Variables the caller has set, changed, or removed for the process,
+     * as NAME=VALUE, or just NAME for removed ones. The rest of the
+     * environment is the same for every process we spawn, and differs
+     * between machines, so it isn't part of the key. */
+    std::vector<std::string>
+    env_changes(std::optional<harness::env_t> const& env) {
+        std::vector<std::string> changes;
+        if (env) {
+            auto const ours = pkgxx::cenviron();
+            for (auto const& [name, value]: *env) {
+                auto const it = ours.find(name);
+                if (it == ours.end() || it->second != value) {
+                    changes.push_back(name + '=' + value);
+                }
+            }
+            for (auto const& [name, _value]: ours) {
+                if (env->count(name) == 0) {
+                    changes.push_back(name);
+                }
+            }
+            std::sort(changes.begin(), changes.end());
+        }
+        return changes;
+    }
+
+    /* The tape format is a sequence of fields, each being a line of a
+     * name and an optional length, followed by that many bytes and a
+     * newline:
+     *
+     *   pkgxx-tape 2
+     *   arg 5
+     *   bmake
+     *   cwd 21
+     *   /usr/pkgsrc/devel/foo
+     *   env 15
+     *   PKG_PATH=/pkgs
+     *   stdin 0
+     *
+     *   stdout 15
+     *   PKGNAME=foo-1.0
+     *   stderr 0
+     *
+     *   exited 0
+     *   duration 1234
+     *   end
+     *
+     * so that stdout containing NUL bytes or newlines is stored as is.
+     *
+     * Answers to questions about the file system are stored as if they
+     * were given by test(1), e.g. "test -d /usr/pkgsrc" exiting with 0
+     * for yes or 1 for no. */
+    void
+    write_field(std::ostream& out, char const* name, std::string_view const& data) {
+        out << name << ' ' << data.size() << '\n';
+        out.write(data.data(), static_cast<std::streamsize>(data.size()));
+        out << '\n';
+    }
+
+    void
+    write_interaction(std::ostream& out, interaction const& i) {
+        for (auto const& arg: i.argv) {
+            write_field(out, "arg", arg);
+        }
+        if (i.cwd) {
+            write_field(out, "cwd", *i.cwd);
+        }
+        for (auto const& var: i.env) {
+            write_field(out, "env", var);
+        }
+        write_field(out, "stdin" , i.in);
+        write_field(out, "stdout", i.out);
+        write_field(out, "stderr", i.err);
+        if (auto const* e = std::get_if<harness::exited>(&i.status)) {
+            out << "exited " << e->status << '\n';
+        }
+        else {
+            auto const& s = std::get<harness::signaled>(i.status);
+            out << "signaled " << s.signal << ' ' << s.coredumped << '\n';
+        }
+        out << "duration " << i.duration.count() << '\n'
+            << "end" << std::endl;
+    }
+
+    struct bad_tape: std::runtime_error {
+        bad_tape(fs::path const& file, std::string const& why)
+            : std::runtime_error(file.string() + ": not a valid tape: " + why) {}
+    };
+
+    std::deque<interaction>
+    read_tape(fs::path const& file) {
+        std::ifstream in(file, std::ios_base::in | std::ios_base::binary);
+        if (!in) {
+            throw std::system_error(errno, std::generic_category(), "Failed to open " + file.string());
+        }
+
+        std::string line;
+        if (!std::getline(in, line) || line != MAGIC) {
+            throw bad_tape(file, "missing header");
+        }
+
+        auto const number =
+            [&](std::string_view const& str) {
+                long long n;
+                auto const [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), n);
+                if (ec != std::errc() || ptr != str.data() + str.size()) {
+                    throw bad_tape(file, "bad number: " + std::string(str));
+                }
+                return n;
+            };
+        auto const data =
+            [&](std::string_view const& len) {
+                std::string buf(static_cast<std::size_t>(number(len)), '\0');
+                if (!in.read(buf.data(), static_cast<std::streamsize>(buf.size())) || in.get() != '\n') {
+                    throw bad_tape(file, "truncated data");
+                }
+                return buf;
+            };
+
+        std::deque<interaction> tape;
+        interaction cur;
+        while (std::getline(in, line)) {
+            auto const sp    = line.find(' ');
+            auto const name  = std::string_view(line).substr(0, sp);
+            auto const value = sp == std::string::npos ? ""sv : std::string_view(line).substr(sp + 1);
+
+            if      (name == "arg"   ) { cur.argv.push_back(data(value)); }
+            else if (name == "cwd"   ) { cur.cwd = data(value); }
+            else if (name == "env"   ) { cur.env.push_back(data(value)); }
+            else if (name == "stdin" ) { cur.in  = data(value); }
+            else if (name == "stdout") { cur.out = data(value); }
+            else if (name == "stderr") { cur.err = data(value); }
+            else if (name == "exited") {
+                cur.status = harness::exited {static_cast<int>(number(value))};
+            }
+            else if (name == "signaled") {
+                auto const sp2 = value.find(' ');
+                cur.status = harness::signaled {
+                    static_cast<int>(number(value.substr(0, sp2))),
+                    sp2 != std::string_view::npos && value.substr(sp2 + 1) == "1"
+                };
+            }
+            else if (name == "duration") {
+                cur.duration = std::chrono::microseconds(number(value));
+            }
+            else if (name == "end") {
+                tape.push_back(std::move(cur));
+                cur = interaction();
+            }
+            else {
+                throw bad_tape(file, "unknown field: " + std::string(name));
+            }
+        }
+        return tape;
+    }
+
+    // Never destroyed, because children may still be terminating while
+    // the process exits.
+    struct writer {
+        static writer&
+        instance() {
+            // The mutex is held across fork(2), so that the child never
+            // inherits it locked.
+            static auto* const w =
+                []() {
+                    pthread_atfork(
+                        []() { instance().mtx.lock();   },
+                        []() { instance().mtx.unlock(); },
+                        []() { instance().mtx.unlock(); });
+                    return new writer();
+                }();
+            return *w;
+        }
+
+        void
+        append(interaction const& i) {
+            std::lock_guard<std::mutex> lk(mtx);
+            write_interaction(out, i);
+        }
+
+        std::mutex mtx;
+        std::ofstream out;
+    };
+
+    struct library {
+        static library&
+        instance() {
+            static auto* const l =
+                []() {
+                    pthread_atfork(
+                        []() { instance().mtx.lock();   },
+                        []() { instance().mtx.unlock(); },
+                        []() { instance().mtx.unlock(); });
+                    return new library();
+                }();
+            return *l;
+        }
+
+        /* Take an interaction for key, preferring one whose stdin is
+         * in. The last one of a key is never taken away so that it can
+         * be repeated. */
+        interaction
+        take(std::string const& key, std::string const* in) {
+            std::lock_guard<std::mutex> lk(mtx);
+            auto& queue = tape.at(key);
+            auto it = queue.begin();
+            if (in) {
+                it = std::find_if(
+                    queue.begin(), queue.end(),
+                    [&](auto const& i) {
+                        return i.in == *in;
+                    });
+                if (it == queue.end()) {
+                    it = queue.begin();
+                }
+            }
+            if (queue.size() == 1) {
+                return *it;
+            }
+            else {
+                auto i = std::move(*it);
+                queue.erase(it);
+                return i;
+            }
+        }
+
+        std::mutex mtx;
+        std::map<std::string, std::deque<interaction>> tape;
+        fs::path file;
+        pkgxx::tape::latency lat;
+    };
+
+    // Return (our end, the caller's end) of a new pipe.
+    std::pair<int, int>
+    caller_pipe(bool caller_writes) {
+        auto const fds = pkgxx::cpipe(true);
+        return caller_writes
+            ? std::make_pair(fds[0], fds[1])
+            : std::make_pair(fds[1], fds[0]);
+    }
+
+    /* Copying data between pipes is done by the reactor, which runs the
+     * callbacks below. They may outlive the session, e.g. when the
+     * caller keeps stdin open after the process terminates, so what they
+     * touch is shared. */
+    struct recording {
+        std::mutex mtx;
+        std::condition_variable cv;
+        interaction i;
+        // The number of outputs of the process not closed yet.
+        int open_outputs = 0;
+        std::exception_ptr error;
+    };
+
+    struct recorder: public pkgxx::tape::session {
+        recorder(std::vector<std::string> const& argv,
+                 std::optional<fs::path> const& cwd,
+                 std::vector<std::string>&& env)
+            : _st(std::make_shared<recording>())
+            , _begin(std::chrono::steady_clock::now()) {
+
+            _st->i.argv = argv;
+            if (cwd) {
+                _st->i.cwd = cwd->string();
+            }
+            _st->i.env = std::move(env);
+        }
+
+        virtual bool
+        replaying() const noexcept override {
+            return false;
+        }
+
+        virtual int
+        input(int child) override {
+            auto const [ours, theirs] = caller_pipe(true);
+            auto& r = pkgxx::reactor::instance();
+            r.send(child, ""sv);
+            r.watch(
+                ours,
+                [st = _st, child = child](auto const& chunk) {
+                    {
+                        std::lock_guard<std::mutex> lk(st->mtx);
+                        st->i.in.append(chunk);
+                    }
+                    pkgxx::reactor::instance().send(child, chunk);
+                },
+                [child = child](auto) {
+                    pkgxx::reactor::instance().close_after_sent(child);
+                });
+            return theirs;
+        }
+
+        virtual int
+        output(int child, int which) override {
+            auto const [ours, theirs] = caller_pipe(false);
+            auto& r = pkgxx::reactor::instance();
+            r.send(ours, ""sv);
+            {
+                std::lock_guard<std::mutex> lk(_st->mtx);
+                _st->open_outputs++;
+            }
+            auto* const tape = which == STDERR_FILENO ? &_st->i.err : &_st->i.out;
+            r.watch(
+                child,
+                [st = _st, tape, ours = ours](auto const& chunk) {
+                    {
+                        std::lock_guard<std::mutex> lk(st->mtx);
+                        tape->append(chunk);
+                    }
+                    pkgxx::reactor::instance().send(ours, chunk);
+                },
+                [st = _st, ours = ours](auto ex) {
+                    pkgxx::reactor::instance().close_after_sent(ours);
+                    {
+                        std::lock_guard<std::mutex> lk(st->mtx);
+                        if (ex && !st->error) {
+                            st->error = ex;
+                        }
+                        st->open_outputs--;
+                    }
+                    st->cv.notify_all();
+                });
+            return theirs;
+        }
+
+        virtual void
+        start() override {}
+
+        virtual void
+        kill(int) override {}
+
+        virtual harness::status
+        finish(std::optional<harness::status> const& real) override {
+            // The process has terminated, so its outputs are about to
+            // reach EOF. Its stdin is recorded as far as the caller has
+            // written it.
+            std::unique_lock<std::mutex> lk(_st->mtx);
+            _st->cv.wait(lk, [&]() { return _st->open_outputs == 0; });
+            if (_st->error) {
+                std::rethrow_exception(_st->error);
+            }
+            _st->i.status   = real.value();
+            _st->i.duration = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - _begin);
+            writer::instance().append(_st->i);
+            return *real;
+        }
+
+    private:
+        std::shared_ptr<recording> _st;
+        std::chrono::steady_clock::time_point _begin;
+    };
+
+    struct playback {
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::string key;
+        // The stdin is needed only if it tells apart interactions with
+        // the same command.
+        bool need_stdin = false;
+        std::string in;
+        int out = -1;
+        int err = -1;
+        interaction i;
+        int killed = 0;
+        // The output has been delivered.
+        bool completed = false;
+        // The process has either completed or been killed.
+        bool done = false;
+        std::exception_ptr error;
+    };
+
+    // Hand the recorded output over to the reactor, unless the process
+    // has been killed in the meantime.
+    void
+    deliver(std::shared_ptr<playback> const& st) {
+        {
+            std::lock_guard<std::mutex> lk(st->mtx);
+            if (st->done) {
+                return;
+            }
+            auto& r = pkgxx::reactor::instance();
+            for (auto [fd, data]: {std::make_pair(st->out, &st->i.out),
+                                   std::make_pair(st->err, &st->i.err)}) {
+                if (fd != -1) {
+                    r.send(fd, *data);
+                    r.close_after_sent(fd);
+                }
+            }
+            st->completed = true;
+            st->done      = true;
+        }
+        st->cv.notify_all();
+    }
+
+    // Pick the interaction to replay, and deliver its output after the
+    // latency.
+    void
+    play(std::shared_ptr<playback> const& st) {
+        try {
+            auto& lib = library::instance();
+            auto i = lib.take(st->key, st->need_stdin ? &st->in : nullptr);
+            auto const lat = lib.lat(i.duration);
+            {
+                std::lock_guard<std::mutex> lk(st->mtx);
+                st->i = std::move(i);
+            }
+            if (lat.count() > 0) {
+                pkgxx::reactor::instance().after(lat, [st]() { deliver(st); });
+            }
+            else {
+                deliver(st);
+            }
+        }
+        catch (...) {
+            {
+                std::lock_guard<std::mutex> lk(st->mtx);
+                st->error = std::current_exception();
+                st->done  = true;
+            }
+            st->cv.notify_all();
+        }
+    }
+
+    struct player: public pkgxx::tape::session {
+        player(std::vector<std::string> const& argv,
+               std::optional<fs::path> const& cwd,
+               std::vector<std::string>&& env)
+            : _st(std::make_shared<playback>())
+            , _stdin_piped(false) {
+
+            std::optional<std::string> cwd_str;
+            if (cwd) {
+                cwd_str = cwd->string();
+            }
+            _st->key = key_of(argv, cwd_str, env);
+
+            auto& lib = library::instance();
+            std::lock_guard<std::mutex> lk(lib.mtx);
+            auto const it = lib.tape.find(_st->key);
+            if (it == lib.tape.end()) {
+                throw std::runtime_error(
+                    "not found in the tape " + lib.file.string() +
+                    (cwd_str ? " (working directory: " + *cwd_str + ")" : ""));
+            }
+            auto const& queue = it->second;
+            _st->need_stdin = std::any_of(
+                queue.begin(), queue.end(),
+                [&](auto const& i) {
+                    return i.in != queue.front().in;
+                });
+        }
+
+        virtual
+        ~player() {
+            // Close the outputs if the caller never waited for us.
+            kill(SIGKILL);
+        }
+
+        virtual bool
+        replaying() const noexcept override {
+            return true;
+        }
+
+        virtual int
+        input(int) override {
+            // A real process would keep reading its stdin until it
+            // exits, so the caller may go on writing to it even after we
+            // have completed. Read it until the caller closes it.
+            auto const [ours, theirs] = caller_pipe(true);
+            _stdin_piped = true;
+            pkgxx::reactor::instance().watch(
+                ours,
+                [st = _st](auto const& chunk) {
+                    if (st->need_stdin) {
+                        st->in.append(chunk);
+                    }
+                },
+                [st = _st](auto) {
+                    if (st->need_stdin) {
+                        play(st);
+                    }
+                });
+            return theirs;
+        }
+
+        virtual int
+        output(int, int which) override {
+            auto const [ours, theirs] = caller_pipe(false);
+            pkgxx::reactor::instance().send(ours, ""sv);
+            (which == STDERR_FILENO ? _st->err : _st->out) = ours;
+            return theirs;
+        }
+
+        virtual void
+        start() override {
+            if (!_st->need_stdin || !_stdin_piped) {
+                play(_st);
+            }
+        }
+
+        virtual void
+        kill(int sig) override {
+            {
+                std::lock_guard<std::mutex> lk(_st->mtx);
+                if (_st->done) {
+                    return;
+                }
+                auto& r = pkgxx::reactor::instance();
+                for (int const fd: {_st->out, _st->err}) {
+                    if (fd != -1) {
+                        r.close_after_sent(fd);
+                    }
+                }
+                _st->killed = sig;
+                _st->done   = true;
+            }
+            _st->cv.notify_all();
+        }
+
+        virtual harness::status
+        finish(std::optional<harness::status> const&) override {
+            std::unique_lock<std::mutex> lk(_st->mtx);
+            _st->cv.wait(lk, [&]() { return _st->done; });
+            if (_st->error) {
+                std::rethrow_exception(_st->error);
+            }
+            else if (_st->killed != 0 && !_st->completed) {
+                return harness::signaled {_st->killed, false};
+            }
+            return _st->i.status;
+        }
+
+    private:
+        std::shared_ptr<playback> _st;
+        bool _stdin_piped;
+    };
+
+    // Answer a question about the file system with real, or with the
+    // tape.
+    bool
+    test_path(char op, fs::path const& path, bool (*real)(fs::path const&)) {
+        std::vector<std::string> const argv = {"test", std::string("-") + op, path.string()};
+        switch (pkgxx::tape::detail::current.load(std::memory_order_relaxed)) {
+        case pkgxx::tape::detail::mode::recording:
+            {
+                auto const begin = std::chrono::steady_clock::now();
+                interaction i;
+                i.argv     = argv;
+                i.status   = harness::exited {real(path) ? 0 : 1};
+                i.duration = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - begin);
+                writer::instance().append(i);
+                return std::get<harness::exited>(i.status).status == 0;
+            }
+        case pkgxx::tape::detail::mode::replaying:
+            {
+                auto& lib = library::instance();
+                auto const key = key_of(argv, std::nullopt, {});
+                {
+                    std::lock_guard<std::mutex> lk(lib.mtx);
+                    if (lib.tape.count(key) == 0) {
+                        throw std::runtime_error(
+                            path.string() + ": not found in the tape " + lib.file.string());
+                    }
+                }
+                auto const i = lib.take(key, nullptr);
+                auto const* e = std::get_if<harness::exited>(&i.status);
+                return e && e->status == 0;
+            }
+        default:
+            return real(path);
+        }
+    }
+}
+
+namespace pkgxx {
+    namespace tape {
+        latency
+        latency::parse(std::string_view const& str) {
+            if (str == "recorded") {
+                latency lat;
+                lat._fixed.reset();
+                return lat;
+            }
+            long long ms;
+            auto const [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), ms);
+            if (ec != std::errc() || ptr != str.data() + str.size() || ms < 0) {
+                throw std::invalid_argument("Invalid latency: " + std::string(str));
+            }
+            return latency(std::chrono::milliseconds(ms));
+        }
+
+        void
+        start_recording(std::filesystem::path const& file) {
+            auto& w = writer::instance();
+            {
+                std::lock_guard<std::mutex> lk(w.mtx);
+                w.out.open(file, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+                if (!w.out) {
+                    throw std::system_error(errno, std::generic_category(), "Failed to open " + file.string());
+                }
+                w.out << MAGIC << std::endl;
+            }
+            detail::current.store(detail::mode::recording, std::memory_order_relaxed);
+        }
+
+        void
+        start_replaying(std::filesystem::path const& file, tape::latency const& lat) {
+            auto& lib = library::instance();
+            {
+                std::lock_guard<std::mutex> lk(lib.mtx);
+                for (auto& i: read_tape(file)) {
+                    auto const key = key_of(i.argv, i.cwd, i.env);
+                    lib.tape[key].push_back(std::move(i));
+                }
+                lib.file = file;
+                lib.lat  = lat;
+            }
+            detail::current.store(detail::mode::replaying, std::memory_order_relaxed);
+        }
+
+        bool
+        exists(std::filesystem::path const& path) {
+            return test_path(
+                'e', path, [](fs::path const& p) { return fs::exists(p); });
+        }
+
+        bool
+        is_directory(std::filesystem::path const& path) {
+            return test_path(
+                'd', path, [](fs::path const& p) { return fs::is_directory(p); });
+        }
+
+        std::unique_ptr<session>
+        session::begin(std::vector<std::string> const& argv,
+                       std::optional<std::filesystem::path> const& cwd,
+                       std::optional<harness::env_t> const& env) {
+            switch (detail::current.load(std::memory_order_relaxed)) {
+            case detail::mode::recording:
+                return std::make_unique<recorder>(argv, cwd, env_changes(env));
+            case detail::mode::replaying:
+                return std::make_unique<player>(argv, cwd, env_changes(env));
+            default:
+                return nullptr;
+            }
+        }
+    }
+}
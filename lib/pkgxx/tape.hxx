@@ -0,0 +1,165 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <pkgxx/harness.hxx>
+
+namespace pkgxx {
+    /** Recording and replaying interactions with child processes.
+     *
+     * While recording, processes spawned by \ref harness run as usual,
+     * but their argv, working directory, changes to the environment,
+     * piped stdin, stdout and stderr, exit status, and wall time are
+     * appended to a tape file as they terminate. While replaying, \ref
+     * harness spawns nothing and serves the recorded interactions
+     * in-process instead, so that our own CPU time, scheduling, and
+     * memory usage can be studied on a machine that has neither pkgsrc
+     * nor pkg_install. Either way the data is copied by \ref reactor,
+     * so that no threads are added to the ones being studied.
+     *
+     * Interactions are looked up by argv, working directory, and the
+     * environment variables the caller set, changed, or removed for the
+     * process, but not by the rest of the environment, which differs
+     * between machines. If the same command was recorded more than once,
+     * the recordings are replayed in order and the last one is repeated
+     * after they run out. If they were given different stdin, the choice
+     * is deferred until the caller closes stdin.
+     *
+     * Whether files in pkgsrc exist is asked through \ref exists and
+     * \ref is_directory, which put the answers on the tape too. Note
+     * that anything else we read from the file system ourselves, such as
+     * \c pkg_summary(5) files or \c pkgchk.conf, is not on the tape.
+     */
+    namespace tape {
+        namespace detail {
+            enum class mode {
+                off,
+                recording,
+                replaying
+            };
+            inline std::atomic<mode> current = mode::off;
+        }
+
+        /// Return \c true if interactions are being recorded.
+        inline bool
+        recording() noexcept {
+            return detail::current.load(std::memory_order_relaxed) == detail::mode::recording;
+        }
+
+        /// Return \c true if interactions are being replayed.
+        inline bool
+        replaying() noexcept {
+            return detail::current.load(std::memory_order_relaxed) == detail::mode::replaying;
+        }
+
+        /** How long a replayed process takes before producing any
+         * output. */
+        struct latency {
+            /// No latency at all.
+            latency()
+                : _fixed(std::chrono::microseconds(0)) {}
+
+            /// The same latency for every process.
+            latency(std::chrono::microseconds fixed)
+                : _fixed(fixed) {}
+
+            /** Parse either a number of milliseconds or the word \c
+             * recorded, meaning as long as each process took when it was
+             * recorded. Throws \c std::invalid_argument for anything
+             * else. */
+            static latency
+            parse(std::string_view const& str);
+
+            /// Return the latency of a process that took \c recorded.
+            std::chrono::microseconds
+            operator() (std::chrono::microseconds recorded) const noexcept {
+                return _fixed ? *_fixed : recorded;
+            }
+
+        private:
+            // std::nullopt means "as recorded".
+            std::optional<std::chrono::microseconds> _fixed;
+        };
+
+        /** Start recording interactions to \c file, replacing it if it
+         * exists. Throws if it cannot be opened. */
+        void
+        start_recording(std::filesystem::path const& file);
+
+        /** Start replaying interactions from \c file instead of spawning
+         * processes. Throws if it cannot be read or isn't a tape. */
+        void
+        start_replaying(std::filesystem::path const& file, tape::latency const& lat = tape::latency());
+
+        /** Return \c std::filesystem::exists(path), recording the
+         * answer if recording, or replaying it if replaying. Throws if
+         * replaying and the answer isn't on the tape. */
+        bool
+        exists(std::filesystem::path const& path);
+
+        /** Return \c std::filesystem::is_directory(path), recording the
+         * answer if recording, or replaying it if replaying. Throws if
+         * replaying and the answer isn't on the tape. */
+        bool
+        is_directory(std::filesystem::path const& path);
+
+        /** An interaction being recorded or replayed. This is an
+         * implementation detail of \ref harness.
+         */
+        struct session {
+            /** Begin recording or replaying an interaction with a
+             * process, or return \c nullptr if neither is on. \c env is
+             * the environment of the process if the caller has modified
+             * ours. Throws if replaying and the process isn't on the
+             * tape. */
+            static std::unique_ptr<session>
+            begin(std::vector<std::string> const& argv,
+                  std::optional<std::filesystem::path> const& cwd,
+                  std::optional<harness::env_t> const& env);
+
+            virtual
+            ~session() = default;
+
+            /// Return \c true if the process is replayed, i.e. there is
+            /// no real process.
+            virtual bool
+            replaying() const noexcept = 0;
+
+            /** Return the fd the caller should write stdin of the process
+             * to. \c child is the write end of the pipe to the real
+             * process, or -1 when replaying. */
+            virtual int
+            input(int child) = 0;
+
+            /** Return the fd the caller should read stdout or stderr of
+             * the process from, chosen by \c which being \c STDOUT_FILENO
+             * or \c STDERR_FILENO. \c child is the read end of the pipe
+             * from the real process, or -1 when replaying. */
+            virtual int
+            output(int child, int which) = 0;
+
+            /** Start the interaction. Called after every \ref input and
+             * \ref output call. */
+            virtual void
+            start() = 0;
+
+            /// Send a signal to a replayed process.
+            virtual void
+            kill(int sig) = 0;
+
+            /** Wait until all the data is copied and return the status of
+             * the process. When recording, \c real is the status of the
+             * real process which has just terminated, and is returned as
+             * is. */
+            virtual harness::status
+            finish(std::optional<harness::status> const& real) = 0;
+        };
+    }
+}
@@ -0,0 +1,173 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <pthread.h>
+#include <sstream>
+#include <system_error>
+#include <unistd.h>
+
+#include "trace.hxx"
+
+namespace {
+    struct recorder {
+        static recorder&
+        instance() {
+            // Never destroyed, because pool threads may still be
+            // recording spans while the process exits. The mutex is held
+            // across fork(2), and the buffer is flushed, so that the child
+            // neither inherits the mutex locked nor writes the same spans
+            // again.
+            static auto* const r =
+                []() {
+                    pthread_atfork(
+                        []() {
+                            instance().mtx.lock();
+                            instance().out.flush();
+                        },
+                        []() { instance().mtx.unlock(); },
+                        []() { instance().mtx.unlock(); });
+                    return new recorder();
+                }();
+            return *r;
+        }
+
+        std::mutex mtx;
+        std::ofstream out;
+        pkgxx::trace::clock::time_point epoch;
+        long pid = 0;
+    };
+
+    // Small thread IDs are easier to read in the viewer than
+    // pthread_t.
+    unsigned
+    this_thread_id() {
+        static std::atomic<unsigned> next = 1;
+        thread_local unsigned const id = next++;
+        return id;
+    }
+
+    void
+    write_json_string(std::ostream& out, std::string_view const& str) {
+        out << '"';
+        for (char const c: str) {
+            switch (c) {
+            case '"':  out << "\\\""; break;
+            case '\\': out << "\\\\"; break;
+            case '\n': out << "\\n";  break;
+            case '\t': out << "\\t";  break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buf[8];
+                    std::snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned>(c));
+                    out << buf;
+                }
+                else {
+                    out << c;
+                }
+            }
+        }
+        out << '"';
+    }
+
+    void
+    write_json_string(std::string& out, std::string_view const& str) {
+        std::ostringstream ss;
+        write_json_string(ss, str);
+        out += ss.str();
+    }
+}
+
+namespace pkgxx {
+    namespace trace {
+        void
+        start(std::filesystem::path const& file, std::string_view const& process_name) {
+            auto& r = recorder::instance();
+            {
+                std::lock_guard<std::mutex> lk(r.mtx);
+                r.out.open(file, std::ios_base::out | std::ios_base::trunc);
+                if (!r.out) {
+                    throw std::system_error(errno, std::generic_category(), "Failed to open " + file.string());
+                }
+                r.epoch = clock::now();
+                r.pid   = static_cast<long>(getpid());
+
+                r.out << "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << r.pid
+                      << ",\"args\":{\"name\":";
+                write_json_string(r.out, process_name);
+                r.out << "}}";
+            }
+            detail::enabled.store(true, std::memory_order_relaxed);
+            std::atexit([]() { finish(); });
+        }
+
+        void
+        finish() noexcept {
+            auto& r = recorder::instance();
+            std::lock_guard<std::mutex> lk(r.mtx);
+            if (detail::enabled.exchange(false, std::memory_order_relaxed)) {
+                try {
+                    r.out << "\n]\n";
+                    r.out.close();
+                }
+                catch (...) {
+                    // Nothing we can do about it at this point.
+                }
+            }
+        }
+
+        args&
+        args::add(std::string_view const& key, std::string_view const& value) {
+            std::string json;
+            write_json_string(json, value);
+            return add_raw(key, json);
+        }
+
+        args&
+        args::add_raw(std::string_view const& key, std::string const& json) {
+            if (!_json.empty()) {
+                _json += ',';
+            }
+            write_json_string(_json, key);
+            _json += ':';
+            _json += json;
+            return *this;
+        }
+
+        void
+        record(char const* category,
+               std::string_view const& name,
+               clock::time_point begin,
+               clock::time_point end,
+               args const& a) {
+
+            if (!enabled()) {
+                return;
+            }
+
+            using std::chrono::duration_cast;
+            using std::chrono::microseconds;
+
+            auto& r = recorder::instance();
+            auto const tid = this_thread_id();
+            std::lock_guard<std::mutex> lk(r.mtx);
+            // Tracing may have been finished while we were waiting for the
+            // lock.
+            if (!enabled()) {
+                return;
+            }
+            r.out << ",\n{\"name\":";
+            write_json_string(r.out, name);
+            r.out << ",\"cat\":\"" << category << "\",\"ph\":\"X\""
+                  << ",\"ts\":"  << duration_cast<microseconds>(begin - r.epoch).count()
+                  << ",\"dur\":" << duration_cast<microseconds>(end - begin).count()
+                  << ",\"pid\":" << r.pid
+                  << ",\"tid\":" << tid;
+            if (!a.empty()) {
+                r.out << ",\"args\":{" << a.json() << '}';
+            }
+            r.out << '}';
+        }
+    }
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace pkgxx {
+    /** A recorder of spans of time, written as a Chrome trace
+     * (https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU)
+     * which can be viewed with chrome://tracing or https://ui.perfetto.dev.
+     *
+     * Tracing is off until \ref trace::start is called. While it's off,
+     * constructing a \ref trace::span costs a single relaxed atomic
+     * load.
+     */
+    namespace trace {
+        using clock = std::chrono::steady_clock;
+
+        namespace detail {
+            inline std::atomic<bool> enabled = false;
+        }
+
+        /// Return \c true if tracing is on.
+        inline bool
+        enabled() noexcept {
+            return detail::enabled.load(std::memory_order_relaxed);
+        }
+
+        /** Start writing spans to \c file, replacing it if it exists. The
+         * trace is completed when the process exits. \c process_name is
+         * shown as the name of the process in the viewer. Throws if the
+         * file cannot be opened. */
+        void
+        start(std::filesystem::path const& file, std::string_view const& process_name);
+
+        /** Complete the trace and stop recording spans. Called
+         * automatically on exit. */
+        void
+        finish() noexcept;
+
+        /** Arguments of a span, shown in the viewer when it's selected. */
+        struct args {
+            /// Add a string argument.
+            args&
+            add(std::string_view const& key, std::string_view const& value);
+
+            /// Add a numeric argument.
+            template <typename T,
+                      typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+            args&
+            add(std::string_view const& key, T value) {
+                return add_raw(key, std::to_string(value));
+            }
+
+            /// Return \c true if no arguments have been added.
+            bool
+            empty() const noexcept {
+                return _json.empty();
+            }
+
+            /// Return the members of a JSON object without braces.
+            std::string const&
+            json() const noexcept {
+                return _json;
+            }
+
+        private:
+            args&
+            add_raw(std::string_view const& key, std::string const& json);
+
+            std::string _json;
+        };
+
+        /** Record a span that began at \c begin and ended at \c end on the
+         * calling thread. Does nothing if tracing is off. */
+        void
+        record(char const* category,
+               std::string_view const& name,
+               clock::time_point begin,
+               clock::time_point end,
+               args const& a = args());
+
+        /** An RAII span which begins when constructed and ends when
+         * destroyed. */
+        struct span {
+            /** Begin a span. \c category must be a string literal. */
+            span(char const* category, std::string_view const& name)
+                : _category(category) {
+
+                if (enabled()) {
+                    _name  = name;
+                    _begin = clock::now();
+                }
+            }
+
+            span(span const&) = delete;
+
+            ~span() {
+                if (_begin) {
+                    try {
+                        record(_category, _name, *_begin, clock::now(), _args);
+                    }
+                    catch (...) {
+                        // Failing to write a trace must not abort what is
+                        // being traced.
+                    }
+                }
+            }
+
+            /** Attach an argument to the span. Does nothing if tracing was
+             * off when the span began. */
+            template <typename T>
+            span&
+            arg(std::string_view const& key, T const& value) {
+                if (_begin) {
+                    _args.add(key, value);
+                }
+                return *this;
+            }
+
+        private:
+            char const* _category;
+            std::string _name;
+            std::optional<clock::time_point> _begin;
+            trace::args _args;
+        };
+    }
+}
@@ -1,15 +1,19 @@
 #include <cerrno>
+#include <mutex>
 
 #include "wwwstream.hxx"
 
 namespace pkgxx {
     wwwstreambuf::wwwstreambuf(std::string const& url) {
+        // libfetch reports errors through process-wide variables. Don't
+        // let another thread overwrite them before we read them.
+        static std::mutex mtx;
+        std::lock_guard<std::mutex> lk(mtx);
+
         if (fetchIO* fio = fetchGetURL(url.c_str(), ""); fio != nullptr) {
             _fio = std::unique_ptr<fetchIO, fetchIO_deleter>(fio);
         }
         else {
-            // This is obviously thread-unsafe. We may have to change the
-            // backend to libcurl.
             switch (fetchLastErrCode) {
                 case FETCH_UNAVAIL:
                     throw remote_file_unavailable("file not available: " + url);
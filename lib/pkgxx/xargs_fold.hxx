@@ -1,106 +1,79 @@
 #pragma once
 
 #include <algorithm>
-#include <exception>
 #include <cassert>
+#include <climits>
 #include <condition_variable>
 #include <deque>
-#include <istream>
+#include <exception>
+#include <map>
 #include <memory>
 #include <mutex>
-#include <set>
-#include <thread>
+#include <string>
+#include <string_view>
 #include <type_traits>
+#include <unistd.h>
+#include <utility>
 #include <vector>
 
-#include <pkgxx/config.h>
+#include <pkgxx/concurrency.hxx>
 #include <pkgxx/harness.hxx>
+#include <pkgxx/reactor.hxx>
+#include <pkgxx/spawn.hxx>
 
 namespace pkgxx {
     namespace detail {
+        /* The number of bytes available for arguments appended to \c cmd
+         * without exceeding ARG_MAX.
+         */
+        inline std::size_t
+        exec_arg_budget(std::vector<std::string> const& cmd) {
+            // Leave some room just like xargs(1) does, because some
+            // platforms count things we don't know about.
+            constexpr std::size_t headroom = 4096;
+
+            long const arg_max = sysconf(_SC_ARG_MAX);
+            std::size_t budget = arg_max > 0
+                ? static_cast<std::size_t>(arg_max)
+                : static_cast<std::size_t>(_POSIX_ARG_MAX);
+
+            std::size_t used = headroom + environ_snapshot()->bytes();
+            for (auto const& arg: cmd) {
+                used += arg.size() + 1 + sizeof(char*);
+            }
+            return budget > used ? budget - used : 0;
+        }
+
         template <typename Parse>
         struct xargs_nursery {
-        private:
-            using mutex_t   = std::recursive_mutex;
-            using lock_t    = std::lock_guard<mutex_t>;
-            using condvar_t = std::condition_variable_any;
-
-        public:
             struct split_sink {
                 split_sink(xargs_nursery& parent)
-                    : _parent(parent)
-                    , _lk(parent._mtx)
-                    , _next_child(0) {}
-
-                ~split_sink() {
-                    _parent.split_done();
-                }
+                    : _parent(parent) {}
 
                 void
                 push_back(std::string const& arg) {
-                    _parent._harnesses[_next_child]->cin() << arg << '\0';
-                    _next_child = (_next_child + 1) % _parent._harnesses.size();
+                    _parent._args.push_back(arg);
                 }
 
             private:
-                // We can lock the parent during the entire lifetime of
-                // split_sink because readers (i.e. parser threads) only
-                // needs to lock it at their very end.
                 xargs_nursery& _parent;
-                xargs_nursery::lock_t _lk;
-                std::vector<harness>::size_type _next_child;
             };
 
-            static_assert(std::is_invocable_v<Parse, std::istream&>);
-            using result_type = std::invoke_result_t<Parse, std::istream&>;
+            static_assert(std::is_invocable_v<Parse>);
+            using parser_type = std::invoke_result_t<Parse>;
+            static_assert(std::is_invocable_v<parser_type&, std::string_view const&>);
+            using result_type = decltype(std::declval<parser_type&&>().result());
             static_assert(std::is_default_constructible_v<result_type>);
             // result_type must also form a commutative monoid under its
             // default constructor and operator+=.
 
             xargs_nursery(std::vector<std::string> const& cmd,
                           Parse&& parse,
-                          unsigned int concurrency) {
-                lock_t lk(_mtx);
-
-                std::vector<std::string> argv = {CFG_XARGS, "-r", "-0"};
-                argv.insert(argv.end(), cmd.begin(), cmd.end());
-
-                for (unsigned int i = 0; i < concurrency; i++) {
-                    auto xargs = std::make_shared<harness>(CFG_XARGS, argv);
-                    _harnesses.push_back(xargs);
-
-                    auto parser = std::make_unique<std::thread>(
-                        [this, &parse, xargs]() {
-                            try {
-                                // Don't lock the mutex while parsing the
-                                // stdout of the commands. That would
-                                // prevent the parallelisation which is the
-                                // whole point of this entire machinery.
-                                auto result = parse(xargs->cout());
-
-                                lock_t lk_(_mtx);
-                                _running_parsers.erase(std::this_thread::get_id());
-                                _result += std::move(result);
-                            }
-                            catch (...) {
-                                lock_t lk_(_mtx);
-                                _running_parsers.erase(std::this_thread::get_id());
-                                if (!_ex) {
-                                    _ex = std::current_exception();
-                                }
-                            }
-                            _finished.notify_one();
-                        });
-                    _running_parsers.insert(parser->get_id());
-                    _parsers.push_back(std::move(parser));
-                }
-            }
-
-            virtual ~xargs_nursery() {
-                for (auto& p: _parsers) {
-                    p->join();
-                }
-            }
+                          pkgxx::concurrency const& concurrency)
+                : _cmd(cmd)
+                , _parse(parse)
+                , _concurrency(concurrency)
+                , _budget(exec_arg_budget(cmd)) {}
 
             // This method must not be called twice.
             split_sink
@@ -111,54 +84,196 @@ namespace pkgxx {
             // This method must not be called twice.
             result_type
             await() {
-                std::unique_lock<mutex_t> lk(_mtx);
+                using namespace na::literals;
+
+                // Outputs are parsed by reactor callbacks as chunks
+                // arrive, so that neither a whole output nor a thread is
+                // held per child. A chunk may end in the middle of a
+                // line, which is kept until the rest of it arrives.
+                struct line_parser {
+                    void
+                    feed(std::string_view chunk) {
+                        for (auto nl = chunk.find('\n'); nl != std::string_view::npos; nl = chunk.find('\n')) {
+                            if (partial.empty()) {
+                                parser(chunk.substr(0, nl));
+                            }
+                            else {
+                                partial.append(chunk.substr(0, nl));
+                                parser(std::string_view(partial));
+                                partial.clear();
+                            }
+                            chunk.remove_prefix(nl + 1);
+                        }
+                        partial.append(chunk);
+                    }
+
+                    result_type
+                    finish() {
+                        // The last line may lack a newline.
+                        if (!partial.empty()) {
+                            parser(std::string_view(partial));
+                            partial.clear();
+                        }
+                        return std::move(parser).result();
+                    }
+
+                    parser_type parser;
+                    std::string partial;
+                };
+
+                // Children whose outputs have been fully parsed. This is
+                // shared with reactor callbacks, which may outlive us if
+                // we are unwinding.
+                struct completion {
+                    std::size_t id;
+                    std::exception_ptr error;
+                    result_type result;
+                };
+                struct completions {
+                    std::mutex mtx;
+                    std::condition_variable cv;
+                    std::deque<completion> done;
+                };
+                auto const comp = std::make_shared<completions>();
 
-                while (!_running_parsers.empty()) {
-                    _finished.wait(lk);
+                result_type result;
+                std::map<std::size_t, std::unique_ptr<harness>> children;
+                std::size_t next_arg = 0;
+                std::size_t next_id  = 0;
+                unsigned limit       = 1;
+
+                auto const launch =
+                    [&]() {
+                        auto argv = _cmd;
+                        auto const batch_end = next_arg + batch_size(next_arg, limit);
+                        argv.insert(argv.end(), _args.begin() + static_cast<std::ptrdiff_t>(next_arg),
+                                                _args.begin() + static_cast<std::ptrdiff_t>(batch_end));
+                        next_arg = batch_end;
+
+                        auto const id = next_id++;
+                        auto child = std::make_unique<harness>(
+                            argv[0], argv,
+                            "dtor_action"_na  = harness::dtor_action::kill,
+                            "stdin_action"_na = harness::fd_action::close);
+                        auto const lp = std::make_shared<line_parser>(line_parser {_parse(), {}});
+                        reactor::instance().watch(
+                            child->cout().release(),
+                            [lp](auto const& chunk) {
+                                lp->feed(chunk);
+                            },
+                            [comp, id, lp](auto ex) {
+                                completion c {id, ex, result_type()};
+                                if (!ex) {
+                                    try {
+                                        c.result = lp->finish();
+                                    }
+                                    catch (...) {
+                                        c.error = std::current_exception();
+                                    }
+                                }
+                                {
+                                    std::lock_guard<std::mutex> lk(comp->mtx);
+                                    comp->done.push_back(std::move(c));
+                                }
+                                comp->cv.notify_one();
+                            });
+                        children.emplace(id, std::move(child));
+                    };
+
+                limit = _concurrency(workload::spawn);
+                while (next_arg < _args.size() && children.size() < limit) {
+                    launch();
                 }
+                while (!children.empty()) {
+                    completion c;
+                    {
+                        std::unique_lock<std::mutex> lk(comp->mtx);
+                        comp->cv.wait(lk, [&]() { return !comp->done.empty(); });
+                        c = std::move(comp->done.front());
+                        comp->done.pop_front();
+                    }
+
+                    // Whichever child finishes first gets the next
+                    // batch. This is what keeps a shard of large
+                    // arguments from becoming the straggler.
+                    auto child = std::move(children.at(c.id));
+                    children.erase(c.id);
+                    limit = _concurrency(workload::spawn);
+                    while (next_arg < _args.size() && children.size() < limit) {
+                        launch();
+                    }
 
-                return std::move(_result);
+                    child->wait_success();
+                    if (c.error) {
+                        std::rethrow_exception(c.error);
+                    }
+                    result += std::move(c.result);
+                }
+                return result;
             }
 
         private:
-            void
-            split_done() {
-                lock_t lk(_mtx);
+            // Guided scheduling: hand out large batches while there's a
+            // lot of work left, and smaller ones towards the end so that
+            // children finish at about the same time.
+            std::size_t
+            batch_size(std::size_t first, unsigned limit) const {
+                constexpr std::size_t max_batch = 256;
+
+                auto const remaining = _args.size() - first;
+                auto const guided    = (remaining + 2 * limit - 1) / (2 * limit);
+                auto n = std::clamp<std::size_t>(guided, 1, max_batch);
 
-                for (auto& child: _harnesses) {
-                    child->cin().close();
+                // The first argument is always taken, even if it alone
+                // exceeds ARG_MAX. Let exec(2) report it then.
+                std::size_t used = _args[first].size() + 1 + sizeof(char*);
+                for (std::size_t i = 1; i < n; i++) {
+                    used += _args[first + i].size() + 1 + sizeof(char*);
+                    if (used > _budget) {
+                        return i;
+                    }
                 }
+                return n;
             }
 
-            mutex_t _mtx;
-            std::vector<std::shared_ptr<harness>> _harnesses;
-            std::vector<std::unique_ptr<std::thread>> _parsers;
-            std::set<std::thread::id> _running_parsers;
-            result_type _result;
-            std::exception_ptr _ex;
-            condvar_t _finished; // Signaled when a parser finishes running.
+            std::vector<std::string> _cmd;
+            Parse& _parse;
+            pkgxx::concurrency _concurrency;
+            std::size_t _budget;
+            std::vector<std::string> _args;
         };
     }
 
-    /** Spawn several instances of xargs(1), let a function \c split feed
-     * them arguments in a round-robin manner, and then let a function \c
-     * parse the output and produce a result. The result type of the
-     * function \c parse must form a commutative monoid under its default
-     * constructor and \c operator+=. */
+    /** Run a command \c cmd with arguments supplied by a function \c
+     * split, in the manner of xargs(1), and parse the output to produce
+     * a result. Instances of the command run at once are limited by \c
+     * concurrency for \ref workload::spawn. Arguments are handed out in
+     * small batches to whichever instance finishes first, so a few
+     * expensive arguments don't keep the others waiting, and no batch
+     * exceeds \c ARG_MAX.
+     *
+     * The function \c parse is called with no arguments for each
+     * instance of the command, and returns a parser for its output. The
+     * parser is called with each line of the output as a \c
+     * std::string_view without the newline, and its \c result() is
+     * called after the last line. Parsers run on the \ref reactor thread
+     * as the output arrives, so they must not block. The result type
+     * must form a commutative monoid under its default constructor and
+     * \c operator+=. */
     template <typename Split, typename Parse>
     typename detail::xargs_nursery<Parse>::result_type
     xargs_fold(std::vector<std::string> const& cmd,
                Split&& split,
                Parse&& parse,
-               unsigned int concurrency = std::max(1u, std::thread::hardware_concurrency())) {
+               pkgxx::concurrency const& concurrency = pkgxx::concurrency()) {
 
         static_assert(
             std::is_invocable_v<
                 Split,
                 typename detail::xargs_nursery<Parse>::split_sink&&>);
 
-        assert(concurrency > 0);
-        auto nursery = detail::xargs_nursery(cmd, parse, concurrency);
+        assert(!cmd.empty());
+        auto nursery = detail::xargs_nursery<Parse>(cmd, std::forward<Parse>(parse), concurrency);
         split(nursery.sink());
         return nursery.await();
     }
@@ -2,8 +2,12 @@
 #include <thread>
 
 #include <pkgxx/makevars.hxx>
+#include <pkgxx/map_reduce.hxx>
 #include <pkgxx/mutex_guard.hxx>
-#include <pkgxx/nursery.hxx>
+#include <pkgxx/pkgdb.hxx>
+#include <pkgxx/progress.hxx>
+#include <pkgxx/tape.hxx>
+#include <pkgxx/trace.hxx>
 
 #include "check.hxx"
 
@@ -13,10 +17,11 @@ namespace pkg_chk {
     checker_base::checker_base(
         bool add_missing,
         bool check_build_version,
-        unsigned concurrency,
+        pkgxx::concurrency const& concurrency,
         bool update,
         bool delete_mismatched,
-        std::shared_future<std::string> const& PKG_INFO)
+        std::shared_future<std::string> const& PKG_INFO,
+        std::shared_future<pkgxx::summary> const& installed_pkg_summary)
         : _add_missing(add_missing)
         , _check_build_version(check_build_version)
         , _concurrency(concurrency)
@@ -24,7 +29,9 @@ namespace pkg_chk {
         , _delete_mismatched(delete_mismatched)
         , _PKG_INFO(PKG_INFO)
         , _installed_pkg_summary(
-            std::async(
+            installed_pkg_summary.valid()
+            ? installed_pkg_summary
+            : std::async(
                 std::launch::deferred,
                 [this]() {
                     atomic_verbose(
@@ -56,132 +63,202 @@ namespace pkg_chk {
 
     checker_base::result
     checker_base::run(std::set<pkgxx::pkgpath> const& pkgpaths) const {
+        pkgxx::trace::span span("phase", "check");
+        span.arg("pkgpaths", pkgpaths.size());
+        return compare(latest_pkgnames(pkgpaths));
+    }
+
+    checker_base::result
+    checker_base::run() const {
+        return run(_installed_pkgpaths.get());
+    }
+
+    void
+    checker_base::refresh_installed() {
+        // Reading pkg_info -X is unnecessary for this, as the comparison
+        // only needs installed PKGNAMEs.
+        _installed_pkgnames =
+            std::async(
+                std::launch::deferred,
+                [this]() {
+                    atomic_verbose(
+                        [](auto& out) {
+                            out << "Getting the list of installed packages" << std::endl;
+                        });
+                    std::set<pkgxx::pkgname> ret;
+                    for (auto& name: pkgxx::installed_pkgnames(_PKG_INFO.get())) {
+                        ret.insert(std::move(name));
+                    }
+                    return ret;
+                }).share();
+    }
+
+    checker_base::latest_pkgnames_map
+    checker_base::latest_pkgnames(std::set<pkgxx::pkgpath> const& pkgpaths) const {
         // This is the slowest part of pkg_chk. For each package we need to
         // extract variables from package Makefiles unless we are using
         // binary packages. Luckily for us each check is independent of
-        // each other so we can parallelise them.
-        pkgxx::guarded<result> res;
+        // each other so we can parallelise them. The package source
+        // doesn't change while we are running, so anything we have
+        // already extracted is reused.
+        latest_pkgnames_map ret;
+        std::set<pkgxx::pkgpath> todo;
         {
-            pkgxx::nursery n(_concurrency);
+            auto memo = _latest_pkgnames_memo.lock();
             for (pkgxx::pkgpath const& path: pkgpaths) {
-                n.start_soon(
-                    [&]() {
-                        // Find the set of latest PKGNAMEs provided by this
-                        // PKGPATH. Most PKGPATHs have just one
-                        // corresponding PKGNAME but some (py-*) have more.
-                        auto const latest_pkgnames = find_latest_pkgnames(path);
-                        if (latest_pkgnames.empty()) {
-                            res.lock()->MISSING_DONE.insert(path);
-                            return;
-                        }
+                if (auto it = memo->find(path); it != memo->end()) {
+                    ret.insert(*it);
+                }
+                else {
+                    todo.insert(path);
+                }
+            }
+        }
+        if (!todo.empty()) {
+            pkgxx::progress prog("Checking latest versions", todo.size());
+            auto found = pkgxx::map_reduce<latest_pkgnames_map>(
+                todo,
+                [&](pkgxx::pkgpath const& path, latest_pkgnames_map& acc) {
+                    pkgxx::progress::item item(prog, path);
+                    // Find the set of latest PKGNAMEs provided by this
+                    // PKGPATH. Most PKGPATHs have just one corresponding
+                    // PKGNAME but some (py-*) have more.
+                    acc.emplace(path, find_latest_pkgnames(path));
+                },
+                _concurrency, pkgxx::workload::spawn);
+            auto memo = _latest_pkgnames_memo.lock();
+            for (auto& pair: found) {
+                memo->insert(pair);
+                ret.insert(std::move(pair));
+            }
+        }
+        return ret;
+    }
 
-                        auto const& installed_pkgnames = _installed_pkgnames.get();
-                        for (pkgxx::pkgname const& name: latest_pkgnames) {
-                            if (auto installed = installed_pkgnames.lower_bound(
-                                    pkgxx::pkgname(name.base, pkgxx::pkgversion()));
-                                installed != installed_pkgnames.end() && installed->base == name.base) {
+    checker_base::result
+    checker_base::compare(latest_pkgnames_map const& latest) const {
+        // Comparing PKGNAMEs is cheap but fetching build versions
+        // isn't. Do it in parallel too.
+        pkgxx::progress prog("Comparing with installed packages", latest.size());
+        return pkgxx::map_reduce<result>(
+            latest,
+            [&](auto const& pair, result& res) {
+                pkgxx::pkgpath const& path = pair.first;
+                auto const& latest_pkgnames = pair.second;
+                pkgxx::progress::item item(prog, path);
+                if (latest_pkgnames.empty()) {
+                    res.MISSING_DONE.insert(path);
+                    return;
+                }
 
-                                if (installed->version == name.version) {
-                                    // The latest PKGNAME turned out to be
-                                    // installed. Good, but that's not
-                                    // enough if -B is given.
-                                    if (_check_build_version) {
-                                        auto const latest_build_version    = fetch_build_version(name, path);
-                                        auto const installed_build_version =
-                                            pkgxx::build_version::from_installed(_PKG_INFO.get(), *installed);
-                                        assert(installed_build_version.has_value());
+                auto const& installed_pkgnames = _installed_pkgnames.get();
+                for (pkgxx::pkgname const& name: latest_pkgnames) {
+                    if (auto installed = installed_pkgnames.lower_bound(
+                            pkgxx::pkgname(name.base, pkgxx::pkgversion()));
+                        installed != installed_pkgnames.end() && installed->base == name.base) {
 
-                                        if (latest_build_version.has_value()) {
-                                            if (latest_build_version == installed_build_version) {
-                                                atomic_verbose(
-                                                    [&](auto& out) {
-                                                        out << path << " - " << name << " OK" << std::endl;
-                                                    });
-                                            }
-                                            else {
-                                                atomic_msg(
-                                                    [&](auto& out) {
-                                                        out << path << " - " << name << " build_version mismatch" << std::endl;
-                                                    });
-                                                atomic_verbose(
-                                                    [&](auto& out) {
-                                                        out << "--current--"                   << std::endl
-                                                            << latest_build_version.value()
-                                                            << "--installed--"                 << std::endl
-                                                            << installed_build_version.value()
-                                                            << "----"                          << std::endl
-                                                            << std::endl;
-                                                    });
-                                                res.lock()->MISMATCH_TODO.emplace(*installed, path);
-                                            }
-                                        }
-                                        else {
-                                            atomic_msg(
-                                                [&](auto& out) {
-                                                    out << path << " - " << name << " build_version missing" << std::endl;
-                                                });
-                                        }
-                                    }
-                                    else {
+                        if (installed->version == name.version) {
+                            // The latest PKGNAME turned out to be
+                            // installed. Good, but that's not
+                            // enough if -B is given.
+                            if (_check_build_version) {
+                                auto const latest_build_version    = memoized_build_version(name, path);
+                                auto const installed_build_version =
+                                    pkgxx::build_version::from_installed(_PKG_INFO.get(), *installed);
+                                assert(installed_build_version.has_value());
+
+                                if (latest_build_version.has_value()) {
+                                    if (latest_build_version == installed_build_version) {
                                         atomic_verbose(
                                             [&](auto& out) {
                                                 out << path << " - " << name << " OK" << std::endl;
                                             });
                                     }
-                                }
-                                else if (installed->version < name.version) {
-                                    // We have an older version installed.
-                                    atomic_msg(
-                                        [&](auto& out) {
-                                            out << path << " - " << *installed << " < " << name
-                                                << (is_binary_available(name) ? " (has binary package)" : "")
-                                                << std::endl;
-                                        });
-                                    res.lock()->MISMATCH_TODO.emplace(*installed, path);
-                                }
-                                else {
-                                    // We have a newer version installed
-                                    // but how can that happen?
-                                    if (_check_build_version) {
+                                    else {
                                         atomic_msg(
                                             [&](auto& out) {
-                                                out << path << " - " << *installed << " > " << name
-                                                    << (is_binary_available(name) ? " (has binary package)" : "")
-                                                    << std::endl;
+                                                out << path << " - " << name << " build_version mismatch" << std::endl;
                                             });
-                                        res.lock()->MISMATCH_TODO.emplace(*installed, path);
-                                    }
-                                    else {
-                                        atomic_msg(
+                                        atomic_verbose(
                                             [&](auto& out) {
-                                                out << path << " - " << *installed << " > " << name << " - ignoring"
-                                                    << (is_binary_available(name) ? " (has binary package)" : "")
+                                                out << "--current--"                   << std::endl
+                                                    << latest_build_version.value()
+                                                    << "--installed--"                 << std::endl
+                                                    << installed_build_version.value()
+                                                    << "----"                          << std::endl
                                                     << std::endl;
                                             });
+                                        res.MISMATCH_TODO.emplace(*installed, path);
                                     }
                                 }
+                                else {
+                                    atomic_msg(
+                                        [&](auto& out) {
+                                            out << path << " - " << name << " build_version missing" << std::endl;
+                                        });
+                                }
                             }
                             else {
+                                atomic_verbose(
+                                    [&](auto& out) {
+                                        out << path << " - " << name << " OK" << std::endl;
+                                    });
+                            }
+                        }
+                        else if (installed->version < name.version) {
+                            // We have an older version installed.
+                            atomic_msg(
+                                [&](auto& out) {
+                                    out << path << " - " << *installed << " < " << name
+                                        << (is_binary_available(name) ? " (has binary package)" : "")
+                                        << std::endl;
+                                });
+                            res.MISMATCH_TODO.emplace(*installed, path);
+                        }
+                        else {
+                            // We have a newer version installed
+                            // but how can that happen?
+                            if (_check_build_version) {
                                 atomic_msg(
                                     [&](auto& out) {
-                                        out << path << " - " << name << " missing"
+                                        out << path << " - " << *installed << " > " << name
+                                            << (is_binary_available(name) ? " (has binary package)" : "")
+                                            << std::endl;
+                                    });
+                                res.MISMATCH_TODO.emplace(*installed, path);
+                            }
+                            else {
+                                atomic_msg(
+                                    [&](auto& out) {
+                                        out << path << " - " << *installed << " > " << name << " - ignoring"
                                             << (is_binary_available(name) ? " (has binary package)" : "")
                                             << std::endl;
                                     });
-                                res.lock()->MISSING_TODO.emplace(name, path);
                             }
                         }
-                    });
-            }
-        }
-        // The nursery has to be destroyed before this std::move() happens,
-        // otherwise we would return an empty result.
-        return std::move(*res.lock());
+                    }
+                    else {
+                        atomic_msg(
+                            [&](auto& out) {
+                                out << path << " - " << name << " missing"
+                                    << (is_binary_available(name) ? " (has binary package)" : "")
+                                    << std::endl;
+                            });
+                        res.MISSING_TODO.emplace(name, path);
+                    }
+                }
+            },
+            _concurrency, pkgxx::workload::spawn);
     }
 
-    checker_base::result
-    checker_base::run() const {
-        return run(_installed_pkgpaths.get());
+    std::optional<pkgxx::build_version>
+    checker_base::memoized_build_version(pkgxx::pkgname const& name, pkgxx::pkgpath const& path) const {
+        if (auto memo = _latest_build_version_memo.lock(); memo->count(name) > 0) {
+            return memo->at(name);
+        }
+        auto bv = fetch_build_version(name, path);
+        _latest_build_version_memo.lock()->emplace(name, bv);
+        return bv;
     }
 
     source_checker_base::source_checker_base(
@@ -215,7 +292,7 @@ namespace pkg_chk {
         //
         // * pkg_chk -r: Same as above.
         //
-        if (!fs::exists(_PKGSRCDIR.get() / path / "Makefile")) {
+        if (!pkgxx::tape::exists(_PKGSRCDIR.get() / path / "Makefile")) {
             atomic_warn(
                 [&](auto& out) {
                     out << "No " << path << "/Makefile - package moved or obsolete?" << std::endl;
@@ -8,6 +8,8 @@
 #include <set>
 
 #include <pkgxx/build_version.hxx>
+#include <pkgxx/concurrency.hxx>
+#include <pkgxx/mutex_guard.hxx>
 #include <pkgxx/pkgname.hxx>
 #include <pkgxx/stream.hxx>
 #include <pkgxx/summary.hxx>
@@ -18,15 +20,29 @@ namespace pkg_chk {
             std::set<pkgxx::pkgpath>                 MISSING_DONE;
             std::map<pkgxx::pkgname, pkgxx::pkgpath> MISSING_TODO;
             std::map<pkgxx::pkgname, pkgxx::pkgpath> MISMATCH_TODO;
+
+            /// Merge two results into one. The result \c other will be
+            /// destroyed in the process.
+            result&
+            operator+= (result&& other) {
+                MISSING_DONE.merge(other.MISSING_DONE);
+                MISSING_TODO.merge(other.MISSING_TODO);
+                MISMATCH_TODO.merge(other.MISMATCH_TODO);
+                return *this;
+            }
         };
 
+        /** Construct a checker. The summary of installed packages is
+         * read with \c PKG_INFO unless \c installed_pkg_summary is
+         * valid. */
         checker_base(
             bool add_missing,
             bool check_build_version,
-            unsigned concurrency,
+            pkgxx::concurrency const& concurrency,
             bool update,
             bool delete_mismatched,
-            std::shared_future<std::string> const& PKG_INFO);
+            std::shared_future<std::string> const& PKG_INFO,
+            std::shared_future<pkgxx::summary> const& installed_pkg_summary = {});
 
         /// Run \c pkg_chk for each package path in \c pkgpaths.
         result
@@ -36,7 +52,40 @@ namespace pkg_chk {
         result
         run() const;
 
+        /** Forget the set of installed packages obtained so far. The next
+         * call of \ref run will compare the latest PKGNAMEs against a
+         * freshly read set, but the latest PKGNAMEs themselves are
+         * memoized for the lifetime of the checker. Call this after
+         * deleting packages to recheck them cheaply.
+         */
+        void
+        refresh_installed();
+
     protected:
+        struct latest_pkgnames_map: public std::map<pkgxx::pkgpath, std::set<pkgxx::pkgname>> {
+            using std::map<pkgxx::pkgpath, std::set<pkgxx::pkgname>>::map;
+
+            latest_pkgnames_map&
+            operator+= (latest_pkgnames_map&& other) {
+                merge(other);
+                return *this;
+            }
+        };
+
+        /// Return the set of latest PKGNAMEs for each package path in \c
+        /// pkgpaths. Results are memoized so that no PKGPATH is queried
+        /// twice. PKGPATHs that provide nothing map to an empty set.
+        latest_pkgnames_map
+        latest_pkgnames(std::set<pkgxx::pkgpath> const& pkgpaths) const;
+
+        /// Compare the latest PKGNAMEs against installed packages.
+        result
+        compare(latest_pkgnames_map const& latest) const;
+
+        /// A memoizing wrapper for \ref fetch_build_version.
+        std::optional<pkgxx::build_version>
+        memoized_build_version(pkgxx::pkgname const& name, pkgxx::pkgpath const& path) const;
+
         /// Return the set of latest PKGNAMEs provided by a given PKGPATH.
         virtual std::set<pkgxx::pkgname>
         find_latest_pkgnames(pkgxx::pkgpath const& path) const = 0;
@@ -66,7 +115,7 @@ namespace pkg_chk {
 
         bool _add_missing;
         bool _check_build_version;
-        unsigned _concurrency;
+        pkgxx::concurrency _concurrency;
         bool _update;
         bool _delete_mismatched;
 
@@ -74,6 +123,14 @@ namespace pkg_chk {
         std::shared_future<pkgxx::summary>           _installed_pkg_summary;
         std::shared_future<std::set<pkgxx::pkgname>> _installed_pkgnames;
         std::shared_future<std::set<pkgxx::pkgpath>> _installed_pkgpaths;
+
+        mutable pkgxx::guarded<latest_pkgnames_map> _latest_pkgnames_memo;
+        mutable pkgxx::guarded<
+            std::map<
+                pkgxx::pkgname,
+                std::optional<pkgxx::build_version>
+                >
+            > _latest_build_version_memo;
     };
 
     /// Obtains data from source.
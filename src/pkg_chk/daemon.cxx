@@ -0,0 +1,1262 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <getopt.h>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <poll.h>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+#include <pkgxx/config.h>
+#include <pkgxx/fswatch.hxx>
+#include <pkgxx/harness.hxx>
+#include <pkgxx/makevars.hxx>
+#include <pkgxx/spawn.hxx>
+#include <pkgxx/stats.hxx>
+
+#include "config_file.hxx"
+#include "daemon.hxx"
+#include "message.hxx"
+
+using namespace std::literals;
+namespace fs = std::filesystem;
+
+namespace {
+    using clock = std::chrono::steady_clock;
+
+    // Bump this whenever the protocol between clients and the daemon
+    // changes.
+    char const PROTOCOL[] = "pkgchkxx-daemon-2";
+
+    // Environment variables which affect what the daemon holds in
+    // memory, either read by us or by bmake on behalf of mk.conf and
+    // pkgsrc. So do those whose names begin with "PKG". A client having
+    // values different from the daemon's does the work by itself.
+    std::set<std::string_view> const RELEVANT_ENV = {
+        "BMAKE",
+        "FETCH_USING",
+        "HOME",
+        "LOCALBASE",
+        "MACHINE",
+        "MACHINE_ARCH",
+        "MAKECONF",
+        "MAKEFLAGS",
+        "MAKESYSPATH",
+        "OPSYS",
+        "OS_VERSION",
+        "PACKAGES",
+        "PATH",
+        "SU_CMD",
+        "UNPRIVILEGED",
+        "USER",
+        "WRKDIR_BASENAME",
+        "XDG_CACHE_HOME"
+    };
+
+    // How often to look for changes if the kernel can't tell us. Every
+    // request looks for them anyway before being served, so this only
+    // gets reloading started before the next request comes.
+    constexpr auto POLL_INTERVAL = 60s;
+
+    // How long to wait for a burst of changes, such as "cvs update", to
+    // settle before loading everything again.
+    constexpr auto SETTLE_TIME = 2s;
+
+    // How long to wait before trying again after failing to load.
+    constexpr auto RETRY_INTERVAL = 60s;
+
+#if defined(MSG_NOSIGNAL)
+    constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+    constexpr int SEND_FLAGS = 0; // We rely on SO_NOSIGPIPE or SIG_IGN.
+#endif
+
+    // Messages on the channel between the supervisor and the holder.
+    constexpr char CTL_CONNECTION = 'C'; // Supervisor -> holder, with an fd.
+    constexpr char CTL_RELOAD     = 'H'; // Supervisor -> holder.
+    constexpr char CTL_READY      = 'R'; // Holder -> supervisor.
+    constexpr char CTL_STALE      = 'S'; // Holder -> supervisor.
+
+    [[noreturn]] void
+    throw_errno(std::string const& what) {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    void
+    set_cloexec(int fd) {
+        int const flags = fcntl(fd, F_GETFD);
+        if (flags == -1 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
+            throw_errno("fcntl");
+        }
+    }
+
+    void
+    set_nonblock(int fd) {
+        int const flags = fcntl(fd, F_GETFL);
+        if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            throw_errno("fcntl");
+        }
+    }
+
+    fs::path
+    url_safe_absolute(fs::path const& path) {
+        if (path.empty() || path.string().find("://") != std::string::npos) {
+            return path;
+        }
+        else {
+            return fs::absolute(path);
+        }
+    }
+
+    // Everything other than files that affects what the daemon holds in
+    // memory. The daemon serves a client only if they agree on it.
+    std::string
+    request_key(pkg_chk::options const& opts) {
+        std::ostringstream key;
+        key << "uid=" << geteuid() << '\n'
+            << "-C=" << url_safe_absolute(opts.pkgchk_conf_path).string() << '\n'
+            << "-D=" << opts.add_tags << '\n'
+            << "-P=" << url_safe_absolute(opts.bin_pkg_path).string() << '\n'
+            << "-U=" << opts.remove_tags << '\n';
+        // cenviron() is sorted by name.
+        for (auto const& [name, value]: pkgxx::cenviron()) {
+            if (name.compare(0, 3, "PKG") == 0 || RELEVANT_ENV.count(name)) {
+                key << name << '=' << value << '\n';
+            }
+        }
+        return key.str();
+    }
+
+    sockaddr_un
+    unix_addr(fs::path const& path) {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.string().size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error(path.string() + ": socket path too long");
+        }
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        return addr;
+    }
+
+    int
+    unix_socket() {
+        int const sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock == -1) {
+            throw_errno("socket");
+        }
+        set_cloexec(sock);
+#if defined(SO_NOSIGPIPE)
+        int const on = 1;
+        setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        return sock;
+    }
+
+    // Connect to a socket, or return -1 if nobody is listening on it.
+    int
+    connect_to(fs::path const& path) {
+        auto const addr = unix_addr(path);
+        int const sock = unix_socket();
+        if (connect(sock, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) == -1) {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    std::optional<uid_t>
+    peer_uid(int sock [[maybe_unused]]) {
+#if defined(HAVE_GETPEEREID)
+        uid_t uid;
+        gid_t gid;
+        if (getpeereid(sock, &uid, &gid) == 0) {
+            return uid;
+        }
+#elif defined(SO_PEERCRED)
+        ucred cred;
+        socklen_t len = sizeof(cred);
+        if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+            return cred.uid;
+        }
+#endif
+        return std::nullopt;
+    }
+
+    bool
+    send_all(int sock, std::string_view data) {
+        while (!data.empty()) {
+            ssize_t const n = send(sock, data.data(), data.size(), SEND_FLAGS);
+            if (n > 0) {
+                data.remove_prefix(static_cast<std::size_t>(n));
+            }
+            else if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Send data along with file descriptors. They are attached to the
+    // first byte, so that the peer receives them with its first read.
+    bool
+    send_with_fds(int sock, std::string_view data, std::vector<int> const& fds) {
+        if (fds.empty()) {
+            return send_all(sock, data);
+        }
+
+        std::vector<char> cbuf(CMSG_SPACE(sizeof(int) * fds.size()));
+        iovec iov;
+        iov.iov_base = const_cast<char*>(data.data());
+        iov.iov_len  = data.size();
+
+        msghdr mh = {};
+        mh.msg_iov        = &iov;
+        mh.msg_iovlen     = 1;
+        mh.msg_control    = cbuf.data();
+        mh.msg_controllen = cbuf.size();
+
+        cmsghdr* const cm = CMSG_FIRSTHDR(&mh);
+        if (!cm) {
+            errno = EINVAL;
+            return false;
+        }
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type  = SCM_RIGHTS;
+        cm->cmsg_len   = CMSG_LEN(sizeof(int) * fds.size());
+        std::memcpy(CMSG_DATA(cm), fds.data(), sizeof(int) * fds.size());
+
+        ssize_t n;
+        do {
+            n = sendmsg(sock, &mh, SEND_FLAGS);
+        } while (n == -1 && errno == EINTR);
+        if (n <= 0) {
+            return false;
+        }
+        data.remove_prefix(static_cast<std::size_t>(n));
+        return send_all(sock, data);
+    }
+
+    // Receive data along with at most max_fds file descriptors. Return
+    // the number of bytes received like recvmsg(2).
+    ssize_t
+    recv_with_fds(int sock, char* buf, std::size_t len, std::vector<int>& fds, std::size_t max_fds) {
+        std::vector<char> cbuf(CMSG_SPACE(sizeof(int) * max_fds));
+        iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len  = len;
+
+        msghdr mh = {};
+        mh.msg_iov        = &iov;
+        mh.msg_iovlen     = 1;
+        mh.msg_control    = cbuf.data();
+        mh.msg_controllen = cbuf.size();
+
+        ssize_t n;
+        do {
+            n = recvmsg(sock, &mh, 0);
+        } while (n == -1 && errno == EINTR);
+        if (n < 0) {
+            return n;
+        }
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+                auto const n_fds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (std::size_t i = 0; i < n_fds; i++) {
+                    int fd;
+                    std::memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+                    set_cloexec(fd);
+                    fds.push_back(fd);
+                }
+            }
+        }
+        return n;
+    }
+
+    std::optional<std::size_t>
+    parse_decimal(std::string_view const& digits) {
+        if (digits.empty() || digits.size() > 9) {
+            return std::nullopt;
+        }
+        std::size_t n = 0;
+        for (char c: digits) {
+            if (c < '0' || c > '9') {
+                return std::nullopt;
+            }
+            n = n * 10 + static_cast<std::size_t>(c - '0');
+        }
+        return n;
+    }
+
+    /* A buffered reader of lines and netstrings from a stream socket.
+     */
+    struct sock_reader {
+        sock_reader(int sock)
+            : _sock(sock)
+            , _eof(false) {}
+
+        // Receive the first chunk of data along with at most max_fds
+        // file descriptors. This must be called before anything else if
+        // the peer sends any.
+        std::vector<int>
+        recv_fds(std::size_t max_fds) {
+            std::vector<int> fds;
+            char buf[4096];
+            ssize_t const n = recv_with_fds(_sock, buf, sizeof(buf), fds, max_fds);
+            if (n > 0) {
+                _buf.append(buf, static_cast<std::size_t>(n));
+            }
+            else {
+                _eof = true;
+            }
+            return fds;
+        }
+
+        // Read a line without the terminating newline, or return
+        // std::nullopt on EOF.
+        std::optional<std::string>
+        line() {
+            while (true) {
+                if (auto const nl = _buf.find('\n'); nl != std::string::npos) {
+                    auto l = _buf.substr(0, nl);
+                    _buf.erase(0, nl + 1);
+                    return l;
+                }
+                if (!fill()) {
+                    return std::nullopt;
+                }
+            }
+        }
+
+        // Read a netstring, or return std::nullopt on EOF or on
+        // malformed input.
+        std::optional<std::string>
+        netstring() {
+            std::size_t colon;
+            while ((colon = _buf.find(':')) == std::string::npos) {
+                if (_buf.size() > 9 || !fill()) {
+                    return std::nullopt;
+                }
+            }
+            auto const len = parse_decimal(std::string_view(_buf).substr(0, colon));
+            if (!len) {
+                return std::nullopt;
+            }
+            while (_buf.size() < colon + 1 + *len + 1) {
+                if (!fill()) {
+                    return std::nullopt;
+                }
+            }
+            if (_buf[colon + 1 + *len] != ',') {
+                return std::nullopt;
+            }
+            auto str = _buf.substr(colon + 1, *len);
+            _buf.erase(0, colon + 1 + *len + 1);
+            return str;
+        }
+
+    private:
+        bool
+        fill() {
+            if (_eof) {
+                return false;
+            }
+            char buf[4096];
+            ssize_t n;
+            do {
+                n = read(_sock, buf, sizeof(buf));
+            } while (n == -1 && errno == EINTR);
+            if (n <= 0) {
+                _eof = true;
+                return false;
+            }
+            _buf.append(buf, static_cast<std::size_t>(n));
+            return true;
+        }
+
+        int _sock;
+        std::string _buf;
+        bool _eof;
+    };
+
+    void
+    put_netstring(std::string& out, std::string_view const& str) {
+        out += std::to_string(str.size());
+        out += ':';
+        out += str;
+        out += ',';
+    }
+
+    // A request is a netstring of netstrings: PROTOCOL, the key, the
+    // working directory of the client, and its argv.
+    std::string
+    encode_request(std::string const& key, fs::path const& cwd, int argc, char* const argv[]) {
+        std::string fields;
+        put_netstring(fields, PROTOCOL);
+        put_netstring(fields, key);
+        put_netstring(fields, cwd.string());
+        for (int i = 0; i < argc; i++) {
+            put_netstring(fields, argv[i]);
+        }
+        std::string req;
+        put_netstring(req, fields);
+        return req;
+    }
+
+    std::optional<std::vector<std::string>>
+    decode_request(sock_reader& in) {
+        auto const req = in.netstring();
+        if (!req) {
+            return std::nullopt;
+        }
+        std::vector<std::string> fields;
+        std::string_view rest = *req;
+        while (!rest.empty()) {
+            auto const colon = rest.find(':');
+            if (colon == std::string_view::npos) {
+                return std::nullopt;
+            }
+            auto const len = parse_decimal(rest.substr(0, colon));
+            if (!len || rest.size() < colon + 1 + *len + 1 || rest[colon + 1 + *len] != ',') {
+                return std::nullopt;
+            }
+            fields.emplace_back(rest.substr(colon + 1, *len));
+            rest.remove_prefix(colon + 1 + *len + 1);
+        }
+        return fields;
+    }
+
+    // Signals are turned into bytes written to a pipe, so that poll(2)
+    // can wait for them along with sockets.
+    int signal_pipe_w = -1;
+
+    extern "C" void
+    on_signal(int sig) {
+        int const saved = errno;
+        char const c = static_cast<char>(sig);
+        [[maybe_unused]] auto const n = write(signal_pipe_w, &c, 1);
+        errno = saved;
+    }
+
+    // Route signals to a pipe and return its reading end.
+    int
+    trap_signals(std::initializer_list<int> sigs) {
+        int fds[2];
+        if (pipe(fds) == -1) {
+            throw_errno("pipe");
+        }
+        for (int fd: fds) {
+            set_cloexec(fd);
+            set_nonblock(fd);
+        }
+        signal_pipe_w = fds[1];
+
+        struct sigaction sa = {};
+        sa.sa_handler = on_signal;
+        sa.sa_flags   = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        for (int sig: sigs) {
+            sigaction(sig, &sa, nullptr);
+        }
+        return fds[0];
+    }
+
+    void
+    untrap_signals(int pipe_r, std::initializer_list<int> sigs) {
+        for (int sig: sigs) {
+            std::signal(sig, SIG_DFL);
+        }
+        close(pipe_r);
+        close(signal_pipe_w);
+        signal_pipe_w = -1;
+    }
+
+    // Return signals delivered since the last call.
+    std::vector<int>
+    drain_signals(int pipe_r) {
+        std::vector<int> sigs;
+        char buf[64];
+        ssize_t n;
+        while ((n = read(pipe_r, buf, sizeof(buf))) > 0) {
+            for (ssize_t i = 0; i < n; i++) {
+                sigs.push_back(static_cast<unsigned char>(buf[i]));
+            }
+        }
+        return sigs;
+    }
+
+    // The line telling a client how its server has terminated.
+    std::string
+    result_of(int st) {
+        if (WIFEXITED(st)) {
+            return "exit " + std::to_string(WEXITSTATUS(st)) + "\n";
+        }
+        else if (WIFSIGNALED(st)) {
+            return "signal " + std::to_string(WTERMSIG(st)) + "\n";
+        }
+        else {
+            return "exit 1\n";
+        }
+    }
+
+    int
+    millis_until(clock::time_point const& t) {
+        auto const left = std::chrono::duration_cast<std::chrono::milliseconds>(t - clock::now()).count();
+        return static_cast<int>(std::max<decltype(left)>(left, 0));
+    }
+
+    // -1 means forever.
+    int
+    min_timeout(int a, int b) {
+        return a < 0 ? b : b < 0 ? a : std::min(a, b);
+    }
+
+    void
+    flush_all() {
+        std::cout.flush();
+        std::cerr.flush();
+        std::fflush(nullptr);
+    }
+
+    // Die of the signal the server has died of, so that our parent sees
+    // the same as it would without the daemon. Return the exit status to
+    // use if the signal doesn't terminate us.
+    int
+    reraise(int sig) {
+        flush_all();
+        std::signal(sig, SIG_DFL);
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, sig);
+        sigprocmask(SIG_UNBLOCK, &set, nullptr);
+        raise(sig);
+        return 128 + sig;
+    }
+
+    fs::path
+    pkg_dbdir(pkg_chk::environment const& env) {
+        using namespace na::literals;
+        auto const argv = pkgxx::shell_command_argv(env.PKG_ADMIN.get(), {"config-var", "PKG_DBDIR"});
+        pkgxx::harness pkg_admin(
+            argv[0], argv, "stdin_action"_na = pkgxx::harness::fd_action::close);
+        std::string dir;
+        std::getline(pkg_admin.cout(), dir);
+        pkg_admin.wait_success();
+        return dir;
+    }
+
+    /* The process holding everything in memory. It is forked from the
+     * supervisor, which hands it connections from clients through a
+     * control channel. It forks a server for each of them, and tells the
+     * supervisor when it has become ready or stale. A stale holder
+     * closes the channel once changes settle, and exits when the requests
+     * it has accepted are done.
+     */
+    struct holder {
+        holder(pkg_chk::options const& opts,
+               pkg_chk::daemon::hooks const& hooks,
+               std::string const& key,
+               int ctl)
+            : _opts(opts)
+            , _hooks(hooks)
+            , _key(key)
+            , _ctl(ctl)
+            , _sigchld(-1)
+            , _watch(POLL_INTERVAL)
+            , _stale(false) {}
+
+        [[noreturn]] void
+        run() {
+            pkgxx::memoize_pkgmk_vars();
+            auto const started = clock::now();
+            pkg_chk::environment const env(_opts);
+            auto const n_paths = load(env);
+
+            msg(_opts) << "Daemon: ready in " << std::fixed << std::setprecision(1)
+                       << std::chrono::duration<double>(clock::now() - started).count()
+                       << " seconds, watching " << n_paths << " package paths" << std::endl;
+            send_all(_ctl, std::string_view(&CTL_READY, 1));
+            if (_changed_while_loading) {
+                become_stale(_changed_while_loading->string() + " has changed");
+            }
+
+            _sigchld = trap_signals({SIGCHLD});
+            loop(env);
+            flush_all();
+            _exit(0);
+        }
+
+    private:
+        struct request {
+            int conn;
+            bool hung_up;
+        };
+
+        // Watch everything the state depends on, and then load it. Return
+        // the number of package paths being watched.
+        std::size_t
+        load(pkg_chk::environment const& env) {
+            auto const loading = fs::file_time_type::clock::now();
+
+            // Things must be watched before reading them, or changes made
+            // in between would go unnoticed. Watching the whole tree of
+            // pkgsrc would exhaust inotify watches, so we watch only what
+            // PKGNAMEs of packages we care about are computed from.
+            fs::path const& pkgsrcdir = env.PKGSRCDIR.get();
+            _watch.add(pkgsrcdir);
+            _watch.add(pkgsrcdir / "mk", true);
+            _watch.add(pkgsrcdir / "doc");
+            if (fs::is_directory(pkgsrcdir / ".git")) {
+                _watch.add(pkgsrcdir / ".git");
+            }
+            _watch.add(env.MAKECONF.get());
+            _watch.add(env.PKGCHK_CONF.get());
+            if (env.PACKAGES.get().string().find("://") == std::string::npos) {
+                _watch.add(env.PACKAGES.get());
+            }
+            if (auto const dbdir = pkg_dbdir(env); !dbdir.empty()) {
+                _watch.add(dbdir, true);
+            }
+            else {
+                warn(_opts) << "Unable to determine PKG_DBDIR."
+                            << " Changes to installed packages won't be noticed." << std::endl;
+            }
+
+            std::set<pkgxx::pkgpath> pkgpaths = env.installed_pkgpaths.get();
+            if (fs::exists(env.PKGCHK_CONF.get())) {
+                pkg_chk::config const conf(env.PKGCHK_CONF.get());
+                pkgpaths.merge(conf.pkgpaths(env.included_tags.get(), env.excluded_tags.get()));
+            }
+            std::set<std::string> categories;
+            for (auto const& path: pkgpaths) {
+                if (categories.insert(path.category).second) {
+                    _watch.add(pkgsrcdir / path.category);
+                }
+                _watch.add(pkgsrcdir / path);
+            }
+
+            // Now evaluate everything a request may need, so that servers
+            // inherit the results.
+            for (auto const* f: {&env.PKG_ADD, &env.PKG_DELETE, &env.PKG_SUFX, &env.SU_CMD}) {
+                f->get();
+            }
+            env.PKGCHK_UPDATE_CONF.get();
+            env.installed_pkgnames.get();
+            env.installed_pkg_summary.get();
+            if (fs::exists(pkgsrcdir / "doc/TODO")) {
+                env.todo.get();
+            }
+            try {
+                env.bin_pkg_map.get();
+                env.bin_pkg_depends.get();
+            }
+            catch (std::exception const& e) {
+                // Not fatal, as only some requests need them. Servers
+                // will report it again.
+                warn(_opts) << "Binary packages are unavailable: " << e.what() << std::endl;
+            }
+            _hooks.warm_up(_opts, env, pkgpaths);
+
+            // PKGNAMEs also depend on makefiles outside of the package
+            // directories, such as lang/python/pyversion.mk, Makefile.common
+            // of other packages, buildlink3.mk of dependencies, and files
+            // mk.conf includes. We learn which ones only after bmake has
+            // read them, so one modified since we started loading may
+            // have been read either before or after the change. Allow for
+            // file systems with coarse timestamps.
+            auto const mkdir = (pkgsrcdir / "mk").lexically_normal();
+            for (auto const& file: pkgxx::memoized_pkgmk_makefiles()) {
+                auto const [end, _it] = std::mismatch(mkdir.begin(), mkdir.end(), file.begin(), file.end());
+                if (end == mkdir.end()) {
+                    continue; // Already watched.
+                }
+                _watch.add(file);
+                std::error_code ec;
+                if (auto const mtime = fs::last_write_time(file, ec);
+                    !ec && mtime + 1s >= loading && !_changed_while_loading) {
+                    _changed_while_loading = file;
+                }
+            }
+            return pkgpaths.size();
+        }
+
+        void
+        loop(pkg_chk::environment const& env) {
+            auto last_change = clock::now();
+            while (_ctl >= 0 || !_serving.empty()) {
+                std::vector<pollfd> fds;
+                fds.push_back({_sigchld, POLLIN, 0});
+                if (_ctl >= 0) {
+                    fds.push_back({_ctl, POLLIN, 0});
+                    if (_watch.fd() >= 0) {
+                        fds.push_back({_watch.fd(), POLLIN, 0});
+                    }
+                }
+                for (auto const& [_pid, req]: _serving) {
+                    if (!req.hung_up) {
+                        // We are only interested in POLLHUP, which is
+                        // reported regardless of events. Being readable
+                        // only means the server hasn't read the request
+                        // yet.
+                        fds.push_back({req.conn, 0, 0});
+                    }
+                }
+
+                int timeout = -1;
+                if (_ctl >= 0) {
+                    timeout = _watch.poll_timeout();
+                    if (_stale) {
+                        timeout = min_timeout(timeout, millis_until(last_change + SETTLE_TIME));
+                    }
+                }
+                if (poll(fds.data(), fds.size(), timeout) == -1 && errno != EINTR) {
+                    throw_errno("poll");
+                }
+
+                reap();
+                for (auto const& pfd: fds) {
+                    if (pfd.events == 0 && (pfd.revents & POLLHUP)) {
+                        hang_up(pfd.fd);
+                    }
+                }
+                if (_ctl >= 0) {
+                    if (auto const path = _watch.changed(); path) {
+                        last_change = clock::now();
+                        become_stale(path->string() + " has changed");
+                    }
+                    receive(env, last_change);
+                }
+                if (_ctl >= 0 && _stale && clock::now() >= last_change + SETTLE_TIME) {
+                    // The supervisor starts a new holder when it sees the
+                    // channel closed.
+                    close(_ctl);
+                    _ctl = -1;
+                }
+            }
+        }
+
+        void
+        become_stale(std::string const& why) {
+            if (!_stale) {
+                _stale = true;
+                msg(_opts) << "Daemon: " << why << ", reloading" << std::endl;
+                send_all(_ctl, std::string_view(&CTL_STALE, 1));
+            }
+        }
+
+        // Process messages from the supervisor.
+        void
+        receive(pkg_chk::environment const& env, clock::time_point& last_change) {
+            while (_ctl >= 0) {
+                pollfd pfd = {_ctl, POLLIN, 0};
+                if (poll(&pfd, 1, 0) <= 0) {
+                    return;
+                }
+
+                char cmd;
+                std::vector<int> fds;
+                if (recv_with_fds(_ctl, &cmd, 1, fds, 1) <= 0) {
+                    // The supervisor has gone away.
+                    close(_ctl);
+                    _ctl = -1;
+                }
+                else if (cmd == CTL_CONNECTION && fds.size() == 1) {
+                    // The client may have just changed something, such
+                    // as installing a package. A kernel notification of
+                    // it is already queued, but a poll may be far away.
+                    if (auto const path = _watch.changed(true); path) {
+                        last_change = clock::now();
+                        become_stale(path->string() + " has changed");
+                    }
+                    if (_stale) {
+                        send_all(fds.front(), "declined\n");
+                        close(fds.front());
+                    }
+                    else {
+                        fork_server(env, fds.front());
+                    }
+                }
+                else {
+                    for (int fd: fds) {
+                        close(fd);
+                    }
+                    if (cmd == CTL_RELOAD) {
+                        last_change = clock::now() - SETTLE_TIME;
+                        become_stale("asked to reload");
+                    }
+                }
+            }
+        }
+
+        void
+        fork_server(pkg_chk::environment const& env, int conn) {
+            // Threads of the pool and the reactor may still be around
+            // after loading. Every mutex of libpkgxx they may hold is
+            // held across fork(2) by pthread_atfork(3) handlers, and the
+            // pool and the reactor start over in the child.
+            flush_all();
+            pid_t const pid = fork();
+            if (pid == -1) {
+                warn(_opts) << "fork: " << std::strerror(errno) << std::endl;
+                send_all(conn, "declined\n");
+                close(conn);
+            }
+            else if (pid == 0) {
+                // Get a process group of our own, so that the holder can
+                // terminate everything we spawn when the client goes
+                // away.
+                setpgid(0, 0);
+                untrap_signals(_sigchld, {SIGCHLD});
+                std::signal(SIGPIPE, SIG_DFL);
+                close(_ctl);
+                for (auto const& [_pid, req]: _serving) {
+                    close(req.conn);
+                }
+                std::exit(serve(env, conn));
+            }
+            else {
+                _serving.emplace(pid, request {conn, false});
+            }
+        }
+
+        // Serve a request in a forked process, and return the exit
+        // status.
+        int
+        serve(pkg_chk::environment const& env, int conn) {
+            sock_reader in(conn);
+            auto const fds = in.recv_fds(3);
+            auto const fields = decode_request(in);
+            if (fds.size() != 3 || !fields || fields->size() < 4 ||
+                (*fields)[0] != PROTOCOL || (*fields)[1] != _key ||
+                chdir((*fields)[2].c_str()) == -1) {
+                send_all(conn, "declined\n");
+                return 0;
+            }
+            send_all(conn, "accepted\n");
+
+            std::vector<char*> argv;
+            for (auto it = fields->begin() + 3; it != fields->end(); it++) {
+                argv.push_back(const_cast<char*>(it->c_str()));
+            }
+            argv.push_back(nullptr);
+
+            flush_all();
+            std::cout << std::nounitbuf;
+            for (int i = 0; i < 3; i++) {
+                if (dup2(fds[i], i) == -1) {
+                    return 1;
+                }
+                close(fds[i]);
+            }
+
+            pkgxx::stats::reset();
+            try {
+                // getopt(3) has already been used to parse the command
+                // line of the daemon itself.
+#if defined(__GLIBC__)
+                optind = 0;
+#else
+                optind = 1;
+#  if HAVE_DECL_OPTRESET
+                optreset = 1;
+#  endif
+#endif
+                pkg_chk::options opts(static_cast<int>(argv.size() - 1), argv.data());
+                return _hooks.run(opts, env);
+            }
+            catch (pkg_chk::bad_options&) {
+                return 1;
+            }
+            catch (std::exception& e) {
+                std::cerr << argv[0] << ": " << e.what() << std::endl;
+                return 1;
+            }
+        }
+
+        // Report the exit status of servers to their clients.
+        void
+        reap() {
+            drain_signals(_sigchld);
+            int st;
+            pid_t pid;
+            while ((pid = waitpid(-1, &st, WNOHANG)) > 0) {
+                if (auto it = _serving.find(pid); it != _serving.end()) {
+                    send_all(it->second.conn, result_of(st));
+                    close(it->second.conn);
+                    _serving.erase(it);
+                }
+            }
+        }
+
+        // Terminate the server of a client that has gone away.
+        void
+        hang_up(int conn) {
+            for (auto& [pid, req]: _serving) {
+                if (req.conn == conn && !req.hung_up) {
+                    req.hung_up = true;
+                    kill(-pid, SIGTERM);
+                }
+            }
+        }
+
+        pkg_chk::options const& _opts;
+        pkg_chk::daemon::hooks const& _hooks;
+        std::string const& _key;
+        int _ctl;
+        int _sigchld;
+        pkgxx::fswatch _watch;
+        bool _stale;
+        std::optional<fs::path> _changed_while_loading;
+        std::map<pid_t, request> _serving;
+    };
+
+    // Start listening on a socket, replacing a stale one.
+    int
+    listen_on(fs::path const& path) {
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0) {
+            if (!S_ISSOCK(st.st_mode)) {
+                throw std::runtime_error(path.string() + ": exists and is not a socket");
+            }
+            if (int const sock = connect_to(path); sock != -1) {
+                close(sock);
+                throw std::runtime_error(path.string() + ": a daemon is already running");
+            }
+            unlink(path.c_str());
+        }
+
+        auto const addr = unix_addr(path);
+        int const sock = unix_socket();
+        mode_t const mask = umask(077);
+        int const res = bind(sock, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr));
+        umask(mask);
+        if (res == -1 || listen(sock, SOMAXCONN) == -1) {
+            throw_errno(path.string());
+        }
+        set_nonblock(sock);
+        return sock;
+    }
+
+    /* The process owning the socket. It keeps a holder running, and hands
+     * connections to it while it's ready. Otherwise clients are declined
+     * and do the work by themselves.
+     */
+    struct supervisor {
+        supervisor(pkg_chk::options const& opts,
+                   pkg_chk::daemon::hooks const& hooks)
+            : _opts(opts)
+            , _hooks(hooks)
+            , _path(pkg_chk::daemon::socket_path(opts))
+            , _key(request_key(opts))
+            , _listener(-1)
+            , _signals(-1)
+            , _holder(-1)
+            , _ctl(-1)
+            , _loaded(false)
+            , _ready(false)
+            , _restart_at(clock::now()) {}
+
+        [[noreturn]] void
+        run() {
+            // Messages of a daemon shouldn't sit in the buffer until it
+            // exits.
+            std::cout << std::unitbuf;
+            std::signal(SIGPIPE, SIG_IGN);
+            _listener = listen_on(_path);
+            if (stat(_path.c_str(), &_socket_st) == -1) {
+                throw_errno(_path.string());
+            }
+            _signals = trap_signals({SIGCHLD, SIGHUP, SIGINT, SIGTERM});
+            msg(_opts) << "Daemon: listening on " << _path.string() << std::endl;
+
+            while (true) {
+                if (_holder == -1 && _restart_at && clock::now() >= *_restart_at) {
+                    spawn_holder();
+                }
+
+                std::vector<pollfd> fds;
+                fds.push_back({_signals, POLLIN, 0});
+                fds.push_back({_listener, POLLIN, 0});
+                if (_ctl >= 0) {
+                    fds.push_back({_ctl, POLLIN, 0});
+                }
+                int const timeout =
+                    _holder == -1 && _restart_at ? millis_until(*_restart_at) : -1;
+                if (poll(fds.data(), fds.size(), timeout) == -1 && errno != EINTR) {
+                    throw_errno("poll");
+                }
+
+                for (int sig: drain_signals(_signals)) {
+                    switch (sig) {
+                    case SIGCHLD:
+                        reap();
+                        break;
+                    case SIGHUP:
+                        if (_ready) {
+                            send_all(_ctl, std::string_view(&CTL_RELOAD, 1));
+                        }
+                        break;
+                    default:
+                        shut_down();
+                    }
+                }
+                if (_ctl >= 0) {
+                    receive();
+                }
+                accept_clients();
+            }
+        }
+
+    private:
+        void
+        spawn_holder() {
+            int ctl[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctl) == -1) {
+                throw_errno("socketpair");
+            }
+            set_cloexec(ctl[0]);
+            set_cloexec(ctl[1]);
+
+            flush_all();
+            pid_t const pid = fork();
+            if (pid == -1) {
+                throw_errno("fork");
+            }
+            else if (pid == 0) {
+                close(ctl[0]);
+                close(_listener);
+                untrap_signals(_signals, {SIGCHLD, SIGHUP, SIGINT, SIGTERM});
+                try {
+                    holder(_opts, _hooks, _key, ctl[1]).run();
+                }
+                catch (std::exception& e) {
+                    std::cerr << "pkgchkxx: daemon: " << e.what() << std::endl;
+                    flush_all();
+                    _exit(1);
+                }
+            }
+            close(ctl[1]);
+            _holder     = pid;
+            _ctl        = ctl[0];
+            _loaded     = false;
+            _ready      = false;
+            _restart_at = std::nullopt;
+        }
+
+        void
+        receive() {
+            char buf[16];
+            ssize_t const n = recv(_ctl, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                return;
+            }
+            else if (n > 0) {
+                for (ssize_t i = 0; i < n; i++) {
+                    if (buf[i] == CTL_READY) {
+                        _loaded = true;
+                        _ready  = true;
+                    }
+                    else if (buf[i] == CTL_STALE) {
+                        _ready = false;
+                    }
+                }
+            }
+            else {
+                retire_holder();
+            }
+        }
+
+        // The holder has either died, or become stale and stopped taking
+        // requests. In the latter case it's still running to finish what
+        // it has accepted.
+        void
+        retire_holder() {
+            if (_ctl >= 0) {
+                close(_ctl);
+                _ctl = -1;
+            }
+            if (_loaded) {
+                _restart_at = clock::now();
+            }
+            else {
+                warn(_opts) << "Daemon: failed to load, retrying in "
+                            << std::chrono::duration_cast<std::chrono::seconds>(RETRY_INTERVAL).count()
+                            << " seconds" << std::endl;
+                _restart_at = clock::now() + RETRY_INTERVAL;
+            }
+            _retired.push_back(_holder);
+            _holder = -1;
+            _ready  = false;
+        }
+
+        void
+        reap() {
+            int st;
+            pid_t pid;
+            while ((pid = waitpid(-1, &st, WNOHANG)) > 0) {
+                if (pid == _holder) {
+                    retire_holder();
+                }
+                _retired.erase(std::remove(_retired.begin(), _retired.end(), pid), _retired.end());
+            }
+        }
+
+        void
+        accept_clients() {
+            while (true) {
+                int const conn = accept(_listener, nullptr, nullptr);
+                if (conn == -1) {
+                    return;
+                }
+                set_cloexec(conn);
+
+                if (peer_uid(conn) != geteuid()) {
+                    // Don't even talk to it.
+                }
+                else if (_ready &&
+                         send_with_fds(_ctl, std::string_view(&CTL_CONNECTION, 1), {conn})) {
+                    // The holder now has it.
+                }
+                else {
+                    send_all(conn, "declined\n");
+                }
+                close(conn);
+            }
+        }
+
+        [[noreturn]] void
+        shut_down() {
+            // Don't remove a socket another daemon has created since.
+            struct stat cur;
+            if (stat(_path.c_str(), &cur) == 0 &&
+                cur.st_dev == _socket_st.st_dev && cur.st_ino == _socket_st.st_ino) {
+                unlink(_path.c_str());
+            }
+            // A holder that has loaded exits by itself when it sees the
+            // channel closed and finishes serving accepted requests.
+            if (_holder != -1 && !_loaded) {
+                kill(_holder, SIGTERM);
+            }
+            msg(_opts) << "Daemon: exiting" << std::endl;
+            std::exit(0);
+        }
+
+        pkg_chk::options const& _opts;
+        pkg_chk::daemon::hooks const& _hooks;
+        fs::path const _path;
+        std::string const _key;
+        struct stat _socket_st;
+        int _listener;
+        int _signals;
+        pid_t _holder;
+        std::vector<pid_t> _retired;
+        int _ctl;
+        bool _loaded; // The holder has sent CTL_READY.
+        bool _ready;  // ...and hasn't become stale since.
+        std::optional<clock::time_point> _restart_at;
+    };
+}
+
+namespace pkg_chk::daemon {
+    fs::path
+    socket_path(options const& opts) {
+        if (opts.socket_path) {
+            return *opts.socket_path;
+        }
+        else if (auto const dir = pkgxx::cgetenv("XDG_RUNTIME_DIR"); !dir.empty()) {
+            return fs::path(dir) / "pkgchkxx.sock";
+        }
+        else {
+            return "/tmp/pkgchkxx-" + std::to_string(geteuid()) + ".sock";
+        }
+    }
+
+    void
+    serve(options const& opts, hooks const& h) {
+        supervisor(opts, h).run();
+    }
+
+    std::optional<int>
+    delegate(options const& opts, int argc, char* const argv[]) {
+        if (opts.no_daemon || opts.trace_file || opts.record_file || opts.replay_file) {
+            // These have to happen in this process.
+            return std::nullopt;
+        }
+        // Only requests that change nothing are delegated. Anything
+        // else would run with the umask, resource limits, controlling
+        // terminal, and the rest of the environment of the daemon, not
+        // ours.
+        switch (opts.mode) {
+        case mode::ADD_DELETE_UPDATE:
+            if (!opts.dry_run && !opts.list_ver_diffs) {
+                return std::nullopt;
+            }
+            break;
+        case mode::LIST_BIN_PKGS:
+        case mode::LOOKUP_TODO:
+            break;
+        default:
+            return std::nullopt;
+        }
+
+        // Don't talk to a daemon run by anyone else.
+        auto const path = socket_path(opts);
+        struct stat st;
+        if (lstat(path.c_str(), &st) == -1 || !S_ISSOCK(st.st_mode) || st.st_uid != geteuid()) {
+            return std::nullopt;
+        }
+        int const sock = connect_to(path);
+        if (sock == -1) {
+            return std::nullopt;
+        }
+        if (peer_uid(sock) != geteuid()) {
+            close(sock);
+            return std::nullopt;
+        }
+
+        flush_all();
+        auto const req = encode_request(request_key(opts), fs::current_path(), argc, argv);
+        if (!send_with_fds(sock, req, {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO})) {
+            close(sock);
+            return std::nullopt;
+        }
+
+        sock_reader in(sock);
+        if (in.line() != "accepted") {
+            close(sock);
+            return std::nullopt;
+        }
+        auto const result = in.line();
+        close(sock);
+        if (result && result->compare(0, 5, "exit ") == 0) {
+            if (auto const status = parse_decimal(std::string_view(*result).substr(5)); status) {
+                return static_cast<int>(*status);
+            }
+        }
+        else if (result && result->compare(0, 7, "signal ") == 0) {
+            if (auto const sig = parse_decimal(std::string_view(*result).substr(7)); sig) {
+                return reraise(static_cast<int>(*sig));
+            }
+        }
+        std::cerr << argv[0] << ": lost connection to the daemon" << std::endl;
+        return 1;
+    }
+}
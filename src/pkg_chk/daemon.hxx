@@ -0,0 +1,61 @@
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <set>
+
+#include <pkgxx/pkgpath.hxx>
+
+#include "environment.hxx"
+#include "options.hxx"
+
+namespace pkg_chk {
+    /** A resident process serving pkg_chk over a Unix domain socket.
+     *
+     * Most of the time of a run goes to evaluating the environment,
+     * reading package summaries, and extracting PKGNAMEs from package
+     * Makefiles. The daemon does them once and keeps the results in
+     * memory until anything they depend on changes, which it learns from
+     * \ref pkgxx::fswatch. Every request is served by a process forked
+     * from the one holding the results, so a request can't corrupt them
+     * and sees the command line of the client exactly as pkg_chk would.
+     */
+    namespace daemon {
+        /** Functions of the tool the daemon calls back. */
+        struct hooks {
+            /** Do in advance what checking \c pkgpaths takes, so that the
+             * results stay in memory. */
+            std::function<
+                void (options const&, environment const&, std::set<pkgxx::pkgpath> const&)
+                > warm_up;
+
+            /** Serve a request with options given by the client, and
+             * return the exit status. */
+            std::function<
+                int (options&, environment const&)
+                > run;
+        };
+
+        /** Return the path to the socket of the daemon: either the one
+         * given with \c --socket, \c $XDG_RUNTIME_DIR/pkgchkxx.sock, or
+         * \c /tmp/pkgchkxx-UID.sock. */
+        std::filesystem::path
+        socket_path(options const& opts);
+
+        /** Listen on the socket and serve requests until terminated by
+         * \c SIGTERM or \c SIGINT. \c SIGHUP makes it forget everything
+         * it has in memory. Options other than the command line of
+         * clients are taken from \c opts. */
+        [[noreturn]] void
+        serve(options const& opts, hooks const& h);
+
+        /** Have a daemon listening on the socket run the command line
+         * with the standard input, output, and error of this
+         * process. Return the exit status, or \c std::nullopt if no
+         * daemon is running or it has declined the request. The caller
+         * should do the work by itself in that case. */
+        std::optional<int>
+        delegate(options const& opts, int argc, char* const argv[]);
+    }
+}
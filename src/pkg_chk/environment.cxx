@@ -11,6 +11,7 @@
 #include <pkgxx/harness.hxx>
 #include <pkgxx/makevars.hxx>
 #include <pkgxx/pkgdb.hxx>
+#include <pkgxx/tape.hxx>
 
 #include "config.h"
 #include "environment.hxx"
@@ -84,7 +85,7 @@ namespace pkg_chk {
             [this, &opts]() {
                 makefile_env _menv;
 
-                if (!fs::is_directory(PKGSRCDIR.get())) {
+                if (!pkgxx::tape::is_directory(PKGSRCDIR.get())) {
                     fatal(opts, [this](auto& out) {
                                     out << "Unable to locate PKGSRCDIR ("
                                         << (PKGSRCDIR.get().empty() ? "not set" : PKGSRCDIR.get())
@@ -92,18 +93,18 @@ namespace pkg_chk {
                                 });
                 }
                 std::vector<std::string> vars = {
-                    "PACKAGES",
                     "PKG_ADD",
                     "PKG_ADMIN",
                     "PKG_DELETE",
                     "PKG_INFO",
                     "PKG_SUFX",
+                    "PKG_SYSCONFDIR",
                     "PKGCHK_NOTAGS",
                     "PKGCHK_TAGS",
                     "PKGCHK_UPDATE_CONF"
                 };
                 if (opts.pkgchk_conf_path.empty()) {
-                    vars.push_back("PKGCHK_CONF_PATH");
+                    vars.push_back("PKGCHK_CONF");
                 }
                 if (opts.bin_pkg_path.empty()) {
                     vars.push_back("PACKAGES");
@@ -111,17 +112,7 @@ namespace pkg_chk {
                 if (geteuid() != 0) {
                     vars.push_back("SU_CMD");
                 }
-                std::map<std::string, std::string> value_of;
-                auto const pkgpath = PKGSRCDIR.get() / "pkgtools/pkg_install"; // Any package will do.
-                if (fs::is_directory(pkgpath)) {
-                    value_of = pkgxx::extract_pkgmk_vars(pkgpath, vars).value();
-                }
-                else if (MAKECONF.get() != "/dev/null") {
-                    value_of = pkgxx::extract_mkconf_vars(MAKECONF.get(), vars).value();
-                }
-                for (auto const& [var, value]: value_of) {
-                    verbose_var(opts, var, value);
-                }
+                auto value_of = pkgsrc_vars_of(vars);
                 _menv.PACKAGES           =
                     opts.bin_pkg_path.empty()
                     ? fs::path(value_of["PACKAGES"])
@@ -187,17 +178,13 @@ namespace pkg_chk {
             [this, &opts]() {
                 platform_env _penv;
 
-                auto const pkgpath = PKGSRCDIR.get() / "pkgtools/pkg_chk"; // Any package will do.
-                if (fs::is_directory(pkgpath)) {
-                    std::vector<std::string> const vars = {
-                        "OPSYS",
-                        "OS_VERSION",
-                        "MACHINE_ARCH"
-                    };
-                    auto value_of = pkgxx::extract_pkgmk_vars(pkgpath, vars).value();
-                    for (auto const& [var, value]: value_of) {
-                        verbose_var(opts, var, value);
-                    }
+                auto const& all = pkgsrc_vars.get();
+                if (auto const it = all.find("OPSYS"); it != all.end() && !it->second.empty()) {
+                    auto value_of = pkgsrc_vars_of({
+                            "OPSYS",
+                            "OS_VERSION",
+                            "MACHINE_ARCH"
+                        });
                     _penv.OPSYS        = value_of["OPSYS"       ];
                     _penv.OS_VERSION   = value_of["OS_VERSION"  ];
                     _penv.MACHINE_ARCH = value_of["MACHINE_ARCH"];
@@ -242,6 +229,13 @@ namespace pkg_chk {
             [this]() {
                 return pkgxx::pkgmap(bin_pkg_summary.get());
             }).share();
+        bin_pkg_depends = std::async(
+            std::launch::deferred,
+            [this, &opts]() {
+                pkgxx::resolved_depends deps(bin_pkg_summary.get(), opts.concurrency);
+                verbose(opts) << "Distinct dependency patterns: " << deps.distinct_patterns() << std::endl;
+                return deps;
+            }).share();
 
         installed_pkgnames = std::async(
             std::launch::deferred,
@@ -259,9 +253,10 @@ namespace pkg_chk {
             [this, &opts]() {
                 verbose(opts) << "Enumerate PKGPATH from installed packages" << std::endl;
 
-                pkgxx::harness pkg_info(pkgxx::shell, {pkgxx::shell, "-s", "--", "-aQ", "PKGPATH"});
-                pkg_info.cin() << "exec " << PKG_INFO.get() << " \"$@\"" << std::endl;
-                pkg_info.cin().close();
+                using namespace na::literals;
+                auto const argv = pkgxx::shell_command_argv(PKG_INFO.get(), {"-aQ", "PKGPATH"});
+                pkgxx::harness pkg_info(
+                    argv[0], argv, "stdin_action"_na = pkgxx::harness::fd_action::close);
 
                 std::set<pkgxx::pkgpath> pkgpaths;
                 for (std::string line; std::getline(pkg_info.cout(), line); ) {
@@ -271,6 +266,20 @@ namespace pkg_chk {
                 }
                 return pkgpaths;
             }).share();
+        installed_pkg_summary = std::async(
+            std::launch::deferred,
+            [this, &opts]() {
+                atomic_verbose(opts, [](auto& out) {
+                                         out << "Getting summary from installed packages" << std::endl;
+                                     });
+                return pkgxx::summary(PKG_INFO.get());
+            }).share();
+
+        todo = std::async(
+            std::launch::deferred,
+            [this]() {
+                return pkgxx::todo_file(PKGSRCDIR.get() / "doc/TODO");
+            }).share();
 
         // Tags are collected from the platform, options, and Makefile
         // variables.
@@ -7,6 +7,7 @@
 
 #include <pkgxx/environment.hxx>
 #include <pkgxx/summary.hxx>
+#include <pkgxx/todo.hxx>
 
 #include "options.hxx"
 #include "tag.hxx"
@@ -44,9 +45,13 @@ namespace pkg_chk {
 
         std::shared_future<pkgxx::summary> bin_pkg_summary;
         std::shared_future<pkgxx::pkgmap>  bin_pkg_map;
+        std::shared_future<pkgxx::resolved_depends> bin_pkg_depends;
 
         std::shared_future<std::set<pkgxx::pkgname>> installed_pkgnames; // Fastest to compute.
         std::shared_future<std::set<pkgxx::pkgpath>> installed_pkgpaths; // Moderately slow.
+        std::shared_future<pkgxx::summary>           installed_pkg_summary; // Slow.
+
+        std::shared_future<pkgxx::todo_file> todo; // doc/TODO
 
         std::shared_future<tagset>  included_tags;
         std::shared_future<tagset>  excluded_tags;
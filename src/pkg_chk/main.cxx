@@ -13,14 +13,22 @@
 #include <tuple>
 
 #include <pkgxx/config.h>
+#include <pkgxx/distfile.hxx>
 #include <pkgxx/graph.hxx>
 #include <pkgxx/harness.hxx>
+#include <pkgxx/mutex_guard.hxx>
+#include <pkgxx/nursery.hxx>
 #include <pkgxx/pkgdb.hxx>
 #include <pkgxx/pkgpath.hxx>
+#include <pkgxx/progress.hxx>
+#include <pkgxx/stats.hxx>
+#include <pkgxx/tape.hxx>
 #include <pkgxx/todo.hxx>
+#include <pkgxx/trace.hxx>
 
 #include "pkg_chk/check.hxx"
 #include "config_file.hxx"
+#include "daemon.hxx"
 #include "environment.hxx"
 #include "message.hxx"
 #include "options.hxx"
@@ -45,7 +53,7 @@ namespace {
         std::vector<std::string> const& args,
         bool fail_ok,
         std::optional<std::filesystem::path> const& cwd = std::nullopt,
-        std::function<void (std::map<std::string, std::string>&)> const& env_mod = [](auto&) {}) {
+        std::function<void (std::map<std::string, std::string>&)> const& env_mod = {}) {
 
         if (opts.list_ver_diffs) {
             return true;
@@ -64,16 +72,14 @@ namespace {
 
         if (!opts.dry_run) {
             using namespace na::literals;
-            std::vector<std::string> argv = {pkgxx::shell, "-s", "--"};
-            argv.insert(argv.end(), args.begin(), args.end());
+            auto const argv = pkgxx::shell_command_argv(cmd, args);
             pkgxx::harness prog(
-                pkgxx::shell, argv,
+                argv[0], argv,
                 "cwd"_na           = cwd,
                 "env_mod"_na       = env_mod,
                 "stdin_action"_na  = pkgxx::harness::fd_action::pipe,
                 "stdout_action"_na = pkgxx::harness::fd_action::pipe,
                 "stderr_action"_na = pkgxx::harness::fd_action::merge_with_stdout);
-            prog.cin() << "exec " << cmd << " \"$@\"" << std::endl;
             prog.cin().close();
 
             for (std::string line; std::getline(prog.cout(), line); ) {
@@ -106,7 +112,7 @@ namespace {
         std::vector<std::string> const& args,
         bool fail_ok,
         std::optional<std::filesystem::path> const& cwd = std::nullopt,
-        std::function<void (std::map<std::string, std::string>&)> const& env_mod = [](auto&) {}) {
+        std::function<void (std::map<std::string, std::string>&)> const& env_mod = {}) {
 
         if (!env.SU_CMD.get().empty()) {
             return run_cmd(opts, env, env.SU_CMD.get(), {cmd + ' ' + pkgxx::stringify_argv(args)}, fail_ok, cwd, env_mod);
@@ -122,15 +128,83 @@ namespace {
         pkg_chk::environment const& env,
         std::map<pkgxx::pkgname, pkgxx::pkgpath> const& pkgs) {
 
+        // Reuse the summary the check has read, and order the packages so
+        // that each one comes before everything it depends on, directly or
+        // through packages that aren't going to be deleted.
+        pkgxx::summary const& installed = env.installed_pkg_summary.get();
+        std::map<pkgxx::pkgname, std::set<pkgxx::pkgname>> reachable;
+        std::function<std::set<pkgxx::pkgname> const& (pkgxx::pkgname const&)> deps_to_delete =
+            [&](pkgxx::pkgname const& name) -> std::set<pkgxx::pkgname> const& {
+                if (auto it = reachable.find(name); it != reachable.end()) {
+                    return it->second;
+                }
+                // Insert it first so that a cycle doesn't recurse forever.
+                auto& ret = reachable[name];
+                std::set<pkgxx::pkgname> found;
+                if (auto it = installed.find(name); it != installed.end()) {
+                    for (auto const& dep_pattern: it->second.DEPENDS) {
+                        if (auto const dep = dep_pattern.best(installed); dep != installed.end()) {
+                            if (pkgs.count(dep->first)) {
+                                found.insert(dep->first);
+                            }
+                            auto const& indirect = deps_to_delete(dep->first);
+                            found.insert(indirect.begin(), indirect.end());
+                        }
+                    }
+                }
+                ret = std::move(found);
+                return ret;
+            };
+
+        using pkgname_cref = std::reference_wrapper<pkgxx::pkgname const>;
+        pkgxx::graph<pkgname_cref> topology;
         for (auto const& [name, _path]: pkgs) {
-            if (pkgxx::is_pkg_installed(env.PKG_INFO.get(), name)) {
-                run_cmd_su(opts, env, env.PKG_DELETE.get(), {"-r", name.string()}, true);
+            if (auto it = installed.find(name); it != installed.end()) {
+                topology.add_vertex(it->first);
+                for (auto const& dep: deps_to_delete(it->first)) {
+                    topology.add_edge(it->first, installed.find(dep)->first);
+                }
+            }
+        }
+
+        std::vector<std::string> args = {"-r"};
+        try {
+            auto const tsorted = topology.tsort();
+            for (auto it = tsorted.rbegin(); it != tsorted.rend(); it++) {
+                args.push_back(it->get().string());
+            }
+        }
+        catch (pkgxx::not_a_dag<pkgname_cref>&) {
+            // Can't happen for sane package databases, but pkg_delete
+            // can sort it out anyway.
+            for (auto const& [name, _path]: pkgs) {
+                if (installed.count(name)) {
+                    args.push_back(name.string());
+                }
+            }
+        }
+        if (args.size() == 1) {
+            return;
+        }
+
+        // pkg_delete stops at the first failure. Delete the rest one by
+        // one to report which ones failed.
+        if (!run_cmd_su(opts, env, env.PKG_DELETE.get(), args, true)) {
+            std::set<pkgxx::pkgname> remaining;
+            for (auto& name: pkgxx::installed_pkgnames(env.PKG_INFO.get())) {
+                remaining.insert(std::move(name));
+            }
+            for (auto it = args.begin() + 1; it != args.end(); it++) {
+                if (remaining.count(pkgxx::pkgname(*it))) {
+                    run_cmd_su(opts, env, env.PKG_DELETE.get(), {"-r", *it}, true);
+                }
             }
         }
     }
 
     std::set<pkgxx::pkgpath>
     pkgpaths_to_check(pkg_chk::options const& opts, pkg_chk::environment const& env) {
+        pkgxx::trace::span span("phase", "scan");
         std::set<pkgxx::pkgpath> pkgpaths;
         if (opts.delete_mismatched || opts.update) {
             pkgpaths = env.installed_pkgpaths.get();
@@ -158,7 +232,8 @@ namespace {
                 opts.concurrency,
                 opts.update,
                 opts.delete_mismatched,
-                env.PKG_INFO)
+                env.PKG_INFO,
+                env.installed_pkg_summary)
             , source_checker_base(env.PKGSRCDIR)
             , binary_checker_base(
                 env.PACKAGES,
@@ -191,12 +266,40 @@ namespace {
         pkg_chk::options const& _opts;
     };
 
+    /* Extracts PKGNAMEs in a daemon ahead of requests. The results are
+     * memoized by pkgxx::extract_pkgmk_vars(), not by the warmer itself,
+     * so that checkers created later find them.
+     */
+    struct warmer: checker {
+        warmer(pkg_chk::options const& opts, pkg_chk::environment const& env)
+            : checker_base(
+                true,
+                opts.check_build_version,
+                opts.concurrency,
+                true,
+                false,
+                env.PKG_INFO,
+                env.installed_pkg_summary)
+            , source_checker_base(env.PKGSRCDIR)
+            , binary_checker_base(
+                env.PACKAGES,
+                env.PKG_SUFX,
+                env.bin_pkg_summary)
+            , configurable_checker_base(true)
+            , checker(opts, env) {}
+
+        void
+        warm_up(std::set<pkgxx::pkgpath> const& pkgpaths) const {
+            latest_pkgnames(pkgpaths);
+        }
+    };
+
     void
     delete_and_recheck(
         pkg_chk::options const& opts,
         pkg_chk::environment const& env,
         std::set<pkgxx::pkgpath> const& pkgpaths,
-        checker const& chk,
+        checker& chk,
         checker::result& res) {
 
         std::set<pkgxx::pkgpath> update_conf;
@@ -229,6 +332,9 @@ namespace {
             if (!res.MISMATCH_TODO.empty()) {
                 delete_pkgs(opts, env, res.MISMATCH_TODO);
                 msg(opts) << "Rechecking packages after deletions" << std::endl;
+                // The latest PKGNAMEs are still valid but the installed
+                // ones aren't.
+                chk.refresh_installed();
             }
             std::set<pkgxx::pkgpath> recheck_paths = pkgpaths;
             if (opts.update) {
@@ -240,15 +346,267 @@ namespace {
         }
     }
 
-    bool
-    try_fetch(
+    /** Fetch distfiles for given packages and their dependencies, and
+     * return the set of packages that failed to fetch any of them.
+     */
+    std::set<pkgxx::pkgname>
+    fetch_distfiles(
         pkg_chk::options const& opts,
         pkg_chk::environment const& env,
-        pkgxx::pkgpath const& path) {
+        std::map<pkgxx::pkgname, pkgxx::pkgpath> const& pkgs) {
 
-        std::stringstream ss;
-        ss << CFG_BMAKE << " -C " << (env.PKGSRCDIR.get() / path) << " fetch-list | " << pkgxx::shell;
-        return run_cmd(opts, env, ss.str(), {}, true);
+        if (opts.list_ver_diffs) {
+            return {};
+        }
+
+        // "make fetch-list" would give us a script that recurses into
+        // dependencies, which means we can't run it in parallel without
+        // the risk of race condition. So we collect distfiles of every
+        // package we are going to build, level by level in the dependency
+        // graph, and then fetch each unique distfile exactly once.
+        pkgxx::guarded<
+            std::map<pkgxx::pkgpath, std::optional<pkgxx::fetch_info>>
+            > infos;
+        std::set<pkgxx::pkgpath> frontier;
+        for (auto const& [_name, path]: pkgs) {
+            frontier.insert(path);
+        }
+        while (!frontier.empty()) {
+            {
+                pkgxx::nursery n(opts.concurrency, pkgxx::workload::spawn);
+                for (pkgxx::pkgpath const& path: frontier) {
+                    n.start_soon(
+                        [&]() {
+                            auto info = pkgxx::fetch_info::from_source(env.PKGSRCDIR.get(), path);
+                            if (!info) {
+                                pkg_chk::atomic_warn(
+                                    opts,
+                                    [&](auto& out) {
+                                        out << "No " << path << "/Makefile - package moved or obsolete?" << std::endl;
+                                    });
+                            }
+                            infos.lock()->emplace(path, std::move(info));
+                        });
+                }
+            }
+
+            std::set<pkgxx::pkgpath> next;
+            auto visited = infos.lock();
+            for (pkgxx::pkgpath const& path: frontier) {
+                if (auto const& info = visited->at(path); info) {
+                    for (pkgxx::pkgpath const& dep: info->depends) {
+                        if (visited->count(dep) == 0) {
+                            next.insert(dep);
+                        }
+                    }
+                }
+            }
+            frontier = std::move(next);
+        }
+
+        auto const visited = std::move(*infos.lock());
+        pkgxx::fetch_tools tools;
+        std::map<fs::path, pkgxx::distfile> unique;
+        for (auto const& [_path, info]: visited) {
+            if (info) {
+                tools = info->tools;
+                for (auto const& file: info->distfiles) {
+                    // Different packages can list different sites for
+                    // the same distfile. Try all of them.
+                    auto [it, emplaced] = unique.emplace(file.path, file);
+                    if (!emplaced) {
+                        for (auto const& site: file.sites) {
+                            auto& sites = it->second.sites;
+                            if (std::find(sites.begin(), sites.end(), site) == sites.end()) {
+                                sites.push_back(site);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        // Existing files are verified too, as they may be leftovers of
+        // interrupted fetches.
+        std::vector<pkgxx::distfile> files;
+        for (auto const& [_path, file]: unique) {
+            files.push_back(file);
+        }
+        verbose(opts) << files.size() << " distfiles to verify or fetch" << std::endl;
+
+        std::map<fs::path, std::exception_ptr> failed;
+        if (opts.dry_run) {
+            for (auto const& file: files) {
+                if (!pkgxx::is_fetched(file, tools.DIGEST)) {
+                    msg(opts) << "Would fetch " << file.path.string() << std::endl;
+                }
+            }
+        }
+        else {
+            failed = pkgxx::fetch_distfiles(
+                files, tools, opts.concurrency, 2,
+                [&](auto const&, auto const& url) {
+                    pkg_chk::atomic_msg(
+                        opts,
+                        [&](auto& out) {
+                            out << "Fetching " << url << std::endl;
+                        });
+                });
+            for (auto const& [_path, ep]: failed) {
+                try {
+                    std::rethrow_exception(ep);
+                }
+                catch (std::exception const& e) {
+                    msg(opts) << "** " << e.what() << std::endl;
+                }
+            }
+        }
+
+        // A package fails if anything in its dependency closure does.
+        std::set<pkgxx::pkgname> ret;
+        for (auto const& [name, path]: pkgs) {
+            std::set<pkgxx::pkgpath> seen = {path};
+            std::deque<pkgxx::pkgpath> queue = {path};
+            while (!queue.empty()) {
+                auto const& info = visited.at(queue.front());
+                queue.pop_front();
+                if (!info) {
+                    ret.insert(name);
+                    break;
+                }
+                if (std::any_of(
+                        info->distfiles.begin(), info->distfiles.end(),
+                        [&](auto const& file) { return failed.count(file.path) > 0; })) {
+                    ret.insert(name);
+                    break;
+                }
+                for (pkgxx::pkgpath const& dep: info->depends) {
+                    if (seen.insert(dep).second) {
+                        queue.push_back(dep);
+                    }
+                }
+            }
+        }
+        return ret;
+    }
+
+    /** Install binary packages for missing packages in \c todo. The
+     * dependency closure of them is resolved from the binary package
+     * summary and is grouped into waves of packages that are independent
+     * of each other. Each wave is then installed with a single pkg_add
+     * invocation. Packages that have been handled are removed from \c
+     * todo, and are added to either \c INSTALL_DONE or \c FAILED_DONE.
+     */
+    void
+    install_binary_pkgs(
+        pkg_chk::options const& opts,
+        pkg_chk::environment const& env,
+        std::map<pkgxx::pkgname, pkgxx::pkgpath>& todo,
+        std::set<pkgxx::pkgname>& INSTALL_DONE,
+        std::set<pkgxx::pkgname>& FAILED_DONE) {
+
+        // The set of installed packages has changed since we checked them,
+        // because of deletions.
+        std::set<pkgxx::pkgname> installed;
+        for (auto& name: pkgxx::installed_pkgnames(env.PKG_INFO.get())) {
+            installed.insert(std::move(name));
+        }
+
+        pkgxx::summary const& sum = env.bin_pkg_summary.get();
+        pkgxx::resolved_depends const& resolved = env.bin_pkg_depends.get();
+        using pkgname_cref = std::reference_wrapper<pkgxx::pkgname const>;
+        pkgxx::graph<pkgname_cref> topology;
+        std::set<pkgname_cref, std::less<pkgxx::pkgname>> planned;
+
+        std::deque<pkgname_cref> queue;
+        for (auto const& [name, _path]: todo) {
+            if (installed.count(name) == 0) {
+                if (auto it = sum.find(name); it != sum.end()) {
+                    topology.add_vertex(it->first);
+                    planned.insert(it->first);
+                    queue.push_back(it->first);
+                }
+            }
+        }
+        while (!queue.empty()) {
+            pkgxx::pkgname const& name = queue.front();
+            queue.pop_front();
+
+            auto const& DEPENDS = sum.at(name).DEPENDS;
+            auto best = resolved.at(name).begin();
+            for (auto const& dep_pattern: DEPENDS) {
+                auto const* const dep = *best++;
+                if (dep_pattern.best(installed) != installed.end()) {
+                    continue;
+                }
+                else if (dep) {
+                    if (!topology.has_vertex(dep->first)) {
+                        queue.push_back(dep->first);
+                    }
+                    topology.add_edge(name, dep->first);
+                }
+                else {
+                    // pkg_add will report it.
+                    verbose(opts) << name << ": missing dependency " << dep_pattern << std::endl;
+                }
+            }
+        }
+
+        std::vector<std::vector<pkgname_cref>> levels;
+        try {
+            levels = topology.tsort_levels();
+        }
+        catch (pkgxx::not_a_dag<pkgname_cref>& e) {
+            fatal(opts, [&](auto& out) {
+                            out << e.what() << std::endl;
+                        });
+        }
+
+        // Only name packages that are explicitly requested. Dependencies
+        // in the closure are pulled in by pkg_add and are marked as
+        // automatic, and ordering waves by the closure ensures that
+        // requested packages are never installed as somebody's dependency.
+        unsigned wave = 0;
+        for (auto const& level: levels) {
+            std::vector<std::string> args;
+            for (pkgxx::pkgname const& name: level) {
+                if (planned.count(name)) {
+                    args.push_back(
+                        (env.PACKAGES.get() / (name.string() + env.PKG_SUFX.get())).string());
+                }
+            }
+            if (args.empty()) {
+                continue;
+            }
+
+            verbose(opts) << "Installing " << args.size()
+                          << " binary packages in wave " << ++wave << std::endl;
+            run_cmd_su(
+                opts, env, env.PKG_ADD.get(), args, true, std::nullopt,
+                [&](auto& env_map) {
+                    if (std::string const& PKG_PATH = env.PKG_PATH.get(); !PKG_PATH.empty()) {
+                        env_map["PKG_PATH"] = PKG_PATH;
+                    }
+                });
+        }
+
+        // pkg_add doesn't tell us which ones failed. See what are
+        // installed now.
+        if (!planned.empty() && !opts.dry_run && !opts.list_ver_diffs) {
+            installed.clear();
+            for (auto& name: pkgxx::installed_pkgnames(env.PKG_INFO.get())) {
+                installed.insert(std::move(name));
+            }
+        }
+        for (pkgxx::pkgname const& name: planned) {
+            if (opts.dry_run || opts.list_ver_diffs || installed.count(name)) {
+                INSTALL_DONE.insert(name);
+            }
+            else {
+                FAILED_DONE.insert(name);
+            }
+            todo.erase(name);
+        }
     }
 
     bool
@@ -277,7 +635,7 @@ namespace {
         }
         else if (opts.build_from_source) {
             return run_cmd(
-                opts, env, CFG_BMAKE,
+                opts, env, pkgxx::bmake(),
                 {
                     "update",
                     opts.no_clean ? "NOCLEAN=yes" : "DEPENDS_TARGET=package-install clean"
@@ -300,7 +658,7 @@ namespace {
             return;
         }
 
-        checker const chk(opts, env);
+        checker chk(opts, env);
         checker::result res = chk.run(pkgpaths);
         if (!res.MISMATCH_TODO.empty() ||
             (opts.update && fs::exists(env.PKGCHK_UPDATE_CONF.get()))) {
@@ -310,23 +668,21 @@ namespace {
 
         std::set<pkgxx::pkgname> FAILED_DONE;
         if (opts.fetch && !res.MISSING_TODO.empty()) {
-            // The script generated by "make fetch-list" recurse into
-            // dependencies, which means we can't run it parallelly without
-            // the risk of race condition.
+            // Packages previously marked as MISMATCH_TODO have been moved
+            // to MISSING_TODO at this point.
             msg(opts) << "Fetching distfiles" << std::endl;
-            for (auto const& [name, path]: res.MISSING_TODO) {
-                // Packages previously marked as MISMATCH_TODO have been
-                // moved to MISSING_TODO at this point.
-                if (!try_fetch(opts, env, path)) {
-                    FAILED_DONE.insert(name);
-                }
-            }
+            FAILED_DONE = fetch_distfiles(opts, env, res.MISSING_TODO);
         }
 
         std::set<pkgxx::pkgname> INSTALL_DONE;
         if ((opts.add_missing || opts.update) && !res.MISSING_TODO.empty()) {
             msg(opts) << "Installing packages" << std::endl;
-            for (auto const& [name, path]: res.MISSING_TODO) {
+            pkgxx::trace::span span("phase", "build");
+            auto todo = res.MISSING_TODO;
+            if (opts.use_binary_pkgs) {
+                install_binary_pkgs(opts, env, todo, INSTALL_DONE, FAILED_DONE);
+            }
+            for (auto const& [name, path]: todo) {
                 if (try_install(opts, env, name, path)) {
                     INSTALL_DONE.insert(name);
                 }
@@ -402,12 +758,13 @@ namespace {
          * file right now to save some time. */
         auto f_todo = std::async(
             std::launch::async,
-            [env]() {
-                return pkgxx::todo_file(env.PKGSRCDIR.get() / "doc/TODO");
+            [todo = env.todo]() {
+                todo.wait();
             });
 
         std::set<pkgxx::pkgname> const& pkgnames = env.installed_pkgnames.get();
-        pkgxx::todo_file const todo(f_todo.get());
+        f_todo.get();
+        pkgxx::todo_file const& todo = env.todo.get();
         for (pkgxx::pkgname name: pkgnames) {
             normalize_pkgname(name);
 
@@ -425,8 +782,8 @@ namespace {
     void
     list_bin_pkgs(pkg_chk::options const& opts, pkg_chk::environment const& env) {
         std::string    const& sufx = env.PKG_SUFX.get();
-        pkgxx::summary const& sum  = env.bin_pkg_summary.get();
         pkgxx::pkgmap  const& pm   = env.bin_pkg_map.get();
+        pkgxx::resolved_depends const& resolved = env.bin_pkg_depends.get();
         pkg_chk::config const conf(env.PKGCHK_CONF.get());
 
         // TODO: We don't take account of SUPERSEDES but how do we do it?
@@ -467,14 +824,16 @@ namespace {
             decltype(to_list) scheduled;
             for (auto const& [name, vars]: to_list) {
                 verbose(opts) << vars.PKGPATH << ": " << name << std::endl;
+                auto best = resolved.at(name).begin();
                 for (auto const& dep_pattern: vars.DEPENDS) {
+                    auto const* const resolved_dep = *best++;
                     verbose(opts) << "    depends on " << dep_pattern << ": ";
-                    if (auto const best = dep_pattern.best(sum); best != sum.end()) {
-                        pkgxx::pkgname const& dep = best->first;
+                    if (resolved_dep) {
+                        pkgxx::pkgname const& dep = resolved_dep->first;
 
                         verbose(opts) << dep << std::endl;
                         if (!topology.has_vertex(dep)) {
-                            scheduled.insert(*best);
+                            scheduled.insert(*resolved_dep);
                         }
                         topology.add_edge(name, dep);
                     }
@@ -501,19 +860,35 @@ namespace {
                         });
         }
     }
-}
-
-int main(int argc, char* argv[]) {
-    try {
-        pkg_chk::options opts(argc, argv);
 
-        verbose(opts) << "ARGV:";
-        for (int i = 0; i < argc; i++) {
-            verbose(opts) << " " << argv[i];
+    // Things to do before anything else, whether or not a daemon serves
+    // the run.
+    void
+    set_up(pkg_chk::options& opts, std::string const& tool) {
+        if (opts.trace_file) {
+            pkgxx::trace::start(*opts.trace_file, tool);
+        }
+        if (opts.record_file) {
+            pkgxx::tape::start_recording(*opts.record_file);
+        }
+        if (opts.replay_file) {
+            pkgxx::tape::start_replaying(*opts.replay_file, opts.replay_latency);
+        }
+        if (opts.stats || opts.stats_file) {
+            pkgxx::stats::report_at_exit(opts.stats, opts.stats_file, tool);
+        }
+        if (opts.progress) {
+            pkgxx::progress::enable();
         }
-        verbose(opts) << std::endl;
 
-        pkg_chk::environment env(opts);
+        opts.concurrency.on_decision(
+            [&](auto const& decision) {
+                atomic_verbose(opts, [&](auto& out) { out << decision << std::endl; });
+            });
+    }
+
+    int
+    run(pkg_chk::options const& opts, pkg_chk::environment const& env, char const* progname) {
         switch (opts.mode) {
         case pkg_chk::mode::ADD_DELETE_UPDATE:
             add_delete_update(opts, env);
@@ -524,7 +899,7 @@ int main(int argc, char* argv[]) {
             break;
 
         case pkg_chk::mode::HELP:
-            pkg_chk::usage(argv[0]);
+            pkg_chk::usage(progname);
             return 1;
 
         case pkg_chk::mode::LIST_BIN_PKGS:
@@ -541,6 +916,42 @@ int main(int argc, char* argv[]) {
         }
         return 0;
     }
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        pkg_chk::options opts(argc, argv);
+        std::string const tool = fs::path(argv[0]).filename().string();
+
+        if (opts.mode == pkg_chk::mode::DAEMON) {
+            pkg_chk::daemon::serve(
+                opts,
+                pkg_chk::daemon::hooks {
+                    [](auto const& d_opts, auto const& env, auto const& pkgpaths) {
+                        if (d_opts.build_from_source) {
+                            warmer(d_opts, env).warm_up(pkgpaths);
+                        }
+                    },
+                    [&](auto& req_opts, auto const& env) {
+                        set_up(req_opts, tool);
+                        return run(req_opts, env, argv[0]);
+                    }
+                });
+        }
+        else if (auto const status = pkg_chk::daemon::delegate(opts, argc, argv); status) {
+            return *status;
+        }
+
+        verbose(opts) << "ARGV:";
+        for (int i = 0; i < argc; i++) {
+            verbose(opts) << " " << argv[i];
+        }
+        verbose(opts) << std::endl;
+
+        set_up(opts, tool);
+        pkg_chk::environment env(opts);
+        return run(opts, env, argv[0]);
+    }
     catch (pkg_chk::bad_options& e) {
         return 1;
     }
@@ -1,6 +1,8 @@
 #include <atomic>
 #include <cstdlib>
 
+#include <pkgxx/progress.hxx>
+
 #include "message.hxx"
 
 namespace {
@@ -19,6 +21,7 @@ namespace pkg_chk {
         if (!traits_type::eq_int_type(ch, traits_type::eof())) {
             char_type const c = traits_type::to_char_type(ch);
 
+            pkgxx::progress::clear_line();
             _opts.logfile.put(c);
 
             if (_to_stderr || _opts.mode == pkg_chk::mode::LIST_BIN_PKGS) {
@@ -33,6 +36,7 @@ namespace pkg_chk {
 
     std::streamsize
     logger::logger_buf::xsputn(const char_type* s, std::streamsize count) {
+        pkgxx::progress::clear_line();
         _opts.logfile.write(s, count);
 
         if (_to_stderr || _opts.mode == pkg_chk::mode::LIST_BIN_PKGS) {
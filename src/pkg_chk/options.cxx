@@ -1,4 +1,5 @@
 #include <cstdlib>
+#include <getopt.h>
 #include <iostream>
 #include <optional>
 #include <thread>
@@ -9,9 +10,33 @@
 
 using namespace std::literals;
 
-extern "C" {
-    extern char* optarg;
-    extern int optind;
+namespace {
+    enum long_only_option {
+        OPT_TRACE = 256,
+        OPT_RECORD,
+        OPT_REPLAY,
+        OPT_REPLAY_LATENCY,
+        OPT_STATS,
+        OPT_STATS_FILE,
+        OPT_PROGRESS,
+        OPT_DAEMON,
+        OPT_SOCKET,
+        OPT_NO_DAEMON
+    };
+
+    struct option const long_options[] = {
+        {"trace"         , required_argument, nullptr, OPT_TRACE         },
+        {"record"        , required_argument, nullptr, OPT_RECORD        },
+        {"replay"        , required_argument, nullptr, OPT_REPLAY        },
+        {"replay-latency", required_argument, nullptr, OPT_REPLAY_LATENCY},
+        {"stats"         , no_argument      , nullptr, OPT_STATS         },
+        {"stats-file"    , required_argument, nullptr, OPT_STATS_FILE    },
+        {"progress"      , no_argument      , nullptr, OPT_PROGRESS      },
+        {"daemon"        , no_argument      , nullptr, OPT_DAEMON        },
+        {"socket"        , required_argument, nullptr, OPT_SOCKET        },
+        {"no-daemon"     , no_argument      , nullptr, OPT_NO_DAEMON     },
+        {nullptr, 0, nullptr, 0}
+    };
 }
 
 namespace pkg_chk {
@@ -21,7 +46,6 @@ namespace pkg_chk {
         , use_binary_pkgs(false)
         , no_clean(false)
         , fetch(false)
-        , concurrency(std::max(1u, std::thread::hardware_concurrency()))
         , continue_on_errors(false)
         , dry_run(false)
         , print_pkgpaths_to_check(false)
@@ -29,11 +53,14 @@ namespace pkg_chk {
         , delete_mismatched(false)
         , build_from_source(false)
         , update(false)
-        , verbose(false) {
+        , verbose(false)
+        , stats(false)
+        , progress(false)
+        , no_daemon(false) {
 
         std::optional<pkg_chk::mode> mode_;
         int ch;
-        while ((ch = getopt(argc, argv, "BC:D:L:P:U:abcdfghij:klNnpqrsuv")) != -1) {
+        while ((ch = getopt_long(argc, argv, "BC:D:L:P:U:abcdfghij:klNnpqrsuv", long_options, nullptr)) != -1) {
             switch (ch) {
             case 'a':
                 mode_       = mode::ADD_DELETE_UPDATE;
@@ -73,11 +100,14 @@ namespace pkg_chk {
                 list_ver_diffs = true;
                 break;
             case 'j':
-                if (int const n = std::atoi(optarg); n > 0) {
-                    concurrency = n;
+                if (optarg == "auto"sv) {
+                    concurrency = pkgxx::concurrency::adaptive();
+                }
+                else if (int const n = std::atoi(optarg); n > 0) {
+                    concurrency = static_cast<unsigned>(n);
                 }
                 else {
-                    std::cerr << argv[0] << ": option -j takes a positive integer" << std::endl;
+                    std::cerr << argv[0] << ": option -j takes a positive integer or \"auto\"" << std::endl;
                     throw bad_options();
                 }
                 break;
@@ -126,6 +156,42 @@ namespace pkg_chk {
             case 'v':
                 verbose = true;
                 break;
+            case OPT_TRACE:
+                trace_file = optarg;
+                break;
+            case OPT_RECORD:
+                record_file = optarg;
+                break;
+            case OPT_REPLAY:
+                replay_file = optarg;
+                break;
+            case OPT_REPLAY_LATENCY:
+                try {
+                    replay_latency = pkgxx::tape::latency::parse(optarg);
+                }
+                catch (std::invalid_argument const&) {
+                    std::cerr << argv[0] << ": option --replay-latency takes milliseconds or \"recorded\"" << std::endl;
+                    throw bad_options();
+                }
+                break;
+            case OPT_STATS:
+                stats = true;
+                break;
+            case OPT_STATS_FILE:
+                stats_file = optarg;
+                break;
+            case OPT_PROGRESS:
+                progress = true;
+                break;
+            case OPT_DAEMON:
+                mode_ = mode::DAEMON;
+                break;
+            case OPT_SOCKET:
+                socket_path = optarg;
+                break;
+            case OPT_NO_DAEMON:
+                no_daemon = true;
+                break;
             case '?':
                 throw bad_options();
             default:
@@ -146,7 +212,7 @@ namespace pkg_chk {
         else {
             std::cerr
                 << argv[0]
-                << ": must specify at least one of -a, -g, -l, -r, -u, or -N" << std::endl;
+                << ": must specify at least one of -a, -g, -l, -r, -u, -N, or --daemon" << std::endl;
             throw bad_options();
         }
 
@@ -158,6 +224,13 @@ namespace pkg_chk {
             throw bad_options();
         }
 
+        if (record_file && replay_file) {
+            std::cerr
+                << argv[0]
+                << ": --record and --replay are mutually exclusive" << std::endl;
+            throw bad_options();
+        }
+
         if (argc > optind) {
             std::cerr
                 << argv[0]
@@ -178,7 +251,7 @@ namespace pkg_chk {
             << "    -f       Perform a 'make fetch' for all required packages" << std::endl
             << "    -g       Generate an initial pkgchk.conf file" << std::endl
             << "    -h       Print this help" << std::endl
-            << "    -j conc  Parallelize certain operations with a given concurrency" << std::endl
+            << "    -j conc  Parallelize certain operations with a given concurrency, or 'auto'" << std::endl
             << "    -k       Continue with further packages if errors are encountered" << std::endl
             << "    -L file  Redirect output from commands run into file (should be fullpath)" << std::endl
             << "    -l       List binary packages including dependencies" << std::endl
@@ -192,6 +265,18 @@ namespace pkg_chk {
             << "    -U tags  Comma separated list of pkgchk.conf tags to unset ('*' for all)" << std::endl
             << "    -u       Update all mismatched packages" << std::endl
             << "    -v       Be verbose" << std::endl
+            << "    --trace=file  Write a Chrome trace of subprocesses and phases to file" << std::endl
+            << "    --record=file Record every subprocess interaction to file" << std::endl
+            << "    --replay=file Replay subprocess interactions from file instead of running them" << std::endl
+            << "    --replay-latency=ms|recorded" << std::endl
+            << "                  Make replayed subprocesses take this long" << std::endl
+            << "    --stats       Print statistics of the run to stderr on exit" << std::endl
+            << "    --stats-file=file" << std::endl
+            << "                  Write statistics of the run to file in the Prometheus text format" << std::endl
+            << "    --progress    Report progress of long phases to stderr" << std::endl
+            << "    --daemon      Keep the environment in memory and serve other invocations" << std::endl
+            << "    --socket=file Use file as the socket of the daemon" << std::endl
+            << "    --no-daemon   Do not ask a running daemon to do the work" << std::endl
             << std::endl
             << "pkg_chk verifies installed packages against pkgsrc." << std::endl
             << "The most common usage is 'pkg_chk -u -q' to check all installed packages or" << std::endl
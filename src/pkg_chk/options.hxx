@@ -3,14 +3,19 @@
 #include <exception>
 #include <filesystem>
 #include <fstream>
+#include <optional>
 #include <set>
 #include <string>
 
+#include <pkgxx/concurrency.hxx>
+#include <pkgxx/tape.hxx>
+
 #include "tag.hxx"
 
 namespace pkg_chk {
     enum class mode {
         ADD_DELETE_UPDATE,    // Any combinations of -a, -r, and -u
+        DAEMON,               // --daemon
         GENERATE_PKGCHK_CONF, // -g
         HELP,                 // -h
         LIST_BIN_PKGS,        // -l
@@ -36,7 +41,7 @@ namespace pkg_chk {
         tagset add_tags;                        // -D
         bool no_clean;                          // -d
         bool fetch;                             // -f
-        unsigned concurrency;                   // -j
+        pkgxx::concurrency concurrency;         // -j
         bool continue_on_errors;                // -k
         mutable std::ofstream logfile;          // -L
         bool dry_run;                           // -n
@@ -48,6 +53,15 @@ namespace pkg_chk {
         tagset remove_tags;                     // -U
         bool update;                            // -u
         bool verbose;                           // -v
+        std::optional<std::filesystem::path> trace_file; // --trace
+        std::optional<std::filesystem::path> record_file; // --record
+        std::optional<std::filesystem::path> replay_file; // --replay
+        pkgxx::tape::latency replay_latency;              // --replay-latency
+        bool stats;                                       // --stats
+        std::optional<std::filesystem::path> stats_file;  // --stats-file
+        bool progress;                                    // --progress
+        std::optional<std::filesystem::path> socket_path; // --socket
+        bool no_daemon;                                   // --no-daemon
     };
 
     // Does *not* exit the program.
@@ -1,4 +1,5 @@
 #include <pkgxx/makevars.hxx>
+#include <pkgxx/tape.hxx>
 
 #include "config.h"
 #include "environment.hxx"
@@ -32,30 +33,19 @@ namespace pkg_rr {
             [this, &opts]() {
                 makefile_env _menv;
 
-                if (!fs::is_directory(PKGSRCDIR.get())) {
+                if (!pkgxx::tape::is_directory(PKGSRCDIR.get())) {
                     fatal([this](auto& out) {
                               out << "Unable to locate PKGSRCDIR ("
                                   << (PKGSRCDIR.get().empty() ? "not set" : PKGSRCDIR.get())
                                   << ")" << std::endl;
                           });
                 }
-                std::vector<std::string> vars = {
-                    "FETCH_USING",
-                    "PKG_ADMIN",
-                    "PKG_INFO",
-                    "SU_CMD"
-                };
-                std::map<std::string, std::string> value_of;
-                auto const pkgpath = PKGSRCDIR.get() / "pkgtools/pkg_install"; // Any package will do.
-                if (fs::is_directory(pkgpath)) {
-                    value_of = pkgxx::extract_pkgmk_vars(pkgpath, vars).value();
-                }
-                else if (MAKECONF.get() != "/dev/null") {
-                    value_of = pkgxx::extract_mkconf_vars(MAKECONF.get(), vars).value();
-                }
-                for (auto const& [var, value]: value_of) {
-                    verbose_var(opts, var, value);
-                }
+                auto value_of = pkgsrc_vars_of({
+                        "FETCH_USING",
+                        "PKG_ADMIN",
+                        "PKG_INFO",
+                        "SU_CMD"
+                    });
                 _menv.FETCH_USING = value_of["FETCH_USING"].empty() ? std::nullopt  : std::make_optional(value_of["FETCH_USING"]);
                 _menv.PKG_ADMIN   = value_of["PKG_ADMIN"  ].empty() ? CFG_PKG_ADMIN : value_of["PKG_ADMIN"];
                 _menv.PKG_INFO    = value_of["PKG_INFO"   ].empty() ? CFG_PKG_INFO  : value_of["PKG_INFO" ];
@@ -1,6 +1,13 @@
 #include <exception>
+#include <filesystem>
+
+#include <pkgxx/progress.hxx>
+#include <pkgxx/stats.hxx>
+#include <pkgxx/tape.hxx>
+#include <pkgxx/trace.hxx>
 
 #include "environment.hxx"
+#include "message.hxx"
 #include "options.hxx"
 #include "replacer.hxx"
 
@@ -13,6 +20,27 @@ int main(int argc, char* argv[]) {
             return 1;
         }
 
+        if (opts.trace_file) {
+            pkgxx::trace::start(*opts.trace_file, std::filesystem::path(argv[0]).filename().string());
+        }
+        if (opts.record_file) {
+            pkgxx::tape::start_recording(*opts.record_file);
+        }
+        if (opts.replay_file) {
+            pkgxx::tape::start_replaying(*opts.replay_file, opts.replay_latency);
+        }
+        if (opts.stats || opts.stats_file) {
+            pkgxx::stats::report_at_exit(opts.stats, opts.stats_file, std::filesystem::path(argv[0]).filename().string());
+        }
+        if (opts.progress) {
+            pkgxx::progress::enable();
+        }
+
+        opts.concurrency.on_decision(
+            [&](auto const& decision) {
+                pkg_rr::atomic_verbose(opts, [&](auto& out) { out << decision << std::endl; });
+            });
+
         pkg_rr::environment env(opts);
         pkg_rr::rolling_replacer(argv[0], opts, env).run();
     }
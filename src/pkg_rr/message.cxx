@@ -1,10 +1,13 @@
 #include <algorithm>
 
+#include <pkgxx/progress.hxx>
+
 #include "message.hxx"
 
 namespace pkg_rr {
     void
     msg_logger::msg_buf::print_prefix() {
+        pkgxx::progress::clear_line();
         switch (_state) {
         case state::initial:
             _out << "RR> ";
@@ -6,6 +6,8 @@
 #include <optional>
 #include <type_traits>
 
+#include <pkgxx/progress.hxx>
+
 #include "options.hxx"
 
 namespace pkg_rr {
@@ -74,6 +76,7 @@ namespace pkg_rr {
         static_assert(std::is_invocable_v<Function&&, std::ostream&>);
 
         std::lock_guard<std::recursive_mutex> lk(detail::message_mutex);
+        pkgxx::progress::clear_line();
         f(std::cout);
     }
 
@@ -100,6 +103,7 @@ namespace pkg_rr {
         static_assert(std::is_invocable_v<Function&&, std::ostream&>);
 
         std::lock_guard<std::recursive_mutex> lk(detail::message_mutex);
+        pkgxx::progress::clear_line();
         std::cout << "*** ";
         f(std::cout);
     }
@@ -153,6 +157,7 @@ namespace pkg_rr {
         static_assert(std::is_invocable_v<Function&&, std::ostream&>);
 
         std::lock_guard<std::recursive_mutex> lk(detail::message_mutex);
+        pkgxx::progress::clear_line();
         std::cout << "*** ";
         f(std::cout);
         std::exit(1);
@@ -1,18 +1,37 @@
 #include <cstdlib>
+#include <getopt.h>
 #include <iostream>
 #include <string_view>
 #include <thread>
 #include <unistd.h>
 
+using namespace std::literals;
+
 #include <pkgxx/string_algo.hxx>
 #include "options.hxx"
 
-extern "C" {
-    extern char* optarg;
-    extern int optind;
-}
-
 namespace {
+    enum long_only_option {
+        OPT_TRACE = 256,
+        OPT_RECORD,
+        OPT_REPLAY,
+        OPT_REPLAY_LATENCY,
+        OPT_STATS,
+        OPT_STATS_FILE,
+        OPT_PROGRESS
+    };
+
+    struct option const long_options[] = {
+        {"trace"         , required_argument, nullptr, OPT_TRACE         },
+        {"record"        , required_argument, nullptr, OPT_RECORD        },
+        {"replay"        , required_argument, nullptr, OPT_REPLAY        },
+        {"replay-latency", required_argument, nullptr, OPT_REPLAY_LATENCY},
+        {"stats"         , no_argument      , nullptr, OPT_STATS         },
+        {"stats-file"    , required_argument, nullptr, OPT_STATS_FILE    },
+        {"progress"      , no_argument      , nullptr, OPT_PROGRESS      },
+        {nullptr, 0, nullptr, 0}
+    };
+
     std::pair<std::string, std::string>
     parse_var_def(std::string_view const& str) {
         auto const equal = str.find('=');
@@ -34,18 +53,19 @@ namespace pkg_rr {
         : check_build_version(false)
         , just_fetch(false)
         , help(false)
-        , concurrency(std::max(1u, std::thread::hardware_concurrency()))
         , continue_on_errors(false)
         , dry_run(false)
         , just_replace(false)
         , strict(false)
         , check_for_updates(false)
-        , verbose(0) {
+        , verbose(0)
+        , stats(false)
+        , progress(false) {
 
         make_vars["IN_PKG_ROLLING_REPLACE"] = "1";
 
         int ch;
-        while ((ch = getopt(argc, argv, "BD:Fhj:kL:nrsuvX:x:")) != -1) {
+        while ((ch = getopt_long(argc, argv, "BD:Fhj:kL:nrsuvX:x:", long_options, nullptr)) != -1) {
             switch (ch) {
             case 'B':
                 check_build_version = true;
@@ -60,11 +80,14 @@ namespace pkg_rr {
                 help = true;
                 break;
             case 'j':
-                if (int const n = std::atoi(optarg); n > 0) {
-                    concurrency = n;
+                if (optarg == "auto"sv) {
+                    concurrency = pkgxx::concurrency::adaptive();
+                }
+                else if (int const n = std::atoi(optarg); n > 0) {
+                    concurrency = static_cast<unsigned>(n);
                 }
                 else {
-                    std::cerr << argv[0] << ": option -j takes a positive integer" << std::endl;
+                    std::cerr << argv[0] << ": option -j takes a positive integer or \"auto\"" << std::endl;
                     throw bad_options();
                 }
                 break;
@@ -99,6 +122,33 @@ namespace pkg_rr {
                     no_check.emplace(pkg);
                 }
                 break;
+            case OPT_TRACE:
+                trace_file = optarg;
+                break;
+            case OPT_RECORD:
+                record_file = optarg;
+                break;
+            case OPT_REPLAY:
+                replay_file = optarg;
+                break;
+            case OPT_REPLAY_LATENCY:
+                try {
+                    replay_latency = pkgxx::tape::latency::parse(optarg);
+                }
+                catch (std::invalid_argument const&) {
+                    std::cerr << argv[0] << ": option --replay-latency takes milliseconds or \"recorded\"" << std::endl;
+                    throw bad_options();
+                }
+                break;
+            case OPT_STATS:
+                stats = true;
+                break;
+            case OPT_STATS_FILE:
+                stats_file = optarg;
+                break;
+            case OPT_PROGRESS:
+                progress = true;
+                break;
             case '?':
                 throw bad_options();
             default:
@@ -107,6 +157,11 @@ namespace pkg_rr {
                 throw std::logic_error(msg);
             }
         }
+
+        if (record_file && replay_file) {
+            std::cerr << argv[0] << ": --record and --replay are mutually exclusive" << std::endl;
+            throw bad_options();
+        }
     }
 
     void usage(std::filesystem::path const& progname) {
@@ -122,10 +177,20 @@ namespace pkg_rr {
             << "    -s         Replace even if the ABIs are still compatible (\"strict\")" << std::endl
             << "    -u         Check for mismatched packages and mark them as so" << std::endl
             << "    -v         Be verbose" << std::endl
+            << "    -j N|auto  Parallelize certain operations with a given concurrency" << std::endl
             << "    -D VAR=VAL Pass given variables and values to make(1)" << std::endl
             << "    -L PATH    Log to path ({PATH}/{pkgdir}/{pkg})" << std::endl
             << "    -X PKG     Exclude PKG from being rebuilt" << std::endl
             << "    -x PKG     Exclude PKG from mismatch check" << std::endl
+            << "    --trace=FILE  Write a Chrome trace of subprocesses and phases to FILE" << std::endl
+            << "    --record=FILE Record every subprocess interaction to FILE" << std::endl
+            << "    --replay=FILE Replay subprocess interactions from FILE instead of running them" << std::endl
+            << "    --replay-latency=MS|recorded" << std::endl
+            << "                  Make replayed subprocesses take this long" << std::endl
+            << "    --stats       Print statistics of the run to stderr on exit" << std::endl
+            << "    --stats-file=FILE" << std::endl
+            << "                  Write statistics of the run to FILE in the Prometheus text format" << std::endl
+            << "    --progress    Report progress of long phases to stderr" << std::endl
             << std::endl
             << progbase << " does `make replace' on one package at a time," << std::endl
             << "tsorting the packages being replaced according to their" << std::endl
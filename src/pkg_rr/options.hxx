@@ -7,7 +7,9 @@
 #include <set>
 #include <string>
 
+#include <pkgxx/concurrency.hxx>
 #include <pkgxx/pkgname.hxx>
+#include <pkgxx/tape.hxx>
 
 namespace pkg_rr {
     struct bad_options: virtual std::runtime_error {
@@ -25,7 +27,7 @@ namespace pkg_rr {
         std::map<std::string, std::string> make_vars; // -D
         bool just_fetch;                              // -F
         bool help;                                    // -h
-        unsigned concurrency;                         // -j
+        pkgxx::concurrency concurrency;               // -j
         bool continue_on_errors;                      // -k
         std::optional<std::filesystem::path> log_dir; // -L
         bool dry_run;                                 // -n
@@ -35,6 +37,13 @@ namespace pkg_rr {
         unsigned verbose;                             // -v
         std::set<pkgxx::pkgbase> no_rebuild;          // -X
         std::set<pkgxx::pkgbase> no_check;            // -x
+        std::optional<std::filesystem::path> trace_file; // --trace
+        std::optional<std::filesystem::path> record_file; // --record
+        std::optional<std::filesystem::path> replay_file; // --replay
+        pkgxx::tape::latency replay_latency;              // --replay-latency
+        bool stats;                                       // --stats
+        std::optional<std::filesystem::path> stats_file;  // --stats-file
+        bool progress;                                    // --progress
     };
 
     // Does *not* exit the program.
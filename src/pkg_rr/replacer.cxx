@@ -3,7 +3,11 @@
 #include <fstream>
 
 #include <pkgxx/config.h>
+#include <pkgxx/map_reduce.hxx>
+#include <pkgxx/progress.hxx>
 #include <pkgxx/string_algo.hxx>
+#include <pkgxx/tape.hxx>
+#include <pkgxx/trace.hxx>
 
 #include "pkg_chk/check.hxx"
 #include "replacer.hxx"
@@ -52,6 +56,15 @@ namespace {
         pkg_rr::options const& _opts;
     };
 
+    // A map from PKGBASE to PKGBASEs it directly depends on.
+    struct depends_map: public std::map<pkgxx::pkgbase, std::set<pkgxx::pkgbase>> {
+        depends_map&
+        operator+= (depends_map&& other) {
+            merge(other);
+            return *this;
+        }
+    };
+
     std::optional<pkgxx::pkgbase>
     obvious_pkgbase_of(pkgxx::pkgpattern const& pat) {
         return std::visit(
@@ -123,6 +136,8 @@ namespace pkg_rr {
                     continue;
                 }
 
+                pkgxx::trace::span span("phase", "build");
+                span.arg("pkgbase", base);
                 if (opts.just_fetch) {
                     fetch(base, path);
                 }
@@ -229,7 +244,7 @@ namespace pkg_rr {
         auto const& PKG_INFO = env.PKG_INFO.get();
         pkgxx::guarded<todo_type> unsafe_pkgs;
         {
-            pkgxx::nursery n(opts.concurrency);
+            pkgxx::nursery n(opts.concurrency, pkgxx::workload::spawn);
             for (auto const& unsafe_pkg: pkgxx::who_requires(PKG_INFO, base)) {
                 if (UNSAFE_TODO.count(unsafe_pkg.base) > 0) {
                     // Already in the set. Skip it.
@@ -391,6 +406,7 @@ namespace pkg_rr {
     pkgxx::graph<pkgxx::pkgbase, void, true>
     rolling_replacer::depgraph_installed() const {
         msg() << "Building dependency graph for installed packages" << std::endl;
+        pkgxx::trace::span span("phase", "depgraph");
 
         // There are two ways to build it. First, enumerate all the
         // installed packages and see which packages they depend
@@ -399,59 +415,61 @@ namespace pkg_rr {
         // former is far easier to implement but is more costly than
         // the latter. We do the latter here.
         auto const& PKG_INFO = env.PKG_INFO.get();
-        pkgxx::guarded<
-            decltype(depgraph_installed())
-            > depgraph;
+        decltype(depgraph_installed()) depgraph;
 
         std::set<pkgxx::pkgbase> to_scan;
         for (auto const& [base, _path]: REPLACE_TODO) {
             to_scan.insert(base);
         }
 
+        // The total grows as we discover more packages to scan.
+        pkgxx::progress prog("Building dependency graph");
         while (!to_scan.empty()) {
-            pkgxx::guarded<decltype(to_scan)> scheduled;
-            {
-                // Breadth-first search to increase concurrency.
-                pkgxx::nursery n(opts.concurrency);
-                for (auto const& base: to_scan) {
-                    // Note that packages in "scheduled" might not be
-                    // actually installed. This can happen when a
-                    // build-only dependency has been deinstalled after
-                    // building packages. It's perfectly okay, as we'll
-                    // later discover dependencies of such packages in the
-                    // "new depends" phase.
-                    if (!is_pkg_installed(base))
-                        continue;
+            // Note that packages we scan might not be actually
+            // installed. This can happen when a build-only dependency has
+            // been deinstalled after building packages. It's perfectly
+            // okay, as we'll later discover dependencies of such packages
+            // in the "new depends" phase.
+            //
+            // Breadth-first search to increase concurrency. Querying
+            // dependencies is expensive, so each worker collects them on
+            // its own and we build the graph afterwards. Workers check
+            // for installed packages concurrently too, so that the checks
+            // can share pkg_info invocations.
+            prog.add_total(to_scan.size());
+            auto const deps_of = pkgxx::map_reduce<depends_map>(
+                to_scan,
+                [&](pkgxx::pkgbase const& base, depends_map& acc) {
+                    pkgxx::progress::item item(prog, base);
+                    if (definitely_installed.count(base) == 0 &&
+                        !pkgxx::is_pkg_installed(PKG_INFO, base)) {
+                        return;
+                    }
+                    auto& deps = acc[base];
+                    for (auto const& dep: pkgxx::build_depends(PKG_INFO, base)) {
+                        deps.insert(dep.base);
+                    }
+                },
+                opts.concurrency, pkgxx::workload::spawn);
+            for (auto const& [base, _deps]: deps_of) {
+                definitely_installed.insert(base);
+            }
 
-                    n.start_soon(
-                        // Don't need to move-capture 'base' because it
-                        // is guaranteed to outlive the closure.
-                        [&]() {
-                            // This operation is expensive so we shouldn't
-                            // lock guarded values while doing it.
-                            auto const& deps = pkgxx::build_depends(PKG_INFO, base);
-                            if (deps.empty()) {
-                                // A package may have no dependencies at
-                                // all. Add at least a vertex in that case,
-                                // or we will fail to update it.
-                                depgraph.lock()->add_vertex(base);
-                            }
-                            else {
-                                // We don't want to repeatedly lock and
-                                // unlock them.
-                                auto&& depgraph_g  = depgraph.lock();
-                                auto&& scheduled_g = scheduled.lock();
-                                for (auto const& dep: deps) {
-                                    if (!depgraph_g->has_vertex(dep.base)) {
-                                        scheduled_g->insert(dep.base);
-                                    }
-                                    depgraph_g->add_edge(base, dep.base);
-                                }
-                            }
-                        });
+            to_scan.clear();
+            for (auto const& [base, deps]: deps_of) {
+                if (deps.empty()) {
+                    // A package may have no dependencies at all. Add at
+                    // least a vertex in that case, or we will fail to
+                    // update it.
+                    depgraph.add_vertex(base);
+                }
+                for (auto const& dep: deps) {
+                    if (!depgraph.has_vertex(dep) && deps_of.count(dep) == 0) {
+                        to_scan.insert(dep);
+                    }
+                    depgraph.add_edge(base, dep);
                 }
             }
-            to_scan = std::move(*(scheduled.lock()));
         }
 
         // Now we have a graph of @blddep entries, which includes not only
@@ -461,10 +479,10 @@ namespace pkg_rr {
         // it. Don't worry, if anything BUILD_DEPENDS or DEPENDS on it,
         // such edges will be discovered later in the "new depends" phase.
         if (auto const FETCH_USING = env.FETCH_USING.get(); FETCH_USING) {
-            depgraph.lock()->remove_in_edges(FETCH_USING.value());
+            depgraph.remove_in_edges(FETCH_USING.value());
         }
 
-        return std::move(*(depgraph.lock()));
+        return depgraph;
     }
 
     std::pair<pkgxx::pkgbase, pkgxx::pkgpath>
@@ -586,12 +604,12 @@ namespace pkg_rr {
         std::map<std::string, std::string> const& vars) const {
 
         auto const& pkgdir = env.PKGSRCDIR.get() / path;
-        if (!fs::exists(pkgdir / "Makefile")) {
+        if (!pkgxx::tape::exists(pkgdir / "Makefile")) {
             throw replace_failed("Makefile is missing from " + pkgdir.string());
         }
 
         std::vector<std::string> argv = {
-            CFG_BMAKE, "-C", pkgdir.string()
+            pkgxx::bmake(), "-C", pkgdir.string()
         };
         for (auto const& target: targets) {
             argv.push_back(target);
@@ -619,7 +637,7 @@ namespace pkg_rr {
 
             using namespace na::literals;
             pkgxx::harness make(
-                CFG_BMAKE, argv,
+                pkgxx::bmake(), argv,
                 "stdin_action"_na  = pkgxx::harness::fd_action::inherit,
                 "stdout_action"_na = pkgxx::harness::fd_action::pipe,
                 "stderr_action"_na = pkgxx::harness::fd_action::merge_with_stdout);
@@ -645,7 +663,7 @@ namespace pkg_rr {
         else {
             using namespace na::literals;
             pkgxx::harness make(
-                CFG_BMAKE, argv,
+                pkgxx::bmake(), argv,
                 "stdin_action"_na  = pkgxx::harness::fd_action::inherit,
                 "stdout_action"_na = pkgxx::harness::fd_action::inherit,
                 "stderr_action"_na = pkgxx::harness::fd_action::inherit);
@@ -729,7 +747,7 @@ namespace pkg_rr {
             std::map<pkgxx::pkgbase, pkgxx::pkgpath>
             > resolved_deps;
         {
-            pkgxx::nursery n(opts.concurrency);
+            pkgxx::nursery n(opts.concurrency, pkgxx::workload::spawn);
             for (auto const& dep: deps) {
                 auto const& [dep_pattern, dep_path] = dep;
 
@@ -1,50 +1,77 @@
 #include <cassert>
 
-#include <pkgxx/mutex_guard.hxx>
-#include <pkgxx/nursery.hxx>
+#include <pkgxx/map_reduce.hxx>
 #include <pkgxx/pkgdb.hxx>
+#include <pkgxx/progress.hxx>
 #include <pkgxx/string_algo.hxx>
+#include <pkgxx/trace.hxx>
 
 #include "scanner.hxx"
 
+namespace {
+    // Results of every axis, in the same order as axes.
+    struct axis_results {
+        using result_type = pkg_rr::package_scanner::result_type;
+
+        axis_results&
+        operator+= (axis_results&& other) {
+            if (per_axis.size() < other.per_axis.size()) {
+                per_axis.resize(other.per_axis.size());
+            }
+            for (std::size_t i = 0; i < other.per_axis.size(); i++) {
+                per_axis[i].merge(other.per_axis[i]);
+            }
+            return *this;
+        }
+
+        std::vector<result_type> per_axis;
+    };
+}
+
 namespace pkg_rr {
     package_scanner::~package_scanner() noexcept(false) {
-        {
-            pkgxx::nursery n(_concurrency);
-            for (auto const& name: pkgxx::installed_pkgnames(_pkg_info)) {
-                n.start_soon(
-                    [&, name = std::move(name)]() {
-                        std::optional<pkgxx::pkgpath> path;
-                        for (auto const& [var, value]: pkgxx::build_info(_pkg_info, name)) {
-                            if (var == "PKGPATH") {
-                                path.emplace(value);
+        pkgxx::trace::span span("phase", "scan");
+
+        std::vector<pkgxx::pkgname> names;
+        for (auto const& name: pkgxx::installed_pkgnames(_pkg_info)) {
+            names.push_back(name);
+        }
+        pkgxx::progress prog("Scanning installed packages", names.size());
+        auto results = pkgxx::map_reduce<axis_results>(
+            names,
+            [&](pkgxx::pkgname const& name, axis_results& acc) {
+                pkgxx::progress::item item(prog, name);
+                acc.per_axis.resize(_axes.size());
+
+                std::optional<pkgxx::pkgpath> path;
+                for (auto const& [var, value]: pkgxx::build_info(_pkg_info, name)) {
+                    if (var == "PKGPATH") {
+                        path.emplace(value);
+                    }
+                    else {
+                        for (std::size_t i = 0; i < _axes.size(); i++) {
+                            auto const& flag    = std::get<1>(_axes[i]);
+                            auto const& exclude = std::get<2>(_axes[i]);
+
+                            if (exclude.count(name.base) > 0) {
+                                // The user wants the package to be
+                                // excluded from the result regardless of
+                                // what flags it has.
+                                continue;
                             }
-                            else {
-                                for (auto& axis: _axes) {
-                                    auto&       result  = std::get<1>(axis);
-                                    auto const& flag    = std::get<2>(axis);
-                                    auto const& exclude = std::get<3>(axis);
-
-                                    if (exclude.count(name.base) > 0) {
-                                        // The user wants the package to be
-                                        // excluded from the result
-                                        // regardless of what flags it has.
-                                        continue;
-                                    }
-                                    else if (var == flag && pkgxx::ci_equal(value, "yes")) {
-                                        assert(path.has_value());
-                                        result.lock()->emplace(name.base, *path);
-                                    }
-                                }
+                            else if (var == flag && pkgxx::ci_equal(value, "yes")) {
+                                assert(path.has_value());
+                                acc.per_axis[i].emplace(name.base, *path);
                             }
                         }
-                    });
-            }
-        }
-        for (auto& axis: _axes) {
-            std::get<0>(axis).set_value(
-                std::move(
-                    *(std::get<1>(axis).lock())));
+                    }
+                }
+            },
+            _concurrency, pkgxx::workload::spawn);
+
+        results.per_axis.resize(_axes.size());
+        for (std::size_t i = 0; i < _axes.size(); i++) {
+            std::get<0>(_axes[i]).set_value(std::move(results.per_axis[i]));
         }
     }
 }
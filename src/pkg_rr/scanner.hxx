@@ -5,7 +5,7 @@
 #include <tuple>
 #include <vector>
 
-#include <pkgxx/mutex_guard.hxx>
+#include <pkgxx/concurrency.hxx>
 #include <pkgxx/pkgname.hxx>
 #include <pkgxx/pkgpath.hxx>
 
@@ -19,7 +19,7 @@ namespace pkg_rr {
         using result_type = std::map<pkgxx::pkgbase, pkgxx::pkgpath>;
 
         /** Construct an empty scanner that does nothing. */
-        package_scanner(std::string const& PKG_INFO, unsigned concurrency)
+        package_scanner(std::string const& PKG_INFO, pkgxx::concurrency const& concurrency)
             : _pkg_info(PKG_INFO)
             , _concurrency(concurrency) {}
 
@@ -37,7 +37,6 @@ namespace pkg_rr {
 
             auto& axis = _axes.emplace_back(
                 std::promise<result_type>(),
-                pkgxx::guarded<result_type>(),
                 flag,
                 exclude);
             return std::get<0>(axis).get_future();
@@ -45,13 +44,12 @@ namespace pkg_rr {
 
     private:
         std::string _pkg_info;
-        unsigned _concurrency;
+        pkgxx::concurrency _concurrency;
         std::vector<
             std::tuple<
                 std::promise<result_type>,
-                pkgxx::guarded<result_type>, // result
-                std::string,                 // flag
-                std::set<pkgxx::pkgbase>     // exclude
+                std::string,             // flag
+                std::set<pkgxx::pkgbase> // exclude
             >
         > _axes;
     };